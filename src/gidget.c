@@ -12,10 +12,82 @@
      3) Script or process to run when triggered
      4) user ID that will run the script or process
      5) email address to receive output
+     6) optional comma separated list of trick options
 
  Example:
  /home/gidget/xmas-list.txt:24:/usr/bin/call_santa.sh:nobody:gidget@example.com
 
+   Trick options:
+     hash   fingerprint the triggering file and skip the script
+            if its content is unchanged since the last successful
+            run.  The fingerprint is passed to the script in the
+            environment variable GIDGET_HASH.
+     poll   poll the path rather than watch it.  Tricks on NFS,
+            CIFS, FUSE and other network filesystems are polled
+            anyway, since a watch there misses other machines'
+            changes
+     watch  watch the path even on a network filesystem
+     retry=n       re-run a failed script up to n more times
+     backoff=s     wait s seconds before the first retry (30),
+                   doubling for each retry after that
+     jitter=p      randomly spread each wait by p percent (20)
+     retrycodes=a/b/c  only retry these exit statuses, instead
+                   of anything from 1 to 125
+     output=n[k|m] keep at most n bytes of script output (16m),
+                   the rest is replaced by a "...N bytes omitted"
+                   line.  output=0 keeps none of it
+     dedupe=s      send output identical to something this trick
+                   sent in the last s seconds only as a count, in
+                   one "repeated N times" notice per window
+            Pending retries are kept in the spool directory and
+            survive a restart.  The attempt number is passed to
+            the script in GIDGET_ATTEMPT.
+
+   Native tricks:
+     A script field of the form
+       @plugin /path/to/handler.so symbol [argument text]
+     runs a handler from a shared object on a daemon worker
+     thread instead of forking a shell.  See gidgetplugin.h
+       @mirror destination [copy|link] [fsync=none|file|dir]
+     copies or hard links the triggering file into a staging
+     tree, see gidgetmirror.c
+       @checksum [md5|sha256]
+     writes an md5sum style sidecar next to the triggering
+     file, see gidgetchecksum.c
+
+   Reloading:
+     A SIGHUP has gidget reread the configuration file.  Only
+     lines that changed have their watches touched, so events
+     on the rest keep flowing, see gidgetconfig.c.  A daemon
+     rereads relative paths from /, so use full ones.
+     With -I, the *.conf files in a directory are read too,
+     and one that changes is reloaded on its own without
+     waiting for a SIGHUP.
+     gidget -n checks a configuration against the kernel's
+     inotify limits without arming it, see gidgetbudget.c.
+     Tricks the kernel has no watch left for, or beyond -W,
+     are polled instead; busy ones are given the watches of
+     ones that have gone quiet, see gidgetpoll.c.  gidget -B
+     times polling the whole configuration.
+     A parsed configuration is cached in the spool directory
+     and reused until the file changes; gidget -C builds the
+     cache ahead of time, see gidgetcache.c.
+
+   Diagnostics:
+     gidget keeps a histogram per trick of how long its events
+     wait to be dispatched, for their script to start, and for
+     it to finish.  A SIGUSR1 logs them, and -m serves them,
+     see gidgetlatency.c.
+     A flight recorder keeps the last few thousand events and
+     what became of them.  A SIGUSR1 or a fatal error saves it
+     in the spool directory, see gidgetflight.c.
+
+   Control:
+     With -k, commands on a Unix socket list the tricks, pause
+     and resume them without losing their events, drain the
+     daemon, flush digests and show what is running, see
+     gidgetcontrol.c.
+
     It is impossible to programmatically predict how 
     many related or unrelated events will occur at any
     given time.  We can detect events being discarded
@@ -30,53 +102,27 @@
 
 #define GVERSION "1.01"
 #define DEFAULT_CONFIG_FILE "/etc/gidget.conf"
-#define MAX_CONFIG_NAME_LEN 256
 #define DEFAULT_LOG_FILE "/var/log/gidget"
-#define MAX_LOG_NAME_LEN 256
 #define DEFAULT_PID_FILE "/var/run/gidget.pid"
-#define MAX_PID_NAME_LEN 128
-
-// It's important that MAX_ERR_TXT_LEN be large enough to hold
-// error messages that may include the names of fully pathed
-// files and significant amounts of diagnostic text.  Be aware
-// that modern file systems allow incredibly long names!
-#define MAX_ERR_TEXT_LEN 1640
-
-#include "gidget.h"              // stdio and friends
+#define DEFAULT_SPOOL_DIR "/var/spool/gidget"
+#define DIGEST_BYTES (1024 * 1024)
+#define DIGEST_SECONDS 300
+#define AUDIT_BYTES (64 * 1024 * 1024)
+#define AUDIT_KEEP 4
+#define LOG_RATE 100             // per-event lines a second, per category
+#define LOG_BURST 500
+#define TIER_QUIET 300           // seconds before a watched trick may be polled instead
+
+#include "gidget.h"              // stdio, friends, and tricks
 #include "gidgetmail.h"          // define mailer here
+#include "gidgethash.h"          // content fingerprints
+#include "gidgetpool.h"          // worker threads for native tricks
 
-// Gidget does tricks!  Each trick is defined by the
-// content of a dynamically allocated data structure
-
-  typedef struct {
-      int32_t watchHandle;  // inotify watch descriptor
-      uint32_t actions;     // bitmap of what to watch for
-      char *fileName;       // file or directory to be watched
-      char *script;         // executable object to run
-      char *userid;         // user who will run script
-      char *mail;           // email to recieve script output
-  } trick_t;
-
-// inotify_event is defined in sys/inotify.h
-
-  typedef struct inotify_event event_t;
-
-// global used by signal handler to pass signal back
+// the signal handler passes each signal back to the read loop as one
+// byte down this pipe, which poll() watches along with everything else
  
-  sig_atomic_t signalCaught;
-
-// simple struct for command line options
-
-  typedef struct {
-      int daemon;
-      int verbose;
-      int log2file;
-      int syslog;
-      int sloglev;
-      char config[MAX_CONFIG_NAME_LEN];
-      char logfile[MAX_LOG_NAME_LEN];
-      char pidfile[MAX_PID_NAME_LEN];
-  } opts_t;
+  static int signalPipe[2] = { -1, -1 };
+  static pid_t signalOwner;      // children inherit the handler, not the job
 
 // function prototypes, actual functions are after main()
 
@@ -84,20 +130,22 @@
   opts_t gig_opts(int argc, char **argv);
   static void signalTrap(int sig, siginfo_t * siginfo, void *context);
   static void reopenLogs(opts_t opt);
-  void logx(int xstatus, opts_t opt, char logtxt[]);
   static void stringifyEventBits(uint32_t bitMap);
+  static void readReports(int reportHandle, opts_t opt, trick_t **trickHeap);
+  static int ownDropping(const trick_t *pony, const char *name);
+  static void holdEvent(opts_t opt, const trick_t *pony, int32_t trick, const event_t *event,
+                        int attempt, int64_t received, int64_t receivedMono);
+  static void reportOnExit(int status, void *report);
+  static void reportOutput(opts_t opt, const trick_t *pony, const report_t *report,
+                           const inflight_t *child);
+
+// event children tell the daemon how they got on through this
+  static int reportWriter = -1;
 
 /*******  Hajime, let it begin *******/
 
 int main(int argc, char **argv) {
 
-// limit number of characters in a pathed script name
-    const int maxScriptLen = 256;
-
-// also limit length of an email address
-// email will not be checked for syntax or existence
-    const int maxEmailLen = 36;
-
 // single ASCII characters used for path composition and munging
     const char space[] = { 32, 0 };
     const char apostrophe[] = { 39, 0 };
@@ -120,16 +168,12 @@ int main(int argc, char **argv) {
     int maxUidLen = sysconf(_SC_LOGIN_NAME_MAX);
     int maxNameLen = 0;     // will be set later with pathconf
 
-    char confLine[maxLineLen];
-    char confToken[maxLineLen];
     char logtxt[MAX_ERR_TEXT_LEN];
 
 // I do not know what the best programming style for C is because I rarely
 // use the language at all.  I am considering declaring all variables at time
 // of use, which would mean the following declarations would have to be moved
-    int lineLen, recordLen, fieldNo, fieldLen;
-    int tokenStart, tokenLen;
-    int i, j, m; // dummies, mostly for string and loop indexing
+    int i, j; // dummies, mostly for string and loop indexing
 
 // it's best to be paranoid about file creation
     umask(027);
@@ -138,8 +182,10 @@ int main(int argc, char **argv) {
     opts_t opt = gig_opts(argc, argv);
 
 // define a syslog socket if called for
-    if (opt.syslog)
-        openlog ("gidget", LOG_CONS | LOG_PID, LOG_DAEMON);
+    if (opt.syslog && (logSyslogOpen() < 0)) {
+        sprintf(logtxt, "unable to reach syslog, logging without it: %s", strerror(errno));
+        logx(0, opt, logtxt);
+    }
 
 // open config file before daemonizing, to allow use of relative
 // file names and to avoid creating log and pid files if the
@@ -152,9 +198,40 @@ int main(int argc, char **argv) {
         logx(1, opt, logtxt);
     }
 
+// SIGHUP rereads it, by which time a daemon has moved to /
+    char configPath[PATH_MAX];
+    if ((realpath(opt.config, configPath) != NULL) &&
+        (strlen(configPath) < MAX_CONFIG_NAME_LEN)) {
+        strcpy(opt.config, configPath);
+    }
+    if ((opt.includeDir[0] != '\0') && (realpath(opt.includeDir, configPath) != NULL) &&
+        (strlen(configPath) < MAX_CONFIG_NAME_LEN)) {
+        strcpy(opt.includeDir, configPath);
+    }
+
 // redirect stdout and stderr if logging to file
     if (opt.log2file) reopenLogs(opt); 
 
+// -C just compiles the configuration cache, for daemons to start from
+    if (opt.compile) {
+        if ((mkdir(opt.spooldir, 0750) < 0) && (errno != EEXIST)) {
+            sprintf(logtxt, "unable to create spool directory %s: %s",
+                    opt.spooldir, strerror(errno));
+            logx(1, opt, logtxt);
+        }
+        exit((configCompile(opt) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+// -n plans the watch budget without arming anything
+    if (opt.plan) {
+        exit((configPlan(opt) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+// -B times the poller on every trick, watching nothing
+    if (opt.bench) {
+        exit((configBench(opt) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
 // if -d option, then daemonize and create pidfile
     pid_t pid, ppid;
     if (opt.daemon) {
@@ -189,6 +266,16 @@ int main(int argc, char **argv) {
         logx(3, opt, "Unable to get daemon pid");
     }
 
+// from here on the daemon's log lines are written by a thread of
+// their own, so logging costs the read loop next to nothing, and
+// per-event lines are rate limited across the daemon and its children
+    if (logLimit(opt) != 0) {
+        logx(0, opt, "unable to share log rate limits, per-event logging unlimited");
+    }
+    if (logStart() != 0) {
+        logx(0, opt, "unable to start log writer, logging synchronously");
+    }
+
 // always log startup (logx does not exit if status 0)
     logx(0, opt, "daemon initialization");
 
@@ -202,277 +289,37 @@ int main(int argc, char **argv) {
         logx(4, opt, "Unable to initialize iNotify");
 
 
-// in order to support comment lines in the configuration file
-// we need to keep separate line and record counters
-    int lineNo = 0;
-    int trickCount = 0;
-
-// if any field in a configuration line fails syntax checking
-// badPony is set to something other than zero.  Using a flag
-// instead of just jumping to the next line whenever a bogus
-// field is encountered lets us give better diagnostics
-// which users will almost certainly appreciate
-    int badPony;
-
-
-/************************************
-           begin configuration parse / inotify setup loop
-                                  *********************************/
-
-// read a line from config file
-// fgets error checking is outside the loop
-    while (fgets(confLine, maxLineLen, configFile) != NULL) {
-        lineLen = strlen(confLine) - 1;
-        lineNo++;
-
-        fieldNo = 0;    // no fields found yet, field count starts at one
-        tokenStart = 0; // position of first character in current field
-        badPony = 0;    // He rides across the nation, the Thoroughbred of Sin
-
-// step through characters until EOL or comment delimiter found
-        for (recordLen = 0;
-             ((confLine[recordLen] != '\0')
-              && (confLine[recordLen] != '#')); recordLen++) {
-
-// you can use vim -b configfile to fix invisible characters
-            if (isprint(confLine[recordLen]) == 0) {
-                if (confLine[recordLen] != '\n') {
-                    int charPos = recordLen + 1;
-                    sprintf(logtxt, 
-                         "invisible character in file %s line %d position %d",
-                          opt.config, lineNo, (recordLen + 1));
-                    logx(0, opt, logtxt);
-                    badPony = 1;
-                }
-            } else {
-                if (confLine[recordLen] == apostrophe[0]) {
-                   sprintf(logtxt,
-                         "illegal character in file %s line %d position %d",
-                          opt.config, lineNo, (recordLen + 1));
-                    logx(0, opt, logtxt);
-                    badPony = 1;
-                }
-            }
-
-// if field delimiter found, extract a token from the currently known field
-            if ((confLine[recordLen] == ':')
-                               || (confLine[recordLen] == '\n')) {
-
-                fieldNo++;
-                fieldLen = recordLen - tokenStart;
-                confToken[fieldLen] = '\0';
-                strncpy(confToken, confLine + tokenStart, fieldLen);
-
-    // for each field, check token syntax while loading up the pony
-                switch (fieldNo) {
-
-                case 1:
-                    m = pathconf(confToken, _PC_NAME_MAX);
-                    if (m <= 0) {
-                      // it is not possible in ISO standard C to test existence of a file
-                      // however in our implementation pathconf gives us a reliable hint
-                        sprintf(logtxt,
-                            "Can't determine max file name length for filesystem hosting %s",
-                            confToken);
-                        logx(0, opt, logtxt);
-                        badPony = 1;
-                    } else {
-                        if (m > maxNameLen) {
-                            maxNameLen = m;
-                            if (opt.verbose) {
-                                sprintf(logtxt, "Maximum file name length set to %d...",m);
-                                logx(0, opt, logtxt);
-                            }
-                        }
-                        pony.fileName = malloc((fieldLen + 1) * sizeof(*pony.fileName));
-                        if (pony.fileName == NULL) {
-                            sprintf(logtxt,
-                                 "Can't allocate memory for file name %s in line %d",
-                                 confToken, lineNo);
-                            logx(0, opt, logtxt);
-                            badPony = 1;
-                        } else {
-                            strcpy(pony.fileName, confToken);
-                        }
-                    }
-                    break;
-
-                case 2:
-                    for (i = 0; i < fieldLen; i++) {
-                        if (!isdigit(confToken[i]))
-                            break;
-                    }
-                    if (i == fieldLen) {
-                        pony.actions = atoi(confToken);
-                    } else {
-                        sprintf(logtxt,
-                             "ERROR: non-numeric event mask in %s line %d field 2",
-                             opt.config, lineNo);
-                        logx(0, opt, logtxt);
-                        badPony = 2;
-                    }
-                    break;
-
-                case 3:
-                    if (fieldLen > maxScriptLen) {
-                        sprintf(logtxt,
-                             "ERROR: script name too long in %s line %d field 3",
-                             opt.config, lineNo);
-                        logx(0, opt, logtxt);
-                        badPony = 3;
-                    } else {
-                        pony.script =
-                            malloc((fieldLen + 1) * sizeof(*pony.script));
-                        if (pony.script == NULL) {
-                            sprintf(logtxt,
-                                 "Can't allocate memory for script name %s in line %d",
-                                 confToken, lineNo);
-                            logx(0, opt, logtxt);
-                            badPony = 3;
-                        } else {
-                            strcpy(pony.script, confToken);
-                        }
-                    }
-                    break;
-
-                case 4:
-                    if (fieldLen > maxUidLen) {
-                        sprintf(logtxt,
-                             "ERROR: script name too long in %s line %d field 3",
-                             opt.config, lineNo);
-                        logx(0, opt, logtxt);
-                        badPony = 4;
-                        break;
-                    }
-                    pony.userid =
-                        malloc((fieldLen + 1) * sizeof(*pony.userid));
-                    if (pony.userid == NULL) {
-                        sprintf(logtxt,
-                             "Can't allocate memory for username %s in line %d",
-                             confToken, lineNo);
-                        logx(0, opt, logtxt);
-                        badPony = 4;
-                        break;
-                    }
-                    strcpy(pony.userid, confToken);
-                    break;
-
-                case 5:
-                    if (fieldLen > maxEmailLen) {
-                        sprintf(logtxt,
-                             "Email address too long in %s line %d field 5",
-                             opt.config, lineNo);
-                        logx(0, opt, logtxt);
-                        badPony = 7;
-                    } else {
-                        pony.mail = malloc((fieldLen + 1) * sizeof(*pony.mail));
-                        if (pony.script == NULL) {
-                            sprintf(logtxt,
-                                 "Can't allocate memory for email address %s in line %d",
-                                 confToken, lineNo);
-                            logx(0, opt, logtxt);
-                            badPony = 8;
-                        } else {
-                            strcpy(pony.mail, confToken);
-                        }
-                    }
-                    break;
-
-                default:
-                    sprintf(logtxt,
-                           "TOO MANY FIELDS IN LINE %d - DISCARDING %s!",
-                           lineNo, confToken);
-                    logx(0, opt, logtxt);
-                    break;
-                }    // end case token
-
-                tokenStart = recordLen + 1;
-            }     // end for each field
-
-        }       // end for each record
-
-// silently skip empty lines and full-line comments
-        if (fieldNo != 0) {
-
-// if all syntax checks were passed the pony is ready to be loaded into heap
-            if ((badPony) || (fieldNo < 5)) {
-                sprintf(logtxt, "ERROR: discarding %s line %d!", opt.config, lineNo);
-                logx(0, opt, logtxt);
-
-            } else {
-
-// An inotify watch list will be built and passed to the kernel
-// which will contain one inode watch for each gidget trick
-
-                pony.watchHandle =
-                    inotify_add_watch(instanceHandle, pony.fileName,
-                                      pony.actions);
-                if (pony.watchHandle < 0) {
-                    sprintf(logtxt,
-                         "ERROR %d: Unable to add watch for %s\t%s (%u)",
-                         pony.watchHandle, pony.fileName, strerror(errno),
-                         errno);
-                    logx(0, opt, logtxt);
-                    sprintf(logtxt, "ERROR: discarding %s line %d!", opt.config, lineNo);
-                    logx(0, opt, logtxt);
-
-                } else {
-                    if (pony.watchHandle != (trickCount + 1)) {
-                        sprintf(logtxt, "%s %s %s",
-                               "FATAL ERROR!",
-                               "Heap corrupt, non-sequential watch descriptor",
-                               "returned from inotify!");
-                        logx(2, opt, logtxt);
-                    }
-                    if (opt.verbose) {
-                        sprintf(logtxt, "Added watch %s mask %#.8x handle %d.",
-                           pony.fileName, pony.actions, pony.watchHandle);
-                        logx(0, opt, logtxt);
-                    }
-
-    // extend the array of pointers to tricks with realloc
-    //     (first use degrades gracefully to malloc)
-                    trickHeap =
-                        (trick_t **) realloc(trickHeap,
-                                             (trickCount +
-                                              1) * sizeof(trick_t *));
-                    if (trickHeap == NULL) {
-                        sprintf(logtxt, "%s %s at %s line %d!",
-                               "FATAL ERROR!",
-                               "Unable to allocate additional memory",
-                               opt.config, lineNo);
-                        logx(3, opt, logtxt);
-                    }
-    // allocate another block of memory for this trick with malloc
-    // and point the newly created pointer at the newly created trick struct
-                    trickHeap[trickCount] =
-                        (trick_t *) malloc(sizeof(trick_t));
-                    if (trickHeap[trickCount] == NULL) {
-                        sprintf(logtxt, "%s %s at %s line %d!",
-                               "FATAL ERROR!",
-                               "Unable to allocate additional memory",
-                               opt.config, lineNo);
-                        logx(4, opt, logtxt);
-                    }
-    // unload pony into trick heap and increment number of tricks
-                    *trickHeap[trickCount++] = pony;
-                }
-            }
+// failed scripts waiting for another go are kept in the spool directory,
+// as is the compiled configuration, and so is the mail queue: tmp while being written, queue once complete,
+// failed for anything the couriers gave up on
+    const char *spoolDirs[] = { "", "/tmp", "/queue", "/failed" };
+    for (j = 0; j < 4; j++) {
+        sprintf(logtxt, "%s%s", opt.spooldir, spoolDirs[j]);
+        if ((mkdir(logtxt, 0750) < 0) && (errno != EEXIST)) {
+            sprintf(logtxt, "unable to create spool directory %s%s: %s",
+                    opt.spooldir, spoolDirs[j], strerror(errno));
+            logx(0, opt, logtxt);
         }
-    } // elihw, loop back for next configuration record
-
+    }
 
-/************************************
-           end configuration parse / inotify setup loop
-                                  *********************************/
+// the configuration is parsed into tricks and each one gets a watch,
+// see gidgetconfig.c.  Watch descriptors are mapped to trick numbers
+// there too, since a reload can retire watches and add new ones
+    int trickCount, nativeCount = 0;
+    trickCount = configLoad(opt, configFile, instanceHandle, &trickHeap, &maxNameLen);
+    if (trickCount < 0) {
+        logx(5, opt, "unable to load configuration");
+    }
+    for (j = 0; j < trickCount; j++) {
+        if (trickHeap[j]->handler != NULL) nativeCount++;
+    }
 
+// how much of the user's inotify allowance that took
+    budgetLog(opt, instanceHandle);
 
-// if we're not at end of file, the file read function blew up 
-    if (!feof(configFile)) {
-        sprintf(logtxt, "Error reading %s: %s (%u)",
-                 opt.config, strerror(errno), errno);
-        logx(5, opt, logtxt);
-    }
+// read buffers are sized from this once and for all, and a reload may
+// bring in filesystems we haven't asked yet, so allow the usual limit
+    if (maxNameLen < NAME_MAX) maxNameLen = NAME_MAX;
 
 // close that file, were you raised in a barn?
     fclose(configFile);  // no error check, we die soon anyway
@@ -498,6 +345,7 @@ int main(int argc, char **argv) {
             printf("script to execute: %s\n",trickHeap[j]->script);
             printf("userid for script execution: %s\n",trickHeap[j]->userid);
             printf("email to receive output: %s\n",trickHeap[j]->mail);
+            printf("trick options bitmap: %#.8x\n",trickHeap[j]->options);
             printf("watch descriptor assigned to trick: %zu\n",trickHeap[j]->watchHandle);
         }
     }
@@ -506,6 +354,13 @@ int main(int argc, char **argv) {
     fflush(stdout);
     fflush(stderr);
 
+// pick up whatever retries the last gidget left behind
+    if ((i = retryLoad(opt, trickHeap, trickCount)) > 0) {
+        sprintf(logtxt, "reloaded %d pending retries from %s", i, opt.spooldir);
+        logx(0, opt, logtxt);
+    }
+    srandom(time(NULL) ^ getpid());     // only used to jitter retries
+
 // we're going to be forking out responses to file system events and
 // ignoring what happens to the children once they've forked off...
 // so we need to set up a signal trap that will auto-reap the dying
@@ -518,10 +373,19 @@ int main(int argc, char **argv) {
     if (sigaction(SIGCHLD, &reapchildren, 0) < 0) {
         logx(6, opt, "could not set up SIGCHLD auto reaper");
     }
+// signals become bytes on a pipe, so the read loop hears of them
+// through poll() no matter what it was doing when they arrived.  Both
+// ends are non-blocking: a handler must never wait on a full pipe
+    signalOwner = getpid();
+    if (pipe2(signalPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        logx(6, opt, "unable to create signal pipe");
+    }
+
 // a couple more signal traps before starting read loop
 // these let us terminate cleanly on various interupts
-    struct sigaction newAction, oldTermAct, oldIntAct, oldHupAct;
+    struct sigaction newAction, oldTermAct, oldIntAct, oldHupAct, oldUsr1Act;
     memset(&newAction, '\0', sizeof(newAction));
+    memset(&oldUsr1Act, '\0', sizeof(oldUsr1Act));
     memset(&oldIntAct, '\0', sizeof(oldIntAct));
     memset(&oldTermAct, '\0', sizeof(oldTermAct));
     memset(&oldHupAct, '\0', sizeof(oldHupAct));
@@ -545,11 +409,64 @@ int main(int argc, char **argv) {
         logx(6, opt, "could not set control-c trap");
     }
 
-// logrotate will use a SIGHUP to tell us to reopen logging
+// logrotate will use a SIGHUP to tell us to reopen logging, and
+// the same signal has us reread the configuration file
     if (sigaction(SIGHUP, &newAction, &oldHupAct) < 0) {
         logx(6, opt, "could not set trap for SIGHUP");
     }
 
+// and a SIGUSR1 has us log the latency histograms
+    if (sigaction(SIGUSR1, &newAction, &oldUsr1Act) < 0) {
+        logx(6, opt, "could not set trap for SIGUSR1");
+    }
+
+// event children write completion reports into this pipe.  Both ends
+// are close-on-exec so scripts never see them, and the daemon end is
+// non-blocking so a burst of reports can be drained in one go
+    int reportPipe[2];
+    if (pipe2(reportPipe, O_CLOEXEC) == -1) {
+        logx(6, opt, "unable to create report pipe");
+    }
+    if (fcntl(reportPipe[0], F_SETFL, O_NONBLOCK) == -1) {
+        logx(6, opt, "unable to make report pipe non-blocking");
+    }
+
+// from here on there are threads, and each module's lock is taken
+// around every fork so that no event child inherits one held by a
+// thread that didn't come along.  None of them nests inside another
+    fingerprintForkSafe();
+    auditForkSafe();
+    digestForkSafe();
+    mailForkSafe();
+    poolForkSafe();
+
+// with -a every event also gets a machine readable line of its own
+    if (auditOpen(opt) < 0) {
+        sprintf(logtxt, "Error (%u) opening audit log %s: %s",
+                errno, opt.auditFile, strerror(errno));
+        logx(30, opt, logtxt);
+    }
+
+// couriers deliver the mail queue, with -M deciding how and how many
+    if (mailStart(opt) == 0) {
+        logx(6, opt, "unable to start mail couriers");
+    }
+
+// native tricks are run by a pool of worker threads.  The workers
+// block every signal, so signals still interrupt our poll() below
+    if ((nativeCount > 0) && (poolStart(opt.workers) == 0)) {
+        logx(6, opt, "unable to start worker threads for native tricks");
+    }
+
+// the flight recorder is always on, but only the daemon dumps it
+    flightStart();
+
+// with -m, a thread of its own answers metrics scrapes
+    if (opt.metrics[0] != '\0') metricsStart(opt, instanceHandle);
+
+// and with -k the read loop answers control commands
+    if (opt.control[0] != '\0') controlStart(opt);
+
 /************************************
                    begin inotify read/wait loop
                                   *********************************/
@@ -568,56 +485,329 @@ int main(int argc, char **argv) {
 // the size of our read buffer.  Program will block on the read
 // until a valid event occurs.
 
-    int len, eventID = 0;
-    int maxEventBufSize = sizeof(struct inotify_event) + maxNameLen + 1;
-    char buf[maxEventBufSize];
+// Completion reports from event children arrive on their own pipe,
+// so we poll both and only read inotify once it has something for us
 
+// A single read hands back as many whole events as fit in the buffer,
+// so make room for a good handful and walk through all of them
 
-    while (pid > 0) {
-        errno = 0;          // errno is not guaranteed clean so scrub it
+    int len, eventID = 0, eventOffset = 0;
+    int maxEventBufSize = (sizeof(struct inotify_event) + maxNameLen + 1) * 16;
+    char buf[maxEventBufSize];
+    char retryBuf[sizeof(event_t) + NAME_MAX + 1];
+    event_t *incoming, *dispatched = NULL;
+    int32_t retryTrick, dispatchedTrick = -1;
+    int64_t received = 0, receivedMono = 0, dispatchedMono = 0;   // for the audit log
+    inflight_t *child;
+    int attempt = 1, pollWait, digestWait, repeatWait;
+    int pollTurn = 0;       // polled events and inotify's take turns
+    int events;             // in one read, for the metrics
+    time_t lastSweep = time(NULL);
+    struct pollfd waitHandles[4 + CONTROL_CLIENTS];
+    int waitCount;
+    unsigned char signalByte;
+
+    waitHandles[0].fd = instanceHandle;
+    waitHandles[0].events = POLLIN;
+    waitHandles[1].fd = reportPipe[0];
+    waitHandles[1].events = POLLIN;
+    waitHandles[2].fd = signalPipe[0];
+    waitHandles[2].events = POLLIN;
 
-        len = read(instanceHandle, buf, maxEventBufSize);
-        //possible results are signal, event, or weird error
+    while (pid > 0) {
+        pollWait = retryTimeout(time(NULL));
+        repeatWait = repeatTimeout(time(NULL));
+        if ((pollWait < 0) || ((repeatWait >= 0) && (repeatWait < pollWait))) {
+            pollWait = repeatWait;
+        }
+        repeatWait = auditTimeout();
+        if ((pollWait < 0) || ((repeatWait >= 0) && (repeatWait < pollWait))) {
+            pollWait = repeatWait;
+        }
+        repeatWait = logTimeout(time(NULL));
+        if ((pollWait < 0) || ((repeatWait >= 0) && (repeatWait < pollWait))) {
+            pollWait = repeatWait;
+        }
+        repeatWait = pollTimeout(time(NULL));
+        if ((pollWait < 0) || ((repeatWait >= 0) && (repeatWait < pollWait))) {
+            pollWait = repeatWait;
+        }
+        if (opt.digestCount > 0) {
+            digestWait = digestTimeout(opt, time(NULL));
+            if ((pollWait < 0) || ((digestWait >= 0) && (digestWait < pollWait))) {
+                pollWait = digestWait;
+            }
+        }
+        repeatWait = controlTimeout();
+        if ((pollWait < 0) || ((repeatWait >= 0) && (repeatWait < pollWait))) {
+            pollWait = repeatWait;
+        }
+        waitCount = 3 + controlWaits(waitHandles + 3);
+        len = poll(waitHandles, waitCount, pollWait);
+        logClock();         // the one thread that may ask libc the time of day
+
+// signals first, each one once, however long ago it landed
+        if ((len > 0) && (waitHandles[2].revents & POLLIN)) {
+            while (read(signalPipe[0], &signalByte, 1) == 1) {
+                sprintf(logtxt, "Caught signal %d", signalByte);
+                switch (signalByte) {
+
+                  case SIGHUP:
+                    configReload(opt, instanceHandle, &trickHeap, &trickCount, maxNameLen);
+                    budgetLog(opt, instanceHandle);
+                    if ((opt.auditFile[0] != '\0') && (auditOpen(opt) < 0)) {
+                        sprintf(logtxt, "unable to reopen audit log %s: %s, auditing stopped",
+                                opt.auditFile, strerror(errno));
+                        logx(0, opt, logtxt);
+                        sprintf(logtxt, "Caught signal %d", signalByte);
+                    }
+                    if (opt.log2file) {
+                        strcat(logtxt, ", reopening stdout/stderr");
+                        logx(0, opt, logtxt);
+                        reopenLogs(opt);
+                    } else {
+                        strcat(logtxt, ", ignored.");
+                        logx(0, opt, logtxt);
+                    }
+                    break;
 
-        if (errno == EINTR) {
-            sprintf(logtxt, "Caught signal %d", signalCaught);
-            switch (signalCaught) {
+                  case SIGUSR1:
+                    strcat(logtxt, ", logging latencies and saving the flight recorder");
+                    logx(0, opt, logtxt);
+                    latencyDump(opt);
+                    {
+                        char flightName[MAX_SPOOL_NAME_LEN + 32];
+                        int records = flightSave(opt, flightName);
+                        if (records < 0) {
+                            sprintf(logtxt, "unable to save flight recorder to %s: %s",
+                                    flightName, strerror(errno));
+                        } else {
+                            sprintf(logtxt, "flight recorder, %d records, saved to %s",
+                                    records, flightName);
+                        }
+                        logx(0, opt, logtxt);
+                    }
+                    break;
 
-              case SIGHUP:
-                if (opt.log2file) {
-                    strcat(logtxt, ", reopening stdout/stderr");
+                  case SIGINT:
+                    strcat(logtxt, ", probably Control-C");
                     logx(0, opt, logtxt);
-                    reopenLogs(opt);
+                    // do not break
+
+                  default:
+                    logx(0, opt, "gidget event wait terminated by signal, shutting down.");
+                    close(instanceHandle);
+                    metricsStop(opt);
+                    controlStop(opt);
+                    retrySave(opt, trickHeap, 1);
+                    readReports(reportPipe[0], opt, trickHeap);
+                    repeatFlush(opt, trickHeap, 1);
+                    if (opt.digestCount > 0) digestFlush(opt, 1);
+                    mailStop(opt);
+                    auditFlush(1);
+                    logSummary(opt, 1);
+                    if (opt.syslog) logSyslogClose();
+                    exit(EXIT_SUCCESS);          /*******  NORMAL DAEMON EXIT  *******/
+                    break;
+                }
+            }
+        }
+
+        if ((len > 0) && (waitHandles[1].revents & POLLIN)) {
+            readReports(reportPipe[0], opt, trickHeap);
+        }
+        if (len >= 0) {
+            controlServe(opt, trickHeap, trickCount, waitHandles + 3, waitCount - 3);
+        }
+
+// retries that have come due are run just like fresh events
+        if (len >= 0) {
+            repeatFlush(opt, trickHeap, 0);
+            if (opt.digestCount > 0) digestFlush(opt, 0);
+            auditFlush(0);
+            logSummary(opt, 0);
+            retrySave(opt, trickHeap, 0);
+            pollScan(trickHeap, time(NULL));
+            configTier(opt, instanceHandle, trickHeap, trickCount);
+            configReclaim(opt, trickHeap, trickCount);
+            metricGauge(GAUGE_TRICKS, trickCount);
+            metricGauge(GAUGE_POLLED, pollCount());
+            metricGauge(GAUGE_INFLIGHT, inflightCount());
+            metricGauge(GAUGE_RETRIES, retryPending());
+            metricGauge(GAUGE_HELD, controlHeld());
+            while ((dispatched = retryDue(time(NULL), retryBuf, &retryTrick, &attempt)) != NULL) {
+                if (trickHeap[retryTrick]->options & TRICK_RETIRED) {
+                    metricAdd(METRIC_DROPPED, 1);
+                    if (logRate(RATE_RETRY)) {
+                        sprintf(logtxt, "dropping retry of %s for %s, trick removed by a reload",
+                                trickHeap[retryTrick]->script, trickHeap[retryTrick]->fileName);
+                        logx(0, opt, logtxt);
+                    }
+                    continue;
+                }
+                dispatched->wd = trickHeap[retryTrick]->watchHandle;
+                dispatchedTrick = retryTrick;
+                received = auditClock(CLOCK_REALTIME);
+                receivedMono = dispatchedMono = auditClock(CLOCK_MONOTONIC);
+                if (trickHeap[retryTrick]->options & TRICK_PAUSED) {
+                    holdEvent(opt, trickHeap[retryTrick], retryTrick, dispatched, attempt,
+                              received, receivedMono);
+                    continue;
+                }
+                pid = fork();
+                if (pid <= 0) break;
+                metricAdd(METRIC_SPAWNS, 1);
+                metricMask(1, dispatched->mask);
+                flightRecord(FLIGHT_SPAWNED, retryTrick, dispatched->mask, pid, attempt,
+                             (dispatched->len != 0) ? dispatched->name : NULL);
+                if ((child = inflightAdd(pid, retryTrick, dispatched, attempt)) == NULL) {
+                    logx(0, opt, "unable to track retry child, its result will be lost");
                 } else {
-                    strcat(logtxt, ", ignored.");
-                    logx(0, opt, logtxt);
+                    child->received = received;
+                    child->receivedMono = receivedMono;
+                    child->dispatched = dispatchedMono;
                 }
-                break;
+            }
+            if (pid <= 0) break;
+
+    // and so are the held events of tricks resumed over the control socket
+            while ((dispatched = controlReleased(trickHeap, retryBuf, &retryTrick, &attempt,
+                                                 &received, &receivedMono)) != NULL) {
+                dispatched->wd = trickHeap[retryTrick]->watchHandle;
+                dispatchedTrick = retryTrick;
+                if (trickHeap[retryTrick]->handler != NULL) {
+                    nativeDispatch(trickHeap[retryTrick], retryTrick, dispatched, opt,
+                                   received, receivedMono);
+                    continue;
+                }
+                dispatchedMono = auditClock(CLOCK_MONOTONIC);
+                pid = fork();
+                if (pid <= 0) break;
+                metricAdd(METRIC_SPAWNS, 1);
+                metricMask(1, dispatched->mask);
+                flightRecord(FLIGHT_SPAWNED, retryTrick, dispatched->mask, pid, attempt,
+                             (dispatched->len != 0) ? dispatched->name : NULL);
+                if ((child = inflightAdd(pid, retryTrick, dispatched, attempt)) == NULL) {
+                    logx(0, opt, "unable to track released child, its result will be lost");
+                } else {
+                    child->received = received;
+                    child->receivedMono = receivedMono;
+                    child->dispatched = dispatchedMono;
+                }
+            }
+            if (pid <= 0) break;
 
-              case SIGINT:
-                strcat(logtxt, ", probably Control-C");
-                logx(0, opt, logtxt);
-                // do not break
-
-              default:
-                logx(0, opt, "gidget event wait terminated by signal, shutting down.");
-                close(instanceHandle);
-                if (opt.syslog) closelog();
-                exit(EXIT_SUCCESS);          /*******  NORMAL DAEMON EXIT  *******/
-                break;
+    // children that died without a word are swept up now and then
+            if (time(NULL) - lastSweep >= 60) {
+                readReports(reportPipe[0], opt, trickHeap);
+                inflightSweep(opt, trickHeap, lastSweep);
+                lastSweep = time(NULL);
             }
+        }
 
-        } else {
-            if (len > 0) {
-                pid = fork();      // Clone off a child to handle the event
-            } else {
-                if (len == 0) {
-                    sprintf(logtxt, "zero length string returned from inotify, daemon dead");
+        // with both inotify and the poller holding events, each gets every other read
+        pollTurn = !pollTurn;
+        if ((len > 0) && (waitHandles[0].revents & POLLIN) &&
+            !(pollTurn && (pollTimeout(time(NULL)) == 0))) {
+            len = read(instanceHandle, buf, maxEventBufSize);
+            received = auditClock(CLOCK_REALTIME);
+            receivedMono = auditClock(CLOCK_MONOTONIC);
+        } else if ((len >= 0) && ((len = pollEvents(buf, maxEventBufSize)) > 0)) {
+            received = auditClock(CLOCK_REALTIME);
+            receivedMono = auditClock(CLOCK_MONOTONIC);
+        } else if (len >= 0) {
+            continue;       // nothing but reports and retries this time around
+        }
+        // a signal that cut the wait or the read short is already in the
+        // signal pipe, and the kernel still holds any events we didn't read
+        if ((len < 0) && (errno == EINTR)) continue;
+
+        if (len > 0) {
+            attempt = 1;
+            events = 0;
+            metricAdd(METRIC_READS, 1);
+            for (eventOffset = 0; eventOffset < len;
+                 eventOffset += sizeof(event_t) + incoming->len) {
+                incoming = (event_t *) &buf[eventOffset];
+                events++;
+                metricMask(0, incoming->mask);
+                dispatchedTrick = watchTrick(incoming->wd);
+                flightRecord(FLIGHT_READ, dispatchedTrick, incoming->mask, 0, 0,
+                             (incoming->len != 0) ? incoming->name : NULL);
+                if (dispatchedTrick < 0) {
+                    // no trick to run: a fragment in the include directory changed,
+                    // the kernel dropped events, or this is the last of what a
+                    // watch removed by a reload had queued
+                    if (configInclude(opt, instanceHandle, &trickHeap, &trickCount,
+                                      maxNameLen, incoming)) {
+                        continue;
+                    }
+                    if (incoming->mask & IN_Q_OVERFLOW) {
+                        metricAdd(METRIC_OVERFLOWS, 1);
+                        logx(0, opt, "inotify event queue overflowed, events were lost");
+                    } else {
+                        metricAdd(METRIC_DROPPED, 1);
+                        flightRecord(FLIGHT_DROPPED, -1, incoming->mask, 0, 0,
+                                     (incoming->len != 0) ? incoming->name : NULL);
+                    }
+                    continue;
+                }
+                if ((incoming->mask & IN_IGNORED) &&
+                    (incoming->wd != trickHeap[dispatchedTrick]->watchHandle)) {
+                    watchDrop(incoming->wd);   // the watch of a trick now polled is gone
+                    continue;
+                }
+                trickHeap[dispatchedTrick]->lastEvent = received / 1000000000;
+                if ((incoming->len != 0) &&
+                    (ownDropping(trickHeap[dispatchedTrick], incoming->name))) {
+                    metricAdd(METRIC_FILTERED, 1);
+                    flightRecord(FLIGHT_FILTERED, dispatchedTrick, incoming->mask, 0, 0,
+                                 incoming->name);
+                    continue;      // a trick's own droppings, e.g. checksum sidecars
+                }
+                if (trickHeap[dispatchedTrick]->options & TRICK_PAUSED) {
+                    holdEvent(opt, trickHeap[dispatchedTrick], dispatchedTrick, incoming,
+                              attempt, received, receivedMono);
+                    continue;      // paused over the control socket
+                }
+                if (trickHeap[dispatchedTrick]->handler != NULL) {
+                    // native tricks never leave the daemon
+                    nativeDispatch(trickHeap[dispatchedTrick], dispatchedTrick,
+                                   incoming, opt, received, receivedMono);
                 } else {
-                    sprintf(logtxt, "inotify returned %d, FAIL, daemon dead", len);
+                    // a fresh event makes any pending retry of the same object moot
+                    int coalesced = retryCoalesce(dispatchedTrick,
+                                                  (incoming->len != 0) ? incoming->name : "");
+                    if (coalesced > 0) {
+                        metricAdd(METRIC_COALESCED, coalesced);
+                        flightRecord(FLIGHT_COALESCED, dispatchedTrick, incoming->mask, 0,
+                                     coalesced, incoming->name);
+                    }
+                    dispatched = incoming;
+                    dispatchedMono = auditClock(CLOCK_MONOTONIC);
+                    pid = fork();      // Clone off a child to handle the event
+                    if (pid <= 0) break;   // child, or no child at all
+                    metricAdd(METRIC_SPAWNS, 1);
+                    metricMask(1, incoming->mask);
+                    flightRecord(FLIGHT_SPAWNED, dispatchedTrick, incoming->mask, pid,
+                                 attempt, (incoming->len != 0) ? incoming->name : NULL);
+                    if ((child = inflightAdd(pid, dispatchedTrick, incoming, attempt)) == NULL) {
+                        logx(0, opt, "unable to track event child, its result will be lost");
+                    } else {
+                        child->received = received;
+                        child->receivedMono = receivedMono;
+                        child->dispatched = dispatchedMono;
+                    }
                 }
-                logx(7, opt, logtxt);   /******** INOTIFY FAILURE EXIT  *******/
             }
+            if (pid > 0) metricBatch(events);
+        } else {
+            if (len == 0) {
+                sprintf(logtxt, "zero length string returned from inotify, daemon dead");
+            } else {
+                sprintf(logtxt, "inotify returned %d, FAIL, daemon dead", len);
+            }
+            logx(7, opt, logtxt);   /******** INOTIFY FAILURE EXIT  *******/
         }
     }
 
@@ -636,10 +826,13 @@ int main(int argc, char **argv) {
 
 // If execution reaches this point we are the child
 
+// with -L sampling, most events keep their verbose detail to themselves
+    if (opt.verbose && !logSampled()) opt.verbose = 0;
+
     if ((pid = getpid()) < 0) {
         logx(1, opt, "Unable to get event child pid");
     } else {
-        if (opt.verbose) {
+        if (opt.verbose && logRate(RATE_EXEC)) {
             sprintf(logtxt, "spawned event child process %d", pid);
             logx(0, opt, logtxt);
         }
@@ -658,18 +851,34 @@ int main(int argc, char **argv) {
     if (sigaction(SIGHUP, &oldHupAct, NULL) < 0) {
         logx(10, opt, "Unable to release SIGHUP trap");
     }
+    if (sigaction(SIGUSR1, &oldUsr1Act, NULL) < 0) {
+        logx(10, opt, "Unable to release SIGUSR1 trap");
+    }
 
 // Only the parent should hold the watches open
     close(instanceHandle);
+    close(reportPipe[0]);
+    close(signalPipe[0]);
+    close(signalPipe[1]);
 
-// cast the raw event buffer into an inotify event structure
-// so we can figure out what the hell is going on here
+// the event we were forked for, straight from inotify or off the retry queue
     struct inotify_event *event;
-    event = (struct inotify_event *) &buf[0];
+    event = dispatched;
+
+// however we leave, even by way of logx(), the daemon hears about it
+    report_t report;
+    memset(&report, 0, sizeof(report));
+    report.pid = getpid();
+    report.trick = dispatchedTrick;
+    report.status = EXIT_FAILURE;
+    reportWriter = reportPipe[1];
+    if (on_exit(reportOnExit, &report) != 0) {
+        logx(0, opt, "unable to arrange completion report");
+    }
 
 // more debuggery
     if (opt.verbose) {
-        printf("\n%s", trickHeap[((event->wd) - 1)]->fileName);
+        printf("\n%s", trickHeap[dispatchedTrick]->fileName);
         if (event->len != 0) printf("/%s", event->name);
         printf(" watch=%d mask=%zu cookie=%zu len=%u\n",
                  event->wd, event->mask, event->cookie, event->len);
@@ -677,9 +886,9 @@ int main(int argc, char **argv) {
         stringifyEventBits(dummy);  //converts events to readable form
     }
 
-// returned events are matched against known tricks by watch descriptor
-// find the appropriate trick and load our faithful pony
-    pony = *trickHeap[(event->wd) - 1];
+// returned events were matched against known tricks by watch descriptor
+// before the fork, so load our faithful pony with the one we were given
+    pony = *trickHeap[dispatchedTrick];
 
 
 /************************************
@@ -722,6 +931,47 @@ int main(int argc, char **argv) {
         }
     }
 
+// the real name of the object, unmunged, for anything that opens it
+    char realPath[maxNameLen + strlen(pony.fileName) + 2];
+    strcpy(realPath, pony.fileName);
+    if (event->len != 0) {
+        strcat(realPath, slash);
+        strcat(realPath, event->name);
+    }
+
+// content fingerprinting: if the bytes haven't changed since the
+// script last ran successfully there is nothing to do.  The LRU we
+// consult is the daemon's, as it stood when we were forked.  Mapping
+// the file is fine here, a SIGBUS only costs this child
+    if ((pony.options & TRICK_HASH) &&
+        !(event->mask & (IN_ISDIR | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM |
+                         IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT))) {
+        if (gigHashFile(realPath, &report.contentHash, 1) < 0) {
+            if (opt.verbose) {
+                sprintf(logtxt, "unable to fingerprint %s: %s, running anyway",
+                        realPath, strerror(errno));
+                logx(0, opt, logtxt);
+            }
+        } else {
+            report.pathKey = gigHashBytes(realPath, strlen(realPath), report.trick);
+            if (fingerprintMatches(report.pathKey, report.contentHash)) {
+                sprintf(logtxt, "content of %s unchanged (%016llx), skipping %s",
+                        realPath, (unsigned long long) report.contentHash, pony.script);
+                logx(0, opt, logtxt);
+                report.flags |= REPORT_SKIPPED;
+                exit(EXIT_SUCCESS);
+            }
+            char hashText[20];
+            sprintf(hashText, "%016llx", (unsigned long long) report.contentHash);
+            setenv("GIDGET_HASH", hashText, 1);
+        }
+    }
+
+// scripts may want to behave differently on a second go
+    char attemptText[12];
+    sprintf(attemptText, "%d", attempt);
+    setenv("GIDGET_ATTEMPT", attemptText, 1);
+
 // test for backing filesystem unmount event
     if (event->mask & IN_UNMOUNT) {
         sprintf(logtxt,
@@ -827,6 +1077,13 @@ int main(int argc, char **argv) {
         logx(24, opt, "unable to create mail pipe");
     }
 
+// and one that only says when the script has been exec'd: nothing
+// is ever written to it, the grandchild's end just closes on exec
+    int execPipe[2];
+    if (pipe2(execPipe, O_CLOEXEC) == -1) {
+        logx(24, opt, "unable to create exec pipe");
+    }
+
 // ..Primary logging action..  This program should emit no other
 // output except error messages and startup/shutdown unless verbose
 // mode has been specifically selected by the user at run time
@@ -838,9 +1095,11 @@ int main(int argc, char **argv) {
     } else {
         sprintf(logtxt, "Executing %s using shell %s with output to %s", command, pwd->pw_shell, pony.mail);
     }
-      logx(0, opt, logtxt);
+    if (logRate(RATE_EXEC)) logx(0, opt, logtxt);
 
-// environment has been built, so it's time to fork
+// environment has been built, so it's time to fork.  The clock is
+// read first, since on a busy box the script may well run before we do
+    report.spawned = auditClock(CLOCK_MONOTONIC);
     pid = fork();
 
     if (pid == -1) {
@@ -851,6 +1110,7 @@ int main(int argc, char **argv) {
 // note, in valgrind the dup2 generates a spurious EBADF warning
     if (pid == 0) {
         close(pipehandle[0]);        // close read end (0) of pipe
+        close(execPipe[0]);
         dup2(pipehandle[1], 1);        // make stdout (1) write end (1) of pipe
         dup2(1, 2);                // make stderr (2) same as stdout (1)
         close(pipehandle[1]);        // close redundant handle
@@ -877,64 +1137,103 @@ int main(int argc, char **argv) {
         logx(29, opt, "execl script FAILED"); // should never be reached
     }
 
-// if the script outputs anything, it will need to be emailed, so
-// build a timestamp instead of trusting the local email transport
-// to be properly configured.  Use fundamentally stupid traditional
-// Unix time format in order to be extremely SMTP friendly
-
-    time_t unixEpochTime;  // only YOU can prevent the Y2.038K disaster
-    char tmbuf[26], *mailTime;
-
-    unixEpochTime = time(NULL);
-    mailTime = ctime_r(&unixEpochTime, tmbuf);
-    mailTime[24]=0; // strip unnneccccesssary newline
-
-// parent (of grandchild) will receive output from script, if any
-// this will block until something gets written or EOF
+// parent (of grandchild) will receive output from script, if any.
+// Drain it all before going near a sink so the script never waits
+// on us, and only then decide where it goes
     if (pid > 0) {
         close(pipehandle[1]);        // close write end (1) of pipe
-
-        int bytesMailed = 0;
-        FILE *fromPipe = fdopen(pipehandle[0], "r");
-        int ch = getc(fromPipe);
-        if (ch != EOF) {        // we got fish on the hook!
-            // fire up a mail process
-            FILE *mailslot;
-            // and stuff the mail into it
-            if (mailslot = popen(MAILCOMMAND, "w")) {
-                // boilerplate mail headers
-                fprintf(mailslot, "From: %s (gidget)\n", pony.userid);
-                fprintf(mailslot, "To: %s\n", pony.mail);
-                fprintf(mailslot, "Subject: gidget event: %s\n",
-                        fileOrFolder);
-                fprintf(mailslot, "Date: %s\n", mailTime);
-                // gidget is RFC3834 section 5.1 compliant
-                // scalix autoresponder is non-compliant though
-                fprintf(mailslot, "Auto-Submitted: auto-generated\n");
-                // clues for the exceptionally clever or observant (hi there!)
-                fprintf(mailslot, "X-gidget-object: %s\n", fileOrFolder);
-                fprintf(mailslot, "X-gidget-watch: %d\n", event->wd);
-                fprintf(mailslot, "X-gidget-mask: %d\n\n", event->mask);
-                fprintf(mailslot, "%s -c %s:\n\n", shell, command);
-                putc(ch, mailslot);        // first char
-                while ((ch = getc(fromPipe)) != EOF) {
-                    bytesMailed++;
-                    putc(ch, mailslot);
+        close(execPipe[1]);
+        char execByte;
+        while ((read(execPipe[0], &execByte, 1) < 0) && (errno == EINTR));
+        report.executed = auditClock(CLOCK_MONOTONIC);
+        close(execPipe[0]);
+
+        capture_t output;
+        if (captureDrain(opt, pipehandle[0], pony.outputMax, &output) < 0) {
+            sprintf(logtxt, "error reading output of %s: %s, keeping what we got",
+                    pony.script, strerror(errno));
+            logx(0, opt, logtxt);
+        }
+        close(pipehandle[0]);
+
+        long long bytesMailed = 0;
+        int spooled = 0;
+        int haveOutput = ((captureLength(&output) > 0) || (output.omitted > 0));
+        if (haveOutput) report.outputHash = captureHash(&output);
+        report.outputBytes = captureLength(&output) + output.omitted;
+        if ((opt.digestCount > 0) && haveOutput) {
+            // digests are put together by the daemon, so leave it the output
+            char spoolName[MAX_SPOOL_NAME_LEN + 32];
+            sprintf(spoolName, "%s/output.%d", opt.spooldir, report.pid);
+            int spoolHandle = open(spoolName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+            if (spoolHandle < 0) {
+                sprintf(logtxt, "unable to spool output to %s: %s, mailing it instead",
+                        spoolName, strerror(errno));
+                logx(0, opt, logtxt);
+            } else {
+                bytesMailed = captureWrite(&output, spoolHandle);
+                if ((close(spoolHandle) < 0) || (bytesMailed < 0)) {
+                    sprintf(logtxt, "error spooling output of %s to %s: %s",
+                            pony.script, spoolName, strerror(errno));
+                    logx(0, opt, logtxt);
                 }
+                report.flags |= REPORT_OUTPUT;  // whatever made it, the daemon sends
+                spooled = 1;
+            }
+        }
+        if (!spooled && haveOutput) {        // we got fish on the hook!
+            // write a message into the mail queue, the daemon's couriers
+            // deliver it whenever the MTA gets round to taking it
+            FILE *mailslot;
+            mailSlot_t slot;
+            char preface[strlen(shell) + strlen(command) + 8];
+            sprintf(preface, "%s -c %s:", shell, command);
+            if ((mailslot = mailStream(opt, pony.mail, &slot)) != NULL) {
+                mailHeaders(mailslot, &pony, fileOrFolder, event->wd, event->mask, preface);
                 fflush(mailslot);
-                pclose(mailslot);
+                bytesMailed = captureWrite(&output, fileno(mailslot));
+                if (bytesMailed < 0) {
+                    sprintf(logtxt, "error writing output of %s to mail queue: %s",
+                            pony.script, strerror(errno));
+                    logx(0, opt, logtxt);
+                }
+                if (mailFinish(opt, mailslot, &slot) == 0) {
+                    strcpy(report.queued, slot.name);
+                    report.flags |= REPORT_QUEUED;
+                }
+            } else {
+                sprintf(logtxt, "unable to queue output of %s: %s, output lost",
+                        pony.script, strerror(errno));
+                logx(0, opt, logtxt);
             }
         }
 
-        if (bytesMailed != 0) {
+        if ((bytesMailed > 0) && spooled && logRate(RATE_OUTPUT)) {
+            sprintf(logtxt,
+                    "parentpid [%d] spooled %lld bytes of output for %s",
+                    ppid, bytesMailed, pony.mail);
+            logx(0, opt, logtxt);
+        } else if ((bytesMailed > 0) && !spooled && logRate(RATE_OUTPUT)) {
             sprintf(logtxt, 
-                    "parentpid [%d] mailed %d bytes of output to %s",
-                    ppid, bytesMailed, MAIL_TRANSPORT);
+                    "parentpid [%d] queued %lld bytes of output for %s",
+                    ppid, bytesMailed, pony.mail);
+            logx(0, opt, logtxt);
+        }
+        if (haveOutput && !(report.flags & (REPORT_OUTPUT | REPORT_QUEUED))) {
+            report.flags |= REPORT_LOST;
+        }
+        if ((output.omitted > 0) && logRate(RATE_OUTPUT)) {
+            sprintf(logtxt,
+                    "parentpid [%d] output of %s over its %u byte cap, %lld bytes omitted",
+                    ppid, pony.script, pony.outputMax, output.omitted);
             logx(0, opt, logtxt);
         }
+        captureFree(&output);
 
         int cstatus;
-        if (waitpid(pid, &cstatus, 0) == -1) {
+        int waited = waitpid(pid, &cstatus, 0);
+        report.finished = auditClock(CLOCK_MONOTONIC);
+        if (waited == -1) {
             sprintf(logtxt, "unable to obtain exit status of grandchild [%d]%s",
                     pid, pony.script);
             logx(29, opt, "execl mail FAILED");
@@ -987,8 +1286,12 @@ int main(int argc, char **argv) {
         free(pbuffer);
         free(trickHeap);
 */
-        logx(shstatus, opt, logtxt);
-        exit(shstatus);  // only reached if shstatus is zero
+
+// the daemon remembers fingerprints of successes and retries failures
+        report.flags |= REPORT_RAN;
+        report.status = shstatus;
+        if (logRate(RATE_STATUS)) logx(shstatus, opt, logtxt);
+        exit(shstatus);  // only reached if shstatus is zero, or not logged
     }
 
     logx(255, opt, "The sky is falling!  The sky is falling!");  // should never happen
@@ -1005,13 +1308,31 @@ int main(int argc, char **argv) {
 void usage(FILE *fh) {
     fprintf(fh,"\nRun programs when specific filesystem events occur\n");
     fprintf(fh,"\nUsage: gidget [OPTION]\n");
+    fprintf(fh,"\t-a file    \twrite a JSON line per event to an audit log\n");
+    fprintf(fh,"\t-A b[,n]   \trotate the audit log at b bytes, keeping n old ones\n");
+    fprintf(fh,"\t-B n       \tpoll every trick n times, report entries/sec and exit\n");
     fprintf(fh,"\t-c filename\toverride default configuration file\n");
+    fprintf(fh,"\t-C         \tcompile the configuration cache and exit\n");
     fprintf(fh,"\t-d         \trun as a system daemon, using pid & log files\n");
+    fprintf(fh,"\t-D n[,b[,s]]\tmail digests of n events, b bytes or s seconds\n");
+    fprintf(fh,"\t-I dir     \talso read every *.conf in dir, reloading each as it changes\n");
+    fprintf(fh,"\t-k socket  \ttake commands such as list, pause and resume on a Unix socket\n");
     fprintf(fh,"\t-l logfile \toverride default error and event logging\n");
+    fprintf(fh,"\t-L r[,b[,n]]\tlimit per-event log lines to r a second, bursts of b,\n");
+    fprintf(fh,"\t            \tand verbose detail to one event in n (100,500,1)\n");
+    fprintf(fh,"\t-M transport[,n]\tdeliver mail with sendmail (default), smtp://host[:port]\n");
+    fprintf(fh,"\t                \tor lmtp:/socket, over n connections\n");
+    fprintf(fh,"\t-m socket  \tserve Prometheus metrics on a Unix socket path,\n");
+    fprintf(fh,"\t           \tor a TCP port number on 127.0.0.1\n");
+    fprintf(fh,"\t-n         \tcheck the configuration against inotify limits and exit\n");
     fprintf(fh,"\t-p pidfile \toverride default daemon process id file\n");
+    fprintf(fh,"\t-q spooldir\toverride default spool directory for retries\n");
     fprintf(fh,"\t-s [n]     \tuse syslog to log events at level n\n");
     fprintf(fh,"\t-V         \tprint version string\n");
     fprintf(fh,"\t-v         \tbe exceptionally verbose\n");
+    fprintf(fh,"\t-w n       \tuse n worker threads for native tricks\n");
+    fprintf(fh,"\t-W n[,s]   \thold at most n inotify watches, polling the rest,\n");
+    fprintf(fh,"\t           \tand poll watched tricks quiet for s seconds first (300)\n");
     fprintf(fh,"\t-?         \tthese messages\n");
     fprintf(fh,"\nNOTE syslog levels are 0-7, higher number indicating lower priority\n\n");
     fprintf(fh,"Warnings and significant events will be logged to stdout unless\n");
@@ -1024,12 +1345,21 @@ opts_t gig_opts(int argc, char **argv) {
 
 // default log level if syslog is invoked is 1 (LOG_ALERT)
     opts_t opt={0,0,0,0,0}; // no-verbose, no-daemon, no-logfile, no-syslog
+    opt.workers = POOL_THREADS;
+    char logtxt[MAX_ERR_TEXT_LEN];
     strcpy(opt.config, DEFAULT_CONFIG_FILE);
     strcpy(opt.logfile, DEFAULT_LOG_FILE);
     strcpy(opt.pidfile, DEFAULT_PID_FILE);
+    strcpy(opt.spooldir, DEFAULT_SPOOL_DIR);
+    opt.auditBytes = AUDIT_BYTES;
+    opt.auditKeep = AUDIT_KEEP;
+    opt.logRate = LOG_RATE;
+    opt.logBurst = LOG_BURST;
+    opt.logSample = 1;
+    opt.tierQuiet = TIER_QUIET;
 
     char o;
-    while ((o = getopt (argc, argv, ":dVvc:l:p:s:")) != -1) {
+    while ((o = getopt (argc, argv, ":a:A:B:CdD:I:k:m:nVvc:l:L:M:p:q:s:w:W:")) != -1) {
         switch (o) {
 
           case ':':
@@ -1040,11 +1370,71 @@ opts_t gig_opts(int argc, char **argv) {
             }
             break;
 
+          case 'a':
+            if (strlen(optarg) >= MAX_LOG_NAME_LEN) {
+                fprintf (stderr, "audit log name too long!\n");
+                exit(1);
+            }
+            strcpy(opt.auditFile, optarg);
+            break;
+
+          case 'A':
+            if ((sscanf(optarg, "%lld,%d", &opt.auditBytes, &opt.auditKeep) < 1) ||
+                (opt.auditBytes < 4096) || (opt.auditKeep < 0) || (opt.auditKeep > 99)) {
+                fprintf (stderr, "audit log rotation wants at least 4096 bytes and 0-99 old logs\n");
+                exit(1);
+            }
+            break;
+
+          case 'C':
+            opt.compile = 1;
+            break;
+
+          case 'n':
+            opt.plan = 1;
+            break;
+
+          case 'k':
+            if ((strlen(optarg) >= MAX_CONTROL_NAME_LEN) || (optarg[0] != '/')) {
+                fprintf (stderr, "the control socket needs a full path under 108 characters\n");
+                exit(1);
+            }
+            strcpy(opt.control, optarg);
+            break;
+
+          case 'm':
+            if ((strlen(optarg) >= MAX_METRICS_NAME_LEN) ||
+                ((optarg[0] != '/') && ((atoi(optarg) < 1) || (atoi(optarg) > 65535)))) {
+                fprintf (stderr, "metrics need a socket path or a port from 1 to 65535\n");
+                exit(1);
+            }
+            strcpy(opt.metrics, optarg);
+            break;
+
+          case 'B':
+            opt.bench = atoi(optarg);
+            if (opt.bench < 1) {
+                fprintf (stderr, "benchmark rounds must be at least 1\n");
+                exit(1);
+            }
+            break;
+
           case 'd':
             opt.daemon = 1;
             opt.log2file = 1;
             break;
 
+          case 'D':
+            opt.digestBytes = DIGEST_BYTES;
+            opt.digestSeconds = DIGEST_SECONDS;
+            if ((sscanf(optarg, "%d,%ld,%d", &opt.digestCount, &opt.digestBytes,
+                        &opt.digestSeconds) < 1) ||
+                (opt.digestCount < 1) || (opt.digestBytes < 1) || (opt.digestSeconds < 1)) {
+                fprintf (stderr, "digest limits must be positive numbers\n");
+                exit(1);
+            }
+            break;
+
           case 'V':
             fprintf(stdout,"\nGidget v%s Goddard & Brooks 2011\n\n",GVERSION);
             exit(0);
@@ -1062,6 +1452,14 @@ opts_t gig_opts(int argc, char **argv) {
             strcpy(opt.config,optarg);
             break;
 
+          case 'I':
+            if (strlen(optarg) >= MAX_CONFIG_NAME_LEN) {
+                fprintf (stderr, "include directory name too long!\n");
+                exit(1);
+            }
+            strcpy(opt.includeDir, optarg);
+            break;
+
           case 'l':
             if (strlen(optarg) > MAX_LOG_NAME_LEN) {
                 fprintf (stderr, "log file name too long!\n");
@@ -1071,6 +1469,22 @@ opts_t gig_opts(int argc, char **argv) {
             opt.log2file = 1;
             break;
 
+          case 'L':
+            if ((sscanf(optarg, "%d,%d,%d", &opt.logRate, &opt.logBurst, &opt.logSample) < 1) ||
+                (opt.logRate < 0) || (opt.logBurst < 1) || (opt.logSample < 1)) {
+                fprintf (stderr, "log limits must be a rate of 0 or more, then positive numbers\n");
+                exit(1);
+            }
+            break;
+
+          case 'M':
+            if (mailTransportCheck(optarg, logtxt, sizeof(logtxt), 0) < 0) {
+                fprintf (stderr, "%s\n", logtxt);
+                exit(1);
+            }
+            strcpy(opt.transport, optarg);
+            break;
+
           case 'p':
             if (strlen(optarg) > MAX_PID_NAME_LEN) {
                 fprintf (stderr, "Pid file name too long!\n");
@@ -1079,6 +1493,14 @@ opts_t gig_opts(int argc, char **argv) {
             strcpy(opt.pidfile,optarg);
             break;
 
+          case 'q':
+            if (strlen(optarg) >= MAX_SPOOL_NAME_LEN) {
+                fprintf (stderr, "spool directory name too long!\n");
+                exit(1);
+            }
+            strcpy(opt.spooldir,optarg);
+            break;
+
           case 's':
             if ((strlen(optarg) == 1) && (isdigit(*optarg))) {
                 opt.sloglev = atoi(optarg);
@@ -1091,6 +1513,22 @@ opts_t gig_opts(int argc, char **argv) {
             opt.syslog = 1;
             break;
 
+          case 'w':
+            opt.workers = atoi(optarg);
+            if ((opt.workers < 1) || (opt.workers > 256)) {
+                fprintf (stderr, "worker threads must be between 1 and 256\n");
+                exit(1);
+            }
+            break;
+
+          case 'W':
+            if ((sscanf(optarg, "%d,%d", &opt.watchBudget, &opt.tierQuiet) < 1) ||
+                (opt.watchBudget < 1) || (opt.tierQuiet < 0)) {
+                fprintf (stderr, "watch budget must be at least 1, and quiet seconds at least 0\n");
+                exit(1);
+            }
+            break;
+
           case '?':
             usage(stdout);
             break;
@@ -1115,21 +1553,123 @@ opts_t gig_opts(int argc, char **argv) {
     return opt;
 }
 
+// the boilerplate headers and preface of a message about one event
+void mailHeaders(FILE *mailslot, const trick_t *pony, const char *object,
+                 int32_t wd, uint32_t mask, const char *preface) {
+
+// if the script outputs anything, it will need to be emailed, so
+// build a timestamp instead of trusting the local email transport
+// to be properly configured.  Use fundamentally stupid traditional
+// Unix time format in order to be extremely SMTP friendly
+
+    time_t unixEpochTime;  // only YOU can prevent the Y2.038K disaster
+    char mailTime[26];
+    struct tm fancyTime;
+
+    unixEpochTime = time(NULL);
+    strftime(mailTime, sizeof(mailTime), "%a %b %e %T %Y",  // ctime() less its newline
+             logTime(unixEpochTime, 1, &fancyTime));
+
+    // boilerplate mail headers
+    fprintf(mailslot, "From: %s (gidget)\n", pony->userid);
+    fprintf(mailslot, "To: %s\n", pony->mail);
+    fprintf(mailslot, "Subject: gidget event: %s\n", object);
+    fprintf(mailslot, "Date: %s\n", mailTime);
+    // gidget is RFC3834 section 5.1 compliant
+    // scalix autoresponder is non-compliant though
+    fprintf(mailslot, "Auto-Submitted: auto-generated\n");
+    // clues for the exceptionally clever or observant (hi there!)
+    fprintf(mailslot, "X-gidget-object: %s\n", object);
+    fprintf(mailslot, "X-gidget-watch: %d\n", wd);
+    fprintf(mailslot, "X-gidget-mask: %d\n\n", mask);
+    fprintf(mailslot, "%s\n\n", preface);
+}
+
+// an unnamed scratch file in the spool directory, or -1
+int spoolTemp(opts_t opt) {
+    int handle = open(opt.spooldir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (handle < 0) {
+    // no O_TMPFILE here, so make a name and lose it straight away
+        char temp[MAX_SPOOL_NAME_LEN + 32];
+        sprintf(temp, "%s/scratch.XXXXXX", opt.spooldir);
+        if ((handle = mkostemp(temp, O_CLOEXEC)) >= 0) unlink(temp);
+    }
+    return handle;
+}
+
+// Move everything from one file to another, from and to their current
+// offsets, until EOF.  Script output reaches us already drained into a
+// spool file, so both ends are regular files and copy_file_range() can
+// keep the bytes in the kernel (or share extents, on filesystems that
+// can); otherwise they go through one large buffer rather than stdio.
+// Returns bytes moved, or -1 with errno set if the destination gave up
+// on us
+long long relayFile(int from, int to) {
+    long long moved = 0;
+    ssize_t got, put, done;
+    char *buf;
+
+    for (;;) {
+        got = copy_file_range(from, NULL, to, NULL, RELAY_CHUNK, 0);
+        if (got > 0) {
+            moved += got;
+            continue;
+        }
+        if (got == 0) return moved;
+        if (errno == EINTR) continue;
+        // older kernels, different filesystems, not a regular file
+        if ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) ||
+            (errno == EOPNOTSUPP) || (errno == EBADF)) break;
+        return -1;
+    }
+
+    if ((buf = malloc(RELAY_CHUNK)) == NULL) return -1;
+    while ((got = read(from, buf, RELAY_CHUNK)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        for (done = 0; done < got; done += put) {
+            put = write(to, buf + done, got - done);
+            if (put < 0) {
+                if (errno == EINTR) {
+                    put = 0;
+                    continue;
+                }
+                free(buf);
+                return -1;
+            }
+        }
+        moved += got;
+    }
+    free(buf);
+    return moved;
+}
+
 /*  "If you'd told me in 1989 that unix would be the hope for
      the future, I'd have cut my throat" --Jamie Zwarinski?    */
 
 
-// Signal management allows read() to provide EINTR results and
-// permits forked children to be auto-reaped for zombie control
+// Signal management hands each signal to the read loop through
+// signalPipe, and permits forked children to be auto-reaped for
+// zombie control
 
 static void signalTrap(int sig, siginfo_t * siginfo, void *context) {
     long sigpid = siginfo->si_pid;
     long siguid = siginfo->si_uid;
+    unsigned char signalByte = (unsigned char) sig;
+    int saveErrno = errno;
     if (sigpid != 0 && siguid != 0) {
         printf("Signal %d received from process: %ld, UID: %ld\n", sig,
                sigpid, siguid);
     }
-    signalCaught = (sig_atomic_t) sig;
+// an event child caught before it drops our traps keeps quiet, and a
+// full pipe already holds more signals than the loop has handled
+    if ((getpid() == signalOwner) && (write(signalPipe[1], &signalByte, 1) < 0)) {
+        signalByte = 0;
+    }
+    errno = saveErrno;
     return;
 }
 
@@ -1139,17 +1679,24 @@ static void signalTrap(int sig, siginfo_t * siginfo, void *context) {
 static void reopenLogs(opts_t opt) {
 
     char logtxt[MAX_ERR_TEXT_LEN];
+    int logHandle;
 
-    if (NULL == freopen(opt.logfile,"a",stdout)) {
-        sprintf(logtxt,"Error (%u) opening %s for stdout: %s",
+// open the new file first and dup2() it into place, so the log
+// writer thread never sees stdout closed or pointing elsewhere
+    fflush(stdout);
+    fflush(stderr);
+    logHandle = open(opt.logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (logHandle < 0) {
+        sprintf(logtxt,"Error (%u) opening %s: %s",
              errno, opt.logfile, strerror(errno));
         logx(1, opt, logtxt);
     }
-    if (NULL == freopen(opt.logfile,"a",stderr)) {
-        sprintf(logtxt,"Error (%u) opening %s for stderr: %s",
+    if ((dup2(logHandle, 1) < 0) || (dup2(logHandle, 2) < 0)) {
+        sprintf(logtxt,"Error (%u) redirecting stdout/stderr to %s: %s",
              errno, opt.logfile, strerror(errno));
         logx(1, opt, logtxt);
     }
+    close(logHandle);
 }
 
 /*
@@ -1169,54 +1716,208 @@ static void reopenLogs(opts_t opt) {
 void logx(int xstatus, opts_t opt, char logtxt[]) {
 
 //  ISO standard date/time representations
-//  are used by all right-thinking people everywhere
-
-    time_t unixEpochTime;
-    struct tm fancyTime, *bigTime;
-    char tmbuf[20], *Now;
-    Now = &tmbuf[0];
-
-    unixEpochTime = time(NULL);
-    bigTime = localtime_r(&unixEpochTime, &fancyTime);
-    strftime(tmbuf, sizeof(tmbuf), "%F %T", bigTime);
+//  are used by all right-thinking people everywhere.
+//  logStamp() only formats one when the second changes
 
 //  remember, kids, anyone who uses any time format other
 //  than the ISO standard is an infidel and/or terrorist
 
-    pid_t pid;
-    char pidString[64];
+    char line[LOG_LINE_LEN];
+    int lineLen;
 
-    if ((pid = getpid()) < 0) {
-        strcpy(pidString,"[unknown]");
-    } else {
-        sprintf(pidString, "[%d]", pid);
+    if (strlen(logtxt) <= 0) {
+        strcpy(logtxt, (0 == xstatus) ? "Missing log string. This should not happen."
+                                      : "The sky is falling!  The sky is falling!");
     }
 
-    FILE* logstream;
+    lineLen = snprintf(line, sizeof(line), "gidget[%d]: %s %s\n",
+                       (int) logPid(), logStamp(), logtxt);
+    if (lineLen >= (int) sizeof(line)) {
+        lineLen = sizeof(line) - 1;
+        line[lineLen - 1] = '\n';
+    }
 
-    if (0 == xstatus) {
-        fflush(stderr);
-        logstream = stdout;
-        if (strlen(logtxt) <= 0) {
-            strcpy(logtxt,"Missing log string. This should not happen.");
+// the daemon's writer thread does the actual writing, except for
+// fatal messages, which are written here once it has caught up
+    logPost(opt, xstatus, line, lineLen);
+    if (0 == xstatus) return;
+    flightFatal(opt);       // what led up to it, if this is the daemon
+    exit(xstatus);
+}
+
+// hold an event of a paused trick until it is resumed, see gidgetcontrol.c
+static void holdEvent(opts_t opt, const trick_t *pony, int32_t trick, const event_t *event,
+                      int attempt, int64_t received, int64_t receivedMono) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+
+    if (controlHold(trick, event, attempt, received, receivedMono) == 0) {
+        flightRecord(FLIGHT_HELD, trick, event->mask, 0, controlHeld(),
+                     (event->len != 0) ? event->name : NULL);
+        return;
+    }
+    metricAdd(METRIC_DROPPED, 1);
+    flightRecord(FLIGHT_DROPPED, trick, event->mask, 0, 0,
+                 (event->len != 0) ? event->name : NULL);
+    if (logRate(RATE_RETRY)) {
+        sprintf(logtxt, "no room to hold an event for paused %s on %s, event lost",
+                pony->script, pony->fileName);
+        logx(0, opt, logtxt);
+    }
+}
+
+// drain completion reports from event children.  The pipe is
+// non-blocking, so we stop as soon as it runs dry
+
+static void readReports(int reportHandle, opts_t opt, trick_t **trickHeap) {
+
+    char logtxt[MAX_ERR_TEXT_LEN];
+    report_t report;
+    inflight_t *child;
+    ssize_t got;
+    int delay, suppressed;
+
+    while ((got = read(reportHandle, &report, sizeof(report))) == sizeof(report)) {
+        if ((report.status == 0) && (report.pathKey != 0)) {
+            fingerprintRemember(report.pathKey, report.contentHash);
         }
-    } else {
-        fflush(stdout);
-        logstream = stderr;
-        if (strlen(logtxt) <= 0) {
-            strcpy(logtxt,"The sky is falling!  The sky is falling!");
+        child = inflightFind(report.pid);
+        suppressed = 0;
+        if ((report.flags & (REPORT_QUEUED | REPORT_OUTPUT)) &&
+            (trickHeap[report.trick]->dedupeWindow != 0)) {
+            const char *name = (child != NULL) ? child->name : "";
+            char object[strlen(trickHeap[report.trick]->fileName) + strlen(name) + 2];
+            sprintf(object, (name[0] != '\0') ? "%s/%s" : "%s",
+                    trickHeap[report.trick]->fileName, name);
+            if (repeatSuppress(opt, trickHeap, report.trick, report.outputHash, object)) {
+                if (report.flags & REPORT_QUEUED) mailDiscard(opt, report.queued);
+                if (report.flags & REPORT_OUTPUT) {
+                    char spoolName[MAX_SPOOL_NAME_LEN + 32];
+                    sprintf(spoolName, "%s/output.%d", opt.spooldir, report.pid);
+                    unlink(spoolName);
+                }
+                report.flags &= ~(REPORT_QUEUED | REPORT_OUTPUT);
+                suppressed = 1;
+            }
+        }
+        if (report.flags & REPORT_QUEUED) {
+            mailEnqueue(report.queued);
         }
+        if (report.flags & REPORT_OUTPUT) {
+            reportOutput(opt, trickHeap[report.trick], &report, child);
+        }
+        if (report.flags & REPORT_RAN) metricExit(report.status);
+        if (report.flags & REPORT_SKIPPED) metricAdd(METRIC_SKIPPED, 1);
+        if (report.flags & REPORT_LOST) metricAdd(METRIC_LOST, 1);
+        if (suppressed) metricAdd(METRIC_SUPPRESSED, 1);
+        flightRecord((report.flags & REPORT_SKIPPED) ? FLIGHT_SKIPPED : FLIGHT_EXITED,
+                     report.trick, (child != NULL) ? child->mask : 0, report.pid, report.status,
+                     (child != NULL) ? child->name : NULL);
+        if (child == NULL) continue;
+
+        int64_t stamps[STAMPS] = { child->receivedMono, child->dispatched, report.spawned,
+                                   report.executed, report.finished };
+        latencyRecord(child->trick, trickHeap[child->trick]->fileName, stamps);
+
+        auditChild(opt, trickHeap, child, &report,
+                   suppressed ? "suppressed" :
+                   (report.flags & REPORT_QUEUED) ? "queued" :
+                   (report.flags & REPORT_OUTPUT) ? "digest" :
+                   (report.flags & REPORT_SKIPPED) ? "skipped" :
+                   (report.flags & REPORT_LOST) ? "lost" : "none");
+
+    // only a script that actually ran and failed is worth another go,
+    // and only while its trick is still configured
+        if ((report.flags & REPORT_RAN) && (report.status != 0) &&
+            (trickHeap[child->trick]->retryMax != 0) &&
+            !(trickHeap[child->trick]->options & TRICK_RETIRED)) {
+            trick_t *pony = trickHeap[child->trick];
+            delay = retrySchedule(pony, child->trick, child->mask, child->cookie,
+                                  child->name, child->attempt, report.status);
+            if (delay > 0) {
+                metricAdd(METRIC_RETRIES, 1);
+                flightRecord(FLIGHT_RETRY, child->trick, child->mask, 0, delay, child->name);
+                sprintf(logtxt, "will retry %s for %s/%s, attempt %d of %d in %d seconds",
+                        pony->script, pony->fileName, child->name,
+                        child->attempt + 1, pony->retryMax + 1, delay);
+            } else if (delay < 0) {
+                sprintf(logtxt, "unable to queue retry of %s for %s/%s, out of memory",
+                        pony->script, pony->fileName, child->name);
+            } else {
+                sprintf(logtxt, "giving up on %s for %s/%s after %d attempts, status %d",
+                        pony->script, pony->fileName, child->name,
+                        child->attempt, report.status);
+            }
+            if (logRate(RATE_RETRY)) logx(0, opt, logtxt);
+        }
+        inflightRemove(child);
     }
 
-    fprintf(logstream, "gidget%s: %s %s\n", pidString, Now, logtxt);
+    if ((got < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        sprintf(logtxt, "Error reading report pipe: %s (%u)", strerror(errno), errno);
+        logx(0, opt, logtxt);
+    } else if (got > 0) {
+        logx(0, opt, "short read on report pipe, report discarded");
+    }
+}
 
-    if (opt.syslog == 1) {
-         syslog(opt.sloglev, "gidget%s: %s %s\n", pidString, Now, logtxt);
+// hand output an event child spooled for us to its recipient's digest
+static void reportOutput(opts_t opt, const trick_t *pony, const report_t *report,
+                         const inflight_t *child) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char spoolName[MAX_SPOOL_NAME_LEN + 32];
+    const char *name = (child != NULL) ? child->name : "";
+    char object[strlen(pony->fileName) + strlen(name) + 2];
+    int spoolHandle;
+
+    sprintf(object, (name[0] != '\0') ? "%s/%s" : "%s", pony->fileName, name);
+    sprintf(spoolName, "%s/output.%d", opt.spooldir, report->pid);
+    if ((spoolHandle = open(spoolName, O_RDONLY | O_CLOEXEC)) < 0) {
+        sprintf(logtxt, "unable to read spooled output %s: %s", spoolName, strerror(errno));
+        logx(0, opt, logtxt);
+        return;
     }
-    
-    fflush(logstream);
-    if (0 == xstatus) return;
-    exit(xstatus);
+    digestAdd(opt, pony, object, (child != NULL) ? child->mask : 0, report->status,
+              spoolHandle, NULL, 0);
+    close(spoolHandle);
+    unlink(spoolName);
+}
+
+// registered with on_exit() by event children.  The grandchild
+// inherits the registration across fork, hence the pid check
+static void reportOnExit(int status, void *arg) {
+    report_t *report = arg;
+
+    if ((reportWriter < 0) || (getpid() != report->pid)) return;
+    if (!(report->flags & REPORT_RAN)) report->status = status;
+    if (write(reportWriter, report, sizeof(*report)) != sizeof(*report)) {
+        // nobody left to tell, the daemon's sweep will notice
+    }
+}
+
+// true if name is something the trick wrote itself, such as a
+// checksum sidecar.  An O_TMPFILE sidecar is only ever seen under its
+// final name, but where there is no O_TMPFILE it is written as
+// name.gidget-pid-thread first, pid in decimal and thread in hex
+static int ownDropping(const trick_t *pony, const char *name) {
+    size_t nameLen = strlen(name), suffixLen, digits;
+    const char *temp, *next;
+
+    if (pony->ignoreSuffix == NULL) return 0;
+
+    suffixLen = strlen(pony->ignoreSuffix);
+    if ((nameLen > suffixLen) &&
+        (strcmp(name + nameLen - suffixLen, pony->ignoreSuffix) == 0)) {
+        return 1;
+    }
+
+    for (temp = NULL, next = name; (next = strstr(next, ".gidget-")) != NULL; next++) {
+        temp = next;
+    }
+    if ((temp == NULL) || (temp == name)) return 0;
+    temp += strlen(".gidget-");
+    if (((digits = strspn(temp, "0123456789")) == 0) || (temp[digits] != '-')) return 0;
+    temp += digits + 1;
+    return ((digits = strspn(temp, "0123456789abcdef")) > 0) && (temp[digits] == '\0');
 }
 
 /*
@@ -5,6 +5,10 @@
 
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE      /* O_NOATIME, pipe2 and friends */
+#endif
+
 #include <stdio.h>       /* printf */
 #include <ctype.h>
 #include <limits.h>
@@ -20,4 +24,497 @@
 #include <sys/wait.h>    /* wait and wait status fns */
 #include <time.h>        /* time, localtime, asctime */
 #include <fcntl.h>       /* open() & friends */
-//#include <sys/stat.h>	 /* for open() CREAT modes */
+#include <stdint.h>      /* uint32_t & friends */
+#include <poll.h>        /* poll */
+#include <sys/ioctl.h>   /* FIONREAD */
+#include <sys/stat.h>	 /* mkdir, umask, open() CREAT modes */
+
+#include "gidgetplugin.h"  /* native handler ABI */
+
+/*
+
+  Everything below is shared between gidget.c and the
+  other gidget modules.
+
+*/
+
+#define MAX_CONFIG_NAME_LEN 256
+#define MAX_LOG_NAME_LEN 256
+#define MAX_PID_NAME_LEN 128
+#define MAX_SPOOL_NAME_LEN 200
+#define MAX_TRANSPORT_LEN 200
+#define MAX_METRICS_NAME_LEN 108   // what a Unix socket address holds
+#define MAX_CONTROL_NAME_LEN 108
+#define MAIL_NAME_LEN 48         // names of queued messages
+#define CACHE_FILE_NAME "config.cache"  // compiled configuration, in the spool directory
+
+// script output is moved this many bytes at a time
+#define RELAY_CHUNK (1024 * 1024)
+
+// It's important that MAX_ERR_TXT_LEN be large enough to hold
+// error messages that may include the names of fully pathed
+// files and significant amounts of diagnostic text.  Be aware
+// that modern file systems allow incredibly long names!
+#define MAX_ERR_TEXT_LEN 1640
+
+// a formatted log line: "gidget[pid]: date time " and the text
+#define LOG_LINE_LEN (MAX_ERR_TEXT_LEN + 64)
+
+// categories of per-event log line, each rate limited on its own
+#define RATE_EXEC 0              // spawning and executing
+#define RATE_OUTPUT 1            // what became of the output
+#define RATE_STATUS 2            // how the script finished
+#define RATE_RETRY 3             // retry decisions
+#define RATE_NATIVE 4            // native handler results
+#define RATE_CATEGORIES 5
+
+// Gidget does tricks!  Each trick is defined by the
+// content of a dynamically allocated data structure
+
+  typedef struct {
+      int32_t watchHandle;  // inotify watch descriptor
+      uint32_t actions;     // bitmap of what to watch for
+      char *fileName;       // file or directory to be watched
+      char *script;         // executable object to run
+      char *userid;         // user who will run script
+      char *mail;           // email to recieve script output
+      uint32_t options;     // bitmap of TRICK_ options below
+      gidget_handler_t *handler;  // native handler, NULL for scripts
+      char *handlerArg;     // argument text for the native handler
+      const char *ignoreSuffix;   // names ending in this never trigger
+      uint16_t retryMax;    // retries allowed after a failure, 0 for none
+      uint16_t retryBackoff;      // seconds before the first retry
+      uint8_t retryJitter;  // percent of random spread on each delay
+      uint8_t retryCodes[32];     // bitmap of retryable exit codes
+      uint32_t outputMax;   // bytes of script output kept per run
+      uint32_t dedupeWindow;      // seconds repeated output is held back, 0 for never
+      char *source;         // config line as written, compared on reload
+      int lineNo;           // where it was in the config file
+      int origin;           // 0 for the config file, else its include fragment
+      time_t lastEvent;     // when it last had one, watched tricks quiet longest are polled first
+      int jobs;             // native jobs queued or running on this definition
+  } trick_t;
+
+// polled tricks' events carry a made up watch descriptor, below the
+// -1 inotify uses for queue overflows.  It turns back into the trick
+// number the same way
+# define POLL_WD(trick) (-2 - (trick))
+
+// trick option bits, set from the optional sixth config field
+# define TRICK_HASH 0x00000001  // skip runs when content is unchanged
+# define TRICK_POLL 0x00000002  // always polled, never given a watch
+# define TRICK_WATCH 0x00000004 // given a watch whatever the filesystem, polled only for want of one
+// and one set by the daemon
+# define TRICK_RETIRED 0x80000000     // dropped by a reload, gets no more events
+# define TRICK_MAPPED 0x40000000      // strings live in a config cache image
+# define TRICK_REMOTE 0x20000000      // on a network filesystem, so polled
+# define TRICK_PAUSED 0x10000000      // events held, by the control socket
+
+// a config line that made no trick, as kept in the config cache
+
+  typedef struct {
+      int lineNo;
+      char *text;
+  } reject_t;
+
+// event children report back to the daemon over a pipe when they
+// finish.  Records are far smaller than PIPE_BUF, so each write()
+// is atomic and reports from different children never interleave
+
+  typedef struct {
+      pid_t pid;            // event child doing the reporting
+      int32_t trick;        // index into trickHeap
+      int32_t status;       // exit status of the event child
+      uint32_t flags;       // REPORT_ bits below
+      uint64_t pathKey;     // fingerprint LRU key for trick and path
+      uint64_t contentHash; // fingerprint of the file the script saw
+      uint64_t outputHash;  // of the script's output, 0 if there was none
+      int64_t outputBytes;  // produced by the script, kept or not
+      int64_t spawned;      // CLOCK_MONOTONIC ns when the script was forked
+      int64_t executed;     // when it exec'd
+      int64_t finished;     // and when it exited, 0 if it never ran
+      char queued[MAIL_NAME_LEN];  // mail the child queued, with REPORT_QUEUED
+  } report_t;
+
+# define REPORT_RAN     0x0001  // script ran, status is its exit status
+# define REPORT_SKIPPED 0x0002  // content unchanged, script not run
+# define REPORT_OUTPUT  0x0004  // output is waiting in the spool for a digest
+# define REPORT_QUEUED  0x0008  // output was queued for mail delivery
+# define REPORT_LOST    0x0010  // there was output but it went nowhere
+
+// the daemon remembers each event child until it reports back
+
+  typedef struct {
+      pid_t pid;            // zero marks a free slot
+      int32_t trick;
+      uint32_t mask;
+      uint32_t cookie;
+      int attempt;          // 1 for the first run, more for retries
+      time_t started;
+      int64_t received;     // wall clock ns when the event was read
+      int64_t receivedMono; // the same moment on CLOCK_MONOTONIC
+      int64_t dispatched;   // CLOCK_MONOTONIC ns just before the fork
+      char *name;
+  } inflight_t;
+
+// one event's line in the audit log, see gidgetaudit.c.  Times
+// are nanoseconds, wall clock for received and CLOCK_MONOTONIC
+// for the rest, 0 where they don't apply
+
+  typedef struct {
+      int64_t received;
+      int64_t receivedMono;
+      int64_t dispatched;   // forked, or picked up by a worker thread
+      int64_t spawned;      // script forked, or native handler called
+      int64_t finished;
+      int32_t wd;
+      uint32_t mask;
+      const char *path;
+      int32_t trick;
+      const char *script;
+      int attempt;
+      int ran;              // status is meaningful
+      int status;
+      int64_t outputBytes;
+      const char *delivery;
+  } audit_t;
+
+// a message being written into the mail queue
+
+  typedef struct {
+      int handle;
+      char name[MAIL_NAME_LEN];
+  } mailSlot_t;
+
+// script output as the event child captured it
+
+  typedef struct {
+      char *memory;         // the first part, in memory
+      size_t memoryLen;
+      int spool;            // the rest, in an unnamed spool file
+      char *mapped;
+      size_t mappedSize, spoolLen;
+      long long cap;        // most we keep
+      long long omitted;    // drained past the cap and thrown away
+  } capture_t;
+
+// what the daemon counts for its metrics, see gidgetmetrics.c
+
+  enum {
+      METRIC_READS,
+      METRIC_FILTERED,      // a trick's own droppings
+      METRIC_COALESCED,     // retries made moot by a fresh event
+      METRIC_QUEUED,        // handed to the native worker pool
+      METRIC_DROPPED,       // no trick left to run, or no memory to run it
+      METRIC_OVERFLOWS,
+      METRIC_SPAWNS,
+      METRIC_SKIPPED,       // content unchanged
+      METRIC_LOST,          // output that went nowhere
+      METRIC_SUPPRESSED,    // output repeated within a dedupe window
+      METRIC_RETRIES,
+      METRIC_NATIVE_RUNS,
+      METRIC_NATIVE_FAILURES,
+      METRIC_MAIL_MESSAGES,
+      METRIC_MAIL_BYTES,
+      METRIC_MAIL_DEFERRED,
+      METRIC_MAIL_FAILED,
+      METRIC_COUNTERS
+  };
+
+  enum {
+      GAUGE_TRICKS,
+      GAUGE_POLLED,
+      GAUGE_INFLIGHT,
+      GAUGE_RETRIES,
+      GAUGE_MAIL_QUEUED,
+      GAUGE_HELD,           // events of paused tricks
+      METRIC_GAUGES
+  };
+
+// per-trick latency histograms, see gidgetlatency.c.  The moments
+// an event passes through, and the stages measured between them
+
+  enum { STAMP_READ, STAMP_DEQUEUE, STAMP_SPAWN, STAMP_EXEC, STAMP_EXIT, STAMPS };
+
+  enum {
+      LATENCY_QUEUE,
+      LATENCY_SPAWN,
+      LATENCY_EXEC,
+      LATENCY_RUN,
+      LATENCY_START,        // read to exec'd, when the handler got going
+      LATENCY_TOTAL,
+      LATENCY_STAGES
+  };
+
+# define LATENCY_QUANTILES 4   // 0.5, 0.9, 0.99 and 0.999
+
+  typedef struct {
+      uint64_t count;
+      uint64_t sum;         // microseconds, as are the rest
+      uint64_t max;
+      uint64_t quantile[LATENCY_QUANTILES];
+  } latency_t;
+
+// what the flight recorder notes, see gidgetflight.c
+
+  enum {
+      FLIGHT_READ,
+      FLIGHT_DROPPED,       // no trick for it
+      FLIGHT_FILTERED,
+      FLIGHT_COALESCED,
+      FLIGHT_HELD,          // for a paused trick
+      FLIGHT_QUEUED,        // for a native worker
+      FLIGHT_SPAWNED,
+      FLIGHT_SKIPPED,       // content unchanged
+      FLIGHT_EXITED,
+      FLIGHT_RETRY,
+      FLIGHT_MAILED,
+      FLIGHT_MAIL_FAILED,
+      FLIGHT_KINDS
+  };
+
+// the kernel's inotify limits and what is used of them, see gidgetbudget.c
+
+  typedef struct {
+      long maxWatches;      // per user, -1 if unknown
+      long maxInstances;    // per user
+      long maxQueued;       // events per instance
+      long userWatches;     // held by all of this user's instances
+      long userInstances;
+      long ownWatches;      // held by ours
+      long refused;         // watches turned down with ENOSPC since startup
+      long polled;          // tricks polled for want of a watch
+  } budget_t;
+
+// inotify_event is defined in sys/inotify.h
+
+  typedef struct inotify_event event_t;
+
+// simple struct for command line options
+
+  typedef struct {
+      int daemon;
+      int verbose;
+      int log2file;
+      int syslog;
+      int sloglev;
+      int workers;          // threads for native tricks
+      int compile;          // -C, compile the config cache and exit
+      int plan;             // -n, plan the watch budget and exit
+      int bench;            // -B, rounds of polling every trick to time, then exit
+      int watchBudget;      // -W, most watches to hold, 0 for as many as the kernel allows
+      int tierQuiet;        // seconds without events before a watched trick may be polled
+      char config[MAX_CONFIG_NAME_LEN];
+      char includeDir[MAX_CONFIG_NAME_LEN];   // -I, empty for none
+      char logfile[MAX_LOG_NAME_LEN];
+      char pidfile[MAX_PID_NAME_LEN];
+      char spooldir[MAX_SPOOL_NAME_LEN];
+      char transport[MAX_TRANSPORT_LEN];  // -M, empty for sendmail
+      char metrics[MAX_METRICS_NAME_LEN]; // -m, socket path or loopback port, empty for none
+      char control[MAX_CONTROL_NAME_LEN]; // -k, control socket path, empty for none
+      int digestCount;      // events per digest, 0 to mail every event
+      long digestBytes;     // output bytes per digest
+      int digestSeconds;    // longest an event waits in a digest
+      char auditFile[MAX_LOG_NAME_LEN];   // -a, empty for no audit log
+      long long auditBytes; // rotate the audit log at this size
+      int auditKeep;        // old audit logs kept
+      int logRate;          // per-event lines a second per category, 0 for no limit
+      int logBurst;         // lines a category may write at once
+      int logSample;        // log verbose detail for one event in this many
+  } opts_t;
+
+// functions that live in gidget.c but get used elsewhere
+
+  void logx(int xstatus, opts_t opt, char logtxt[]);
+  void mailHeaders(FILE *mailslot, const trick_t *pony, const char *object,
+                   int32_t wd, uint32_t mask, const char *preface);
+  int spoolTemp(opts_t opt);
+  long long relayFile(int from, int to);
+
+// the configuration file and live reloads, see gidgetconfig.c
+
+  int configLoad(opts_t opt, FILE *configFile, int instanceHandle,
+                 trick_t ***trickHeap, int *maxNameLen);
+  int configReload(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                   int maxNameLen);
+  int configCompile(opts_t opt);
+  int configPlan(opts_t opt);
+  int configBench(opts_t opt);
+  int configInclude(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                    int maxNameLen, const event_t *event);
+  int32_t watchTrick(int32_t wd);
+  void watchDrop(int32_t wd);
+  void configTier(opts_t opt, int instanceHandle, trick_t **trickHeap, int trickCount);
+  void configReclaim(opts_t opt, trick_t **trickHeap, int trickCount);
+
+// tricks polled for want of a watch, see gidgetpoll.c
+
+  int pollAdd(const trick_t *pony, int32_t trick);
+  void pollRemove(const trick_t *pony, int32_t trick, int flush);
+  void pollScan(trick_t **trickHeap, time_t now);
+  int pollEvents(char *buf, int size);
+  int pollTimeout(time_t now);
+  int pollHot(trick_t **trickHeap, int32_t *tricks, int max, time_t now);
+  int pollCount(void);
+  long pollBench(trick_t **trickHeap, int count, int *threads);
+
+// the compiled configuration cache, see gidgetcache.c
+
+  int cacheWrite(opts_t opt, uint64_t configHash, size_t configSize, trick_t **parsed, int count,
+                 const reject_t *rejects, int rejectCount, int maxNameLen);
+  int cacheLoad(opts_t opt, uint64_t configHash, size_t configSize, trick_t ***parsed,
+                int *maxNameLen, reject_t **rejects, int *rejectCount);
+  void cacheRelease(const char *inside);
+
+// metrics, see gidgetmetrics.c
+
+  void metricAdd(int counter, uint64_t n);
+  void metricMask(int dispatched, uint32_t mask);
+  void metricExit(int status);
+  void metricBatch(int events);
+  void metricGauge(int gauge, int64_t value);
+  int metricsStart(opts_t opt, int instanceHandle);
+  void metricsStop(opts_t opt);
+
+// the control socket, see gidgetcontrol.c
+
+# define CONTROL_CLIENTS 8      // served at once, each in the read loop's poll set
+
+  int controlHold(int32_t trick, const event_t *event, int attempt,
+                  int64_t received, int64_t receivedMono);
+  int controlHeld(void);
+  event_t *controlReleased(trick_t **trickHeap, char *buf, int32_t *trick, int *attempt,
+                           int64_t *received, int64_t *receivedMono);
+  void controlForget(int32_t trick);
+  int controlWaits(struct pollfd *waits);
+  int controlTimeout(void);
+  void controlServe(opts_t opt, trick_t **trickHeap, int trickCount, const struct pollfd *waits,
+                    int used);
+  int controlStart(opts_t opt);
+  void controlStop(opts_t opt);
+
+// the flight recorder, see gidgetflight.c
+
+  void flightRecord(int kind, int32_t trick, uint32_t mask, pid_t pid, int64_t value,
+                    const char *name);
+  void flightStart(void);
+  int flightDump(FILE *out);
+  int flightSave(opts_t opt, char *path);
+  void flightFatal(opts_t opt);
+
+// latency histograms, see gidgetlatency.c
+
+  void latencyRecord(int32_t trick, const char *path, const int64_t stamps[STAMPS]);
+  int latencyTricks(void);
+  const char *latencyStage(int stage);
+  uint64_t latencyStats(int32_t trick, int stage, latency_t *stats, char *path, size_t pathSize);
+  void latencyForget(int32_t trick);
+  void latencyDump(opts_t opt);
+
+// the inotify watch budget, see gidgetbudget.c
+
+  int budgetRead(budget_t *budget, int instanceHandle);
+  long budgetMemory(long watches, long queued);
+  void budgetRefused(void);
+  void budgetLog(opts_t opt, int instanceHandle);
+
+// the log writer, see gidgetlog.c
+
+  int logStart(void);
+  int logLimit(opts_t opt);
+  int logRate(int category);
+  int logSampled(void);
+  int logTimeout(time_t now);
+  void logSummary(opts_t opt, int force);
+  void logPost(opts_t opt, int xstatus, const char *line, int len);
+  void logFlush(void);
+  pid_t logPid(void);
+  const char *logStamp(void);
+  void logClock(void);
+  struct tm *logTime(time_t t, int local, struct tm *tm);
+  int logSyslogOpen(void);
+  void logSyslogClose(void);
+
+// native tricks, see gidgetnative.c
+
+  int nativeLoad(trick_t *pony, opts_t opt, int lineNo);
+  void nativeDispatch(trick_t *pony, int32_t trickNo, event_t *event, opts_t opt,
+                      int64_t received, int64_t receivedMono);
+
+// event children in flight, see gidgetinflight.c
+
+  inflight_t *inflightAdd(pid_t pid, int32_t trick, const event_t *event, int attempt);
+  inflight_t *inflightFind(pid_t pid);
+  void inflightRemove(inflight_t *gone);
+  int inflightSweep(opts_t opt, trick_t **trickHeap, time_t olderThan);
+  int inflightCount(void);
+  inflight_t *inflightNext(unsigned int *cursor);
+  void inflightBusy(char *busy, int32_t trickCount);
+
+// failed executions waiting for another go, see gidgetretry.c
+
+  int retryOption(trick_t *pony, const char *word);
+  int retrySchedule(const trick_t *pony, int32_t trick, uint32_t mask, uint32_t cookie,
+                    const char *name, int attempt, int status);
+  int retryCoalesce(int32_t trick, const char *name);
+  int retryTimeout(time_t now);
+  event_t *retryDue(time_t now, char *buf, int32_t *trick, int *attempt);
+  int retryPending(void);
+  void retryBusy(char *busy, int32_t trickCount);
+  void retrySave(opts_t opt, trick_t **trickHeap, int force);
+  int retryLoad(opts_t opt, trick_t **trickHeap, int trickCount);
+
+// per-recipient mail digests, see gidgetdigest.c
+
+  int digestAdd(opts_t opt, const trick_t *pony, const char *object, uint32_t mask,
+                int status, int fromFd, const char *text, size_t textLen);
+  int digestTimeout(opts_t opt, time_t now);
+  void digestFlush(opts_t opt, int force);
+  void digestForkSafe(void);
+
+// script output capture, see gidgetcapture.c
+
+  int captureOption(trick_t *pony, const char *word);
+  int captureDrain(opts_t opt, int from, long long cap, capture_t *c);
+  long long captureLength(const capture_t *c);
+  long long captureWrite(const capture_t *c, int to);
+  uint64_t captureHash(const capture_t *c);
+  void captureFree(capture_t *c);
+
+// suppression of repeated output, see gidgetrepeat.c
+
+  int repeatOption(trick_t *pony, const char *word);
+  int repeatSuppress(opts_t opt, trick_t **trickHeap, int32_t trick, uint64_t hash,
+                     const char *object);
+  int repeatTimeout(time_t now);
+  void repeatFlush(opts_t opt, trick_t **trickHeap, int force);
+  void repeatBusy(char *busy, int32_t trickCount);
+
+// the audit log, see gidgetaudit.c
+
+  int64_t auditClock(clockid_t clock);
+  int auditOpen(opts_t opt);
+  void auditRecord(opts_t opt, const audit_t *a);
+  void auditChild(opts_t opt, trick_t **trickHeap, const inflight_t *child,
+                  const report_t *report, const char *delivery);
+  void auditFlush(int force);
+  int auditTimeout(void);
+  void auditForkSafe(void);
+
+// the mail queue and its couriers, see gidgetqueue.c
+
+  int mailTransportCheck(const char *spec, char *why, size_t whyLen, int record);
+  FILE *mailStream(opts_t opt, const char *recipient, mailSlot_t *slot);
+  int mailFinish(opts_t opt, FILE *mailslot, mailSlot_t *slot);
+  void mailEnqueue(const char *name);
+  void mailDiscard(opts_t opt, const char *name);
+  int mailStart(opts_t opt);
+  void mailStop(opts_t opt);
+  void mailForkSafe(void);
+
+// built in native actions, one file each
+
+  int mirrorCheck(const char *arg, char *why, size_t whyLen);
+  gidget_handler_t mirrorHandler;
+  const char *checksumSuffix(const char *arg);
+  gidget_handler_t checksumHandler;
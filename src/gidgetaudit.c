@@ -0,0 +1,280 @@
+/*
+
+  The audit log.  With -a, every event gidget handles gets
+  one JSON object on a line of its own, written when the
+  daemon learns how the event turned out:
+
+    {"received":"2026-10-16T18:48:08.123456Z","wd":1,"mask":8,
+     "path":"/srv/in/x","trick":0,"script":"/usr/bin/x.sh",
+     "attempt":1,"queue_wait_us":41,"spawn_us":980,"run_us":21034,
+     "status":0,"output_bytes":33,"delivery":"queued"}
+
+  received is when the daemon read the event (or, for a
+  retry, when it came due).  queue_wait_us runs from there to
+  the fork or the worker thread picking it up, spawn_us from
+  there to the script's own fork, run_us from there to its
+  exit.  Latencies that don't apply are null.  delivery is
+  one of none, queued, digest, suppressed, skipped, lost or
+  vanished.
+
+  Paths are whatever bytes the filesystem holds, which need
+  not be UTF-8, but JSON has to be.  Each byte that isn't part
+  of a well formed UTF-8 character is written as \u00XX with
+  the byte's value, so a name in Latin-1 comes out readable
+  and nothing is lost: valid characters are always written
+  as they are, so an escape from \u0080 up can only stand for
+  a stray byte, which a reader can turn back into the raw name.
+
+  Lines go through a 64 KiB buffer which is flushed
+  about once a second, and the file is rotated when it
+  reaches -A bytes, keeping that many old generations as
+  file.1, file.2 and so on.  Native tricks write from their
+  worker threads, hence the lock.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <pthread.h>             // native tricks audit from worker threads
+
+#define AUDIT_BUFFER (64 * 1024)
+#define AUDIT_LINE_LEN (16 * 1024)
+#define AUDIT_FLUSH_SECONDS 1
+
+// records are buffered by hand rather than through stdio, so
+// a forked event child leaving by exit() can't write them twice
+  static int auditHandle = -1;
+  static char auditBuffer[AUDIT_BUFFER];
+  static size_t auditBuffered = 0;
+  static long long auditSize = 0;
+  static time_t auditFlushed = 0;
+  static pthread_mutex_t auditLock = PTHREAD_MUTEX_INITIALIZER;
+
+// nanoseconds on the given clock
+int64_t auditClock(clockid_t clock) {
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// caller holds auditLock
+static void auditWriteOut(void) {
+    size_t done = 0;
+    ssize_t put;
+
+    while (done < auditBuffered) {
+        put = write(auditHandle, auditBuffer + done, auditBuffered - done);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            break;      // nowhere to complain to but the log, and it's not worth it
+        }
+        done += put;
+    }
+    auditBuffered = 0;
+}
+
+// caller holds auditLock
+static int auditOpenLocked(opts_t opt) {
+    struct stat st;
+
+    if (auditHandle >= 0) {
+        auditWriteOut();
+        close(auditHandle);
+    }
+    auditHandle = open(opt.auditFile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (auditHandle < 0) return -1;
+    auditSize = (fstat(auditHandle, &st) == 0) ? st.st_size : 0;
+    return 0;
+}
+
+// Open, or reopen after rotation by somebody else, the audit log.
+// Returns 0, or -1 with errno set
+int auditOpen(opts_t opt) {
+    int result;
+
+    if (opt.auditFile[0] == '\0') return 0;
+    pthread_mutex_lock(&auditLock);
+    result = auditOpenLocked(opt);
+    pthread_mutex_unlock(&auditLock);
+    return result;
+}
+
+// shift file.n-1 to file.n ... file to file.1 and start afresh
+static void auditRotate(opts_t opt) {
+    char from[MAX_LOG_NAME_LEN + 16], to[MAX_LOG_NAME_LEN + 16];
+    int i;
+
+    auditWriteOut();
+    close(auditHandle);
+    auditHandle = -1;
+    for (i = opt.auditKeep; i > 1; i--) {
+        sprintf(from, "%s.%d", opt.auditFile, i - 1);
+        sprintf(to, "%s.%d", opt.auditFile, i);
+        rename(from, to);
+    }
+    if (opt.auditKeep > 0) {
+        sprintf(to, "%s.1", opt.auditFile);
+        rename(opt.auditFile, to);
+    } else {
+        unlink(opt.auditFile);
+    }
+    auditOpenLocked(opt);
+}
+
+// the length of the well formed UTF-8 character at p, or 0 if it isn't
+// one: overlong forms, surrogates and anything past U+10FFFF included
+static int utf8Length(const unsigned char *p) {
+    int len, i;
+
+    if (p[0] < 0x80) return 1;
+    if ((p[0] < 0xc2) || (p[0] > 0xf4)) return 0;
+    len = (p[0] < 0xe0) ? 2 : (p[0] < 0xf0) ? 3 : 4;
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) return 0;     // the terminator stops us too
+    }
+    if ((p[0] == 0xe0) && (p[1] < 0xa0)) return 0;
+    if ((p[0] == 0xed) && (p[1] > 0x9f)) return 0;
+    if ((p[0] == 0xf0) && (p[1] < 0x90)) return 0;
+    if ((p[0] == 0xf4) && (p[1] > 0x8f)) return 0;
+    return len;
+}
+
+// append a JSON string, quotes and all, as far as it fits.  Bytes
+// that aren't UTF-8 become \u00XX, as described at the top
+static size_t jsonString(char *to, size_t room, const char *s) {
+    const unsigned char *p;
+    size_t used = 0;
+    int len;
+
+    if (room < 8) return 0;
+    to[used++] = '"';
+    for (p = (const unsigned char *) s; (*p != '\0') && (used + 8 < room); p += len) {
+        len = utf8Length(p);
+        if ((*p == '"') || (*p == '\\')) {
+            to[used++] = '\\';
+            to[used++] = *p;
+        } else if ((*p < 0x20) || (len == 0)) {
+            used += sprintf(to + used, "\\u%04x", *p);
+            len = 1;
+        } else {
+            memcpy(to + used, p, len);
+            used += len;
+        }
+    }
+    to[used++] = '"';
+    return used;
+}
+
+// append a latency in microseconds, or null if either end is unknown
+static size_t jsonSpan(char *to, size_t room, const char *name, int64_t from, int64_t until) {
+    int n;
+
+    if ((from <= 0) || (until <= 0) || (until < from)) {
+        n = snprintf(to, room, ",\"%s\":null", name);
+    } else {
+        n = snprintf(to, room, ",\"%s\":%lld", name, (long long) ((until - from) / 1000));
+    }
+    return ((n < 0) || ((size_t) n >= room)) ? 0 : n;
+}
+
+// write one event's record
+void auditRecord(opts_t opt, const audit_t *a) {
+    char line[AUDIT_LINE_LEN], stamp[40], status[16];
+    size_t len;
+    struct tm when;
+    time_t seconds;
+
+    if (opt.auditFile[0] == '\0') return;
+
+    seconds = a->received / 1000000000;
+    strftime(stamp, sizeof(stamp), "%FT%T", logTime(seconds, 0, &when));
+
+// the two free-form strings get half the line each, at most
+    len = snprintf(line, sizeof(line), "{\"received\":\"%s.%06ldZ\",\"wd\":%d,\"mask\":%u,\"path\":",
+                   stamp, (long) (a->received % 1000000000) / 1000, a->wd, a->mask);
+    len += jsonString(line + len, (sizeof(line) - len) / 2, a->path);
+    len += snprintf(line + len, sizeof(line) - len, ",\"trick\":%d,\"script\":", a->trick);
+    len += jsonString(line + len, (sizeof(line) - len) / 2, a->script);
+    len += snprintf(line + len, sizeof(line) - len, ",\"attempt\":%d", a->attempt);
+    len += jsonSpan(line + len, sizeof(line) - len, "queue_wait_us", a->receivedMono, a->dispatched);
+    len += jsonSpan(line + len, sizeof(line) - len, "spawn_us", a->dispatched, a->spawned);
+    len += jsonSpan(line + len, sizeof(line) - len, "run_us", a->spawned, a->finished);
+    if (a->ran) sprintf(status, "%d", a->status);
+    else strcpy(status, "null");
+    len += snprintf(line + len, sizeof(line) - len,
+                    ",\"status\":%s,\"output_bytes\":%lld,\"delivery\":\"%s\"}\n",
+                    status, (long long) a->outputBytes, a->delivery);
+
+    pthread_mutex_lock(&auditLock);
+    if (auditHandle >= 0) {
+        if (auditBuffered + len > sizeof(auditBuffer)) auditWriteOut();
+        memcpy(auditBuffer + auditBuffered, line, len);
+        auditBuffered += len;
+        auditSize += len;
+        if ((opt.auditBytes > 0) && (auditSize >= opt.auditBytes)) auditRotate(opt);
+    }
+    pthread_mutex_unlock(&auditLock);
+}
+
+// the record for an event child, from what the daemon knew when it
+// forked and what the child reported, which is NULL if it never did
+void auditChild(opts_t opt, trick_t **trickHeap, const inflight_t *child,
+                const report_t *report, const char *delivery) {
+    const trick_t *pony = trickHeap[child->trick];
+    char path[strlen(pony->fileName) + strlen(child->name) + 2];
+    audit_t a;
+
+    if (opt.auditFile[0] == '\0') return;
+
+    sprintf(path, (child->name[0] != '\0') ? "%s/%s" : "%s", pony->fileName, child->name);
+    memset(&a, 0, sizeof(a));
+    a.received = child->received;
+    a.receivedMono = child->receivedMono;
+    a.dispatched = child->dispatched;
+    a.wd = pony->watchHandle;
+    a.mask = child->mask;
+    a.path = path;
+    a.trick = child->trick;
+    a.script = pony->script;
+    a.attempt = child->attempt;
+    a.delivery = delivery;
+    if (report != NULL) {
+        a.spawned = report->spawned;
+        a.finished = report->finished;
+        a.ran = ((report->flags & REPORT_RAN) != 0);
+        a.status = report->status;
+        a.outputBytes = report->outputBytes;
+    }
+    auditRecord(opt, &a);
+}
+
+static void auditForkPrepare(void) {
+    pthread_mutex_lock(&auditLock);
+}
+
+static void auditForkDone(void) {
+    pthread_mutex_unlock(&auditLock);
+}
+
+// auditLock is held across fork(), see main()
+void auditForkSafe(void) {
+    pthread_atfork(auditForkPrepare, auditForkDone, auditForkDone);
+}
+
+// push buffered records out if they have waited long enough, or now
+void auditFlush(int force) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&auditLock);
+    if ((auditHandle >= 0) && (auditBuffered > 0) &&
+        (force || (now - auditFlushed >= AUDIT_FLUSH_SECONDS))) {
+        auditWriteOut();
+        auditFlushed = now;
+    }
+    pthread_mutex_unlock(&auditLock);
+}
+
+// milliseconds until buffered records are due out, -1 if there are none
+int auditTimeout(void) {
+    return (auditBuffered > 0) ? AUDIT_FLUSH_SECONDS * 1000 : -1;
+}
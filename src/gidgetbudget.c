@@ -0,0 +1,149 @@
+/*
+
+  The inotify watch budget.  The kernel allows each user so
+  many watches and instances, set in /proc/sys/fs/inotify,
+  and shares them between every inotify instance the user
+  has, so what is left for us depends on everybody else too.
+  Once they run out inotify_add_watch() fails with ENOSPC
+  and a trick is simply lost.
+
+  The limits are read straight from /proc, and what is in use
+  is counted from /proc/<pid>/fdinfo, where each inotify
+  instance lists one "inotify wd:" line per watch.  That
+  covers only processes we may look into, which for anyone
+  but root means the user's own, which are the ones that count.
+
+  gidget -n uses this to plan a configuration before it is
+  armed, see configPlan() in gidgetconfig.c.  A running daemon
+  logs the same figures after starting and after every
+  SIGHUP, and warns when its user is near the limit.
+
+  Kernel memory is an estimate.  A watch pins an inode mark
+  and keeps its inode cached, which the kernel itself reckons
+  at about a kilobyte when it sizes max_user_watches, and a
+  queued event costs its header plus the name.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <dirent.h>              // walking /proc
+
+#define BUDGET_WATCH_COST 1024   // kernel bytes per watch, roughly
+#define BUDGET_EVENT_COST 80     // and per queued event with a short name
+#define BUDGET_WARN_PERCENT 90   // of max_user_watches
+
+  static long refusedWatches = 0;
+
+// a number from /proc/sys/fs/inotify, -1 if it can't be read
+static long budgetLimit(const char *name) {
+    char path[64];
+    long value = -1;
+    FILE *fp;
+
+    sprintf(path, "/proc/sys/fs/inotify/%s", name);
+    if ((fp = fopen(path, "r")) == NULL) return -1;
+    if (fscanf(fp, "%ld", &value) != 1) value = -1;
+    fclose(fp);
+    return value;
+}
+
+// watches held by the inotify instance open as fd in process pid,
+// or -1 if it isn't an inotify instance
+static long budgetWatches(const char *pid, const char *fd) {
+    char path[64], line[256];
+    long watches = 0;
+    ssize_t len;
+    FILE *fp;
+
+    sprintf(path, "/proc/%.16s/fd/%.16s", pid, fd);
+    if ((len = readlink(path, line, sizeof(line) - 1)) < 0) return -1;
+    line[len] = '\0';
+    if (strcmp(line, "anon_inode:inotify") != 0) return -1;
+
+    sprintf(path, "/proc/%.16s/fdinfo/%.16s", pid, fd);
+    if ((fp = fopen(path, "r")) == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "inotify wd:", 11) == 0) watches++;
+    }
+    fclose(fp);
+    return watches;
+}
+
+// Fill in the limits and what this user has in use, and what our own
+// instance holds if instanceHandle isn't -1.  Returns 0, or -1 if the
+// limits can't be read, when the kernel has no inotify to speak of
+int budgetRead(budget_t *budget, int instanceHandle) {
+    char self[16], own[16];
+    struct dirent *proc, *fd;
+    struct stat st;
+    DIR *procDir, *fdDir;
+    char path[64];
+    uid_t uid = getuid();
+    long watches;
+
+    memset(budget, 0, sizeof(*budget));
+    budget->maxWatches = budgetLimit("max_user_watches");
+    budget->maxInstances = budgetLimit("max_user_instances");
+    budget->maxQueued = budgetLimit("max_queued_events");
+    budget->refused = refusedWatches;
+    budget->polled = pollCount();
+    if (budget->maxWatches < 0) return -1;
+
+    sprintf(self, "%d", (int) getpid());
+    sprintf(own, "%d", instanceHandle);
+    if ((procDir = opendir("/proc")) == NULL) return 0;
+    while ((proc = readdir(procDir)) != NULL) {
+        if (!isdigit((unsigned char) proc->d_name[0])) continue;
+        sprintf(path, "/proc/%.16s", proc->d_name);
+        if ((stat(path, &st) < 0) || (st.st_uid != uid)) continue;  // not charged to us
+        sprintf(path, "/proc/%.16s/fd", proc->d_name);
+        if ((fdDir = opendir(path)) == NULL) continue;
+        while ((fd = readdir(fdDir)) != NULL) {
+            if (!isdigit((unsigned char) fd->d_name[0])) continue;
+            if ((watches = budgetWatches(proc->d_name, fd->d_name)) < 0) continue;
+            budget->userInstances++;
+            budget->userWatches += watches;
+            if ((instanceHandle >= 0) && (strcmp(proc->d_name, self) == 0) &&
+                (strcmp(fd->d_name, own) == 0)) {
+                budget->ownWatches = watches;
+            }
+        }
+        closedir(fdDir);
+    }
+    closedir(procDir);
+    return 0;
+}
+
+// kernel memory for so many watches and a full event queue, in KiB
+long budgetMemory(long watches, long queued) {
+    return (watches * BUDGET_WATCH_COST + queued * BUDGET_EVENT_COST + 1023) / 1024;
+}
+
+// the kernel turned a watch down for want of room
+void budgetRefused(void) {
+    refusedWatches++;
+}
+
+// log where the daemon stands against the limits
+void budgetLog(opts_t opt, int instanceHandle) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    budget_t budget;
+
+    if (budgetRead(&budget, instanceHandle) < 0) {
+        logx(0, opt, "unable to read inotify limits from /proc/sys/fs/inotify");
+        return;
+    }
+    sprintf(logtxt, "inotify budget: %ld watches ours, %ld of %ld in use by this user "
+            "in %ld of %ld instances, about %ld KiB of kernel memory with a full queue, "
+            "%ld refused, %ld tricks polled",
+            budget.ownWatches, budget.userWatches, budget.maxWatches,
+            budget.userInstances, budget.maxInstances,
+            budgetMemory(budget.ownWatches, budget.maxQueued), budget.refused, budget.polled);
+    logx(0, opt, logtxt);
+    if (budget.userWatches * 100 >= budget.maxWatches * BUDGET_WARN_PERCENT) {
+        sprintf(logtxt, "WARNING: this user has %ld of %ld inotify watches in use, "
+                "raise fs.inotify.max_user_watches before adding tricks",
+                budget.userWatches, budget.maxWatches);
+        logx(0, opt, logtxt);
+    }
+}
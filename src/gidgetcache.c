@@ -0,0 +1,337 @@
+/*
+
+  The configuration cache.  Parsing a config of tens of
+  thousands of tricks means a pathconf() per line and a
+  malloc per string, and used to be most of what startup
+  and reload cost.  Once a config has been parsed, its tricks
+  are written to the spool directory as one relocatable
+  image, and the next time the file holds exactly the same
+  bytes the image is mapped and the tricks' strings point
+  straight into it:
+
+    header      what config it came from, and that file's
+                size and hash, which are all that decide
+                whether the image is still good
+    records     one per trick, strings as pool offsets
+    rejects     line number and text of every line that
+                failed, which are parsed afresh on each load
+                since a missing path may have turned up
+    pool        the strings, each NUL terminated
+
+  gidget -C compiles the image and exits; otherwise a daemon
+  writes one whenever it had to parse.  Images are written
+  to a temporary name and renamed into place, so a mapping
+  stays good however often the cache is replaced, and each
+  is unmapped once the last trick using it is freed.
+
+  An image says what scripts run as which users, so one is
+  only loaded if it and the spool directory holding it belong
+  to the daemon's own user and nobody else can write to them.
+  Otherwise the config is parsed as though there were none.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // image checksums
+#include <sys/mman.h>            // mmap for the image
+
+#define CACHE_MAGIC "gidgetc"
+#define CACHE_VERSION 2          // bump whenever parsing or trick_t changes meaning
+
+  typedef struct {
+      char magic[8];
+      uint32_t version;
+      uint32_t tricks;      // records after the header
+      uint32_t rejects;     // and rejected lines after them
+      int32_t maxNameLen;   // longest name the watched filesystems allow
+      uint64_t configSize;
+      uint64_t configHash;  // of the whole config file
+      uint64_t imageHash;   // of everything after the header
+      uint64_t poolSize;
+      char config[MAX_CONFIG_NAME_LEN];
+  } cacheHeader_t;
+
+  typedef struct {
+      uint32_t fileName, script, userid, mail, source;   // pool offsets
+      uint32_t actions;
+      uint32_t options;
+      int32_t lineNo;
+      uint32_t outputMax;
+      uint32_t dedupeWindow;
+      uint16_t retryMax;
+      uint16_t retryBackoff;
+      uint8_t retryJitter;
+      uint8_t retryCodes[32];
+  } cacheTrick_t;
+
+  typedef struct {
+      int32_t lineNo;
+      uint32_t text;        // pool offset
+  } cacheReject_t;
+
+// mapped images and how many tricks still point into each
+  typedef struct {
+      char *base;
+      size_t size;
+      int refs;
+  } cacheImage_t;
+
+  static cacheImage_t *images = NULL;
+  static int imageCount = 0;
+
+// add a string to the pool, returning its offset
+static uint32_t poolAdd(char *pool, size_t *used, const char *s) {
+    uint32_t at = *used;
+    size_t len = strlen(s) + 1;
+
+    memcpy(pool + at, s, len);
+    *used += len;
+    return at;
+}
+
+// Write the image of a freshly parsed config.  Returns 0, or logs
+// and returns -1
+int cacheWrite(opts_t opt, uint64_t configHash, size_t configSize, trick_t **parsed, int count,
+               const reject_t *rejects, int rejectCount, int maxNameLen) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[MAX_SPOOL_NAME_LEN + 32], temp[MAX_SPOOL_NAME_LEN + 40];
+    size_t poolSize = 0, used = 0, imageSize, done;
+    cacheHeader_t *header;
+    cacheTrick_t *record;
+    cacheReject_t *reject;
+    char *image, *pool;
+    const trick_t *pony;
+    ssize_t put;
+    int i, fd;
+
+    for (i = 0; i < count; i++) {
+        pony = parsed[i];
+        poolSize += strlen(pony->fileName) + strlen(pony->script) + strlen(pony->userid) +
+                    strlen(pony->mail) + strlen(pony->source) + 5;
+    }
+    for (i = 0; i < rejectCount; i++) poolSize += strlen(rejects[i].text) + 1;
+    if (poolSize > UINT32_MAX) {
+        logx(0, opt, "configuration too large to cache");
+        return -1;
+    }
+
+    imageSize = sizeof(cacheHeader_t) + count * sizeof(cacheTrick_t) +
+                rejectCount * sizeof(cacheReject_t) + poolSize;
+    if ((image = calloc(1, imageSize)) == NULL) {
+        logx(0, opt, "no memory to build configuration cache");
+        return -1;
+    }
+    header = (cacheHeader_t *) image;
+    record = (cacheTrick_t *) (header + 1);
+    reject = (cacheReject_t *) (record + count);
+    pool = (char *) (reject + rejectCount);
+
+    for (i = 0; i < count; i++) {
+        pony = parsed[i];
+        record[i].fileName = poolAdd(pool, &used, pony->fileName);
+        record[i].script = poolAdd(pool, &used, pony->script);
+        record[i].userid = poolAdd(pool, &used, pony->userid);
+        record[i].mail = poolAdd(pool, &used, pony->mail);
+        record[i].source = poolAdd(pool, &used, pony->source);
+        record[i].actions = pony->actions;
+        record[i].options = pony->options & ~(TRICK_MAPPED | TRICK_RETIRED | TRICK_REMOTE |
+                                               TRICK_PAUSED);
+        record[i].lineNo = pony->lineNo;
+        record[i].outputMax = pony->outputMax;
+        record[i].dedupeWindow = pony->dedupeWindow;
+        record[i].retryMax = pony->retryMax;
+        record[i].retryBackoff = pony->retryBackoff;
+        record[i].retryJitter = pony->retryJitter;
+        memcpy(record[i].retryCodes, pony->retryCodes, sizeof(record[i].retryCodes));
+    }
+    for (i = 0; i < rejectCount; i++) {
+        reject[i].lineNo = rejects[i].lineNo;
+        reject[i].text = poolAdd(pool, &used, rejects[i].text);
+    }
+
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->tricks = count;
+    header->rejects = rejectCount;
+    header->maxNameLen = maxNameLen;
+    header->configSize = configSize;
+    header->configHash = configHash;
+    header->poolSize = poolSize;
+    strcpy(header->config, opt.config);
+    header->imageHash = gigHashBytes(header + 1, imageSize - sizeof(cacheHeader_t), 0);
+
+    sprintf(path, "%s/%s", opt.spooldir, CACHE_FILE_NAME);
+    sprintf(temp, "%s.tmp", path);
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) < 0) goto failed;
+    for (done = 0; done < imageSize; done += put) {
+        put = write(fd, image + done, imageSize - done);
+        if (put < 0) {
+            if (errno == EINTR) {
+                put = 0;
+                continue;
+            }
+            close(fd);
+            unlink(temp);
+            goto failed;
+        }
+    }
+    if (close(fd) < 0) {
+        unlink(temp);
+        goto failed;
+    }
+    if (rename(temp, path) < 0) {
+        unlink(temp);
+        goto failed;
+    }
+    free(image);
+    return 0;
+
+failed:
+    sprintf(logtxt, "unable to write configuration cache %s: %s", path, strerror(errno));
+    logx(0, opt, logtxt);
+    free(image);
+    return -1;
+}
+
+// true if st is owned by us and writable by nobody else
+static int cacheTrusted(const struct stat *st) {
+    return (st->st_uid == geteuid()) && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Build tricks from the cached image of a config, if there is one for
+// these very bytes.  Rejected lines come back as text for the caller
+// to parse again; the text lives in the image, so rather than free it
+// pass any one of them to cacheRelease().  Returns the number of
+// tricks, or -1 if there is no good image
+int cacheLoad(opts_t opt, uint64_t configHash, size_t configSize, trick_t ***parsed,
+              int *maxNameLen, reject_t **rejects, int *rejectCount) {
+    char path[MAX_SPOOL_NAME_LEN + 32];
+    const cacheHeader_t *header;
+    const cacheTrick_t *record;
+    const cacheReject_t *reject;
+    cacheImage_t *grown;
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct stat st, dir;
+    trick_t *pony, **tricks = NULL;
+    reject_t *lines = NULL;
+    char *image, *pool;
+    uint32_t i;
+    int fd;
+
+    *parsed = NULL;
+    *rejects = NULL;
+    *rejectCount = 0;
+
+    sprintf(path, "%s/%s", opt.spooldir, CACHE_FILE_NAME);
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) return -1;
+    if ((fstat(fd, &st) < 0) || (st.st_size < (off_t) sizeof(cacheHeader_t))) {
+        close(fd);
+        return -1;
+    }
+    if (!cacheTrusted(&st) || (stat(opt.spooldir, &dir) < 0) || !cacheTrusted(&dir)) {
+        close(fd);
+        sprintf(logtxt, "not loading %s, it or %s could have been written by another user",
+                path, opt.spooldir);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return -1;
+
+// the cheap checks first, then make sure every byte is as written
+    header = (const cacheHeader_t *) image;
+    record = (const cacheTrick_t *) (header + 1);
+    reject = (const cacheReject_t *) (record + header->tricks);
+    pool = (char *) (reject + header->rejects);
+    if ((memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != CACHE_VERSION) ||
+        (header->configSize != configSize) || (header->configHash != configHash) ||
+        (strncmp(header->config, opt.config, sizeof(header->config)) != 0) ||
+        ((uint64_t) st.st_size != sizeof(cacheHeader_t) +
+                                  (uint64_t) header->tricks * sizeof(cacheTrick_t) +
+                                  (uint64_t) header->rejects * sizeof(cacheReject_t) +
+                                  header->poolSize) ||
+        ((header->poolSize > 0) && (pool[header->poolSize - 1] != '\0')) ||
+        (gigHashBytes(header + 1, st.st_size - sizeof(cacheHeader_t), 0) != header->imageHash)) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+    for (i = 0; i < header->tricks; i++) {
+        if ((record[i].fileName >= header->poolSize) || (record[i].script >= header->poolSize) ||
+            (record[i].userid >= header->poolSize) || (record[i].mail >= header->poolSize) ||
+            (record[i].source >= header->poolSize)) {
+            munmap(image, st.st_size);
+            return -1;
+        }
+    }
+    for (i = 0; i < header->rejects; i++) {
+        if (reject[i].text >= header->poolSize) {
+            munmap(image, st.st_size);
+            return -1;
+        }
+    }
+
+    grown = realloc(images, (imageCount + 1) * sizeof(cacheImage_t));
+    tricks = malloc((header->tricks + 1) * sizeof(trick_t *));
+    lines = malloc((header->rejects + 1) * sizeof(reject_t));
+    if (grown != NULL) images = grown;
+    i = 0;
+    if ((grown == NULL) || (tricks == NULL) || (lines == NULL)) goto abandon;
+
+    for (i = 0; i < header->tricks; i++) {
+        if ((pony = calloc(1, sizeof(trick_t))) == NULL) goto abandon;
+        pony->fileName = pool + record[i].fileName;
+        pony->script = pool + record[i].script;
+        pony->userid = pool + record[i].userid;
+        pony->mail = pool + record[i].mail;
+        pony->source = pool + record[i].source;
+        pony->actions = record[i].actions;
+        pony->options = record[i].options | TRICK_MAPPED;
+        pony->lineNo = record[i].lineNo;
+        pony->outputMax = record[i].outputMax;
+        pony->dedupeWindow = record[i].dedupeWindow;
+        pony->retryMax = record[i].retryMax;
+        pony->retryBackoff = record[i].retryBackoff;
+        pony->retryJitter = record[i].retryJitter;
+        memcpy(pony->retryCodes, record[i].retryCodes, sizeof(pony->retryCodes));
+        tricks[i] = pony;
+    }
+    for (i = 0; i < header->rejects; i++) {
+        lines[i].lineNo = reject[i].lineNo;
+        lines[i].text = pool + reject[i].text;
+    }
+
+    if (*maxNameLen < header->maxNameLen) *maxNameLen = header->maxNameLen;
+    *parsed = tricks;
+    *rejects = lines;
+    *rejectCount = header->rejects;
+    if (header->tricks + header->rejects > 0) {
+        images[imageCount].base = image;
+        images[imageCount].size = st.st_size;
+        images[imageCount].refs = header->tricks + (header->rejects ? 1 : 0);
+        imageCount++;
+    } else {
+        munmap(image, st.st_size);
+    }
+    return header->tricks;
+
+abandon:
+    while ((tricks != NULL) && (i-- > 0)) free(tricks[i]);
+    free(tricks);
+    free(lines);
+    munmap(image, st.st_size);
+    return -1;
+}
+
+// let go of an image a trick or a reject list pointed into
+void cacheRelease(const char *inside) {
+    int i;
+
+    for (i = 0; i < imageCount; i++) {
+        if ((inside >= images[i].base) && (inside < images[i].base + images[i].size)) break;
+    }
+    if ((i == imageCount) || (--images[i].refs > 0)) return;
+    munmap(images[i].base, images[i].size);
+    images[i] = images[--imageCount];
+}
@@ -0,0 +1,194 @@
+/*
+
+  Script output capture.  The event child empties the
+  script's pipe as fast as the script can fill it, before it
+  goes anywhere near the mail queue or the digest spool, so
+  a chatty script never stalls on a full 64 KiB pipe while
+  its sink is busy.
+
+  The first OUTPUT_MEMORY bytes are kept in memory, which
+  is all most scripts ever say.  Anything after that goes to
+  an unnamed file in the spool directory, written through a
+  shared mapping that grows as it fills.  Each trick has a
+  hard cap (output=n, OUTPUT_MAX by default); past it the
+  pipe is still drained but the bytes are only counted, and
+  the sink gets a "...N bytes omitted" line in their place.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // output hashes for dedupe
+#include <sys/mman.h>            // mmap for the spooled part
+
+#define OUTPUT_MEMORY (256 * 1024)        // kept in memory before spooling
+#define OUTPUT_MAP_STEP (4 * 1024 * 1024) // smallest growth of the spool mapping
+#define OUTPUT_LIMIT (1024 * 1024 * 1024) // largest cap a trick may ask for
+
+// Parse a trick option word.  Returns 1 if it was ours,
+// 0 if it wasn't, or -1 if it was ours but malformed
+int captureOption(trick_t *pony, const char *word) {
+    char *end;
+    long long n;
+
+    if (strncmp(word, "output=", 7) != 0) return 0;
+
+    n = strtoll(word + 7, &end, 10);
+    if (end == word + 7) return -1;
+    switch (*end) {
+    case 'k': case 'K':
+        n *= 1024;
+        end++;
+        break;
+    case 'm': case 'M':
+        n *= 1024 * 1024;
+        end++;
+        break;
+    }
+    if ((*end != '\0') || (n < 0) || (n > OUTPUT_LIMIT)) return -1;
+    pony->outputMax = n;
+    return 1;
+}
+
+// make room for at least want more bytes in the spool mapping
+static int spoolGrow(opts_t opt, capture_t *c, size_t want) {
+    size_t size = c->mappedSize * 2;
+    void *mapped;
+
+    if (c->spool < 0) {
+        if ((c->spool = spoolTemp(opt)) < 0) return -1;
+    }
+    if (size < c->mappedSize + want) size = c->mappedSize + want;
+    if (size < OUTPUT_MAP_STEP) size = OUTPUT_MAP_STEP;
+    if (size > c->cap - OUTPUT_MEMORY) size = c->cap - OUTPUT_MEMORY;
+
+    // allocate the blocks up front, a sparse mapping on a full
+    // disk would answer our first store with SIGBUS
+    if ((errno = posix_fallocate(c->spool, 0, size)) != 0) return -1;
+
+    if (c->mapped != NULL) munmap(c->mapped, c->mappedSize);
+    mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, c->spool, 0);
+    if (mapped == MAP_FAILED) {
+        c->mapped = NULL;
+        c->mappedSize = 0;
+        return -1;
+    }
+    c->mapped = mapped;
+    c->mappedSize = size;
+    return 0;
+}
+
+// Read a script's output until EOF, keeping up to cap bytes of it.
+// Never gives up on the pipe: if memory or the spool run out the
+// rest is drained and counted as omitted.  Returns 0, or -1 with
+// errno set if the pipe itself failed
+int captureDrain(opts_t opt, int from, long long cap, capture_t *c) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char discard[64 * 1024];
+    size_t room;
+    ssize_t got;
+    char *into;
+
+    memset(c, 0, sizeof(*c));
+    c->spool = -1;
+    c->cap = cap;
+
+    for (;;) {
+        into = NULL;
+        room = 0;
+        if (c->memoryLen + c->spoolLen < (size_t) c->cap) {
+            if (c->memoryLen < OUTPUT_MEMORY) {
+                if (c->memory == NULL) c->memory = malloc(OUTPUT_MEMORY);
+                if (c->memory != NULL) {
+                    into = c->memory + c->memoryLen;
+                    room = OUTPUT_MEMORY - c->memoryLen;
+                }
+            } else {
+                if ((c->spoolLen == c->mappedSize) &&
+                    (spoolGrow(opt, c, RELAY_CHUNK) < 0)) {
+                    sprintf(logtxt, "unable to spool script output: %s, dropping the rest",
+                            strerror(errno));
+                    logx(0, opt, logtxt);
+                    c->cap = c->memoryLen + c->spoolLen;   // keep what we have
+                } else {
+                    into = c->mapped + c->spoolLen;
+                    room = c->mappedSize - c->spoolLen;
+                }
+            }
+            if ((into != NULL) && (room > c->cap - c->memoryLen - c->spoolLen)) {
+                room = c->cap - c->memoryLen - c->spoolLen;
+            }
+        }
+        if (into == NULL) {       // over the cap, or nowhere left to put it
+            into = discard;
+            room = sizeof(discard);
+        }
+
+        got = read(from, into, room);
+        if (got == 0) return 0;
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (into == discard) c->omitted += got;
+        else if (into == c->memory + c->memoryLen) c->memoryLen += got;
+        else c->spoolLen += got;
+    }
+}
+
+// bytes of output kept, not counting any omitted
+long long captureLength(const capture_t *c) {
+    return c->memoryLen + c->spoolLen;
+}
+
+// write all of buf or fail
+static int writeAll(int to, const char *buf, size_t len) {
+    ssize_t put;
+
+    while (len > 0) {
+        put = write(to, buf, len);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += put;
+        len -= put;
+    }
+    return 0;
+}
+
+// Write captured output to a sink, with the omitted marker if any
+// was cut.  Returns bytes of output written, or -1 with errno set
+long long captureWrite(const capture_t *c, int to) {
+    char marker[64];
+    int markerLen;
+
+    if (writeAll(to, c->memory, c->memoryLen) < 0) return -1;
+    if (writeAll(to, c->mapped, c->spoolLen) < 0) return -1;
+    if (c->omitted > 0) {
+        markerLen = snprintf(marker, sizeof(marker), "%s...%lld bytes omitted\n",
+                             (captureLength(c) > 0) ? "\n" : "", c->omitted);
+        if (writeAll(to, marker, markerLen) < 0) return -1;
+    }
+    return captureLength(c);
+}
+
+// Hash of the output as the sink sees it, omitted count and all.
+// Never 0, which stands for no output at all
+uint64_t captureHash(const capture_t *c) {
+    gigHashState_t state;
+    uint64_t hash;
+
+    gigHashInit(&state, (uint64_t) c->omitted);
+    gigHashUpdate(&state, c->memory, c->memoryLen);
+    gigHashUpdate(&state, c->mapped, c->spoolLen);
+    hash = gigHashFinal(&state);
+    return (hash != 0) ? hash : 1;
+}
+
+void captureFree(capture_t *c) {
+    free(c->memory);
+    if (c->mapped != NULL) munmap(c->mapped, c->mappedSize);
+    if (c->spool >= 0) close(c->spool);
+    memset(c, 0, sizeof(*c));
+    c->spool = -1;
+}
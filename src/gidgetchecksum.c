@@ -0,0 +1,494 @@
+/*
+
+  @checksum - a native action that writes a checksum sidecar
+  next to the triggering file, the way charlie-example.proc
+  does with md5sum, minus a bash, an md5sum and a diff per file.
+
+     @checksum [md5|sha256]
+
+  The sidecar is named after the file with .md5 or .sha256
+  tacked on and holds the same line md5sum or sha256sum would
+  print, so "md5sum -c" still works on the far end.
+
+  The sidecar is built in an anonymous O_TMPFILE and linked
+  into place with linkat(), which refuses to replace anything.
+  That is the noclobber race guard: if a sidecar already exists
+  and agrees with the file we say nothing, if it disagrees we
+  complain (and the complaint gets mailed).  Events for the
+  sidecars themselves are filtered out before they are ever
+  dispatched, see the read loop in main().
+
+  Anybody who can write the watched directory decides what we
+  are given, so the file is opened as the trick's user, with
+  the daemon's fs identity switched for the call the way
+  @mirror does it, and the sidecar is that user's too.  Only
+  regular files are hashed: symlinks are not followed and a
+  FIFO or device is left alone rather than read.  The file is
+  read rather than mapped, since a mapped file truncated
+  under us would kill the daemon with a SIGBUS.
+
+  SHA-256 uses the SHA-NI instructions when the CPU has them.
+  MD5 has no such luck; it is serial by design.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <sys/stat.h>            // fstat
+#include <sys/fsuid.h>           // setfsuid, setfsgid
+#include <pthread.h>             // pthread_self
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+# include <immintrin.h>
+# define CHECKSUM_SHANI 1
+#endif
+
+#define CHECKSUM_CHUNK (1024 * 1024)  // aligned read size
+#define CHECKSUM_MAX_HEX 65           // sha256 is 64 hex digits plus a NUL
+
+  typedef void blockFn_t(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+  typedef struct {
+      int sha;                  // 0 for md5, 1 for sha256
+      uint32_t state[8];
+      unsigned char buffer[64];
+      size_t buffered;
+      uint64_t total;
+      blockFn_t *blocks;
+  } checksum_t;
+
+static inline uint32_t rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+static inline uint32_t rotr32(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+/*
+    MD5, RFC 1321
+*/
+
+static const uint32_t md5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5Shift[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5Blocks(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32_t m[16], a, b, c, d, f, t;
+    int i, g;
+
+    while (blocks--) {
+        for (i = 0; i < 16; i++) {
+            m[i] = (uint32_t) data[i * 4] | ((uint32_t) data[i * 4 + 1] << 8) |
+                   ((uint32_t) data[i * 4 + 2] << 16) | ((uint32_t) data[i * 4 + 3] << 24);
+        }
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        for (i = 0; i < 64; i++) {
+            if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+            else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+            else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) & 15; }
+            else             { f = c ^ (b | ~d);       g = (7 * i) & 15; }
+            t = d;
+            d = c;
+            c = b;
+            b = b + rotl32(a + f + md5K[i] + m[g], md5Shift[i]);
+            a = t;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        data += 64;
+    }
+}
+
+/*
+    SHA-256, FIPS 180-4
+*/
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256Blocks(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while (blocks--) {
+        for (i = 0; i < 16; i++) {
+            w[i] = ((uint32_t) data[i * 4] << 24) | ((uint32_t) data[i * 4 + 1] << 16) |
+                   ((uint32_t) data[i * 4 + 2] << 8) | (uint32_t) data[i * 4 + 3];
+        }
+        for (i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for (i = 0; i < 64; i++) {
+            t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+                 ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+                 ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef CHECKSUM_SHANI
+
+// Four rounds per sha256rnds2 pair, message schedule from
+// sha256msg1/msg2, after the Intel white paper.  The state is kept
+// as ABEF/CDGH, the order the instructions want it in.
+
+__attribute__((target("sha,sse4.1")))
+static void sha256BlocksShaNi(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, m0, m1, m2, m3, abefSave, cdghSave;
+    int i;
+
+    tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+    while (blocks--) {
+        abefSave = state0;
+        cdghSave = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), byteSwap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), byteSwap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), byteSwap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), byteSwap);
+
+        for (i = 0; i < 16; i++) {
+            msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *) &sha256K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            // next four schedule words, W[t-16] + s0 + W[t-7] + s1
+            tmp = _mm_sha256msg1_epu32(m0, m1);
+            tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(m3, m2, 4));
+            tmp = _mm_sha256msg2_epu32(tmp, m3);
+            m0 = m1; m1 = m2; m2 = m3; m3 = tmp;
+        }
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+static int haveShaNi(void) {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1)) return 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return 0;
+    return (b & (1u << 29)) != 0;   // CPUID.7.0:EBX.SHA
+}
+
+#endif
+
+static blockFn_t *sha256Best(void) {
+#ifdef CHECKSUM_SHANI
+    static int shaNi = -1;          // racy but idempotent
+    if (shaNi < 0) shaNi = haveShaNi();
+    if (shaNi) return sha256BlocksShaNi;
+#endif
+    return sha256Blocks;
+}
+
+/*
+    Streaming front end shared by both algorithms
+*/
+
+static void checksumInit(checksum_t *ctx, int sha) {
+    static const uint32_t md5Init[4] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    static const uint32_t sha256Init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->sha = sha;
+    if (sha) {
+        memcpy(ctx->state, sha256Init, sizeof(sha256Init));
+        ctx->blocks = sha256Best();
+    } else {
+        memcpy(ctx->state, md5Init, sizeof(md5Init));
+        ctx->blocks = md5Blocks;
+    }
+}
+
+static void checksumUpdate(checksum_t *ctx, const unsigned char *p, size_t len) {
+    ctx->total += len;
+    if (ctx->buffered) {
+        size_t take = 64 - ctx->buffered;
+        if (take > len) take = len;
+        memcpy(ctx->buffer + ctx->buffered, p, take);
+        ctx->buffered += take;
+        p += take;
+        len -= take;
+        if (ctx->buffered < 64) return;
+        ctx->blocks(ctx->state, ctx->buffer, 1);
+        ctx->buffered = 0;
+    }
+    if (len >= 64) {
+        ctx->blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t) 63;
+        len &= 63;
+    }
+    memcpy(ctx->buffer, p, len);
+    ctx->buffered = len;
+}
+
+// pad, finish, and spell the digest out in lower case hex
+static void checksumFinal(checksum_t *ctx, char *hex) {
+    uint64_t bits = ctx->total * 8;
+    unsigned char pad[72];
+    size_t padLen = ((ctx->buffered < 56) ? 56 : 120) - ctx->buffered;
+    int i, words = ctx->sha ? 8 : 4;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        // md5 wants the length little endian, sha big endian
+        pad[padLen + i] = ctx->sha ? (bits >> (56 - i * 8)) : (bits >> (i * 8));
+    }
+    checksumUpdate(ctx, pad, padLen + 8);
+
+    for (i = 0; i < words; i++) {
+        uint32_t w = ctx->state[i];
+        if (ctx->sha) {
+            sprintf(hex + i * 8, "%08x", w);
+        } else {
+            sprintf(hex + i * 8, "%02x%02x%02x%02x",
+                    w & 0xff, (w >> 8) & 0xff, (w >> 16) & 0xff, w >> 24);
+        }
+    }
+}
+
+// One pass over the file in big aligned reads.  Returns 0, 1 if it is
+// a symlink or isn't a regular file, or -1 with errno set
+static int checksumFile(const char *path, int sha, char *hex) {
+    checksum_t ctx;
+    struct stat sb;
+    void *chunk;
+    off_t offset = 0;
+    ssize_t got;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+    if ((fd < 0) && (errno == ELOOP)) return 1;
+    if (fd < 0) return -1;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(fd);
+        return 1;
+    }
+    if (posix_memalign(&chunk, 4096, CHECKSUM_CHUNK) != 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    checksumInit(&ctx, sha);
+    while ((got = pread(fd, chunk, CHECKSUM_CHUNK, offset)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(chunk);
+            close(fd);
+            return -1;
+        }
+        checksumUpdate(&ctx, chunk, got);
+        offset += got;
+    }
+    free(chunk);
+    close(fd);
+    checksumFinal(&ctx, hex);
+    return 0;
+}
+
+// validates the argument text, returns the sidecar suffix or NULL
+const char *checksumSuffix(const char *arg) {
+    while ((*arg == ' ') || (*arg == '\t')) arg++;
+    if ((*arg == '\0') || (strcmp(arg, "md5") == 0)) return ".md5";
+    if (strcmp(arg, "sha256") == 0) return ".sha256";
+    return NULL;
+}
+
+// everything checksumHandler() does, as the trick's user
+static int checksumAs(const gidget_event_t *event, const char *suffix, char *output,
+                      size_t outputSize) {
+
+    size_t pathLen = strlen(event->path);
+    char hex[CHECKSUM_MAX_HEX];
+    char sidecar[pathLen + 8];
+    char line[CHECKSUM_MAX_HEX + pathLen + 4];
+    int fd, linked, hashed;
+
+    hashed = checksumFile(event->path, suffix[1] == 's', hex);
+    if (hashed > 0) return 0;           // symlinks, FIFOs and such are not ours
+    if (hashed < 0) {
+        if (errno == ENOENT) return 0;   // gone already, nothing to vouch for
+        snprintf(output, outputSize, "unable to checksum %s: %s\n",
+                 event->path, strerror(errno));
+        return 1;
+    }
+
+    strcpy(sidecar, event->path);
+    strcat(sidecar, suffix);
+    sprintf(line, "%s  %s\n", hex, event->path);
+
+// write the sidecar into an unnamed file, then give it a name
+    char dir[pathLen + 1];
+    strcpy(dir, event->path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = '\0';
+    else if (slash != NULL) *slash = '\0';
+    else strcpy(dir, ".");
+
+    fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0640);
+    if (fd >= 0) {
+        char procPath[64];
+        if (write(fd, line, strlen(line)) != (ssize_t) strlen(line)) {
+            snprintf(output, outputSize, "unable to write checksum for %s: %s\n",
+                     event->path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        sprintf(procPath, "/proc/self/fd/%d", fd);
+        linked = linkat(AT_FDCWD, procPath, AT_FDCWD, sidecar, AT_SYMLINK_FOLLOW);
+        close(fd);
+    } else {
+    // no O_TMPFILE on this filesystem, fall back on a temp name
+        char temp[pathLen + 48];
+        sprintf(temp, "%s.gidget-%d-%lx", event->path, getpid(),
+                (unsigned long) pthread_self());
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+        if ((fd < 0) || (write(fd, line, strlen(line)) != (ssize_t) strlen(line))) {
+            snprintf(output, outputSize, "unable to create %s: %s\n", temp, strerror(errno));
+            if (fd >= 0) close(fd);
+            unlink(temp);
+            return 1;
+        }
+        close(fd);
+        linked = link(temp, sidecar);
+        int saveErrno = errno;
+        unlink(temp);
+        errno = saveErrno;
+    }
+
+    if (linked == 0) return 0;   // success is silent
+
+    if (errno != EEXIST) {
+        snprintf(output, outputSize, "Unable to create %s: %s\nprocess aborting!\n",
+                 sidecar, strerror(errno));
+        return 2;
+    }
+
+// somebody beat us to it.  Same data is a dupe, different data is trouble
+    char existing[CHECKSUM_MAX_HEX] = "";
+    fd = open(sidecar, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t got = read(fd, existing, strlen(hex));
+        existing[(got > 0) ? got : 0] = '\0';
+        close(fd);
+    }
+    if (strcmp(existing, hex) == 0) return 0;
+
+    snprintf(output, outputSize,
+             "WARNING! %s does not match %s!\n"
+             "Duplicate file name without duplicate data\n"
+             "unable to proceed!\n", event->path, sidecar);
+    return 2;
+}
+
+int checksumHandler(const gidget_event_t *event, char *output, size_t outputSize) {
+
+    const char *suffix = checksumSuffix(event->arg);
+    size_t pathLen = strlen(event->path);
+    struct passwd user, *found = NULL;
+    char buffer[4096];
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int result;
+
+    if ((suffix == NULL) ||
+        (event->mask & (IN_ISDIR | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM |
+                        IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT))) {
+        return 0;
+    }
+
+// prevent recursion from eating entire filesystem, belt and braces
+    if ((pathLen > strlen(suffix)) &&
+        (strcmp(event->path + pathLen - strlen(suffix), suffix) == 0)) {
+        return 0;
+    }
+
+    if ((getpwnam_r(event->userid, &user, buffer, sizeof(buffer), &found) != 0) ||
+        (found == NULL)) {
+        snprintf(output, outputSize, "unable to find user %s, %s not checksummed\n",
+                 event->userid, event->path);
+        return 1;
+    }
+
+// group first, setfsuid() away from root drops the right to change it
+    setfsgid(user.pw_gid);
+    setfsuid(user.pw_uid);
+    if (((uid_t) setfsuid(-1) != user.pw_uid) || ((gid_t) setfsgid(-1) != user.pw_gid)) {
+        setfsuid(uid);
+        setfsgid(gid);
+        snprintf(output, outputSize, "unable to act as user %s, %s not checksummed\n",
+                 event->userid, event->path);
+        return 1;
+    }
+    result = checksumAs(event, suffix, output, outputSize);
+    setfsuid(uid);
+    setfsgid(gid);
+    return result;
+}
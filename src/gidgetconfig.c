@@ -0,0 +1,1804 @@
+/*
+
+  The configuration file, read once at startup and again
+  every time the daemon gets a SIGHUP.
+
+  Parsing only builds tricks.  Watches are added afterwards,
+  which lets a reload compare the new configuration with the
+  tricks already running before it touches the kernel.  Each
+  trick keeps its config line as written, less comments and
+  trailing blanks, and a reload matches new tricks to live
+  ones by path:
+
+    same line          left alone, its watch is never touched
+    different line     swapped in at the same trick number,
+                       the watch mask updated in place
+    path not seen      new trick number, new watch
+    live, not in file  watch removed, trick retired
+
+  Trick numbers never move, because event children, retries,
+  dedupe windows and native jobs all refer to tricks by number
+  and may outlive the reload.  A retired trick stays in
+  trickHeap so those can still look it up, it just gets no
+  more events.  Once none of them is left, configReclaim()
+  frees it and gives its number to the next new trick, so a
+  daemon reloaded now and then for years holds no more tricks
+  than it ever had at once.  A native trick's old definition
+  is kept the same way until the last job queued for it is
+  done.  Events the kernel queued on unchanged watches while
+  we were busy are read as usual once the reload is done, so
+  none are lost.
+
+  Watch descriptors used to double as trick numbers, which
+  only held as long as watches were never removed.  Now the
+  map below turns one into the other.
+
+  With -I, every file named *.conf in a directory is read as
+  well, in name order, as a fragment of the configuration
+  with lines numbered from its own start.  The directory has
+  a watch of its own, and writing, renaming or deleting a
+  fragment reloads just that fragment, comparing its new lines
+  with the tricks only it defined just as a SIGHUP compares
+  the whole file.  A path may be watched by one trick only,
+  whichever file it is in.  A SIGHUP also looks through the
+  directory, but leaves fragments whose text is as it was
+  alone unless some of their lines failed last time.  The
+  config cache only covers the config file itself.
+
+  The file is mapped and parsed in place, a field being
+  copied only once it is known to be good.  Checking a path
+  is the expensive part, so every line's path is looked up
+  first, on a few threads, and the lines are then gone
+  through in order as before so diagnostics come out the
+  same.  Watches are only added once all that is done.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // hashing paths for the reload diff
+#include "gidgetpool.h"          // native tricks may arrive with a reload
+#include <pthread.h>             // paths are validated in parallel
+#include <sys/mman.h>            // the config is parsed where it lies
+#include <dirent.h>              // include directories
+#include <sys/vfs.h>             // spotting network filesystems
+
+// limit number of characters in a pathed script name
+#define MAX_SCRIPT_LEN 256
+
+// also limit length of an email address
+// email will not be checked for syntax or existence
+#define MAX_EMAIL_LEN 36
+
+// paths are looked up on up to this many threads, each taking
+// at least this many lines
+#define CONFIG_MAX_THREADS 16
+#define CONFIG_LINES_PER_THREAD 256
+
+// script output kept per run unless a trick says otherwise
+#define OUTPUT_MAX (16 * 1024 * 1024)
+
+// every so often polled tricks that have turned busy are given watches,
+// this many at a time
+#define TIER_SECONDS 5
+#define TIER_MOVES 32
+
+// retired tricks are looked at this often to see if they can be freed
+#define RECLAIM_SECONDS 1
+
+// filesystems where a watch is taken without complaint but only ever
+// hears of changes made on this machine, so tricks on them are polled
+  static const struct {
+      uint32_t magic;       // statfs() f_type
+      const char *name;
+  } remoteFilesystems[] = {
+      { 0x6969, "NFS" },
+      { 0xff534d42, "CIFS" },
+      { 0xfe534d42, "SMB2" },
+      { 0x517b, "SMB" },
+      { 0x65735546, "FUSE" },
+      { 0x01021997, "9P" },
+      { 0x00c36400, "Ceph" },
+      { 0x5346414f, "AFS" },
+      { 0x47504653, "GPFS" },
+  };
+
+// what happens to a fragment in the include directory: written in
+// place, renamed in or out, or deleted
+#define INCLUDE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+// watch descriptor to trick number, -1 where there is no trick
+  static int32_t *watchMap = NULL;
+  static int32_t watchMapSize = 0;
+  static int32_t watchCount = 0;     // descriptors mapped, held against -W
+
+// fragments of the include directory.  A trick's origin is 0 if it
+// came from the config file, or one more than its fragment's index
+  typedef struct {
+      char name[NAME_MAX + 1];
+      uint64_t hash;        // of the text its live tricks came from
+      size_t size;
+      int loaded;           // hash and size mean something
+      int failed;           // lines that made no trick, worth another go
+      int seen;             // by the latest look through the directory
+  } fragment_t;
+
+  static fragment_t *fragments = NULL;
+  static int fragmentCount = 0;
+  static int32_t includeWatch = -1;   // mapped to trick -2
+
+  static void configIncludes(opts_t opt, int instanceHandle, trick_t ***trickHeap,
+                             int *trickCount, int *maxNameLen, int limit);
+
+// what a reclaimed trick number holds until a new trick takes it
+  static trick_t vacant = {
+      .watchHandle = -1, .fileName = "", .script = "", .userid = "", .mail = "",
+      .source = "", .options = TRICK_RETIRED,
+  };
+
+  static int32_t *vacancies = NULL;  // reclaimed trick numbers, taken last first
+  static int vacancyCount = 0, vacancySize = 0;
+  static int retiredCount = 0;       // retired tricks not yet reclaimed
+
+// native definitions swapped out while jobs still held them
+  typedef struct {
+      trick_t *pony;
+      int32_t trick;
+  } stale_t;
+
+  static stale_t *stale = NULL;
+  static int staleCount = 0, staleSize = 0;
+
+// the trick a watch descriptor belongs to, -1 if none does, or -2 for
+// the include directory.  Polled tricks' made up ones map straight back
+int32_t watchTrick(int32_t wd) {
+    if (wd < -1) return POLL_WD(wd);
+    if ((wd <= 0) || (wd >= watchMapSize)) return -1;
+    return watchMap[wd];
+}
+
+// point a watch descriptor at a trick, or at -1 to forget it
+static int watchSet(int32_t wd, int32_t trick) {
+    int32_t size, *grown;
+
+    if (wd <= 0) return -1;
+    if (wd >= watchMapSize) {
+        for (size = watchMapSize ? watchMapSize : 1024; size <= wd; size *= 2);
+        if ((grown = realloc(watchMap, size * sizeof(int32_t))) == NULL) return -1;
+        memset(grown + watchMapSize, 0xff, (size - watchMapSize) * sizeof(int32_t));
+        watchMap = grown;
+        watchMapSize = size;
+    }
+    watchCount += (trick != -1) - (watchMap[wd] != -1);
+    watchMap[wd] = trick;
+    return 0;
+}
+
+// forget the last of a watch that was handed over to the poller,
+// once the kernel has sent the last of its events
+void watchDrop(int32_t wd) {
+    watchSet(wd, -1);
+}
+
+// Add a watch for a trick that no other trick may share.  Returns
+// the watch descriptor, or -1 with errno set, EEXIST if it's taken
+static int32_t watchAdd(int instanceHandle, const trick_t *pony) {
+    int32_t wd;
+
+    wd = inotify_add_watch(instanceHandle, pony->fileName, pony->actions | IN_MASK_CREATE);
+    if ((wd < 0) && (errno == EINVAL)) {
+        // kernels before 4.18 don't know IN_MASK_CREATE, and just
+        // change the other trick's mask, which is the best we can do
+        wd = inotify_add_watch(instanceHandle, pony->fileName, pony->actions);
+        if ((wd >= 0) && (watchTrick(wd) != -1)) {
+            wd = -1;
+            errno = EEXIST;
+        }
+    }
+    return wd;
+}
+
+static void trickFree(trick_t *pony) {
+    if (pony->options & TRICK_MAPPED) {
+        cacheRelease(pony->source);
+    } else {
+        free(pony->fileName);
+        free(pony->script);
+        free(pony->userid);
+        free(pony->mail);
+        free(pony->source);
+    }
+    free(pony->handlerArg);
+    free(pony);
+}
+
+// keep the text of a line that made no trick, for the config cache
+static void rejectAdd(reject_t **rejects, int *rejectCount, int lineNo, const char *text,
+                      int len) {
+    reject_t *grown;
+
+    if ((grown = realloc(*rejects, (*rejectCount + 1) * sizeof(reject_t))) == NULL) return;
+    *rejects = grown;
+    if ((grown[*rejectCount].text = strndup(text, len)) == NULL) return;
+    grown[(*rejectCount)++].lineNo = lineNo;
+}
+
+// tricks are numbered in the order of their lines
+static int byLine(const void *a, const void *b) {
+    return (*(trick_t * const *) a)->lineNo - (*(trick_t * const *) b)->lineNo;
+}
+
+// a field of a config line, in place in the mapped file
+  typedef struct {
+      const char *at;
+      int len;              // -1 where the line has no such field
+  } view_t;
+
+// pathconf() for the first field of a run of lines
+  typedef struct {
+      const view_t *paths;
+      long *nameMax;
+      int from, to;
+  } pathWork_t;
+
+static void *pathWorker(void *arg) {
+    pathWork_t *work = arg;
+    char path[PATH_MAX];
+    int i;
+
+    for (i = work->from; i < work->to; i++) {
+        if (work->paths[i].len < 0) continue;
+        if (work->paths[i].len >= PATH_MAX) {
+            work->nameMax[i] = -1;
+            continue;
+        }
+        memcpy(path, work->paths[i].at, work->paths[i].len);
+        path[work->paths[i].len] = '\0';
+        work->nameMax[i] = pathconf(path, _PC_NAME_MAX);
+    }
+    return NULL;
+}
+
+// Look up the name limit of every line's path before the parse proper.
+// Each lookup walks the path and statfs()s the filesystem, which is
+// most of what parsing a big config costs, so they are spread over
+// a thread per processor
+static void pathValidate(const view_t *paths, long *nameMax, int lines) {
+    pathWork_t work[CONFIG_MAX_THREADS];
+    pthread_t tid[CONFIG_MAX_THREADS];
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), started, t;
+
+    if (threads > lines / CONFIG_LINES_PER_THREAD) threads = lines / CONFIG_LINES_PER_THREAD;
+    if (threads > CONFIG_MAX_THREADS) threads = CONFIG_MAX_THREADS;
+    if (threads < 1) threads = 1;
+
+    for (t = 0; t < threads; t++) {
+        work[t].paths = paths;
+        work[t].nameMax = nameMax;
+        work[t].from = (long long) lines * t / threads;
+        work[t].to = (long long) lines * (t + 1) / threads;
+    }
+// our own thread takes the first share, and any a thread couldn't be started for
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&tid[started], NULL, pathWorker, &work[started]) != 0) break;
+    }
+    pathWorker(&work[0]);
+    for (t = started; t < threads; t++) pathWorker(&work[t]);
+    for (t = 1; t < started; t++) pthread_join(tid[t], NULL);
+}
+
+// Parse configuration text into an array of tricks, without watches.
+// Fields are picked out of the text where they lie and only copied
+// once they make a trick.  maxNameLen is raised to the longest file
+// name any of the watched filesystems allows.  Lines are numbered
+// from lineNo + 1, and if rejects isn't NULL the lines that fail are
+// collected there.  Returns the number of tricks
+static int configParse(opts_t opt, const char *text, size_t size, int lineNo,
+                       trick_t ***parsed, int *maxNameLen,
+                       reject_t **rejects, int *rejectCount) {
+
+// avoid buffer overruns
+// sysconf and pathconf let us use run-time values of system
+// limits rather than compile-time values from limits.h
+    int maxUidLen = sysconf(_SC_LOGIN_NAME_MAX);
+    const int maxScriptLen = MAX_SCRIPT_LEN;
+    const int maxEmailLen = MAX_EMAIL_LEN;
+    const char apostrophe[] = { 39, 0 };
+
+    char logtxt[MAX_ERR_TEXT_LEN];
+
+    const char *confLine, *end = text + size, *next;
+    view_t token, *paths = NULL;
+    long *nameMax = NULL;
+    int lineLen, recordLen, fieldNo, fieldLen;
+    int tokenStart, lines, line;
+    int i, m; // dummies, mostly for string and loop indexing
+    char *optWord, *optSave; // for picking apart the options field
+    trick_t pony, **grown;
+    int trickCount = 0;
+
+// if any field in a configuration line fails syntax checking
+// badPony is set to something other than zero.  Using a flag
+// instead of just jumping to the next line whenever a bogus
+// field is encountered lets us give better diagnostics
+// which users will almost certainly appreciate
+    int badPony;
+
+    *parsed = NULL;
+
+// first find every line's path, and have them all looked up at once
+    for (lines = 0, confLine = text; confLine < end; lines++) {
+        next = memchr(confLine, '\n', end - confLine);
+        confLine = (next != NULL) ? next + 1 : end;
+    }
+    paths = malloc((lines + 1) * sizeof(view_t));
+    nameMax = malloc((lines + 1) * sizeof(long));
+    if ((paths == NULL) || (nameMax == NULL)) {
+        logx(3, opt, "FATAL ERROR! Unable to allocate memory to parse configuration");
+    }
+    for (line = 0, confLine = text; line < lines; line++) {
+        next = memchr(confLine, '\n', end - confLine);
+        lineLen = (next != NULL) ? next + 1 - confLine : end - confLine;
+        paths[line].at = confLine;
+        paths[line].len = -1;
+        nameMax[line] = -1;
+        for (recordLen = 0; (recordLen < lineLen) && (confLine[recordLen] != '\0') &&
+                            (confLine[recordLen] != '#'); recordLen++) {
+            if ((confLine[recordLen] == ':') || (confLine[recordLen] == '\n')) {
+                paths[line].len = recordLen;
+                break;
+            }
+        }
+        confLine += lineLen;
+    }
+    pathValidate(paths, nameMax, lines);
+
+// now step through the lines one by one, with all the diagnostics
+    for (line = 0, confLine = text; line < lines; line++, confLine += lineLen) {
+        next = memchr(confLine, '\n', end - confLine);
+        lineLen = (next != NULL) ? next + 1 - confLine : end - confLine;
+        lineNo++;
+
+        fieldNo = 0;    // no fields found yet, field count starts at one
+        tokenStart = 0; // position of first character in current field
+        badPony = 0;    // He rides across the nation, the Thoroughbred of Sin
+        pony.options = 0;
+        pony.fileName = pony.script = pony.userid = pony.mail = NULL;
+        pony.source = NULL;
+        pony.lineNo = lineNo;
+        pony.origin = 0;
+        pony.handler = NULL;
+        pony.handlerArg = NULL;
+        pony.jobs = 0;
+        pony.ignoreSuffix = NULL;
+        pony.retryMax = 0;      // failures are final unless asked otherwise
+        pony.retryBackoff = 30;
+        pony.retryJitter = 20;
+        memset(pony.retryCodes, 0, sizeof(pony.retryCodes));
+        pony.outputMax = OUTPUT_MAX;
+        pony.dedupeWindow = 0;
+
+// step through characters until EOL or comment delimiter found
+        for (recordLen = 0;
+             ((recordLen < lineLen) && (confLine[recordLen] != '\0')
+              && (confLine[recordLen] != '#')); recordLen++) {
+
+// you can use vim -b configfile to fix invisible characters
+            if (isprint(confLine[recordLen]) == 0) {
+                if (confLine[recordLen] != '\n') {
+                    sprintf(logtxt, 
+                         "invisible character in file %s line %d position %d",
+                          opt.config, lineNo, (recordLen + 1));
+                    logx(0, opt, logtxt);
+                    badPony = 1;
+                }
+            } else {
+                if (confLine[recordLen] == apostrophe[0]) {
+                   sprintf(logtxt,
+                         "illegal character in file %s line %d position %d",
+                          opt.config, lineNo, (recordLen + 1));
+                    logx(0, opt, logtxt);
+                    badPony = 1;
+                }
+            }
+
+// if field delimiter found, take a view of the currently known field
+            if ((confLine[recordLen] == ':')
+                               || (confLine[recordLen] == '\n')) {
+
+                fieldNo++;
+                fieldLen = recordLen - tokenStart;
+                token.at = confLine + tokenStart;
+                token.len = fieldLen;
+
+    // for each field, check token syntax while loading up the pony
+                switch (fieldNo) {
+
+                case 1:
+                    m = nameMax[line];
+                    if (m <= 0) {
+                      // it is not possible in ISO standard C to test existence of a file
+                      // however in our implementation pathconf gives us a reliable hint
+                        sprintf(logtxt,
+                            "Can't determine max file name length for filesystem hosting %.*s",
+                            token.len, token.at);
+                        logx(0, opt, logtxt);
+                        badPony = 1;
+                    } else {
+                        if (m > *maxNameLen) {
+                            *maxNameLen = m;
+                            if (opt.verbose) {
+                                sprintf(logtxt, "Maximum file name length set to %d...",m);
+                                logx(0, opt, logtxt);
+                            }
+                        }
+                        pony.fileName = strndup(token.at, token.len);
+                        if (pony.fileName == NULL) {
+                            sprintf(logtxt,
+                                 "Can't allocate memory for file name %.*s in line %d",
+                                 token.len, token.at, lineNo);
+                            logx(0, opt, logtxt);
+                            badPony = 1;
+                        }
+                    }
+                    break;
+
+                case 2:
+                    for (i = 0; i < fieldLen; i++) {
+                        if (!isdigit(token.at[i]))
+                            break;
+                    }
+                    if (i == fieldLen) {
+                        pony.actions = atoi(token.at);
+                    } else {
+                        sprintf(logtxt,
+                             "ERROR: non-numeric event mask in %s line %d field 2",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 2;
+                    }
+                    break;
+
+                case 3:
+                    if (fieldLen > maxScriptLen) {
+                        sprintf(logtxt,
+                             "ERROR: script name too long in %s line %d field 3",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 3;
+                    } else {
+                        pony.script = strndup(token.at, token.len);
+                        if (pony.script == NULL) {
+                            sprintf(logtxt,
+                                 "Can't allocate memory for script name %.*s in line %d",
+                                 token.len, token.at, lineNo);
+                            logx(0, opt, logtxt);
+                            badPony = 3;
+                        }
+                    }
+                    break;
+
+                case 4:
+                    if (fieldLen > maxUidLen) {
+                        sprintf(logtxt,
+                             "ERROR: script name too long in %s line %d field 3",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 4;
+                        break;
+                    }
+                    pony.userid = strndup(token.at, token.len);
+                    if (pony.userid == NULL) {
+                        sprintf(logtxt,
+                             "Can't allocate memory for username %.*s in line %d",
+                             token.len, token.at, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 4;
+                        break;
+                    }
+                    break;
+
+                case 5:
+                    if (fieldLen > maxEmailLen) {
+                        sprintf(logtxt,
+                             "Email address too long in %s line %d field 5",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 7;
+                    } else {
+                        pony.mail = strndup(token.at, token.len);
+                        if (pony.mail == NULL) {
+                            sprintf(logtxt,
+                                 "Can't allocate memory for email address %.*s in line %d",
+                                 token.len, token.at, lineNo);
+                            logx(0, opt, logtxt);
+                            badPony = 8;
+                        }
+                    }
+                    break;
+
+                case 6: {
+    // option words go to parsers that want strings, so this one field is copied
+                    char options[fieldLen + 1];
+                    memcpy(options, token.at, fieldLen);
+                    options[fieldLen] = '\0';
+                    for (optWord = strtok_r(options, ",", &optSave); optWord != NULL;
+                         optWord = strtok_r(NULL, ",", &optSave)) {
+                        if (strcmp(optWord, "hash") == 0) {
+                            pony.options |= TRICK_HASH;
+                        } else if (strcmp(optWord, "poll") == 0) {
+                            pony.options |= TRICK_POLL;
+                        } else if (strcmp(optWord, "watch") == 0) {
+                            pony.options |= TRICK_WATCH;
+                        } else if ((m = captureOption(&pony, optWord)) != 0) {
+                            if (m < 0) {
+                                sprintf(logtxt,
+                                     "ERROR: bad output cap %s in %s line %d field 6",
+                                     optWord, opt.config, lineNo);
+                                logx(0, opt, logtxt);
+                                badPony = 12;
+                            }
+                        } else if ((m = repeatOption(&pony, optWord)) != 0) {
+                            if (m < 0) {
+                                sprintf(logtxt,
+                                     "ERROR: bad dedupe window %s in %s line %d field 6",
+                                     optWord, opt.config, lineNo);
+                                logx(0, opt, logtxt);
+                                badPony = 13;
+                            }
+                        } else if ((m = retryOption(&pony, optWord)) < 0) {
+                            sprintf(logtxt,
+                                 "ERROR: bad retry option %s in %s line %d field 6",
+                                 optWord, opt.config, lineNo);
+                            logx(0, opt, logtxt);
+                            badPony = 11;
+                        } else if (m == 0) {
+                            sprintf(logtxt,
+                                 "WARNING: unknown option %s in %s line %d field 6, ignored",
+                                 optWord, opt.config, lineNo);
+                            logx(0, opt, logtxt);
+                        }
+                    }
+    // fingerprinting reads the file, and reading a file generates events
+                    if ((pony.options & TRICK_HASH) &&
+                        (pony.actions & (IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))) {
+                        sprintf(logtxt,
+                             "ERROR: hash option would retrigger its own trick in %s line %d",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 9;
+                    }
+                    if ((pony.options & TRICK_POLL) && (pony.options & TRICK_WATCH)) {
+                        sprintf(logtxt,
+                             "ERROR: poll and watch options together in %s line %d",
+                             opt.config, lineNo);
+                        logx(0, opt, logtxt);
+                        badPony = 14;
+                    }
+                    break;
+                }
+
+                default:
+                    sprintf(logtxt,
+                           "TOO MANY FIELDS IN LINE %d - DISCARDING %.*s!",
+                           lineNo, token.len, token.at);
+                    logx(0, opt, logtxt);
+                    break;
+                }    // end case token
+
+                tokenStart = recordLen + 1;
+            }     // end for each field
+
+        }       // end for each record
+
+// silently skip empty lines and full-line comments
+        if (fieldNo == 0) continue;
+
+// the line as written is what a reload compares, trailing blanks aside
+        while ((recordLen > 0) && isspace((unsigned char) confLine[recordLen - 1])) recordLen--;
+        pony.source = strndup(confLine, recordLen);
+        if (pony.source == NULL) {
+            sprintf(logtxt, "Can't allocate memory for line %d", lineNo);
+            logx(0, opt, logtxt);
+            badPony = 1;
+        }
+
+// if all syntax checks were passed the pony is ready to be loaded into heap
+        if ((badPony) || (fieldNo < 5)) {
+            sprintf(logtxt, "ERROR: discarding %s line %d!", opt.config, lineNo);
+            logx(0, opt, logtxt);
+            if (rejects != NULL) rejectAdd(rejects, rejectCount, lineNo, confLine, lineLen);
+            free(pony.fileName);
+            free(pony.script);
+            free(pony.userid);
+            free(pony.mail);
+            free(pony.source);
+            continue;
+        }
+
+    // extend the array of pointers to tricks with realloc
+    //     (first use degrades gracefully to malloc)
+        grown = (trick_t **) realloc(*parsed, (trickCount + 1) * sizeof(trick_t *));
+        if (grown == NULL) {
+            sprintf(logtxt, "%s %s at %s line %d!",
+                   "FATAL ERROR!",
+                   "Unable to allocate additional memory",
+                   opt.config, lineNo);
+            logx(3, opt, logtxt);
+        }
+        *parsed = grown;
+    // allocate another block of memory for this trick with malloc
+    // and point the newly created pointer at the newly created trick struct
+        (*parsed)[trickCount] = (trick_t *) malloc(sizeof(trick_t));
+        if ((*parsed)[trickCount] == NULL) {
+            sprintf(logtxt, "%s %s at %s line %d!",
+                   "FATAL ERROR!",
+                   "Unable to allocate additional memory",
+                   opt.config, lineNo);
+            logx(4, opt, logtxt);
+        }
+    // unload pony into the array and increment number of tricks
+        *(*parsed)[trickCount++] = pony;
+    } // rof, loop back for next configuration record
+
+    free(paths);
+    free(nameMax);
+    return trickCount;
+}
+
+// Whether a trick is to be polled rather than watched, whatever the
+// watch budget: its poll option says so, or its path is on a network
+// filesystem and no watch option says otherwise, in which case it is
+// marked TRICK_REMOTE.  Returns "" for the option, the filesystem's
+// name for a network one, or NULL for a watch
+static const char *pollChosen(trick_t *pony) {
+    struct statfs st;
+    size_t i;
+
+    if (pony->options & TRICK_POLL) return "";
+    if ((pony->options & TRICK_WATCH) || (statfs(pony->fileName, &st) < 0)) return NULL;
+    for (i = 0; i < sizeof(remoteFilesystems) / sizeof(remoteFilesystems[0]); i++) {
+        if ((uint32_t) st.f_type == remoteFilesystems[i].magic) {
+            pony->options |= TRICK_REMOTE;
+            return remoteFilesystems[i].name;
+        }
+    }
+    return NULL;
+}
+
+// Give a parsed trick its native handler and an inotify watch,
+// and map the watch to trick number trick.  A watch on an inode
+// that another trick already watches is refused, since inotify
+// would simply hand back that trick's watch with our mask on it.
+// If -W allows no more watches, or the kernel has none left, the
+// trick is polled instead, see gidgetpoll.c.  Returns 0, or logs
+// and returns -1
+static int configInstall(opts_t opt, int instanceHandle, trick_t *pony, int32_t trick) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    const char *why;
+
+    pony->lastEvent = time(NULL);
+
+// native tricks get their shared object loaded now or not at all
+    if ((pony->script[0] == '@') && (pony->handler == NULL) &&
+        (nativeLoad(pony, opt, pony->lineNo) != 0)) {
+        sprintf(logtxt, "ERROR: discarding %s line %d!", opt.config, pony->lineNo);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+
+// tricks polled by choice never take a watch
+    if ((why = pollChosen(pony)) != NULL) {
+        if (pollAdd(pony, trick) < 0) {
+            sprintf(logtxt, "ERROR: no memory to poll %s, discarding %s line %d!",
+                    pony->fileName, opt.config, pony->lineNo);
+            logx(0, opt, logtxt);
+            return -1;
+        }
+        pony->watchHandle = POLL_WD(trick);
+        if (opt.verbose) {
+            if (why[0] == '\0') {
+                sprintf(logtxt, "Polling %s, as its poll option asks.", pony->fileName);
+            } else {
+                sprintf(logtxt, "Polling %s, a watch on %s only hears of this machine's changes.",
+                        pony->fileName, why);
+            }
+            logx(0, opt, logtxt);
+        }
+        return 0;
+    }
+
+// An inotify watch list will be built and passed to the kernel
+// which will contain one inode watch for each gidget trick
+    if ((opt.watchBudget > 0) && (watchCount >= opt.watchBudget)) {
+        pony->watchHandle = -1;
+        errno = ENOSPC;
+    } else {
+        pony->watchHandle = watchAdd(instanceHandle, pony);
+        if ((pony->watchHandle < 0) && (errno == ENOSPC)) budgetRefused();
+    }
+    if ((pony->watchHandle < 0) && (errno == ENOSPC) && (pollAdd(pony, trick) == 0)) {
+        pony->watchHandle = POLL_WD(trick);
+        if (opt.verbose) {
+            sprintf(logtxt, "Polling %s, no inotify watch to spare.", pony->fileName);
+            logx(0, opt, logtxt);
+        }
+        return 0;
+    }
+    if (pony->watchHandle < 0) {
+        if (errno == EEXIST) {
+            sprintf(logtxt, "ERROR: %s is already watched by another trick", pony->fileName);
+        } else if (errno == ENOSPC) {
+            sprintf(logtxt, "ERROR: no inotify watch left for %s, "
+                    "see fs.inotify.max_user_watches and gidget -n", pony->fileName);
+        } else {
+            sprintf(logtxt,
+                 "ERROR %d: Unable to add watch for %s\t%s (%u)",
+                 pony->watchHandle, pony->fileName, strerror(errno),
+                 errno);
+        }
+        logx(0, opt, logtxt);
+        sprintf(logtxt, "ERROR: discarding %s line %d!", opt.config, pony->lineNo);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    if (watchSet(pony->watchHandle, trick) < 0) {
+        inotify_rm_watch(instanceHandle, pony->watchHandle);
+        sprintf(logtxt, "ERROR: no memory to map watch for %s line %d!", opt.config, pony->lineNo);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    if (opt.verbose) {
+        sprintf(logtxt, "Added watch %s mask %#.8x handle %d.",
+           pony->fileName, pony->actions, pony->watchHandle);
+        logx(0, opt, logtxt);
+    }
+    return 0;
+}
+
+// Map an open config file, leaving text NULL if it is empty.  Editors
+// write a new file and rename it, but anyone truncating one in place
+// while we parse would get us a SIGBUS, as with any mapped file.
+// Returns 0, or -1 with errno set
+static int configMap(int handle, const char **text, size_t *size) {
+    struct stat st;
+
+    *text = NULL;
+    if (fstat(handle, &st) < 0) return -1;
+    *size = st.st_size;
+    if (*size == 0) return 0;
+    *text = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, handle, 0);
+    if (*text == MAP_FAILED) {
+        *text = NULL;
+        return -1;
+    }
+    madvise((void *) *text, *size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+// watch the include directory for fragments coming and going
+static void includeWatchAdd(opts_t opt, int instanceHandle) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+
+    includeWatch = inotify_add_watch(instanceHandle, opt.includeDir, INCLUDE_EVENTS);
+    if ((includeWatch >= 0) && (watchSet(includeWatch, -2) < 0)) {
+        inotify_rm_watch(instanceHandle, includeWatch);
+        includeWatch = -1;
+        errno = ENOMEM;
+    }
+    if (includeWatch < 0) {
+        sprintf(logtxt, "unable to watch include directory %s: %s, "
+                "changes to it will need a SIGHUP", opt.includeDir, strerror(errno));
+        logx(0, opt, logtxt);
+    }
+}
+
+// Read the configuration from an open file into an array of tricks,
+// from the config cache if it holds an image of these very bytes,
+// otherwise by parsing them and then caching the result.  With
+// compile set the cache is ignored but must be written.  Returns the
+// number of tricks, or -1 if the file could not be read or, when
+// compiling, cached
+static int configRead(opts_t opt, int configHandle, int compile, trick_t ***parsed,
+                      int *maxNameLen) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    const char *text = NULL;
+    size_t size;
+    uint64_t hash;
+    reject_t *rejects = NULL;
+    trick_t **more, **grown;
+    int count = 0, rejectCount = 0, moreCount, cachedNameLen = 0, revived = 0, i, j;
+
+// the file is mapped rather than read, and parsed where it lies
+    *parsed = NULL;
+    if (configMap(configHandle, &text, &size) < 0) goto unreadable;
+    hash = gigHashBytes(text, size, 0);
+
+    if (!compile &&
+        ((count = cacheLoad(opt, hash, size, parsed, maxNameLen, &rejects, &rejectCount)) >= 0)) {
+        if (size > 0) munmap((void *) text, size);
+
+    // lines that failed last time get another go, a missing path may have turned up
+        for (i = 0; i < rejectCount; i++) {
+            moreCount = configParse(opt, rejects[i].text, strlen(rejects[i].text),
+                                    rejects[i].lineNo - 1, &more, maxNameLen, NULL, NULL);
+            if (moreCount <= 0) continue;
+            grown = realloc(*parsed, (count + moreCount) * sizeof(trick_t *));
+            if (grown == NULL) {
+                for (j = 0; j < moreCount; j++) trickFree(more[j]);
+            } else {
+                *parsed = grown;
+                for (j = 0; j < moreCount; j++) grown[count++] = more[j];
+                revived += moreCount;
+            }
+            free(more);
+        }
+        if (revived > 0) qsort(*parsed, count, sizeof(trick_t *), byLine);
+        if (rejectCount > 0) cacheRelease(rejects[0].text);
+        free(rejects);
+
+        if (opt.verbose) {
+            sprintf(logtxt, "loaded %d tricks for %s from the configuration cache", count, opt.config);
+            logx(0, opt, logtxt);
+        }
+        return count;
+    }
+
+    count = configParse(opt, text, size, 0, parsed, &cachedNameLen, &rejects, &rejectCount);
+    if (size > 0) munmap((void *) text, size);
+    if (*maxNameLen < cachedNameLen) *maxNameLen = cachedNameLen;
+
+    if ((cacheWrite(opt, hash, size, *parsed, count, rejects, rejectCount, cachedNameLen) < 0) &&
+        compile) {
+        for (i = 0; i < count; i++) trickFree((*parsed)[i]);
+        free(*parsed);
+        *parsed = NULL;
+        count = -1;
+    }
+    for (i = 0; i < rejectCount; i++) free(rejects[i].text);
+    free(rejects);
+    return count;
+
+unreadable:
+    sprintf(logtxt, "Error reading %s: %s (%u)", opt.config, strerror(errno), errno);
+    logx(0, opt, logtxt);
+    return -1;
+}
+
+// Read the configuration at startup and watch everything in it, and
+// then everything in the include directory if there is one.  Lines
+// that can't be watched are logged and left out.  Returns the number
+// of tricks, or -1 if the file could not be read
+int configLoad(opts_t opt, FILE *configFile, int instanceHandle,
+               trick_t ***trickHeap, int *maxNameLen) {
+    trick_t **parsed;
+    int parsedCount, trickCount = 0, i;
+
+    parsedCount = configRead(opt, fileno(configFile), 0, &parsed, maxNameLen);
+    if (parsedCount < 0) return -1;
+
+// the include directory's own watch goes first, so no trick can take it
+    if (opt.includeDir[0] != '\0') includeWatchAdd(opt, instanceHandle);
+
+// tricks that install are packed down in place, so numbers stay dense
+    for (i = 0; i < parsedCount; i++) {
+        if (configInstall(opt, instanceHandle, parsed[i], trickCount) == 0) {
+            parsed[trickCount++] = parsed[i];
+        } else {
+            trickFree(parsed[i]);
+        }
+    }
+    *trickHeap = parsed;
+
+    if (opt.includeDir[0] != '\0') {
+        configIncludes(opt, instanceHandle, trickHeap, &trickCount, maxNameLen, INT_MAX);
+    }
+    return trickCount;
+}
+
+// keep a native trick's old definition until its jobs are done
+static void staleAdd(trick_t *pony, int32_t trick) {
+    stale_t *grown;
+
+    if (staleCount == staleSize) {
+        if ((grown = realloc(stale, (staleSize + 64) * sizeof(stale_t))) == NULL) return;
+        stale = grown;
+        staleSize += 64;
+    }
+    stale[staleCount].pony = pony;
+    stale[staleCount++].trick = trick;
+}
+
+// Put a changed definition in place of live trick number t.  The
+// same path gives back the same watch with the mask replaced, but
+// if the path has come to name another inode since, the old watch
+// goes.  Returns 0, or logs and returns -1 with the old one intact
+static int configSwap(opts_t opt, int instanceHandle, trick_t **trickHeap, int32_t t,
+                      trick_t *pony) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    trick_t *old = trickHeap[t];
+    int32_t owner, wd;
+
+    if ((pony->script[0] == '@') && (nativeLoad(pony, opt, pony->lineNo) != 0)) {
+        sprintf(logtxt, "ERROR: keeping the old definition of %s, discarding %s line %d!",
+                pony->fileName, opt.config, pony->lineNo);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+
+    pony->lastEvent = old->lastEvent;
+    pony->options |= old->options & TRICK_PAUSED;
+
+// a trick that is to be polled now stops being watched; its watch
+// descriptor stays mapped until the kernel's IN_IGNORED for it
+    if (pollChosen(pony) != NULL) {
+        if (old->watchHandle > 0) {
+            if (pollAdd(pony, t) < 0) {
+                sprintf(logtxt, "ERROR: no memory to poll %s, keeping its old definition",
+                        pony->fileName);
+                logx(0, opt, logtxt);
+                return -1;
+            }
+            inotify_rm_watch(instanceHandle, old->watchHandle);
+        }
+        pony->watchHandle = POLL_WD(t);
+        goto swapped;
+    }
+
+// A polled trick stays polled, the next scan goes by the new mask,
+// unless it was only polled by choice, when it gets a watch if one
+// is to be had
+    if (old->watchHandle < -1) {
+        pony->watchHandle = old->watchHandle;
+        if (!(old->options & (TRICK_POLL | TRICK_REMOTE)) ||
+            ((opt.watchBudget > 0) && (watchCount >= opt.watchBudget))) {
+            goto swapped;
+        }
+        if ((wd = watchAdd(instanceHandle, pony)) < 0) {
+            if (errno == ENOSPC) budgetRefused();
+            goto swapped;
+        }
+        if (watchSet(wd, t) < 0) {
+            inotify_rm_watch(instanceHandle, wd);
+            goto swapped;
+        }
+        pony->watchHandle = wd;
+        pollRemove(pony, t, 1);
+        goto swapped;
+    }
+
+    pony->watchHandle = inotify_add_watch(instanceHandle, pony->fileName, pony->actions);
+    if (pony->watchHandle < 0) {
+        if (errno == ENOSPC) budgetRefused();
+        sprintf(logtxt, "ERROR: unable to update watch for %s: %s, keeping its old definition",
+                pony->fileName, strerror(errno));
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    if (pony->watchHandle != old->watchHandle) {
+        owner = watchTrick(pony->watchHandle);
+        if (owner != -1) {
+            // another trick watches that inode, and we just changed its mask
+            inotify_add_watch(instanceHandle, pony->fileName,
+                              (owner >= 0) ? trickHeap[owner]->actions : INCLUDE_EVENTS);
+            sprintf(logtxt, "ERROR: %s is already watched by another trick, discarding %s line %d!",
+                    pony->fileName, opt.config, pony->lineNo);
+            logx(0, opt, logtxt);
+            return -1;
+        }
+        if (watchSet(pony->watchHandle, t) < 0) {
+            inotify_rm_watch(instanceHandle, pony->watchHandle);
+            return -1;
+        }
+        inotify_rm_watch(instanceHandle, old->watchHandle);
+        watchSet(old->watchHandle, -1);
+    }
+
+swapped:
+    trickHeap[t] = pony;
+    // native jobs still queued for the worker threads point at the old
+    // one, which configReclaim() frees once they are done.  If there's
+    // no memory to keep track of it, it is never freed
+    if ((old->handler == NULL) || (__atomic_load_n(&old->jobs, __ATOMIC_ACQUIRE) == 0)) {
+        trickFree(old);
+    } else {
+        staleAdd(old, t);
+    }
+
+    if (opt.verbose) {
+        sprintf(logtxt, "Changed trick %d, %s mask %#.8x handle %d.",
+                t, pony->fileName, pony->actions, pony->watchHandle);
+        logx(0, opt, logtxt);
+    }
+    return 0;
+}
+
+// Bring the live tricks that came from one origin, the config file or
+// a fragment, into line with what it now says, as described at the
+// top.  parsed is used up, and trickHeap and trickCount are updated in
+// place.  Logs a summary as verb, timed from began.  Returns the
+// number of lines discarded, or -1 if out of memory, in which case
+// nothing was changed
+static int configApply(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                       int origin, trick_t **parsed, int parsedCount, const char *verb,
+                       const struct timespec *began) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct timespec ended;
+    trick_t **heap = *trickHeap, **grown, *pony;
+    int32_t *table = NULL, *match = NULL, t, slot, tableMask;
+    char *claimed = NULL;
+    int liveCount = *trickCount, originCount = 0, i;
+    int added = 0, changed = 0, removed = 0, unchanged = 0, discarded = 0;
+
+// an open addressed table of this origin's live tricks by path, never
+// more than half full.  Other origins' tricks are left out, so their
+// paths are only in the way if a line here tries to watch one of them
+    for (t = 0; t < liveCount; t++) {
+        if ((heap[t]->origin == origin) && !(heap[t]->options & TRICK_RETIRED)) originCount++;
+    }
+    for (tableMask = 1023; tableMask < 2 * originCount; tableMask = tableMask * 2 + 1);
+    table = malloc((tableMask + 1) * sizeof(int32_t));
+    match = malloc((parsedCount + 1) * sizeof(int32_t));
+    claimed = calloc(liveCount + 1, 1);
+    if ((table == NULL) || (match == NULL) || (claimed == NULL)) {
+        sprintf(logtxt, "no memory to compare configurations, keeping the running %s", opt.config);
+        logx(0, opt, logtxt);
+        for (i = 0; i < parsedCount; i++) trickFree(parsed[i]);
+        free(parsed);
+        free(table);
+        free(match);
+        free(claimed);
+        return -1;
+    }
+    memset(table, 0xff, (tableMask + 1) * sizeof(int32_t));
+    for (t = 0; (t < liveCount) && (originCount > 0); t++) {
+        if ((heap[t]->origin != origin) || (heap[t]->options & TRICK_RETIRED)) continue;
+        slot = gigHashBytes(heap[t]->fileName, strlen(heap[t]->fileName), 0) & tableMask;
+        while (table[slot] >= 0) slot = (slot + 1) & tableMask;
+        table[slot] = t;
+    }
+
+// first see which live trick, if any, each new line stands for
+    for (i = 0; i < parsedCount; i++) {
+        pony = parsed[i];
+        pony->origin = origin;
+        slot = gigHashBytes(pony->fileName, strlen(pony->fileName), 0) & tableMask;
+        while (((t = table[slot]) >= 0) && (strcmp(heap[t]->fileName, pony->fileName) != 0)) {
+            slot = (slot + 1) & tableMask;
+        }
+        match[i] = t;
+        if (t < 0) continue;
+        if (claimed[t]) {
+            sprintf(logtxt, "ERROR: %s is watched by an earlier line, discarding %s line %d!",
+                    pony->fileName, opt.config, pony->lineNo);
+            logx(0, opt, logtxt);
+            trickFree(pony);
+            parsed[i] = NULL;
+            discarded++;
+            continue;
+        }
+        claimed[t] = 1;
+    }
+
+// then retire what has gone, which frees up its inodes for new lines
+    for (t = 0; (t < liveCount) && (originCount > 0); t++) {
+        if (claimed[t] || (heap[t]->origin != origin) || (heap[t]->options & TRICK_RETIRED)) {
+            continue;
+        }
+        if (heap[t]->watchHandle < -1) {
+            pollRemove(heap[t], t, 0);
+        } else {
+            inotify_rm_watch(instanceHandle, heap[t]->watchHandle);
+            watchSet(heap[t]->watchHandle, -1);
+        }
+        heap[t]->options |= TRICK_RETIRED;
+        retiredCount++;
+        removed++;
+        if (opt.verbose) {
+            sprintf(logtxt, "Removed watch %s handle %d, trick %d retired.",
+                    heap[t]->fileName, heap[t]->watchHandle, t);
+            logx(0, opt, logtxt);
+        }
+    }
+
+// and finally swap in what changed and add what's new
+    for (i = 0; i < parsedCount; i++) {
+        if ((pony = parsed[i]) == NULL) continue;
+        t = match[i];
+        if ((t >= 0) && (strcmp(heap[t]->source, pony->source) == 0)) {
+            trickFree(pony);
+            unchanged++;
+        } else if (t >= 0) {
+            if (configSwap(opt, instanceHandle, heap, t, pony) == 0) {
+                changed++;
+            } else {
+                trickFree(pony);
+                discarded++;
+            }
+        } else {
+    // a new trick takes the number of one reclaimed, if there is one
+            t = (vacancyCount > 0) ? vacancies[vacancyCount - 1] : *trickCount;
+            if (t == *trickCount) {
+                grown = realloc(heap, (*trickCount + 1) * sizeof(trick_t *));
+                if (grown == NULL) {
+                    sprintf(logtxt, "no memory for a new trick, discarding %s line %d!",
+                            opt.config, pony->lineNo);
+                    logx(0, opt, logtxt);
+                    trickFree(pony);
+                    discarded++;
+                    continue;
+                }
+                heap = *trickHeap = grown;
+            }
+            if (configInstall(opt, instanceHandle, pony, t) < 0) {
+                trickFree(pony);
+                discarded++;
+                continue;
+            }
+            heap[t] = pony;
+            if (t == *trickCount) {
+                (*trickCount)++;
+            } else {
+                vacancyCount--;
+            }
+            added++;
+        }
+    }
+
+// the worker threads are only started once there is a native trick
+    for (t = 0; (t < *trickCount) && (poolRunning() == 0); t++) {
+        if ((heap[t]->handler != NULL) && !(heap[t]->options & TRICK_RETIRED) &&
+            (poolStart(opt.workers) == 0)) {
+            logx(0, opt, "unable to start worker threads for native tricks");
+            break;
+        }
+    }
+
+    free(parsed);
+    free(table);
+    free(match);
+    free(claimed);
+
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    sprintf(logtxt, "%s %s in %.1f ms: %d added, %d changed, %d removed, "
+            "%d unchanged, %d discarded",
+            verb, opt.config,
+            (ended.tv_sec - began->tv_sec) * 1e3 + (ended.tv_nsec - began->tv_nsec) / 1e6,
+            added, changed, removed, unchanged, discarded);
+    logx(0, opt, logtxt);
+    return discarded;
+}
+
+// Reread the configuration and bring the live tricks into line with
+// it, as described at the top, then do the same for any fragment in
+// the include directory that has changed.  trickHeap and trickCount
+// are updated in place.  Nothing changes if the file can't be read.
+// Returns 0, or -1 if the running configuration was kept
+int configReload(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                 int maxNameLen) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct timespec began;
+    trick_t **parsed;
+    int parsedCount, newMaxNameLen = maxNameLen, result = -1, i;
+    int configHandle;
+
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    if ((configHandle = open(opt.config, O_RDONLY | O_CLOEXEC)) < 0) {
+        sprintf(logtxt, "Error (%u) opening %s: %s, keeping the running configuration",
+                errno, opt.config, strerror(errno));
+        logx(0, opt, logtxt);
+    } else {
+        parsedCount = configRead(opt, configHandle, 0, &parsed, &newMaxNameLen);
+        close(configHandle);
+        if (parsedCount < 0) {
+            logx(0, opt, "keeping the running configuration");
+        } else if (newMaxNameLen > maxNameLen) {
+    // the read buffers were sized at startup
+            sprintf(logtxt, "%s watches a filesystem with names longer than %d bytes, "
+                    "restart gidget to use it; keeping the running configuration",
+                    opt.config, maxNameLen);
+            logx(0, opt, logtxt);
+            for (i = 0; i < parsedCount; i++) trickFree(parsed[i]);
+            free(parsed);
+        } else if (configApply(opt, instanceHandle, trickHeap, trickCount, 0,
+                               parsed, parsedCount, "reloaded", &began) >= 0) {
+            result = 0;
+        }
+    }
+
+// fragments are looked at whatever became of the file itself
+    if (opt.includeDir[0] != '\0') {
+        if (includeWatch < 0) includeWatchAdd(opt, instanceHandle);
+        configIncludes(opt, instanceHandle, trickHeap, trickCount, &newMaxNameLen, maxNameLen);
+    }
+    return result;
+}
+
+// fragments are files named *.conf, which leaves out the swap and
+// backup files editors leave lying around
+static int fragmentName(const char *name) {
+    size_t len = strlen(name);
+
+    return (name[0] != '.') && (len > 5) && (len <= NAME_MAX) &&
+           (strcmp(name + len - 5, ".conf") == 0);
+}
+
+static int fragmentFilter(const struct dirent *entry) {
+    return fragmentName(entry->d_name);
+}
+
+// the index of a fragment, added if need be, or -1 if out of memory
+static int fragmentFind(const char *name) {
+    fragment_t *grown;
+    int f;
+
+    for (f = 0; f < fragmentCount; f++) {
+        if (strcmp(fragments[f].name, name) == 0) return f;
+    }
+    if ((grown = realloc(fragments, (fragmentCount + 1) * sizeof(fragment_t))) == NULL) return -1;
+    fragments = grown;
+    memset(&fragments[f], 0, sizeof(fragment_t));
+    strcpy(fragments[f].name, name);
+    return fragmentCount++;
+}
+
+// Bring fragment f's tricks into line with the file, which has gone
+// if it can no longer be opened.  A fragment whose text is what its
+// live tricks came from, and which had no lines fail, is left alone
+// without being parsed.  maxNameLen is raised as far as limit.
+// Returns 0, or -1 if its running tricks were kept
+static int fragmentLoad(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                        int *maxNameLen, int limit, int f) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct timespec began;
+    const char *text = NULL;
+    size_t size = 0;
+    uint64_t hash = 0;
+    reject_t *rejects = NULL;
+    trick_t **parsed = NULL;
+    int handle, parsedCount = 0, rejectCount = 0, newMaxNameLen = *maxNameLen, discarded, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+// diagnostics name the fragment rather than the config file
+    if (snprintf(opt.config, sizeof(opt.config), "%s/%s", opt.includeDir, fragments[f].name) >=
+        (int) sizeof(opt.config)) {
+        sprintf(logtxt, "include file name %s/%s too long, ignored",
+                opt.includeDir, fragments[f].name);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+
+    if ((handle = open(opt.config, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (configMap(handle, &text, &size) < 0) {
+            close(handle);
+            handle = -1;
+        } else {
+            hash = gigHashBytes(text, size, 0);
+        }
+    }
+    if ((handle < 0) && (errno != ENOENT)) {
+        sprintf(logtxt, "Error (%u) opening %s: %s, keeping its running tricks",
+                errno, opt.config, strerror(errno));
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    if (handle < 0) {
+        if (!fragments[f].loaded) return 0;     // came and went between looks
+    } else {
+        close(handle);
+        if (fragments[f].loaded && (fragments[f].failed == 0) &&
+            (fragments[f].hash == hash) && (fragments[f].size == size)) {
+            if (size > 0) munmap((void *) text, size);
+            return 0;
+        }
+        parsedCount = configParse(opt, text, size, 0, &parsed, &newMaxNameLen,
+                                  &rejects, &rejectCount);
+        if (size > 0) munmap((void *) text, size);
+        for (i = 0; i < rejectCount; i++) free(rejects[i].text);
+        free(rejects);
+    }
+
+    if (newMaxNameLen > limit) {
+        sprintf(logtxt, "%s watches a filesystem with names longer than %d bytes, "
+                "restart gidget to use it; keeping its running tricks",
+                opt.config, limit);
+        logx(0, opt, logtxt);
+        for (i = 0; i < parsedCount; i++) trickFree(parsed[i]);
+        free(parsed);
+        return -1;
+    }
+    *maxNameLen = newMaxNameLen;
+
+    discarded = configApply(opt, instanceHandle, trickHeap, trickCount, f + 1,
+                            parsed, parsedCount, fragments[f].loaded ? "reloaded" : "loaded",
+                            &began);
+    if (discarded < 0) return -1;
+    fragments[f].loaded = (handle >= 0);
+    fragments[f].hash = hash;
+    fragments[f].size = size;
+    fragments[f].failed = rejectCount + discarded;
+    return 0;
+}
+
+// Look through the whole include directory, bringing in fragments
+// that are new or changed and retiring the tricks of any that have
+// gone.  maxNameLen is raised as far as limit
+static void configIncludes(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                           int *maxNameLen, int limit) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct dirent **names;
+    int count, f, i;
+
+    if ((count = scandir(opt.includeDir, &names, fragmentFilter, alphasort)) < 0) {
+        sprintf(logtxt, "unable to read include directory %s: %s, keeping its running tricks",
+                opt.includeDir, strerror(errno));
+        logx(0, opt, logtxt);
+        return;
+    }
+    for (f = 0; f < fragmentCount; f++) fragments[f].seen = 0;
+    for (i = 0; i < count; i++) {
+        if ((f = fragmentFind(names[i]->d_name)) >= 0) {
+            fragments[f].seen = 1;
+            fragmentLoad(opt, instanceHandle, trickHeap, trickCount, maxNameLen, limit, f);
+        }
+        free(names[i]);
+    }
+    free(names);
+    for (f = 0; f < fragmentCount; f++) {
+        if (!fragments[f].seen && fragments[f].loaded) {
+            fragmentLoad(opt, instanceHandle, trickHeap, trickCount, maxNameLen, limit, f);
+        }
+    }
+}
+
+// Handle an event without a trick, if it was on the include
+// directory, by reloading just the fragment it names.  An event
+// queue overflow may have hidden some, so then the whole directory
+// is looked through.  Returns 1 if the event was ours, else 0
+int configInclude(opts_t opt, int instanceHandle, trick_t ***trickHeap, int *trickCount,
+                  int maxNameLen, const event_t *event) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    int f;
+
+    if ((includeWatch >= 0) && (event->mask & IN_Q_OVERFLOW)) {
+        configIncludes(opt, instanceHandle, trickHeap, trickCount, &maxNameLen, maxNameLen);
+        return 0;       // everybody else wants to know about it too
+    }
+    if ((includeWatch < 0) || (event->wd != includeWatch)) return 0;
+
+    if (event->mask & IN_IGNORED) {
+        sprintf(logtxt, "include directory %s is gone, its tricks stay until a SIGHUP",
+                opt.includeDir);
+        logx(0, opt, logtxt);
+        watchSet(includeWatch, -1);
+        includeWatch = -1;
+    } else if ((event->len != 0) && fragmentName(event->name) &&
+               ((f = fragmentFind(event->name)) >= 0)) {
+        fragmentLoad(opt, instanceHandle, trickHeap, trickCount, &maxNameLen, maxNameLen, f);
+    }
+    return 1;
+}
+
+// watched tricks quiet long enough to be polled instead, coldest first
+static int byQuiet(const void *a, const void *b, void *heap) {
+    const trick_t *x = ((trick_t **) heap)[*(const int32_t *) a];
+    const trick_t *y = ((trick_t **) heap)[*(const int32_t *) b];
+
+    return (x->lastEvent > y->lastEvent) - (x->lastEvent < y->lastEvent);
+}
+
+static int tierCold(opts_t opt, trick_t **trickHeap, int trickCount, time_t now, int32_t **cold) {
+    int count = 0;
+    int32_t t;
+
+    if ((*cold = malloc((trickCount + 1) * sizeof(int32_t))) == NULL) return 0;
+    for (t = 0; t < trickCount; t++) {
+        if ((trickHeap[t]->watchHandle > 0) &&
+            !(trickHeap[t]->options & (TRICK_RETIRED | TRICK_WATCH)) &&
+            (trickHeap[t]->lastEvent + opt.tierQuiet <= now)) {
+            (*cold)[count++] = t;
+        }
+    }
+    qsort_r(*cold, count, sizeof(int32_t), byQuiet, trickHeap);
+    return count;
+}
+
+// Move a watched trick to the poller.  Its snapshot is taken before
+// the watch goes, and the watch descriptor stays mapped until the
+// kernel's IN_IGNORED says nothing more will come of it, so nothing
+// that happens in between is lost.  Returns 0, or -1 if it couldn't
+static int tierDemote(opts_t opt, int instanceHandle, trick_t *pony, int32_t t) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+
+    if (pollAdd(pony, t) < 0) return -1;
+    inotify_rm_watch(instanceHandle, pony->watchHandle);
+    if (opt.verbose) {
+        sprintf(logtxt, "Polling %s, quiet since %ld, watch %d given up.",
+                pony->fileName, (long) pony->lastEvent, pony->watchHandle);
+        logx(0, opt, logtxt);
+    }
+    pony->watchHandle = POLL_WD(t);
+    return 0;
+}
+
+// Hand watches to the polled tricks that have turned busy, as many as
+// -W and the kernel allow, taking them from the watched tricks quiet
+// longest when there are none to spare.  Does nothing more often than
+// every TIER_SECONDS
+void configTier(opts_t opt, int instanceHandle, trick_t **trickHeap, int trickCount) {
+    static time_t lastTier = 0;
+    char logtxt[MAX_ERR_TEXT_LEN];
+    int32_t hot[TIER_MOVES], *cold = NULL, wd;
+    int hotCount, coldCount = 0, coldUsed = 0, promoted = 0, demoted = 0, room, i;
+    time_t now = time(NULL);
+    trick_t *pony;
+
+    if (now < lastTier + TIER_SECONDS) return;
+    lastTier = now;
+    if ((hotCount = pollHot(trickHeap, hot, TIER_MOVES, now)) == 0) return;
+
+    for (i = 0; i < hotCount; i++) {
+        pony = trickHeap[hot[i]];
+        wd = -1;
+        room = (opt.watchBudget == 0) || (watchCount < opt.watchBudget);
+        if (room && ((wd = watchAdd(instanceHandle, pony)) < 0)) {
+            if (errno != ENOSPC) continue;      // can't be watched, stays polled
+            budgetRefused();
+        }
+        if (wd < 0) {
+            if (cold == NULL) coldCount = tierCold(opt, trickHeap, trickCount, now, &cold);
+            if (coldUsed >= coldCount) break;
+            if (tierDemote(opt, instanceHandle, trickHeap[cold[coldUsed]], cold[coldUsed]) < 0) break;
+            coldUsed++;
+            demoted++;
+            if ((wd = watchAdd(instanceHandle, pony)) < 0) continue;
+        }
+        if (watchSet(wd, hot[i]) < 0) {
+            inotify_rm_watch(instanceHandle, wd);
+            continue;
+        }
+        pony->watchHandle = wd;
+        pony->lastEvent = now;
+        pollRemove(pony, hot[i], 1);    // whatever the last scan didn't see yet
+        promoted++;
+        if (opt.verbose) {
+            sprintf(logtxt, "Watching %s again, handle %d.", pony->fileName, wd);
+            logx(0, opt, logtxt);
+        }
+    }
+    free(cold);
+
+    if (promoted + demoted > 0) {
+        sprintf(logtxt, "%d busy tricks given watches, %d quiet ones polled instead, "
+                "%d polled in all", promoted, demoted, pollCount());
+        logx(0, opt, logtxt);
+    }
+}
+
+// Free what reloads left behind once nothing refers to it any more, as
+// described at the top.  A retired trick is still referred to while it
+// has a child to report back, a retry pending, a dedupe window open, a
+// native job queued or running, or a watch descriptor the kernel has
+// yet to send IN_IGNORED for.  Events held for it by the control socket
+// can never be resumed, so they just go.  trickHeap is changed in place
+void configReclaim(opts_t opt, trick_t **trickHeap, int trickCount) {
+    static time_t lastReclaim = 0;
+    char logtxt[MAX_ERR_TEXT_LEN];
+    time_t now = time(NULL);
+    int32_t *grown, t, wd;
+    trick_t *pony;
+    char *busy;
+    int reclaimed = 0, i;
+
+    if (((retiredCount == 0) && (staleCount == 0)) || (now < lastReclaim + RECLAIM_SECONDS)) {
+        return;
+    }
+    lastReclaim = now;
+
+    for (i = 0; i < staleCount; ) {
+        if (__atomic_load_n(&stale[i].pony->jobs, __ATOMIC_ACQUIRE) != 0) {
+            i++;
+            continue;
+        }
+        trickFree(stale[i].pony);
+        stale[i] = stale[--staleCount];
+    }
+    if ((retiredCount == 0) || ((busy = calloc(trickCount, 1)) == NULL)) return;
+
+    inflightBusy(busy, trickCount);
+    retryBusy(busy, trickCount);
+    repeatBusy(busy, trickCount);
+    for (wd = 0; wd < watchMapSize; wd++) {
+        if ((watchMap[wd] >= 0) && (watchMap[wd] < trickCount)) busy[watchMap[wd]] = 1;
+    }
+    for (i = 0; i < staleCount; i++) busy[stale[i].trick] = 1;  // their jobs use the number
+
+    for (t = 0; t < trickCount; t++) {
+        pony = trickHeap[t];
+        if (!(pony->options & TRICK_RETIRED) || (pony == &vacant) || busy[t] ||
+            (__atomic_load_n(&pony->jobs, __ATOMIC_ACQUIRE) != 0)) {
+            continue;
+        }
+        if (vacancyCount == vacancySize) {
+            if ((grown = realloc(vacancies, (vacancySize + 64) * sizeof(int32_t))) == NULL) break;
+            vacancies = grown;
+            vacancySize += 64;
+        }
+        controlForget(t);
+        latencyForget(t);
+        trickFree(pony);
+        trickHeap[t] = &vacant;
+        vacancies[vacancyCount++] = t;
+        retiredCount--;
+        reclaimed++;
+    }
+    free(busy);
+
+    if (opt.verbose && (reclaimed > 0)) {
+        sprintf(logtxt, "Reclaimed %d retired tricks, %d still in use.", reclaimed, retiredCount);
+        logx(0, opt, logtxt);
+    }
+}
+
+// gidget -C: parse the configuration, report on it and leave its
+// image in the config cache for the daemon.  Returns 0, or -1 if
+// there is no usable image
+int configCompile(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    trick_t **parsed;
+    int configHandle, count, maxNameLen = 0, i;
+
+    if ((configHandle = open(opt.config, O_RDONLY | O_CLOEXEC)) < 0) {
+        sprintf(logtxt, "Error (%u) opening %s: %s", errno, opt.config, strerror(errno));
+        logx(0, opt, logtxt);
+        return -1;
+    }
+    count = configRead(opt, configHandle, 1, &parsed, &maxNameLen);
+    close(configHandle);
+    if (count < 0) return -1;
+
+    sprintf(logtxt, "compiled %d tricks from %s into %s/%s", count, opt.config,
+            opt.spooldir, CACHE_FILE_NAME);
+    logx(0, opt, logtxt);
+    for (i = 0; i < count; i++) trickFree(parsed[i]);
+    free(parsed);
+    return 0;
+}
+
+// where a planned watch would go, for spotting two tricks on one inode
+  typedef struct {
+      dev_t dev;
+      ino_t ino;
+      int32_t trick;        // -1 for an empty slot
+  } planSlot_t;
+
+// parse one file for the plan, tagging its tricks with origin and
+// counting lines that made none in rejected.  Returns the number of
+// tricks, or -1 if it couldn't be read
+static int planRead(opts_t opt, int origin, trick_t ***parsed, int *maxNameLen, long *rejected) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    reject_t *rejects = NULL;
+    const char *text;
+    size_t size;
+    int handle, count, rejectCount = 0, i;
+
+    if (((handle = open(opt.config, O_RDONLY | O_CLOEXEC)) < 0) ||
+        (configMap(handle, &text, &size) < 0)) {
+        sprintf(logtxt, "Error (%u) reading %s: %s", errno, opt.config, strerror(errno));
+        logx(0, opt, logtxt);
+        if (handle >= 0) close(handle);
+        return -1;
+    }
+    close(handle);
+    count = configParse(opt, text, size, 0, parsed, maxNameLen, &rejects, &rejectCount);
+    if (size > 0) munmap((void *) text, size);
+    for (i = 0; i < count; i++) (*parsed)[i]->origin = origin;
+    for (i = 0; i < rejectCount; i++) free(rejects[i].text);
+    free(rejects);
+    *rejected += rejectCount;
+    return count;
+}
+
+// gidget -n: parse the configuration and its include directory and,
+// without adding a single watch, work out which tricks could be armed,
+// which would have to be polled for want of a watch, and what they
+// would cost against the kernel's inotify limits and -W, see
+// gidgetbudget.c.  Returns 0 if everything could be armed, else -1
+int configPlan(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char (*files)[MAX_CONFIG_NAME_LEN] = NULL;
+    trick_t **tricks = NULL, **more, **grown, *pony;
+    struct dirent **names = NULL;
+    planSlot_t *table = NULL;
+    struct stat st;
+    budget_t budget;
+    opts_t fileOpt = opt;
+    int32_t slot, tableMask;
+    int count = 0, moreCount, fileCount = 0, nameCount = 0, maxNameLen = 0;
+    long needed = 0, unarmed = 0, polled = 0, available;
+    int i, j;
+
+// every file that goes into the configuration, the config file first
+    if (opt.includeDir[0] != '\0') {
+        nameCount = scandir(opt.includeDir, &names, fragmentFilter, alphasort);
+        if (nameCount < 0) {
+            sprintf(logtxt, "unable to read include directory %s: %s",
+                    opt.includeDir, strerror(errno));
+            logx(0, opt, logtxt);
+            nameCount = 0;
+            unarmed++;
+        }
+    }
+    if ((files = malloc((nameCount + 1) * sizeof(*files))) == NULL) {
+        logx(0, opt, "no memory to plan the configuration");
+        return -1;
+    }
+    strcpy(files[fileCount++], opt.config);
+    for (i = 0; i < nameCount; i++) {
+        if (snprintf(files[fileCount], sizeof(files[0]), "%s/%s", opt.includeDir,
+                     names[i]->d_name) < (int) sizeof(files[0])) {
+            fileCount++;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    for (i = 0; i < fileCount; i++) {
+        strcpy(fileOpt.config, files[i]);
+        if ((moreCount = planRead(fileOpt, i, &more, &maxNameLen, &unarmed)) < 0) {
+            if (i == 0) goto failed;
+            unarmed++;
+            continue;
+        }
+        if ((grown = realloc(tricks, (count + moreCount + 1) * sizeof(trick_t *))) == NULL) {
+            for (j = 0; j < moreCount; j++) trickFree(more[j]);
+            free(more);
+            logx(0, opt, "no memory to plan the configuration");
+            goto failed;
+        }
+        tricks = grown;
+        for (j = 0; j < moreCount; j++) tricks[count++] = more[j];
+        free(more);
+    }
+
+// each inode takes one watch, however many tricks would like it
+    for (tableMask = 1023; tableMask < 2 * count; tableMask = tableMask * 2 + 1);
+    if ((table = malloc((tableMask + 1) * sizeof(planSlot_t))) == NULL) {
+        logx(0, opt, "no memory to plan the configuration");
+        goto failed;
+    }
+    for (slot = 0; slot <= tableMask; slot++) table[slot].trick = -1;
+
+    budgetRead(&budget, -1);
+    available = (budget.maxWatches < 0) ? LONG_MAX : budget.maxWatches - budget.userWatches;
+    if ((opt.watchBudget > 0) && (opt.watchBudget < available)) available = opt.watchBudget;
+    if (opt.includeDir[0] != '\0') needed++;    // the directory's own watch
+
+    for (i = 0; i < count; i++) {
+        pony = tricks[i];
+        if ((stat(pony->fileName, &st) < 0) ||
+            (faccessat(AT_FDCWD, pony->fileName, R_OK, AT_EACCESS) < 0)) {
+            sprintf(logtxt, "%s line %d can't be armed: %s: %s",
+                    files[pony->origin], pony->lineNo, pony->fileName, strerror(errno));
+            logx(0, opt, logtxt);
+            unarmed++;
+            continue;
+        }
+        if (pollChosen(pony) != NULL) {
+            polled++;       // takes no watch, and may share its inode
+            continue;
+        }
+        slot = gigHashBytes(&st.st_ino, sizeof(st.st_ino), st.st_dev) & tableMask;
+        while ((table[slot].trick >= 0) &&
+               ((table[slot].dev != st.st_dev) || (table[slot].ino != st.st_ino))) {
+            slot = (slot + 1) & tableMask;
+        }
+        if (table[slot].trick >= 0) {
+            j = table[slot].trick;
+            sprintf(logtxt, "%s line %d can't be armed: %s is already watched by %s line %d",
+                    files[pony->origin], pony->lineNo, pony->fileName,
+                    files[tricks[j]->origin], tricks[j]->lineNo);
+            logx(0, opt, logtxt);
+            unarmed++;
+            continue;
+        }
+        table[slot].dev = st.st_dev;
+        table[slot].ino = st.st_ino;
+        table[slot].trick = i;
+        if (++needed > available) {
+            if (opt.verbose) {
+                sprintf(logtxt, "%s line %d would be polled: %s would find no inotify watch left",
+                        files[pony->origin], pony->lineNo, pony->fileName);
+                logx(0, opt, logtxt);
+            }
+            polled++;
+        }
+    }
+
+    sprintf(logtxt, "plan for %s: %d tricks from %d files need %ld watches, "
+            "%ld would be polled instead, %ld lines or files can't be armed",
+            opt.config, count, fileCount, needed, polled, unarmed);
+    logx(0, opt, logtxt);
+    if (budget.maxWatches < 0) {
+        logx(0, opt, "unable to read inotify limits from /proc/sys/fs/inotify");
+    } else {
+        sprintf(logtxt, "inotify limits: %ld watches per user with %ld in use now, "
+                "%ld instances per user with %ld in use, %ld queued events per instance",
+                budget.maxWatches, budget.userWatches, budget.maxInstances,
+                budget.userInstances, budget.maxQueued);
+        logx(0, opt, logtxt);
+        sprintf(logtxt, "the plan needs about %ld KiB of kernel memory, "
+                "%ld KiB with a full event queue",
+                budgetMemory(needed - polled, 0), budgetMemory(needed - polled, budget.maxQueued));
+        logx(0, opt, logtxt);
+        if (budget.userWatches + needed > budget.maxWatches) {
+            sprintf(logtxt, "short of %ld watches, fs.inotify.max_user_watches "
+                    "would have to be at least %ld to poll nothing",
+                    budget.userWatches + needed - budget.maxWatches,
+                    budget.userWatches + needed);
+            logx(0, opt, logtxt);
+        }
+        if ((budget.maxInstances >= 0) && (budget.userInstances >= budget.maxInstances)) {
+            logx(0, opt, "this user has no inotify instance left for gidget");
+            unarmed++;
+        }
+    }
+
+    for (i = 0; i < count; i++) trickFree(tricks[i]);
+    free(tricks);
+    free(table);
+    free(files);
+    return (unarmed == 0) ? 0 : -1;
+
+failed:
+    for (i = 0; i < count; i++) trickFree(tricks[i]);
+    free(tricks);
+    free(table);
+    free(files);
+    return -1;
+}
+
+// gidget -B: parse the configuration and poll every trick in it
+// opt.bench times over, as if none had a watch, logging how many
+// entries a second each round gets through.  The first round takes
+// the snapshots and the rest compare with them, which is what a
+// polled trick costs from then on.  Returns 0, or -1 if the
+// configuration can't be read
+int configBench(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct timespec began, ended;
+    trick_t **tricks;
+    long entries, total = 0, rejected = 0;
+    double seconds, totalSeconds = 0;
+    int count, maxNameLen = 0, threads = 1, round, i;
+
+    if ((count = planRead(opt, 0, &tricks, &maxNameLen, &rejected)) < 0) return -1;
+
+    for (round = 1; round <= opt.bench; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &began);
+        entries = pollBench(tricks, count, &threads);
+        clock_gettime(CLOCK_MONOTONIC, &ended);
+        if (entries < 0) {
+            logx(0, opt, "no memory to poll the configuration");
+            break;
+        }
+        seconds = (ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+        sprintf(logtxt, "%s %d of %d: %ld entries of %d tricks in %.1f ms on %d threads, "
+                "%.0f entries/sec", (round == 1) ? "first scan" : "rescan", round, opt.bench,
+                entries, count, seconds * 1e3, threads, (seconds > 0) ? entries / seconds : 0.0);
+        logx(0, opt, logtxt);
+        if (round > 1) {
+            total += entries;
+            totalSeconds += seconds;
+        }
+    }
+    if (totalSeconds > 0) {
+        sprintf(logtxt, "rescans of %s average %.0f entries/sec", opt.config, total / totalSeconds);
+        logx(0, opt, logtxt);
+    }
+
+    for (i = 0; i < count; i++) trickFree(tricks[i]);
+    free(tricks);
+    return 0;
+}
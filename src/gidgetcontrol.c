@@ -0,0 +1,499 @@
+/*
+
+  The control socket, a Unix socket named with -k that takes
+  one command a connection and answers in plain text:
+
+      list            every trick, with what it is up to
+      pause TRICK     hold the trick's events instead of running them
+      resume TRICK    run what was held, and carry on as normal
+      drain           pause every trick and say what is still running
+      flush           send pending digests, dedupe notices and log
+                      summaries now instead of when their windows close
+      inflight        every event child still running
+      flight          the flight recorder, see gidgetflight.c
+      help
+
+  TRICK is a trick's number, as list shows it, its path, or
+  all.  For example
+
+      echo 'pause /srv/cash/in' | socat - UNIX-CONNECT:/run/gidget.ctl
+
+  A paused trick keeps its watch, or its place with the
+  poller, so nothing is lost while it is paused: its events,
+  retries included, are held here in the order they came and
+  handed back to the read loop on resume, with the times they
+  were first read so their latency tells the truth.  Held
+  events live in memory only and die with the daemon, as
+  does the pause itself.  A reload leaves a trick paused,
+  and throws away what was held for a trick it removes.
+
+  Everything here runs on the read loop, so no locking, and
+  the socket is only readable by its owner.  The loop never
+  waits on a client: up to CONTROL_CLIENTS of them are in its
+  poll set, each with its half read command or half sent
+  answer kept here until the socket is ready again.  A client
+  gets a second to send its command, which is then carried
+  out with whatever came, and two to take the answer.  Any
+  more clients wait in the listen backlog.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_HELD_MAX 100000  // events held for all paused tricks together
+#define CONTROL_REQUEST_MS 1000  // for a client to send its command
+#define CONTROL_SEND_MS 2000     // and to take the answer
+#define CONTROL_REQUEST_LEN (MAX_CONFIG_NAME_LEN + 32)
+
+  typedef struct held {
+      struct held *next;
+      uint32_t mask;
+      uint32_t cookie;
+      int attempt;
+      int64_t received;
+      int64_t receivedMono;
+      char name[];
+  } held_t;
+
+// events held, one queue per trick, by trick number
+  typedef struct {
+      held_t *head, *tail;
+      int count;
+  } heldQueue_t;
+
+  static heldQueue_t *queues = NULL;
+  static int queueCount = 0;
+  static int heldCount = 0;
+
+// tricks resumed with events still to hand back
+  static int32_t *ready = NULL;
+  static int readyCount = 0, readySize = 0;
+
+  static int listener = -1;
+
+// clients being served, in the read loop's poll set
+  typedef struct {
+      int fd;               // -1 for a free slot
+      char request[CONTROL_REQUEST_LEN];
+      size_t got;
+      char *reply;          // NULL until the command has been carried out
+      size_t replyLen, sent;
+      int64_t deadline;     // CLOCK_MONOTONIC ms
+  } client_t;
+
+  static client_t clients[CONTROL_CLIENTS] = { [0 ... CONTROL_CLIENTS - 1] = { .fd = -1 } };
+  static int clientCount = 0;
+
+// Hold an event of a paused trick.  Returns 0, or -1 if there is
+// no room, in which case the event is lost
+int controlHold(int32_t trick, const event_t *event, int attempt,
+                int64_t received, int64_t receivedMono) {
+    size_t nameLen = (event->len != 0) ? strlen(event->name) : 0;
+    heldQueue_t *grown;
+    held_t *h;
+
+    if (heldCount >= CONTROL_HELD_MAX) return -1;
+    if (trick >= queueCount) {
+        if ((grown = realloc(queues, (trick + 1) * sizeof(heldQueue_t))) == NULL) return -1;
+        memset(grown + queueCount, 0, (trick + 1 - queueCount) * sizeof(heldQueue_t));
+        queues = grown;
+        queueCount = trick + 1;
+    }
+    if ((h = malloc(sizeof(held_t) + nameLen + 1)) == NULL) return -1;
+    h->next = NULL;
+    h->mask = event->mask;
+    h->cookie = event->cookie;
+    h->attempt = attempt;
+    h->received = received;
+    h->receivedMono = receivedMono;
+    memcpy(h->name, event->name, nameLen);
+    h->name[nameLen] = '\0';
+
+    if (queues[trick].tail != NULL) {
+        queues[trick].tail->next = h;
+    } else {
+        queues[trick].head = h;
+    }
+    queues[trick].tail = h;
+    queues[trick].count++;
+    heldCount++;
+    return 0;
+}
+
+// events held for all tricks
+int controlHeld(void) {
+    return heldCount;
+}
+
+// Hand back the next held event of a resumed trick, built in buf
+// (room for an event_t and NAME_MAX + 1), with its trick, attempt and
+// the times it was first read.  Events of a trick retired by a reload
+// are thrown away, and of one paused again are held on.  NULL when
+// there is nothing more to hand back
+event_t *controlReleased(trick_t **trickHeap, char *buf, int32_t *trick, int *attempt,
+                         int64_t *received, int64_t *receivedMono) {
+    event_t *event = (event_t *) buf;
+    heldQueue_t *q;
+    held_t *h;
+    int32_t t;
+
+    while (readyCount > 0) {
+        t = ready[0];
+        q = &queues[t];
+        if ((q->head == NULL) || (trickHeap[t]->options & TRICK_PAUSED)) {
+            memmove(ready, ready + 1, --readyCount * sizeof(int32_t));
+            continue;
+        }
+        h = q->head;
+        if ((q->head = h->next) == NULL) q->tail = NULL;
+        q->count--;
+        heldCount--;
+        if (trickHeap[t]->options & TRICK_RETIRED) {
+            metricAdd(METRIC_DROPPED, 1);
+            free(h);
+            continue;
+        }
+
+        memset(event, 0, sizeof(event_t));
+        event->mask = h->mask;
+        event->cookie = h->cookie;
+        event->len = strlen(h->name) + 1;
+        strcpy(event->name, h->name);
+        if (h->name[0] == '\0') event->len = 0;
+        *trick = t;
+        *attempt = h->attempt;
+        *received = h->received;
+        *receivedMono = h->receivedMono;
+        free(h);
+        return event;
+    }
+    return NULL;
+}
+
+// Throw away whatever is held for a trick retired by a reload, which
+// can never be resumed, before its number goes to another trick
+void controlForget(int32_t trick) {
+    held_t *h;
+    int i;
+
+    if (trick < queueCount) {
+        while ((h = queues[trick].head) != NULL) {
+            queues[trick].head = h->next;
+            free(h);
+            heldCount--;
+            metricAdd(METRIC_DROPPED, 1);
+        }
+        queues[trick].tail = NULL;
+        queues[trick].count = 0;
+    }
+    for (i = 0; i < readyCount; ) {
+        if (ready[i] != trick) {
+            i++;
+            continue;
+        }
+        memmove(ready + i, ready + i + 1, (--readyCount - i) * sizeof(int32_t));
+    }
+}
+
+// a trick named by number or path, -1 for all, or -2 if there's no such
+// live trick
+static int32_t controlTrick(const char *arg, trick_t **trickHeap, int trickCount) {
+    char *end;
+    long t;
+
+    if (strcmp(arg, "all") == 0) return -1;
+    t = strtol(arg, &end, 10);
+    if ((arg[0] != '\0') && (*end == '\0')) {
+        if ((t < 0) || (t >= trickCount) || (trickHeap[t]->options & TRICK_RETIRED)) return -2;
+        return (int32_t) t;
+    }
+    for (t = 0; t < trickCount; t++) {
+        if (!(trickHeap[t]->options & TRICK_RETIRED) &&
+            (strcmp(trickHeap[t]->fileName, arg) == 0)) {
+            return (int32_t) t;
+        }
+    }
+    return -2;
+}
+
+// pause or resume one trick.  Returns 1 if that changed anything
+static int controlPause(trick_t *pony, int32_t t, int pause) {
+    int32_t *grown;
+
+    if (pause) {
+        if (pony->options & TRICK_PAUSED) return 0;
+        pony->options |= TRICK_PAUSED;
+        return 1;
+    }
+    if (!(pony->options & TRICK_PAUSED)) return 0;
+    pony->options &= ~TRICK_PAUSED;
+    if ((t < queueCount) && (queues[t].head != NULL)) {
+        if (readyCount == readySize) {
+            // if this fails the events stay held until the next resume
+            if ((grown = realloc(ready, (readySize + 64) * sizeof(int32_t))) == NULL) return 1;
+            ready = grown;
+            readySize += 64;
+        }
+        ready[readyCount++] = t;
+    }
+    return 1;
+}
+
+static void controlList(FILE *out, trick_t **trickHeap, int trickCount) {
+    unsigned int cursor = 0;
+    int *running = calloc(trickCount + 1, sizeof(int));
+    inflight_t *child;
+    latency_t total, start;
+    time_t now = time(NULL);
+    int32_t t;
+
+    while ((running != NULL) && ((child = inflightNext(&cursor)) != NULL)) {
+        if (child->trick < trickCount) running[child->trick]++;
+    }
+    for (t = 0; t < trickCount; t++) {
+        trick_t *pony = trickHeap[t];
+        if (pony->options & TRICK_RETIRED) continue;
+        latencyStats(t, LATENCY_TOTAL, &total, NULL, 0);
+        latencyStats(t, LATENCY_START, &start, NULL, 0);
+        fprintf(out, "%d %s %s %s%s held=%d inflight=%d runs=%llu start_p99=%.3fms "
+                "idle=%lds\n",
+                t, pony->fileName, pony->script,
+                (pony->watchHandle < -1) ? "polled" : "watched",
+                (pony->options & TRICK_PAUSED) ? ",paused" : "",
+                (t < queueCount) ? queues[t].count : 0,
+                (running != NULL) ? running[t] : 0,
+                (unsigned long long) total.count, start.quantile[2] / 1e3,
+                (long) (now - pony->lastEvent));
+    }
+    free(running);
+}
+
+static void controlInflight(FILE *out, trick_t **trickHeap) {
+    unsigned int cursor = 0;
+    inflight_t *child;
+    time_t now = time(NULL);
+    int count = 0;
+
+    while ((child = inflightNext(&cursor)) != NULL) {
+        fprintf(out, "pid %d trick %d %s%s%s %s attempt %d mask %#.8x running %lds\n",
+                child->pid, child->trick, trickHeap[child->trick]->fileName,
+                (child->name[0] != '\0') ? "/" : "", child->name,
+                trickHeap[child->trick]->script, child->attempt, child->mask,
+                (long) (now - child->started));
+        count++;
+    }
+    fprintf(out, "%d in flight, %d retries pending, %d events held\n",
+            count, retryPending(), heldCount);
+}
+
+// carry out one command line, answering into out
+static void controlCommand(opts_t opt, FILE *out, char *line,
+                           trick_t **trickHeap, int trickCount) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char *verb, *arg, *save = NULL;
+    int32_t t, from, to;
+    int changed = 0;
+
+    verb = strtok_r(line, " \t\r\n", &save);
+    arg = strtok_r(NULL, "\r\n", &save);
+    if (verb == NULL) verb = "help";
+
+    if (strcmp(verb, "list") == 0) {
+        controlList(out, trickHeap, trickCount);
+
+    } else if ((strcmp(verb, "pause") == 0) || (strcmp(verb, "resume") == 0) ||
+               (strcmp(verb, "drain") == 0)) {
+        if (verb[0] == 'd') arg = "all";
+        if ((arg == NULL) || ((t = controlTrick(arg, trickHeap, trickCount)) == -2)) {
+            fprintf(out, "ERROR: no such trick %s\n", (arg != NULL) ? arg : "");
+            return;
+        }
+        from = (t < 0) ? 0 : t;
+        to = (t < 0) ? trickCount : t + 1;
+        for (t = from; t < to; t++) {
+            if (trickHeap[t]->options & TRICK_RETIRED) continue;
+            changed += controlPause(trickHeap[t], t, verb[0] != 'r');
+        }
+        fprintf(out, "%s %s, %d tricks %s\n",
+                verb, arg, changed, (verb[0] == 'r') ? "resumed" : "paused");
+        snprintf(logtxt, sizeof(logtxt), "control: %s %s, %d tricks %s",
+                 verb, arg, changed, (verb[0] == 'r') ? "resumed" : "paused");
+        logx(0, opt, logtxt);
+        if (verb[0] == 'd') {
+            fprintf(out, "%d in flight, %d retries pending, %d events held\n",
+                    inflightCount(), retryPending(), heldCount);
+        }
+
+    } else if (strcmp(verb, "flush") == 0) {
+        repeatFlush(opt, trickHeap, 1);
+        if (opt.digestCount > 0) digestFlush(opt, 1);
+        auditFlush(1);
+        logSummary(opt, 1);
+        logx(0, opt, "control: flushed digests, dedupe windows and log summaries");
+        fprintf(out, "flushed\n");
+
+    } else if (strcmp(verb, "inflight") == 0) {
+        controlInflight(out, trickHeap);
+
+    } else if (strcmp(verb, "flight") == 0) {
+        flightDump(out);
+
+    } else {
+        fprintf(out, "commands: list, pause TRICK, resume TRICK, drain, flush, inflight, "
+                "flight\n"
+                "TRICK is a number from list, a path, or all\n");
+    }
+}
+
+static int64_t controlNow(void) {
+    return auditClock(CLOCK_MONOTONIC) / 1000000;
+}
+
+static void clientClose(client_t *c) {
+    close(c->fd);
+    free(c->reply);
+    c->fd = -1;
+    c->reply = NULL;
+    clientCount--;
+}
+
+// Carry out a client's command, and send what of the answer the socket
+// will take.  Returns 1 if the client is done with
+static int clientAnswer(opts_t opt, client_t *c, trick_t **trickHeap, int trickCount) {
+    FILE *out;
+
+    c->request[c->got] = '\0';
+    if ((out = open_memstream(&c->reply, &c->replyLen)) == NULL) return 1;
+    controlCommand(opt, out, c->request, trickHeap, trickCount);
+    if (fclose(out) != 0) return 1;
+    c->sent = 0;
+    c->deadline = controlNow() + CONTROL_SEND_MS;
+    return 0;
+}
+
+// Move a client along as far as it will go without waiting.  Returns
+// 1 if it is done with
+static int clientServe(opts_t opt, client_t *c, trick_t **trickHeap, int trickCount) {
+    ssize_t put;
+
+    while (c->reply == NULL) {
+        put = read(c->fd, c->request + c->got, sizeof(c->request) - 1 - c->got);
+        if ((put < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+            if (controlNow() < c->deadline) return 0;
+            put = 0;        // out of time, it gets what it sent
+        }
+        if (put > 0) c->got += put;
+        if ((put <= 0) || (c->got == sizeof(c->request) - 1) ||
+            (memchr(c->request + c->got - put, '\n', put) != NULL)) {
+            if (clientAnswer(opt, c, trickHeap, trickCount)) return 1;
+        }
+    }
+    while (c->sent < c->replyLen) {
+        put = send(c->fd, c->reply + c->sent, c->replyLen - c->sent, MSG_NOSIGNAL);
+        if ((put < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+            return (controlNow() >= c->deadline);
+        }
+        if (put <= 0) return 1;
+        c->sent += put;
+    }
+    return 1;
+}
+
+// Fill in the read loop's poll set for the control socket: the listener,
+// while there is room for another client, then every client, waiting to
+// read its command or send its answer.  Returns the entries used, one
+// more than CONTROL_CLIENTS at most
+int controlWaits(struct pollfd *waits) {
+    int used = 1, i;
+
+    waits[0].fd = listener;     // poll() passes over it if -1
+    waits[0].events = (clientCount < CONTROL_CLIENTS) ? POLLIN : 0;
+    waits[0].revents = 0;
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+        if (clients[i].fd < 0) continue;
+        waits[used].fd = clients[i].fd;
+        waits[used].events = (clients[i].reply == NULL) ? POLLIN : POLLOUT;
+        waits[used++].revents = 0;
+    }
+    return used;
+}
+
+// milliseconds until a client runs out of time, -1 if there are none
+int controlTimeout(void) {
+    int64_t now = controlNow(), wait = -1, due;
+    int i;
+
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+        if (clients[i].fd < 0) continue;
+        due = (clients[i].deadline > now) ? clients[i].deadline - now : 0;
+        if ((wait < 0) || (due < wait)) wait = due;
+    }
+    return (int) wait;
+}
+
+// Serve the control socket after poll(), given the entries controlWaits()
+// filled in: clients that are ready or out of time first, then anyone
+// new, whose command usually arrives with its connection
+void controlServe(opts_t opt, trick_t **trickHeap, int trickCount, const struct pollfd *waits,
+                  int used) {
+    int64_t now = controlNow();
+    client_t *c;
+    int client, i, w;
+
+    for (w = 1; w < used; w++) {
+        for (i = 0; (i < CONTROL_CLIENTS) && (clients[i].fd != waits[w].fd); i++);
+        if (i == CONTROL_CLIENTS) continue;
+        c = &clients[i];
+        if ((waits[w].revents == 0) && (now < c->deadline)) continue;
+        if (clientServe(opt, c, trickHeap, trickCount)) clientClose(c);
+    }
+
+    if ((listener < 0) || !(waits[0].revents & POLLIN)) return;
+    while ((clientCount < CONTROL_CLIENTS) &&
+           ((client = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)) {
+        for (c = clients; c->fd >= 0; c++);
+        c->fd = client;
+        c->got = 0;
+        c->deadline = controlNow() + CONTROL_REQUEST_MS;
+        clientCount++;
+        if (clientServe(opt, c, trickHeap, trickCount)) clientClose(c);
+    }
+}
+
+// Listen on opt.control.  Returns the listening socket for the read
+// loop to wait on, or logs and returns -1
+int controlStart(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct sockaddr_un local;
+
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, opt.control);
+    unlink(opt.control);        // left by a gidget that didn't get to clean up
+    if (((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) ||
+        (bind(listener, (struct sockaddr *) &local, sizeof(local)) < 0) ||
+        (chmod(opt.control, 0600) < 0) || (listen(listener, 16) < 0)) {
+        sprintf(logtxt, "unable to listen for control commands on %s: %s",
+                opt.control, strerror(errno));
+        logx(0, opt, logtxt);
+        if (listener >= 0) close(listener);
+        return listener = -1;
+    }
+    sprintf(logtxt, "listening for control commands on %s", opt.control);
+    logx(0, opt, logtxt);
+    return listener;
+}
+
+// stop listening, and take the socket's name away with us
+void controlStop(opts_t opt) {
+    int i;
+
+    if (listener < 0) return;
+    for (i = 0; i < CONTROL_CLIENTS; i++) {
+        if (clients[i].fd >= 0) clientClose(&clients[i]);
+    }
+    close(listener);
+    unlink(opt.control);
+}
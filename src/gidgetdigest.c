@@ -0,0 +1,261 @@
+/*
+
+  Per-recipient mail digests.  With -D, output from tricks
+  is not mailed one event at a time.  Each recipient gets a
+  digest which collects a one line summary and a section of
+  output per event, and goes out as a single message when it
+  holds enough events, enough bytes, or its oldest event has
+  waited long enough.  A burst of failures on five thousand
+  files then costs the MTA a handful of messages instead of
+  five thousand sendmail processes.
+
+  Event children spool their output to a file and the daemon
+  adds it here when their report comes in.  Native handlers
+  add their output directly from the worker threads, hence
+  the lock.  Section bodies are kept in an unnamed file in
+  the spool directory; summaries are kept in memory.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <pthread.h>             // native tricks add from worker threads
+#include <stdarg.h>              // va_list for summaryAdd
+
+#define DIGEST_SUMMARY_CHUNK 4096
+
+  typedef struct {
+      char *recipient;
+      int events;
+      long long bytes;      // output bytes held, not counting headers
+      time_t opened;        // when the first event went in
+      int body;             // unnamed file holding the sections
+      char *summary;        // one line per event
+      size_t summaryLen, summarySize;
+  } digest_t;
+
+  static digest_t **digests = NULL;
+  static int digestsOpen = 0;
+  static pthread_mutex_t digestLock = PTHREAD_MUTEX_INITIALIZER;
+
+// printf onto the end of a digest's summary, growing it as needed
+static int summaryAdd(digest_t *d, const char *format, ...) {
+    va_list ap;
+    int need;
+
+    for (;;) {
+        va_start(ap, format);
+        need = vsnprintf(d->summary + d->summaryLen, d->summarySize - d->summaryLen,
+                         format, ap);
+        va_end(ap);
+        if (need < 0) return -1;
+        if (d->summaryLen + need < d->summarySize) break;
+
+        size_t bigger = d->summarySize + need + DIGEST_SUMMARY_CHUNK;
+        char *grown = realloc(d->summary, bigger);
+        if (grown == NULL) return -1;
+        d->summary = grown;
+        d->summarySize = bigger;
+    }
+    d->summaryLen += need;
+    return 0;
+}
+
+// find the open digest for a recipient, starting one if need be
+static digest_t *digestFor(opts_t opt, const char *recipient) {
+    digest_t *d, **grown;
+    int i;
+
+    for (i = 0; i < digestsOpen; i++) {
+        if (strcmp(digests[i]->recipient, recipient) == 0) return digests[i];
+    }
+
+    if ((d = calloc(1, sizeof(digest_t))) == NULL) return NULL;
+    d->body = spoolTemp(opt);
+    d->recipient = strdup(recipient);
+    d->summary = malloc(DIGEST_SUMMARY_CHUNK);
+    grown = realloc(digests, (digestsOpen + 1) * sizeof(digest_t *));
+    if ((d->body < 0) || (d->recipient == NULL) || (d->summary == NULL) || (grown == NULL)) {
+        if (d->body >= 0) close(d->body);
+        free(d->recipient);
+        free(d->summary);
+        free(d);
+        if (grown != NULL) digests = grown;
+        return NULL;
+    }
+    d->summary[0] = '\0';
+    d->summarySize = DIGEST_SUMMARY_CHUNK;
+    digests = grown;
+    digests[digestsOpen++] = d;
+    return d;
+}
+
+// take a digest off the table; the caller now owns it
+static void digestDetach(int i) {
+    digests[i] = digests[--digestsOpen];
+}
+
+// queue a detached digest and free it.  Called without the lock held,
+// since copying a large body can take its time
+static void digestSend(opts_t opt, digest_t *d) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char mailTime[26];
+    struct tm when;
+    time_t now = time(NULL);
+    long long relayed;
+    mailSlot_t slot;
+
+    strftime(mailTime, sizeof(mailTime), "%a %b %e %T %Y", logTime(now, 1, &when));
+
+    FILE *mailslot = mailStream(opt, d->recipient, &slot);
+    if (mailslot == NULL) {
+        sprintf(logtxt, "unable to queue mail, digest of %d events for %s lost: %s",
+                d->events, d->recipient, strerror(errno));
+        logx(0, opt, logtxt);
+    } else {
+        fprintf(mailslot, "From: gidget\n");
+        fprintf(mailslot, "To: %s\n", d->recipient);
+        fprintf(mailslot, "Subject: gidget digest: %d event%s\n",
+                d->events, (d->events == 1) ? "" : "s");
+        fprintf(mailslot, "Date: %s\n", mailTime);
+        fprintf(mailslot, "Auto-Submitted: auto-generated\n");
+        fprintf(mailslot, "X-gidget-events: %d\n\n", d->events);
+        fprintf(mailslot, "%d event%s with output, %lld bytes in all\n\n",
+                d->events, (d->events == 1) ? "" : "s", d->bytes);
+        fputs(d->summary, mailslot);
+        fputc('\n', mailslot);
+        fflush(mailslot);
+
+        lseek(d->body, 0, SEEK_SET);
+        relayed = relayFile(d->body, fileno(mailslot));
+        if (relayed < 0) {
+            sprintf(logtxt, "error queueing digest for %s: %s", d->recipient, strerror(errno));
+            logx(0, opt, logtxt);
+        }
+        if ((mailFinish(opt, mailslot, &slot) == 0) && (relayed >= 0)) {
+            sprintf(logtxt, "queued digest of %d events, %lld bytes, for %s",
+                    d->events, d->bytes, d->recipient);
+            logx(0, opt, logtxt);
+        }
+    }
+
+    close(d->body);
+    free(d->recipient);
+    free(d->summary);
+    free(d);
+}
+
+// Add one event's output to its recipient's digest.  The output is
+// either everything readable from fromFd, or text when fromFd is -1.
+// A digest that reaches the count or size limit is sent right away.
+// Returns 0, or -1 if the output could not be kept
+int digestAdd(opts_t opt, const trick_t *pony, const char *object, uint32_t mask,
+              int status, int fromFd, const char *text, size_t textLen) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char stamp[16], header[MAX_ERR_TEXT_LEN];
+    struct tm when;
+    time_t now = time(NULL);
+    long long added;
+    digest_t *d, *full = NULL;
+    int i, headerLen;
+
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", logTime(now, 1, &when));
+
+    pthread_mutex_lock(&digestLock);
+    if ((d = digestFor(opt, pony->mail)) == NULL) {
+        pthread_mutex_unlock(&digestLock);
+        sprintf(logtxt, "unable to start digest for %s, output of %s on %s lost",
+                pony->mail, pony->script, object);
+        logx(0, opt, logtxt);
+        return -1;
+    }
+
+    off_t mark = lseek(d->body, 0, SEEK_END);    // where to cut back to on failure
+    headerLen = snprintf(header, sizeof(header),
+                         "\n======== %d: %s\n%s %s mask %#.8x status %d\n\n",
+                         d->events + 1, object, stamp, pony->script, mask, status);
+    if (write(d->body, header, headerLen) != headerLen) goto failed;
+
+    if (fromFd >= 0) {
+        added = relayFile(fromFd, d->body);
+        if (added < 0) goto failed;
+    } else {
+        if (write(d->body, text, textLen) != (ssize_t) textLen) goto failed;
+        added = textLen;
+    }
+
+    if (d->events == 0) d->opened = now;
+    d->events++;
+    d->bytes += added;
+    summaryAdd(d, "%4d  %s  status %-3d %8lld bytes  %s\n",
+               d->events, stamp, status, added, object);
+
+    if ((d->events >= opt.digestCount) || (d->bytes >= opt.digestBytes)) {
+        for (i = 0; digests[i] != d; i++);
+        digestDetach(i);
+        full = d;
+    }
+    pthread_mutex_unlock(&digestLock);
+
+    if (full != NULL) digestSend(opt, full);
+    return 0;
+
+failed:
+    if (ftruncate(d->body, mark) == 0) lseek(d->body, mark, SEEK_SET);
+    pthread_mutex_unlock(&digestLock);
+    sprintf(logtxt, "unable to add output of %s on %s to digest for %s: %s",
+            pony->script, object, pony->mail, strerror(errno));
+    logx(0, opt, logtxt);
+    return -1;
+}
+
+static void digestForkPrepare(void) {
+    pthread_mutex_lock(&digestLock);
+}
+
+static void digestForkDone(void) {
+    pthread_mutex_unlock(&digestLock);
+}
+
+// digestLock is held across fork(), see main()
+void digestForkSafe(void) {
+    pthread_atfork(digestForkPrepare, digestForkDone, digestForkDone);
+}
+
+// milliseconds until the oldest digest is due, -1 if there are none
+int digestTimeout(opts_t opt, time_t now) {
+    long wait = -1, due;
+    int i;
+
+    pthread_mutex_lock(&digestLock);
+    for (i = 0; i < digestsOpen; i++) {
+        if (digests[i]->events == 0) continue;
+        due = digests[i]->opened + opt.digestSeconds;
+        due = (due > now) ? (due - now) * 1000 : 0;
+        if ((wait < 0) || (due < wait)) wait = due;
+    }
+    pthread_mutex_unlock(&digestLock);
+    return (int) wait;
+}
+
+// send every digest that has waited long enough, or all of them if forced
+void digestFlush(opts_t opt, int force) {
+    time_t now = time(NULL);
+    digest_t *d;
+    int i;
+
+    for (;;) {
+        d = NULL;
+        pthread_mutex_lock(&digestLock);
+        for (i = 0; i < digestsOpen; i++) {
+            if ((digests[i]->events != 0) &&
+                (force || (digests[i]->opened + opt.digestSeconds <= now))) {
+                d = digests[i];
+                digestDetach(i);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&digestLock);
+        if (d == NULL) return;
+        digestSend(opt, d);
+    }
+}
@@ -0,0 +1,182 @@
+/*
+
+  The flight recorder, a fixed ring of the last few thousand
+  things the daemon saw and decided: events read, filtered,
+  coalesced, held, queued for a worker, scripts spawned and
+  exited, retries scheduled and mail delivered.  It is always
+  on and costs a clock read, one atomic add and a 64 byte
+  store a record, so unlike -v it can be left running in
+  production and still say what happened just before things
+  went wrong.
+
+  A record holds a trick number rather than a path, and only
+  the tail of an event's name, so list on the control socket
+  is handy for turning numbers back into paths.
+
+  The ring is dumped as text on SIGUSR1 and on a fatal logx()
+  into the spool directory, as flight.YYYYMMDD-HHMMSS, and
+  straight to whoever asks with the control socket's flight
+  command.
+
+  Any thread may record.  Each claims a slot by bumping the
+  head and stamps it with a sequence number once it is
+  written, the way the log ring in gidgetlog.c does, so a
+  dump can skip a slot that is being overwritten under it.
+  Event children have a copy of the ring of their own, which
+  is never dumped.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <stdatomic.h>
+
+#define FLIGHT_RECORDS 8192      // a power of two, 512 KiB of ring
+#define FLIGHT_NAME_LEN 26       // tail of the name kept, with its terminator
+
+  typedef struct {
+      atomic_uint_fast64_t seq;   // slot number plus one once written, 0 while writing
+      int64_t stamp;        // wall clock ns
+      int64_t value;        // what it means depends on the kind
+      int32_t trick;        // -1 for none
+      uint32_t mask;
+      int32_t pid;
+      uint8_t kind;
+      uint8_t cut;          // name lost its head
+      char name[FLIGHT_NAME_LEN];
+  } flight_t;
+
+  static flight_t ring[FLIGHT_RECORDS];
+  static atomic_uint_fast64_t head;
+  static pid_t recorderPid = 0;    // the daemon, the only process that dumps
+
+// names in FLIGHT_ order, and what value holds for each
+  static const struct {
+      const char *name, *value;
+  } kindInfo[FLIGHT_KINDS] = {
+      { "read", NULL },
+      { "dropped", NULL },
+      { "filtered", NULL },
+      { "coalesced", "retries" },
+      { "held", "held" },
+      { "queued", NULL },
+      { "spawned", "attempt" },
+      { "skipped", NULL },
+      { "exited", "status" },
+      { "retry", "delay" },
+      { "mailed", "bytes" },
+      { "mailfail", "attempts" },
+  };
+
+// Note one thing that happened.  name may be NULL, and only its last
+// few characters are kept
+void flightRecord(int kind, int32_t trick, uint32_t mask, pid_t pid, int64_t value,
+                  const char *name) {
+    uint64_t slot = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    flight_t *f = &ring[slot & (FLIGHT_RECORDS - 1)];
+    struct timespec now;
+    size_t len;
+
+    atomic_store_explicit(&f->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &now);
+    f->stamp = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    f->value = value;
+    f->trick = trick;
+    f->mask = mask;
+    f->pid = pid;
+    f->kind = kind;
+    if (name == NULL) name = "";
+    len = strlen(name);
+    f->cut = (len >= FLIGHT_NAME_LEN);
+    if (f->cut) name += len - (FLIGHT_NAME_LEN - 1);
+    strncpy(f->name, name, FLIGHT_NAME_LEN - 1);
+    f->name[FLIGHT_NAME_LEN - 1] = '\0';
+    atomic_store_explicit(&f->seq, slot + 1, memory_order_release);
+}
+
+// from now on this process is the daemon, whose ring is worth dumping
+void flightStart(void) {
+    recorderPid = getpid();
+}
+
+// Write the ring out as text, oldest first.  Returns the number of
+// records written
+int flightDump(FILE *out) {
+    uint64_t last = atomic_load_explicit(&head, memory_order_acquire), slot;
+    flight_t copy, *f;
+    char stamp[32];
+    time_t seconds;
+    struct tm tm;
+    int count = 0;
+
+    slot = (last > FLIGHT_RECORDS) ? last - FLIGHT_RECORDS : 0;
+    for (; slot < last; slot++) {
+        f = &ring[slot & (FLIGHT_RECORDS - 1)];
+        if (atomic_load_explicit(&f->seq, memory_order_acquire) != slot + 1) continue;
+        memcpy(&copy, f, sizeof(copy));
+        atomic_thread_fence(memory_order_acquire);
+        if ((atomic_load_explicit(&f->seq, memory_order_relaxed) != slot + 1) ||
+            (copy.kind >= FLIGHT_KINDS)) {
+            continue;       // overwritten while we looked
+        }
+
+        seconds = copy.stamp / 1000000000;
+        strftime(stamp, sizeof(stamp), "%F %T", logTime(seconds, 1, &tm));
+        fprintf(out, "%s.%06ld %-9s trick %d", stamp,
+                (long) (copy.stamp % 1000000000) / 1000, kindInfo[copy.kind].name, copy.trick);
+        if (copy.mask != 0) fprintf(out, " mask %#.8x", copy.mask);
+        if (copy.pid != 0) fprintf(out, " pid %d", copy.pid);
+        if (kindInfo[copy.kind].value != NULL) {
+            fprintf(out, " %s %lld", kindInfo[copy.kind].value, (long long) copy.value);
+        }
+        if (copy.name[0] != '\0') {
+            fprintf(out, " %s%s", copy.cut ? "..." : "", copy.name);
+        }
+        fputc('\n', out);
+        count++;
+    }
+    return count;
+}
+
+// Dump the ring into a fresh file in the spool directory, whose name is
+// left in path (MAX_SPOOL_NAME_LEN + 32 bytes).  Returns the number of
+// records written, or -1 with errno set
+int flightSave(opts_t opt, char *path) {
+    char stamp[20];
+    time_t now = time(NULL);
+    struct tm tm;
+    FILE *out;
+    int handle, count;
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", logTime(now, 1, &tm));
+    sprintf(path, "%s/flight.%s", opt.spooldir, stamp);
+    if ((handle = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) < 0) return -1;
+    if ((out = fdopen(handle, "w")) == NULL) {
+        close(handle);
+        return -1;
+    }
+    count = flightDump(out);
+    if (fclose(out) != 0) return -1;
+    return count;
+}
+
+// The daemon is about to die of a fatal logx(): leave the ring behind,
+// and say where, straight to stderr like the fatal line itself
+void flightFatal(opts_t opt) {
+    char path[MAX_SPOOL_NAME_LEN + 32];
+    char line[MAX_ERR_TEXT_LEN];
+    int count, len;
+
+    if ((recorderPid == 0) || (getpid() != recorderPid) || (atomic_load(&head) == 0)) return;
+    recorderPid = 0;        // once is plenty, whatever else goes wrong
+    count = flightSave(opt, path);
+    if (count < 0) {
+        len = snprintf(line, sizeof(line), "gidget[%d]: unable to save flight recorder to %s: %s\n",
+                       (int) getpid(), path, strerror(errno));
+    } else {
+        len = snprintf(line, sizeof(line), "gidget[%d]: flight recorder, %d records, saved to %s\n",
+                       (int) getpid(), count, path);
+    }
+    if (len >= (int) sizeof(line)) len = sizeof(line) - 1;
+    logPost(opt, 1, line, len);
+}
@@ -0,0 +1,312 @@
+/*
+
+  Content fingerprints and the path -> hash LRU used to
+  skip executions when a file's bytes have not changed.
+
+*/
+
+#include "gidget.h"              // stdio and friends
+#include "gidgethash.h"
+#include <sys/mman.h>            // mmap, madvise
+#include <sys/stat.h>            // fstat
+#include <pthread.h>             // native tricks share the LRU
+
+// XXH64 magic numbers, all of them prime
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// memcpy keeps unaligned loads legal, the compiler turns it into a mov
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t val) {
+    acc ^= hashRound(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void gigHashInit(gigHashState_t *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+// the inner loop chews 32 byte stripes, one 8 byte word per lane,
+// and the lanes never depend on each other until the very end
+void gigHashUpdate(gigHashState_t *state, const void *input, size_t len) {
+    const unsigned char *p = input;
+    const unsigned char *end = p + len;
+    uint64_t v0, v1, v2, v3;
+
+    state->total += len;
+
+    if (state->memSize + len < 32) {
+        memcpy(state->mem + state->memSize, p, len);
+        state->memSize += len;
+        return;
+    }
+
+    if (state->memSize) {
+        memcpy(state->mem + state->memSize, p, 32 - state->memSize);
+        p += 32 - state->memSize;
+        state->v[0] = hashRound(state->v[0], read64(state->mem));
+        state->v[1] = hashRound(state->v[1], read64(state->mem + 8));
+        state->v[2] = hashRound(state->v[2], read64(state->mem + 16));
+        state->v[3] = hashRound(state->v[3], read64(state->mem + 24));
+        state->memSize = 0;
+    }
+
+    v0 = state->v[0];
+    v1 = state->v[1];
+    v2 = state->v[2];
+    v3 = state->v[3];
+    while (p + 32 <= end) {
+        v0 = hashRound(v0, read64(p));
+        v1 = hashRound(v1, read64(p + 8));
+        v2 = hashRound(v2, read64(p + 16));
+        v3 = hashRound(v3, read64(p + 24));
+        p += 32;
+    }
+    state->v[0] = v0;
+    state->v[1] = v1;
+    state->v[2] = v2;
+    state->v[3] = v3;
+
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->memSize = end - p;
+    }
+}
+
+uint64_t gigHashFinal(const gigHashState_t *state) {
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memSize;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+            rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        h = hashMerge(h, state->v[0]);
+        h = hashMerge(h, state->v[1]);
+        h = hashMerge(h, state->v[2]);
+        h = hashMerge(h, state->v[3]);
+    } else {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->total;
+
+    while (p + 8 <= end) {
+        h ^= hashRound(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+// avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t gigHashBytes(const void *input, size_t len, uint64_t seed) {
+    gigHashState_t state;
+    gigHashInit(&state, seed);
+    gigHashUpdate(&state, input, len);
+    return gigHashFinal(&state);
+}
+
+// Fingerprint a whole file.  Only regular files are hashed: symlinks
+// aren't followed (ELOOP) and FIFOs or devices are refused (EINVAL)
+// without ever blocking in open.  With map set the file is mapped and
+// hashed in one pass, which is only safe in an event child, since a
+// file truncated under the mapping raises SIGBUS; the daemon's workers
+// pass 0.  Anything not mapped is read with pread in big chunks.
+// Returns 0 on success, -1 with errno set on failure.
+
+int gigHashFile(const char *path, uint64_t *hash, int map) {
+    gigHashState_t state;
+    struct stat sb;
+    int fd, saveErrno;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOATIME);
+    if ((fd < 0) && (errno == EPERM)) {
+        // O_NOATIME needs ownership
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &sb) < 0) goto failed;
+    if (!S_ISREG(sb.st_mode)) {
+        errno = EINVAL;
+        goto failed;
+    }
+
+    gigHashInit(&state, 0);
+
+    if (map && (sb.st_size > 0)) {
+        void *mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, sb.st_size, MADV_SEQUENTIAL);
+            gigHashUpdate(&state, mapped, sb.st_size);
+            munmap(mapped, sb.st_size);
+            close(fd);
+            *hash = gigHashFinal(&state);
+            return 0;
+        }
+    }
+
+    char *chunk = malloc(FINGERPRINT_CHUNK);
+    if (chunk == NULL) goto failed;
+    off_t offset = 0;
+    ssize_t got;
+    while ((got = pread(fd, chunk, FINGERPRINT_CHUNK, offset)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(chunk);
+            goto failed;
+        }
+        gigHashUpdate(&state, chunk, got);
+        offset += got;
+    }
+    free(chunk);
+    close(fd);
+    *hash = gigHashFinal(&state);
+    return 0;
+
+failed:
+    saveErrno = errno;
+    close(fd);
+    errno = saveErrno;
+    return -1;
+}
+
+/*
+    The LRU is a fixed array of slots threaded onto a doubly linked
+    recency list, with a chained hash index on top.  Links are slot
+    numbers plus one so that a zeroed array is an empty table and
+    no initialization is needed.  When the table is full the least
+    recently used fingerprint gets evicted, which only costs us a
+    redundant script run if that file ever shows up again.  Native
+    tricks use the table from worker threads, hence the lock.
+*/
+
+  typedef struct {
+      uint64_t key;
+      uint64_t hash;
+      uint32_t newer, older;     // recency list
+      uint32_t chain;            // next slot in the same bucket
+  } fingerprint_t;
+
+  static fingerprint_t slot[FINGERPRINT_SLOTS + 1];  // slot[0] is never used
+  static uint32_t bucket[FINGERPRINT_SLOTS];
+  static uint32_t newest = 0, oldest = 0, slotsUsed = 0;
+  static pthread_mutex_t fingerprintLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t fingerprintFind(uint64_t key) {
+    uint32_t s = bucket[key % FINGERPRINT_SLOTS];
+    while ((s != 0) && (slot[s].key != key)) s = slot[s].chain;
+    return s;
+}
+
+static void fingerprintUnlink(uint32_t s) {
+    if (slot[s].newer) slot[slot[s].newer].older = slot[s].older;
+    else newest = slot[s].older;
+    if (slot[s].older) slot[slot[s].older].newer = slot[s].newer;
+    else oldest = slot[s].newer;
+    slot[s].newer = slot[s].older = 0;
+}
+
+static void fingerprintPushNewest(uint32_t s) {
+    slot[s].older = newest;
+    slot[s].newer = 0;
+    if (newest) slot[newest].newer = s;
+    newest = s;
+    if (oldest == 0) oldest = s;
+}
+
+void fingerprintRemember(uint64_t key, uint64_t hash) {
+    pthread_mutex_lock(&fingerprintLock);
+    uint32_t s = fingerprintFind(key);
+
+    if (s != 0) {
+        slot[s].hash = hash;
+        fingerprintUnlink(s);
+        fingerprintPushNewest(s);
+        pthread_mutex_unlock(&fingerprintLock);
+        return;
+    }
+
+    if (slotsUsed < FINGERPRINT_SLOTS) {
+        s = ++slotsUsed;
+    } else {
+    // recycle the oldest slot, which means pulling it off its chain too
+        s = oldest;
+        fingerprintUnlink(s);
+        uint32_t *link = &bucket[slot[s].key % FINGERPRINT_SLOTS];
+        while (*link != s) link = &slot[*link].chain;
+        *link = slot[s].chain;
+    }
+
+    slot[s].key = key;
+    slot[s].hash = hash;
+    slot[s].chain = bucket[key % FINGERPRINT_SLOTS];
+    bucket[key % FINGERPRINT_SLOTS] = s;
+    fingerprintPushNewest(s);
+    pthread_mutex_unlock(&fingerprintLock);
+}
+
+int fingerprintMatches(uint64_t key, uint64_t hash) {
+    pthread_mutex_lock(&fingerprintLock);
+    uint32_t s = fingerprintFind(key);
+    int matched = ((s != 0) && (slot[s].hash == hash));
+    pthread_mutex_unlock(&fingerprintLock);
+    return matched;
+}
+
+static void fingerprintForkPrepare(void) {
+    pthread_mutex_lock(&fingerprintLock);
+}
+
+static void fingerprintForkDone(void) {
+    pthread_mutex_unlock(&fingerprintLock);
+}
+
+// fingerprintLock is held across fork(), see main()
+void fingerprintForkSafe(void) {
+    pthread_atfork(fingerprintForkPrepare, fingerprintForkDone, fingerprintForkDone);
+}
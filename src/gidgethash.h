@@ -0,0 +1,53 @@
+/*
+
+    Content fingerprinting for gidget tricks.
+
+    touch, rsync metadata refreshes and re-uploads of
+    identical files all look exactly like real work to
+    inotify.  A trick with the "hash" option has the
+    triggering file fingerprinted before its script is
+    run, and if the bytes are the same as the last time
+    the script ran successfully the execution is skipped.
+
+    The hash is the XXH64 algorithm by Yann Collet: four
+    independent 64 bit lanes that compilers happily keep
+    in registers (or vector registers), which is plenty
+    fast enough to keep up with the disk.  It is NOT a
+    cryptographic hash, don't use it as one.
+
+*/
+
+// simple inclusion guard
+#ifndef _GIG_HASH
+
+# define _GIG_HASH
+
+# include <stdint.h>
+# include <stddef.h>
+
+// number of path -> hash pairs remembered by the daemon
+# define FINGERPRINT_SLOTS 4096
+
+// files are read in chunks this big when they aren't mmap'd
+# define FINGERPRINT_CHUNK (1024 * 1024)
+
+  typedef struct {
+      uint64_t v[4];             // the four lanes
+      uint64_t total;            // bytes hashed so far
+      unsigned char mem[32];     // partial stripe carried between updates
+      uint32_t memSize;
+      uint64_t seed;
+  } gigHashState_t;
+
+  void gigHashInit(gigHashState_t *state, uint64_t seed);
+  void gigHashUpdate(gigHashState_t *state, const void *input, size_t len);
+  uint64_t gigHashFinal(const gigHashState_t *state);
+  uint64_t gigHashBytes(const void *input, size_t len, uint64_t seed);
+  int gigHashFile(const char *path, uint64_t *hash, int map);
+
+// the fingerprint LRU maps a (trick, path) key to a content hash
+  void fingerprintRemember(uint64_t key, uint64_t hash);
+  int fingerprintMatches(uint64_t key, uint64_t hash);
+  void fingerprintForkSafe(void);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+
+  The in-flight table: one entry per event child the daemon
+  has forked and not yet heard back from, keyed by pid.
+
+  Open addressing with linear probing, and deletion by
+  shifting later entries back so there are never any
+  tombstones to trip over.  The table doubles when half full.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+
+  static inflight_t *table = NULL;
+  static unsigned int tableSize = 0, tableUsed = 0;
+
+static unsigned int inflightHome(pid_t pid) {
+    return ((uint32_t) pid * 2654435761u) & (tableSize - 1);
+}
+
+static int inflightGrow(void) {
+    inflight_t *old = table;
+    unsigned int oldSize = tableSize, i, j;
+
+    tableSize = tableSize ? tableSize * 2 : 256;
+    table = calloc(tableSize, sizeof(inflight_t));
+    if (table == NULL) {
+        table = old;
+        tableSize = oldSize;
+        return -1;
+    }
+    for (i = 0; i < oldSize; i++) {
+        if (old[i].pid == 0) continue;
+        for (j = inflightHome(old[i].pid); table[j].pid != 0; j = (j + 1) & (tableSize - 1));
+        table[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// remember a freshly forked event child.  Returns its entry, for the
+// caller to fill in the times, or NULL if out of memory
+inflight_t *inflightAdd(pid_t pid, int32_t trick, const event_t *event, int attempt) {
+    unsigned int i;
+    size_t nameLen = (event->len != 0) ? strlen(event->name) : 0;
+
+    if (((tableUsed + 1) * 2 > tableSize) && (inflightGrow() < 0)) return NULL;
+
+    char *name = malloc(nameLen + 1);
+    if (name == NULL) return NULL;
+    memcpy(name, event->name, nameLen);
+    name[nameLen] = '\0';
+
+    for (i = inflightHome(pid); table[i].pid != 0; i = (i + 1) & (tableSize - 1));
+    table[i].pid = pid;
+    table[i].trick = trick;
+    table[i].mask = event->mask;
+    table[i].cookie = event->cookie;
+    table[i].attempt = attempt;
+    table[i].started = time(NULL);
+    table[i].received = table[i].receivedMono = table[i].dispatched = 0;
+    table[i].name = name;
+    tableUsed++;
+    return &table[i];
+}
+
+inflight_t *inflightFind(pid_t pid) {
+    unsigned int i;
+
+    if (tableSize == 0) return NULL;
+    for (i = inflightHome(pid); table[i].pid != 0; i = (i + 1) & (tableSize - 1)) {
+        if (table[i].pid == pid) return &table[i];
+    }
+    return NULL;
+}
+
+void inflightRemove(inflight_t *gone) {
+    unsigned int i = gone - table, j, home;
+
+    free(gone->name);
+    memset(gone, 0, sizeof(*gone));
+    tableUsed--;
+
+// pull back anything that probed past the hole we just made
+    for (j = (i + 1) & (tableSize - 1); table[j].pid != 0; j = (j + 1) & (tableSize - 1)) {
+        home = inflightHome(table[j].pid);
+        if (((j - home) & (tableSize - 1)) >= ((j - i) & (tableSize - 1))) {
+            table[i] = table[j];
+            memset(&table[j], 0, sizeof(table[j]));
+            i = j;
+        }
+    }
+}
+
+// Children normally report on their way out, but SIGKILL and friends
+// don't leave time for that.  Log and forget anything that has been
+// running for a while and is no longer alive.  Returns how many.
+int inflightSweep(opts_t opt, trick_t **trickHeap, time_t olderThan) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    unsigned int i = 0;
+    int count = 0;
+
+    while (i < tableSize) {
+        if ((table[i].pid != 0) && (table[i].started < olderThan) &&
+            (kill(table[i].pid, 0) < 0) && (errno == ESRCH)) {
+            sprintf(logtxt, "event child %d running %s for %s/%s vanished without reporting",
+                    table[i].pid, trickHeap[table[i].trick]->script,
+                    trickHeap[table[i].trick]->fileName, table[i].name);
+            logx(0, opt, logtxt);
+            auditChild(opt, trickHeap, &table[i], NULL, "vanished");
+            sprintf(logtxt, "%s/output.%d", opt.spooldir, table[i].pid);
+            unlink(logtxt);     // any output it spooled will never be sent
+            inflightRemove(&table[i]);
+            count++;
+            continue;   // something may have shifted into slot i
+        }
+        i++;
+    }
+    return count;
+}
+
+int inflightCount(void) {
+    return tableUsed;
+}
+
+// Walk the table: start cursor at 0 and call until NULL.  Nothing
+// may be added or removed along the way
+inflight_t *inflightNext(unsigned int *cursor) {
+    inflight_t *entry;
+
+    while (*cursor < tableSize) {
+        entry = &table[(*cursor)++];
+        if (entry->pid != 0) return entry;
+    }
+    return NULL;
+}
+
+// mark in busy every trick with a child still to report back
+void inflightBusy(char *busy, int32_t trickCount) {
+    unsigned int i;
+
+    for (i = 0; i < tableSize; i++) {
+        if ((table[i].pid != 0) && (table[i].trick < trickCount)) busy[table[i].trick] = 1;
+    }
+}
@@ -0,0 +1,263 @@
+/*
+
+  Latency histograms, kept per trick.  Every event passes
+  through up to five moments: read from inotify or the
+  poller, dequeued (forked off, or picked up by a worker
+  thread), the script forked, the script exec'd, and the
+  script exited.  The intervals between them go into
+  histograms of their own:
+
+      queue    read to dequeued
+      spawn    dequeued to the script forked
+      exec     forked to exec'd, mostly setuid and friends
+      run      exec'd to exited
+      start    read to exec'd, how long a file waits for its handler
+      total    read to exited
+
+  Native tricks have no fork and no exec, so they skip spawn
+  and exec, and their start is when the handler was called.
+
+  The histograms are log bucketed in the manner of HDR
+  histograms: four buckets to every power of two of
+  microseconds, so a bucket is never more than a quarter
+  wider than the values in it, from a microsecond to a bit
+  over an hour, with anything longer in the top bucket.
+  That makes 124 counts for each stage, about 3 KiB for a
+  trick, allocated the first time one of its events is
+  recorded.  A trick number stands for the same path until
+  a reload removes the trick and nothing is left that refers
+  to it, when its histograms are thrown away and the number
+  may go to a new trick, see configReclaim().  Readers copy
+  what they need under a lock only they and latencyForget()
+  take, so recording never waits for it.
+
+  Recording is a handful of relaxed atomic adds, because a
+  native trick can finish on several worker threads at once.
+  Quantiles are worked out by whoever asks, the metrics
+  thread or a SIGUSR1 dump, from counts that may be moving
+  underneath it, which can leave them one event stale.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <stdatomic.h>           // counts, read while they are counted
+#include <pthread.h>             // readers against forgetting
+
+#define LATENCY_SUB_BITS 2       // four buckets to each power of two
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_TOP_BIT 31       // 2^32 microseconds, a little over an hour
+#define LATENCY_BUCKETS ((LATENCY_TOP_BIT - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+#define LATENCY_CHUNK 1024       // tricks to a chunk of the table
+#define LATENCY_CHUNKS 1024      // so a million tricks, the rest go unrecorded
+
+  typedef struct {
+      _Atomic uint32_t bucket[LATENCY_BUCKETS];
+      atomic_uint_fast64_t sum;   // microseconds
+      atomic_uint_fast64_t max;
+  } histogram_t;
+
+  typedef struct {
+      char *path;
+      histogram_t stage[LATENCY_STAGES];
+  } tracked_t;
+
+  typedef _Atomic(tracked_t *) trackedChunk_t[LATENCY_CHUNK];
+
+  static _Atomic(trackedChunk_t *) chunks[LATENCY_CHUNKS];
+  static atomic_int trackedCount;     // highest trick index recorded, plus one
+  static pthread_mutex_t forgetLock = PTHREAD_MUTEX_INITIALIZER;
+
+// stage names in LATENCY_ order, and where each one starts and ends
+  static const struct {
+      const char *name;
+      int from, to;
+  } stageInfo[LATENCY_STAGES] = {
+      { "queue", STAMP_READ, STAMP_DEQUEUE },
+      { "spawn", STAMP_DEQUEUE, STAMP_SPAWN },
+      { "exec", STAMP_SPAWN, STAMP_EXEC },
+      { "run", STAMP_EXEC, STAMP_EXIT },
+      { "start", STAMP_READ, STAMP_EXEC },
+      { "total", STAMP_READ, STAMP_EXIT },
+  };
+
+  static const double quantiles[LATENCY_QUANTILES] = { 0.5, 0.9, 0.99, 0.999 };
+
+// the bucket a value falls in: small values have one each, after
+// that every power of two is split LATENCY_SUB ways
+static int latencyBucket(uint64_t usec) {
+    int bits;
+
+    if (usec < LATENCY_SUB) return (int) usec;
+    bits = 63 - __builtin_clzll(usec);
+    if (bits > LATENCY_TOP_BIT) return LATENCY_BUCKETS - 1;
+    return ((bits - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+           (int) ((usec >> (bits - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// the largest value that lands in a bucket
+static uint64_t latencyTop(int bucket) {
+    int octave = bucket >> LATENCY_SUB_BITS;
+
+    if (bucket < LATENCY_SUB) return (uint64_t) bucket;
+    return (((uint64_t) (LATENCY_SUB + (bucket & (LATENCY_SUB - 1))) << (octave - 1)) +
+            ((uint64_t) 1 << (octave - 1)) - 1);
+}
+
+// a trick's histograms, made on first use if make is set.  NULL if
+// there are none yet, or no memory for them
+static tracked_t *latencyTracked(int32_t trick, const char *path, int make) {
+    trackedChunk_t *chunk, *fresh;
+    tracked_t *tracked, *made;
+    int count;
+
+    if ((trick < 0) || (trick >= LATENCY_CHUNK * LATENCY_CHUNKS)) return NULL;
+    chunk = atomic_load_explicit(&chunks[trick / LATENCY_CHUNK], memory_order_acquire);
+    if (chunk == NULL) {
+        if (!make) return NULL;
+        if ((fresh = calloc(1, sizeof(trackedChunk_t))) == NULL) return NULL;
+        chunk = NULL;
+        if (atomic_compare_exchange_strong(&chunks[trick / LATENCY_CHUNK], &chunk, fresh)) {
+            chunk = fresh;
+        } else {
+            free(fresh);        // another thread got there first, chunk is theirs
+        }
+    }
+    tracked = atomic_load_explicit(&(*chunk)[trick % LATENCY_CHUNK], memory_order_acquire);
+    if ((tracked != NULL) || !make) return tracked;
+
+    if ((made = calloc(1, sizeof(tracked_t))) == NULL) return NULL;
+    if ((made->path = strdup(path)) == NULL) {
+        free(made);
+        return NULL;
+    }
+    if (atomic_compare_exchange_strong(&(*chunk)[trick % LATENCY_CHUNK], &tracked, made)) {
+        tracked = made;
+        count = atomic_load(&trackedCount);
+        while ((count <= trick) &&
+               !atomic_compare_exchange_weak(&trackedCount, &count, trick + 1));
+    } else {
+        free(made->path);
+        free(made);
+    }
+    return tracked;
+}
+
+// Record one event of a trick from its STAMP_ moments, CLOCK_MONOTONIC
+// nanoseconds with 0 for any it never reached.  path is the trick's
+// watched path, copied the first time round
+void latencyRecord(int32_t trick, const char *path, const int64_t stamps[STAMPS]) {
+    tracked_t *tracked;
+    histogram_t *h;
+    uint64_t usec, max;
+    int stage;
+
+    if ((tracked = latencyTracked(trick, path, 1)) == NULL) return;
+    for (stage = 0; stage < LATENCY_STAGES; stage++) {
+        if ((stamps[stageInfo[stage].from] == 0) || (stamps[stageInfo[stage].to] == 0) ||
+            (stamps[stageInfo[stage].to] < stamps[stageInfo[stage].from])) {
+            continue;
+        }
+        usec = (stamps[stageInfo[stage].to] - stamps[stageInfo[stage].from]) / 1000;
+        h = &tracked->stage[stage];
+        atomic_fetch_add_explicit(&h->bucket[latencyBucket(usec)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+        max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        while ((usec > max) &&
+               !atomic_compare_exchange_weak_explicit(&h->max, &max, usec,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed));
+    }
+}
+
+// the number of trick indexes worth asking latencyStats() about
+int latencyTricks(void) {
+    return atomic_load(&trackedCount);
+}
+
+// a stage's name, as it appears in metrics and dumps
+const char *latencyStage(int stage) {
+    return stageInfo[stage].name;
+}
+
+// Fill in stats for one stage of a trick, and copy the trick's path
+// into path, if it isn't NULL.  Returns the number of events recorded,
+// 0 if there are none
+uint64_t latencyStats(int32_t trick, int stage, latency_t *stats, char *path, size_t pathSize) {
+    tracked_t *tracked;
+    histogram_t *h;
+    uint64_t counts[LATENCY_BUCKETS], seen, rank;
+    int b, q;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&forgetLock);
+    if ((tracked = latencyTracked(trick, NULL, 0)) == NULL) {
+        pthread_mutex_unlock(&forgetLock);
+        return 0;
+    }
+    h = &tracked->stage[stage];
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        counts[b] = atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+        stats->count += counts[b];
+    }
+    stats->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    stats->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    if (path != NULL) snprintf(path, pathSize, "%s", tracked->path);
+    pthread_mutex_unlock(&forgetLock);
+    if (stats->count == 0) return 0;
+
+// each quantile is the top of the bucket holding it, so never an
+// underestimate, but no more than the largest value seen
+    for (q = 0, b = 0, seen = 0; q < LATENCY_QUANTILES; q++) {
+        rank = (uint64_t) (quantiles[q] * stats->count + 0.999999);
+        if (rank == 0) rank = 1;
+        while ((b < LATENCY_BUCKETS - 1) && (seen + counts[b] < rank)) seen += counts[b++];
+        stats->quantile[q] = latencyTop(b);
+        if ((stats->quantile[q] > stats->max) || (b == LATENCY_BUCKETS - 1)) {
+            stats->quantile[q] = stats->max;
+        }
+    }
+    return stats->count;
+}
+
+// Throw away a trick's histograms before its number goes to another
+// trick.  Nothing may be recording for it any more
+void latencyForget(int32_t trick) {
+    trackedChunk_t *chunk;
+    tracked_t *tracked;
+
+    if ((trick < 0) || (trick >= LATENCY_CHUNK * LATENCY_CHUNKS)) return;
+    chunk = atomic_load_explicit(&chunks[trick / LATENCY_CHUNK], memory_order_acquire);
+    if (chunk == NULL) return;
+    pthread_mutex_lock(&forgetLock);
+    tracked = atomic_exchange(&(*chunk)[trick % LATENCY_CHUNK], NULL);
+    pthread_mutex_unlock(&forgetLock);
+    if (tracked != NULL) {
+        free(tracked->path);
+        free(tracked);
+    }
+}
+
+// log every trick's latencies, one line to a stage, for SIGUSR1
+void latencyDump(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[PATH_MAX];
+    latency_t stats;
+    int32_t trick, tricks = latencyTricks();
+    int stage, lines = 0;
+
+    for (trick = 0; trick < tricks; trick++) {
+        for (stage = 0; stage < LATENCY_STAGES; stage++) {
+            if (latencyStats(trick, stage, &stats, path, sizeof(path)) == 0) continue;
+            snprintf(logtxt, sizeof(logtxt),
+                     "latency %s %s: %llu events, mean %.3f p50 %.3f p90 %.3f "
+                     "p99 %.3f p99.9 %.3f max %.3f ms",
+                     path, stageInfo[stage].name, (unsigned long long) stats.count,
+                     stats.sum / 1e3 / stats.count,
+                     stats.quantile[0] / 1e3, stats.quantile[1] / 1e3,
+                     stats.quantile[2] / 1e3, stats.quantile[3] / 1e3, stats.max / 1e3);
+            logx(0, opt, logtxt);
+            lines++;
+        }
+    }
+    if (lines == 0) logx(0, opt, "latency: no events recorded yet");
+}
@@ -0,0 +1,512 @@
+/*
+
+  Asynchronous logging for the daemon.  logx() used to
+  fprintf, fflush both streams and call syslog() in the
+  caller, which made logging the most expensive thing the
+  read loop did in verbose mode.  Now logx() formats its
+  line and drops it into a ring; a writer thread takes
+  whatever has piled up and hands it to the kernel with one
+  writev(), then to syslog if that was asked for.
+
+  The ring is a bounded multi-producer queue in the style of
+  Dmitry Vyukov's: each slot carries a sequence number, so
+  producers (the read loop, workers, couriers) claim slots
+  with one compare and swap and never take a lock, and the
+  single consumer needs no atomics beyond reading sequences.
+  A producer that finds the ring full writes its line itself
+  rather than wait or drop it.
+
+  Only the process that called logStart() has a writer, so
+  event children and anything else forked off the daemon
+  write their lines directly, as before.  Fatal messages
+  flush the ring first so they come out last, and the ring
+  is flushed at exit.
+
+  Nothing here may take a lock inside libc, because the read
+  loop forks event children while the writer, workers and
+  couriers carry on, and a child would inherit any such lock
+  held at that instant with nobody left to release it.  So
+  syslog lines go straight to the syslog socket rather than
+  through syslog(), and times are broken down by logTime()
+  with simple arithmetic rather than localtime_r(), which
+  takes the time zone lock.  logTime() uses the offset from
+  UTC that logClock() last got from libc, and only the read
+  loop, the thread that forks, calls that, whenever it wakes.
+
+  Per-event lines are also rate limited, so a storm of events
+  can't turn the log device into the bottleneck.  Each
+  category of line (see RATE_ in gidget.h) has a token bucket,
+  kept as a single "theoretical arrival time" in the style of
+  the generic cell rate algorithm so that one compare and swap
+  takes a token.  The buckets live in a shared mapping made
+  before any event child is forked, so children and daemon
+  draw on the same ones.  Lines that don't make it are
+  counted, and the daemon logs a "suppressed N similar
+  messages" summary every LOG_SUMMARY_SECONDS.  Verbose
+  per-event chatter can additionally be sampled, one event in
+  n, with -L.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <pthread.h>             // the writer thread
+#include <stdatomic.h>           // slot sequences and the ring head
+#include <sys/eventfd.h>         // waking an idle writer
+#include <sys/uio.h>             // writev
+#include <sys/mman.h>            // buckets shared with event children
+#include <sys/socket.h>          // the syslog socket
+#include <sys/un.h>
+#include <paths.h>               // _PATH_LOG
+
+#define LOG_SLOTS 512            // must be a power of two
+#define LOG_BATCH 64             // lines per writev
+#define LOG_FLUSH_MS 2000        // longest a flush waits on the writer
+#define LOG_SUMMARY_SECONDS 10   // how often suppressed lines are owned up to
+#define LOG_CLOCK_SECONDS 60     // how often logClock() asks libc for the UTC offset
+
+  typedef struct {
+      atomic_size_t seq;    // position + 1 once the line is in
+      int len;
+      int syslog;           // priority to pass it on to syslog with, or -1
+      char text[LOG_LINE_LEN];
+  } logSlot_t;
+
+  static logSlot_t ring[LOG_SLOTS];
+  static atomic_size_t ringHead;     // next slot a producer claims
+  static atomic_size_t ringDone;     // lines the writer has finished with
+  static atomic_int writerIdle;      // writer is asleep on the eventfd
+  static size_t ringTail;            // writer only
+  static int wakeHandle = -1;
+  static pid_t ringPid = 0;          // process the writer belongs to
+  static pid_t cachedPid = 0;
+  static int syslogHandle = -1;      // datagram socket to syslogd, with -s
+  static atomic_long clockOffset;    // seconds east of UTC, see logClock()
+  static atomic_int clockDst;
+  static time_t clockChecked = 0;    // read loop only
+
+  typedef struct {
+      atomic_llong due;     // when the bucket will next be full, ns
+      atomic_long suppressed;     // lines refused since the last summary
+  } bucket_t;
+
+  typedef struct {
+      bucket_t bucket[RATE_CATEGORIES];
+      atomic_ulong sampled;       // per-event verbose decisions so far
+  } limits_t;
+
+  static limits_t *limits = NULL;    // shared, NULL until logLimit()
+  static long long rateInterval = 0, rateTolerance;   // ns per token (0, no limit), ns of burst
+  static int sampleEvery = 1;
+  static time_t lastSummary = 0;
+
+  static const char *rateNames[RATE_CATEGORIES] = {
+      "execution", "output", "status", "retry", "native"
+  };
+
+// the pid is looked up once per process, not once per line
+static void logForked(void) {
+    cachedPid = getpid();
+}
+
+pid_t logPid(void) {
+    return (cachedPid != 0) ? cachedPid : getpid();
+}
+
+// Read loop only: ask libc for the offset from UTC once in a while, so
+// a change to or from summer time reaches logTime() within a minute of
+// the loop next waking
+void logClock(void) {
+    time_t now = time(NULL);
+    struct tm local;
+
+    if ((clockChecked != 0) && (now - clockChecked < LOG_CLOCK_SECONDS) &&
+        (now >= clockChecked)) return;
+    if (localtime_r(&now, &local) == NULL) return;
+    atomic_store(&clockOffset, local.tm_gmtoff);
+    atomic_store(&clockDst, local.tm_isdst);
+    clockChecked = now;
+}
+
+// Break a time down like localtime_r(), or gmtime_r() if local is 0,
+// without going near libc's time zone lock.  The civil date comes from
+// days since the epoch in the manner of Howard Hinnant's days_from_civil
+// inverse, counting years from March so February's leap day falls last
+struct tm *logTime(time_t t, int local, struct tm *tm) {
+    long offset = local ? atomic_load(&clockOffset) : 0;
+    long long secs = (long long) t + offset, days, era, doe, yoe, doy, year, mp;
+
+    memset(tm, 0, sizeof(*tm));
+    days = secs / 86400;
+    secs %= 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    tm->tm_hour = secs / 3600;
+    tm->tm_min = (secs / 60) % 60;
+    tm->tm_sec = secs % 60;
+    tm->tm_wday = ((days % 7) + 11) % 7;     // 1970-01-01 was a Thursday
+
+    days += 719468;                          // from 0000-03-01
+    era = ((days >= 0) ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    year = yoe + era * 400 + (mp >= 10);
+    tm->tm_mday = doy - (153 * mp + 2) / 5 + 1;
+    tm->tm_mon = (mp < 10) ? mp + 2 : mp - 10;
+    tm->tm_year = year - 1900;
+    tm->tm_yday = (doy >= 306) ? doy - 306
+                  : doy + 59 + (((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0)));
+    tm->tm_isdst = local ? atomic_load(&clockDst) : 0;
+    tm->tm_gmtoff = offset;
+    return tm;
+}
+
+// "%F %T" for the current second, formatted once a second per thread
+const char *logStamp(void) {
+    static __thread time_t stampSecond = 0;
+    static __thread char stamp[20];
+    time_t now = time(NULL);
+    struct tm fancyTime;
+
+    if (now != stampSecond) {
+        strftime(stamp, sizeof(stamp), "%F %T", logTime(now, 1, &fancyTime));
+        stampSecond = now;
+    }
+    return stamp;
+}
+
+// Connect to syslogd for -s, in place of openlog().  A line is already
+// "gidget[pid]: ...", so it goes out with just a priority and a time in
+// front of it.  Returns 0, or -1 with errno set
+int logSyslogOpen(void) {
+    struct sockaddr_un to;
+    int handle;
+
+    memset(&to, 0, sizeof(to));
+    to.sun_family = AF_UNIX;
+    strncpy(to.sun_path, _PATH_LOG, sizeof(to.sun_path) - 1);
+    if ((handle = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (connect(handle, (struct sockaddr *) &to, sizeof(to)) < 0) {
+        close(handle);
+        return -1;
+    }
+// a reconnect lands on the same descriptor, so a thread sending at the
+// same moment never writes a log line into somebody else's file
+    if (syslogHandle < 0) {
+        syslogHandle = handle;
+    } else {
+        dup2(handle, syslogHandle);
+        close(handle);
+    }
+    return 0;
+}
+
+// pass a line on to syslogd at the given priority, trying a fresh
+// connection once if syslogd has been restarted under us
+static void logSyslog(int level, const char *line, int len) {
+    char datagram[LOG_LINE_LEN + 32];
+    struct tm when;
+    time_t now = time(NULL);
+    int head, tries;
+
+    if (syslogHandle < 0) return;
+    if ((len > 0) && (line[len - 1] == '\n')) len--;
+    head = snprintf(datagram, sizeof(datagram), "<%d>", LOG_DAEMON | (level & LOG_PRIMASK));
+    head += strftime(datagram + head, sizeof(datagram) - head, "%b %e %T ",
+                     logTime(now, 1, &when));
+    if (len > (int) sizeof(datagram) - head) len = sizeof(datagram) - head;
+    memcpy(datagram + head, line, len);
+    for (tries = 0; tries < 2; tries++) {
+        if (send(syslogHandle, datagram, head + len, MSG_NOSIGNAL) >= 0) return;
+        if ((errno != ECONNREFUSED) && (errno != ENOTCONN)) return;
+        if (logSyslogOpen() < 0) return;
+    }
+}
+
+void logSyslogClose(void) {
+    if (syslogHandle >= 0) close(syslogHandle);
+    syslogHandle = -1;
+}
+
+// write a line straight out, as logx() always used to.  level is
+// the syslog priority, or -1 to leave syslog out of it
+static void logDirect(int to, const char *line, int len, int level) {
+    const char *rest = line;
+    int left = len;
+    ssize_t put;
+
+    while (left > 0) {
+        put = write(to, rest, left);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        rest += put;
+        left -= put;
+    }
+    if (level >= 0) logSyslog(level, line, len);
+}
+
+// write out n ready slots starting at the tail
+static void writeBatch(int n) {
+    struct iovec iov[LOG_BATCH];
+    ssize_t put, want = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        logSlot_t *s = &ring[(ringTail + i) & (LOG_SLOTS - 1)];
+        iov[i].iov_base = s->text;
+        iov[i].iov_len = s->len;
+        want += s->len;
+    }
+    do {
+        put = writev(1, iov, n);
+    } while ((put < 0) && (errno == EINTR));
+
+    // a short write is rare enough to finish the slow way
+    for (i = 0; (put >= 0) && (put < want) && (i < n); i++) {
+        if ((size_t) put >= iov[i].iov_len) {
+            put -= iov[i].iov_len;
+            want -= iov[i].iov_len;
+            continue;
+        }
+        logDirect(1, (char *) iov[i].iov_base + put, iov[i].iov_len - put, -1);
+        want -= iov[i].iov_len;
+        put = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        logSlot_t *s = &ring[ringTail & (LOG_SLOTS - 1)];
+        if (s->syslog >= 0) logSyslog(s->syslog, s->text, s->len);
+        atomic_store_explicit(&s->seq, ringTail + LOG_SLOTS, memory_order_release);
+        ringTail++;
+    }
+    atomic_store(&ringDone, ringTail);
+}
+
+// how many slots from the tail are ready to go
+static int ringReady(void) {
+    int n;
+
+    for (n = 0; n < LOG_BATCH; n++) {
+        logSlot_t *s = &ring[(ringTail + n) & (LOG_SLOTS - 1)];
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) != ringTail + n + 1) break;
+    }
+    return n;
+}
+
+static void *logWriter(void *unused) {
+    struct pollfd wake = { .events = POLLIN };
+    uint64_t count;
+    int n;
+
+// the writer never needs to see the daemon's signals, the read loop does
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, NULL);
+
+    wake.fd = wakeHandle;
+    for (;;) {
+        if ((n = ringReady()) > 0) {
+            writeBatch(n);
+            continue;
+        }
+    // say we're going to sleep, then look once more so a line
+    // published in between isn't left waiting for the next one
+        atomic_store(&writerIdle, 1);
+        if ((n = ringReady()) > 0) {
+            atomic_store(&writerIdle, 0);
+            writeBatch(n);
+            continue;
+        }
+        poll(&wake, 1, 1000);
+        if (read(wakeHandle, &count, sizeof(count)) < 0) {
+            // nothing to read after a timeout, that's fine
+        }
+        atomic_store(&writerIdle, 0);
+    }
+    return unused;
+}
+
+static void logWake(void) {
+    uint64_t one = 1;
+
+    if (atomic_load(&writerIdle) && atomic_exchange(&writerIdle, 0)) {
+        if (write(wakeHandle, &one, sizeof(one)) < 0) {
+            // the writer wakes once a second regardless
+        }
+    }
+}
+
+// wait until everything logged so far has been written, or give up
+void logFlush(void) {
+    size_t target;
+    int waited;
+
+    if ((ringPid == 0) || (getpid() != ringPid)) return;
+    target = atomic_load(&ringHead);
+    for (waited = 0; (atomic_load(&ringDone) < target) && (waited < LOG_FLUSH_MS); waited++) {
+        logWake();
+        usleep(1000);
+    }
+}
+
+// Hand a formatted line to the writer, or write it here and now if
+// there is no writer in this process or the ring is full.  Fatal
+// lines (xstatus not 0) go to stderr after everything before them
+void logPost(opts_t opt, int xstatus, const char *line, int len) {
+    size_t pos = atomic_load_explicit(&ringHead, memory_order_relaxed);
+    int level = opt.syslog ? opt.sloglev : -1;
+    logSlot_t *s;
+    intptr_t diff;
+
+    if (xstatus != 0) {
+        logFlush();
+        logDirect(2, line, len, level);
+        return;
+    }
+    if ((ringPid == 0) || (logPid() != ringPid)) {
+        logDirect(1, line, len, level);
+        return;
+    }
+    if (len > LOG_LINE_LEN) len = LOG_LINE_LEN;
+
+    for (;;) {
+        s = &ring[pos & (LOG_SLOTS - 1)];
+        diff = (intptr_t) atomic_load_explicit(&s->seq, memory_order_acquire) - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ringHead, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) break;
+        } else if (diff < 0) {     // full, the writer is behind
+            logDirect(1, line, len, level);
+            return;
+        } else {
+            pos = atomic_load_explicit(&ringHead, memory_order_relaxed);
+        }
+    }
+    memcpy(s->text, line, len);
+    s->len = len;
+    s->syslog = level;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+    logWake();
+}
+
+// Start the writer for this process.  Returns 0, or -1 if logging
+// stays synchronous
+int logStart(void) {
+    pthread_t tid;
+    size_t i;
+
+    cachedPid = getpid();
+    pthread_atfork(NULL, NULL, logForked);
+    logClock();
+
+    for (i = 0; i < LOG_SLOTS; i++) atomic_init(&ring[i].seq, i);
+    atomic_init(&ringHead, 0);
+    atomic_init(&ringDone, 0);
+    ringTail = 0;
+
+    if ((wakeHandle = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) return -1;
+    if (pthread_create(&tid, NULL, logWriter, NULL) != 0) {
+        close(wakeHandle);
+        wakeHandle = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    ringPid = cachedPid;
+    atexit(logFlush);
+    return 0;
+}
+
+// Set up the shared buckets from -L.  Must be called before any event
+// child is forked.  Returns 0, or -1 if lines go unlimited
+int logLimit(opts_t opt) {
+    int i;
+
+    sampleEvery = (opt.logSample > 1) ? opt.logSample : 1;
+    lastSummary = time(NULL);
+    if ((opt.logRate <= 0) && (sampleEvery == 1)) return 0;
+
+    limits = mmap(NULL, sizeof(limits_t), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (limits == MAP_FAILED) {
+        limits = NULL;
+        return -1;
+    }
+    if (opt.logRate > 0) {
+        rateInterval = 1000000000LL / opt.logRate;
+        rateTolerance = rateInterval * ((opt.logBurst > 1) ? opt.logBurst - 1 : 0);
+    }
+    for (i = 0; i < RATE_CATEGORIES; i++) {
+        atomic_init(&limits->bucket[i].due, 0);
+        atomic_init(&limits->bucket[i].suppressed, 0);
+    }
+    atomic_init(&limits->sampled, 0);
+    return 0;
+}
+
+// May a line of this category be written now?  Takes a token if so,
+// counts the line as suppressed if not
+int logRate(int category) {
+    bucket_t *b;
+    long long now, due, next;
+
+    if ((limits == NULL) || (rateInterval == 0) ||
+        (category < 0) || (category >= RATE_CATEGORIES)) return 1;
+    b = &limits->bucket[category];
+    now = auditClock(CLOCK_MONOTONIC);
+    due = atomic_load_explicit(&b->due, memory_order_relaxed);
+    do {
+        next = ((due > now) ? due : now) + rateInterval;
+        if (next - now > rateTolerance + rateInterval) {
+            atomic_fetch_add_explicit(&b->suppressed, 1, memory_order_relaxed);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&b->due, &due, next,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed));
+    return 1;
+}
+
+// Is this event one whose verbose chatter gets logged?  One in -L's n
+int logSampled(void) {
+    if ((limits == NULL) || (sampleEvery <= 1)) return 1;
+    return (atomic_fetch_add_explicit(&limits->sampled, 1, memory_order_relaxed) % sampleEvery) == 0;
+}
+
+// milliseconds until a summary is due, -1 if there's nothing to own up to
+int logTimeout(time_t now) {
+    int i;
+
+    if (limits == NULL) return -1;
+    for (i = 0; i < RATE_CATEGORIES; i++) {
+        if (atomic_load_explicit(&limits->bucket[i].suppressed, memory_order_relaxed) > 0) {
+            return (lastSummary + LOG_SUMMARY_SECONDS > now)
+                   ? (lastSummary + LOG_SUMMARY_SECONDS - now) * 1000 : 0;
+        }
+    }
+    return -1;
+}
+
+// Daemon only: every LOG_SUMMARY_SECONDS, or now if forced, say how
+// many lines of each category were held back
+void logSummary(opts_t opt, int force) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    time_t now = time(NULL);
+    long held;
+    int i;
+
+    if ((limits == NULL) || (!force && (now < lastSummary + LOG_SUMMARY_SECONDS))) return;
+    for (i = 0; i < RATE_CATEGORIES; i++) {
+        held = atomic_exchange_explicit(&limits->bucket[i].suppressed, 0, memory_order_relaxed);
+        if (held == 0) continue;
+        sprintf(logtxt, "suppressed %ld similar messages (%s) in the last %ld seconds",
+                held, rateNames[i], (long) (now - lastSummary));
+        logx(0, opt, logtxt);
+    }
+    lastSummary = now;
+}
@@ -0,0 +1,430 @@
+/*
+
+  Metrics, served in the Prometheus text format on a Unix
+  socket, or a loopback TCP port, named with -m.  Anything
+  that connects gets the lot: an HTTP GET gets it with a
+  response header, so Prometheus can scrape the TCP port
+  directly, and anything that just connects and waits, such
+  as socat or nc on the Unix socket, gets it bare.
+
+  Counters are kept per thread.  Each thread that counts
+  something gets a set of its own the first time it does,
+  and only ever adds to that, so counting is a load and a
+  store with no lock, no compare and swap and no cache line
+  shared with anybody.  A thread of our own answers scrapes,
+  summing every set as it goes, so a scrape never holds up
+  the read loop, a worker or a courier.  Sets live as long
+  as the daemon; threads here never come and go.  Gauges are
+  single values the read loop stores now and then.
+
+  Event children are separate processes, so what they do is
+  counted by the daemon from their completion reports.
+  Per-trick latencies come from gidgetlatency.c, as one
+  Prometheus summary with a trick, path and stage label.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <pthread.h>             // the scrape thread
+#include <stdatomic.h>           // counters, read while they are counted
+#include <stdarg.h>              // building the page
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>          // loopback TCP
+
+#define METRIC_MAX_THREADS 512   // sets handed out, more threads share one
+#define METRIC_BATCH_BUCKETS 10  // events per read, 1 to 512 in powers of two
+#define METRIC_EXIT_CODES 256
+#define METRIC_REQUEST_MS 100    // wait for an HTTP request before answering bare
+#define METRIC_SEND_SECONDS 2    // give up on a scraper that won't read
+
+// every counter, one set per thread
+  enum {
+      METRIC_READ_BITS = METRIC_COUNTERS,
+      METRIC_DISPATCHED_BITS = METRIC_READ_BITS + 32,
+      METRIC_EXITS = METRIC_DISPATCHED_BITS + 32,
+      METRIC_BATCH = METRIC_EXITS + METRIC_EXIT_CODES,
+      METRIC_BATCH_SUM = METRIC_BATCH + METRIC_BATCH_BUCKETS,
+      METRIC_SLOTS
+  };
+
+  typedef struct {
+      _Alignas(64) atomic_uint_fast64_t value[METRIC_SLOTS];
+      int shared;           // the overflow set, added to with atomics
+  } metricSet_t;
+
+  static _Atomic(metricSet_t *) sets[METRIC_MAX_THREADS];
+  static atomic_int setCount;
+  static metricSet_t spare = { .shared = 1 };
+  static __thread metricSet_t *mine = NULL;
+
+  static atomic_int_fast64_t gauges[METRIC_GAUGES];
+
+  static int listener = -1;
+  static int metricsInstance = -1;   // for the watch budget
+  static time_t metricsStarted;
+
+// names and help for the plain counters, in METRIC_ order
+  static const struct {
+      const char *name, *help;
+  } counterInfo[METRIC_COUNTERS] = {
+      { "reads", "Reads of the inotify instance and the poller that returned events" },
+      { "events_filtered", "Events dropped as a trick's own droppings" },
+      { "events_coalesced", "Pending retries made moot by a fresh event" },
+      { "events_queued", "Events handed to the native worker pool" },
+      { "events_dropped", "Events with no trick left to run, or no memory to run it" },
+      { "queue_overflows", "Times the kernel's inotify queue overflowed and lost events" },
+      { "spawns", "Event children forked, retries included" },
+      { "runs_skipped", "Runs skipped because the file's content was unchanged" },
+      { "outputs_lost", "Script outputs that could be neither mailed nor digested" },
+      { "outputs_suppressed", "Script outputs suppressed as repeats within a dedupe window" },
+      { "retries_scheduled", "Failed runs scheduled for another attempt" },
+      { "native_runs", "Native handler runs" },
+      { "native_failures", "Native handler runs that returned non-zero" },
+      { "mail_messages", "Mail messages delivered" },
+      { "mail_bytes", "Bytes of mail delivered" },
+      { "mail_deferred", "Mail deliveries that failed and will be tried again" },
+      { "mail_failed", "Mail messages given up on and moved to the failed directory" },
+  };
+
+  static const struct {
+      const char *name, *help;
+  } gaugeInfo[METRIC_GAUGES] = {
+      { "tricks", "Tricks configured, retired ones included" },
+      { "tricks_polled", "Tricks polled rather than watched" },
+      { "children_inflight", "Event children running" },
+      { "retries_pending", "Retries waiting to come due" },
+      { "mail_queued", "Mail messages waiting for a courier" },
+      { "events_held", "Events held for paused tricks" },
+  };
+
+  static const char *bitNames[32] = {
+      "IN_ACCESS", "IN_MODIFY", "IN_ATTRIB", "IN_CLOSE_WRITE", "IN_CLOSE_NOWRITE",
+      "IN_OPEN", "IN_MOVED_FROM", "IN_MOVED_TO", "IN_CREATE", "IN_DELETE",
+      "IN_DELETE_SELF", "IN_MOVE_SELF", NULL, "IN_UNMOUNT", "IN_Q_OVERFLOW", "IN_IGNORED",
+      [30] = "IN_ISDIR",
+  };
+
+  static const char *quantileNames[LATENCY_QUANTILES] = { "0.5", "0.9", "0.99", "0.999" };
+
+// this thread's set, handed out the first time it counts anything
+static metricSet_t *metricMine(void) {
+    metricSet_t *set;
+    int n;
+
+    if (mine != NULL) return mine;
+    mine = &spare;
+    if ((n = atomic_fetch_add(&setCount, 1)) < METRIC_MAX_THREADS) {
+        if ((set = aligned_alloc(64, sizeof(metricSet_t))) != NULL) {
+            memset(set, 0, sizeof(metricSet_t));
+            atomic_store(&sets[n], set);
+            mine = set;
+        }
+    }
+    return mine;
+}
+
+static void metricBump(int slot, uint64_t n) {
+    metricSet_t *set = metricMine();
+
+    if (set->shared) {
+        atomic_fetch_add_explicit(&set->value[slot], n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&set->value[slot],
+                              atomic_load_explicit(&set->value[slot], memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    }
+}
+
+// count n of something, see METRIC_ in gidget.h
+void metricAdd(int counter, uint64_t n) {
+    metricBump(counter, n);
+}
+
+// count an event read, or dispatched, once for every bit in its mask
+void metricMask(int dispatched, uint32_t mask) {
+    int base = dispatched ? METRIC_DISPATCHED_BITS : METRIC_READ_BITS;
+
+    for (; mask != 0; mask &= mask - 1) metricBump(base + __builtin_ctz(mask), 1);
+}
+
+// count the exit status of a script that ran
+void metricExit(int status) {
+    metricBump(METRIC_EXITS + (status & (METRIC_EXIT_CODES - 1)), 1);
+}
+
+// count how many events one read returned
+void metricBatch(int events) {
+    int bucket = 0;
+
+    while ((bucket < METRIC_BATCH_BUCKETS - 1) && ((1 << bucket) < events)) bucket++;
+    metricBump(METRIC_BATCH + bucket, 1);
+    metricBump(METRIC_BATCH_SUM, events);
+}
+
+void metricGauge(int gauge, int64_t value) {
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+// one slot summed over every set
+static uint64_t metricSum(int slot) {
+    int n = atomic_load(&setCount), i;
+    uint64_t sum = atomic_load_explicit(&spare.value[slot], memory_order_relaxed);
+    metricSet_t *set;
+
+    if (n > METRIC_MAX_THREADS) n = METRIC_MAX_THREADS;
+    for (i = 0; i < n; i++) {
+        if ((set = atomic_load(&sets[i])) != NULL) {
+            sum += atomic_load_explicit(&set->value[slot], memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+// a growing text buffer for a scrape
+  typedef struct {
+      char *text;
+      size_t len, size;
+  } page_t;
+
+static void pageAdd(page_t *page, const char *format, ...) {
+    va_list args;
+    char *grown;
+    int need;
+
+    for (;;) {
+        va_start(args, format);
+        need = vsnprintf(page->text + page->len, page->size - page->len, format, args);
+        va_end(args);
+        if (need < 0) return;
+        if (page->len + need < page->size) break;
+        if ((grown = realloc(page->text, (page->len + need + 1) * 2)) == NULL) return;
+        page->text = grown;
+        page->size = (page->len + need + 1) * 2;
+    }
+    page->len += need;
+}
+
+// a label value, with the backslashes, quotes and newlines a path
+// might hold escaped
+static void pageLabel(page_t *page, const char *value) {
+    char escaped[2 * PATH_MAX + 1];
+    size_t len = 0;
+
+    for (; (*value != '\0') && (len < sizeof(escaped) - 2); value++) {
+        if ((*value == '\\') || (*value == '"')) escaped[len++] = '\\';
+        if (*value == '\n') {
+            escaped[len++] = '\\';
+            escaped[len++] = 'n';
+            continue;
+        }
+        escaped[len++] = *value;
+    }
+    escaped[len] = '\0';
+    pageAdd(page, "%s", escaped);
+}
+
+static void pageHead(page_t *page, const char *name, const char *type, const char *help) {
+    pageAdd(page, "# HELP gidget_%s %s.\n# TYPE gidget_%s %s\n", name, help, name, type);
+}
+
+// everything there is to say, in the Prometheus text format
+static void metricsRender(page_t *page) {
+    budget_t budget;
+    latency_t latency;
+    char path[PATH_MAX];
+    uint64_t value, total;
+    int i, trick, tricks, stage;
+
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        pageHead(page, counterInfo[i].name, "counter", counterInfo[i].help);
+        pageAdd(page, "gidget_%s_total %llu\n", counterInfo[i].name,
+                (unsigned long long) metricSum(i));
+    }
+
+    pageHead(page, "events_read", "counter", "Events read, by mask bit");
+    for (i = 0; i < 32; i++) {
+        if ((bitNames[i] == NULL) || ((value = metricSum(METRIC_READ_BITS + i)) == 0)) continue;
+        pageAdd(page, "gidget_events_read_total{bit=\"%s\"} %llu\n", bitNames[i],
+                (unsigned long long) value);
+    }
+    pageHead(page, "events_dispatched", "counter", "Events that ran a trick, by mask bit");
+    for (i = 0; i < 32; i++) {
+        if ((bitNames[i] == NULL) || ((value = metricSum(METRIC_DISPATCHED_BITS + i)) == 0)) continue;
+        pageAdd(page, "gidget_events_dispatched_total{bit=\"%s\"} %llu\n", bitNames[i],
+                (unsigned long long) value);
+    }
+    pageHead(page, "script_exits", "counter", "Scripts that ran, by exit status");
+    for (i = 0; i < METRIC_EXIT_CODES; i++) {
+        if ((value = metricSum(METRIC_EXITS + i)) == 0) continue;
+        pageAdd(page, "gidget_script_exits_total{code=\"%d\"} %llu\n", i,
+                (unsigned long long) value);
+    }
+
+    pageHead(page, "read_events", "histogram", "Events returned by one read");
+    for (i = total = 0; i < METRIC_BATCH_BUCKETS; i++) {
+        total += metricSum(METRIC_BATCH + i);
+        if (i < METRIC_BATCH_BUCKETS - 1) {
+            pageAdd(page, "gidget_read_events_bucket{le=\"%d\"} %llu\n", 1 << i,
+                    (unsigned long long) total);
+        }
+    }
+    pageAdd(page, "gidget_read_events_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) total);
+    pageAdd(page, "gidget_read_events_sum %llu\n",
+            (unsigned long long) metricSum(METRIC_BATCH_SUM));
+    pageAdd(page, "gidget_read_events_count %llu\n", (unsigned long long) total);
+
+// per-trick latencies, as summaries worked out from the histograms
+    pageHead(page, "latency_seconds", "summary",
+             "Event latency by trick and stage, from the event being read to its handler "
+             "being dispatched (queue), forked (spawn), exec'd (exec, start) and done (run, total)");
+    for (trick = 0, tricks = latencyTricks(); trick < tricks; trick++) {
+        for (stage = 0; stage < LATENCY_STAGES; stage++) {
+            if (latencyStats(trick, stage, &latency, path, sizeof(path)) == 0) continue;
+            for (i = 0; i <= LATENCY_QUANTILES + 1; i++) {
+                pageAdd(page, "gidget_latency_seconds%s{trick=\"%d\",path=\"",
+                        (i < LATENCY_QUANTILES) ? "" :
+                        (i == LATENCY_QUANTILES) ? "_sum" : "_count", trick);
+                pageLabel(page, path);
+                pageAdd(page, "\",stage=\"%s\"", latencyStage(stage));
+                if (i < LATENCY_QUANTILES) {
+                    pageAdd(page, ",quantile=\"%s\"} %.6f\n", quantileNames[i],
+                            latency.quantile[i] / 1e6);
+                } else if (i == LATENCY_QUANTILES) {
+                    pageAdd(page, "} %.6f\n", latency.sum / 1e6);
+                } else {
+                    pageAdd(page, "} %llu\n", (unsigned long long) latency.count);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < METRIC_GAUGES; i++) {
+        pageHead(page, gaugeInfo[i].name, "gauge", gaugeInfo[i].help);
+        pageAdd(page, "gidget_%s %lld\n", gaugeInfo[i].name,
+                (long long) atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+
+// what inotify has left, straight from /proc, see gidgetbudget.c
+    if (budgetRead(&budget, metricsInstance) == 0) {
+        pageHead(page, "watches", "gauge", "inotify watches this daemon holds");
+        pageAdd(page, "gidget_watches %ld\n", budget.ownWatches);
+        pageHead(page, "user_watches", "gauge", "inotify watches this user holds in all");
+        pageAdd(page, "gidget_user_watches %ld\n", budget.userWatches);
+        pageHead(page, "user_watches_max", "gauge", "fs.inotify.max_user_watches");
+        pageAdd(page, "gidget_user_watches_max %ld\n", budget.maxWatches);
+        pageHead(page, "user_instances", "gauge", "inotify instances this user holds");
+        pageAdd(page, "gidget_user_instances %ld\n", budget.userInstances);
+        pageHead(page, "user_instances_max", "gauge", "fs.inotify.max_user_instances");
+        pageAdd(page, "gidget_user_instances_max %ld\n", budget.maxInstances);
+        pageHead(page, "watches_refused", "counter", "Watches the kernel refused for want of room");
+        pageAdd(page, "gidget_watches_refused_total %ld\n", budget.refused);
+    }
+    pageHead(page, "start_time_seconds", "gauge", "When the daemon started, in seconds since the epoch");
+    pageAdd(page, "gidget_start_time_seconds %ld\n", (long) metricsStarted);
+}
+
+// answer one scraper
+static void metricsServe(int client) {
+    struct pollfd wait = { .fd = client, .events = POLLIN };
+    struct timeval limit = { .tv_sec = METRIC_SEND_SECONDS };
+    page_t page = { NULL, 0, 0 };
+    char request[512], header[160];
+    ssize_t got = 0, put;
+    size_t done;
+    int http = 0;
+
+// a scraper speaking HTTP says so straight away, anything else gets the page bare
+    if (poll(&wait, 1, METRIC_REQUEST_MS) > 0) {
+        got = recv(client, request, sizeof(request) - 1, MSG_DONTWAIT);
+        http = (got >= 4) && (strncmp(request, "GET ", 4) == 0);
+    }
+    metricsRender(&page);
+    if (page.text == NULL) return;
+
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    if (http) {
+        sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\nConnection: close\r\n\r\n", page.len);
+        if (send(client, header, strlen(header), MSG_NOSIGNAL) < 0) goto done;
+    }
+    for (done = 0; done < page.len; done += put) {
+        if ((put = send(client, page.text + done, page.len - done, MSG_NOSIGNAL)) <= 0) break;
+    }
+
+done:
+    free(page.text);
+}
+
+static void *metricsThread(void *unused) {
+    int client;
+
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, NULL);
+
+    for (;;) {
+        if ((client = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+            sleep(1);       // out of descriptors, most likely; try again later
+            continue;
+        }
+        metricsServe(client);
+        close(client);
+    }
+    return NULL;
+}
+
+// Listen on opt.metrics and start answering scrapes: a path for a
+// Unix socket, or a port on 127.0.0.1.  Returns 0, or logs and
+// returns -1
+int metricsStart(opts_t opt, int instanceHandle) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    struct sockaddr_un local;
+    struct sockaddr_in loopback;
+    pthread_t tid;
+    int on = 1;
+
+    metricsInstance = instanceHandle;
+    metricsStarted = time(NULL);
+    if (opt.metrics[0] == '/') {
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, opt.metrics);
+        unlink(opt.metrics);        // left by a gidget that didn't get to clean up
+        if (((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) ||
+            (bind(listener, (struct sockaddr *) &local, sizeof(local)) < 0)) {
+            goto failed;
+        }
+    } else {
+        memset(&loopback, 0, sizeof(loopback));
+        loopback.sin_family = AF_INET;
+        loopback.sin_port = htons(atoi(opt.metrics));
+        loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (((listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) ||
+            (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) ||
+            (bind(listener, (struct sockaddr *) &loopback, sizeof(loopback)) < 0)) {
+            goto failed;
+        }
+    }
+    if ((listen(listener, 16) < 0) || (pthread_create(&tid, NULL, metricsThread, NULL) != 0)) {
+        goto failed;
+    }
+    pthread_detach(tid);
+    sprintf(logtxt, "serving metrics on %s", opt.metrics);
+    logx(0, opt, logtxt);
+    return 0;
+
+failed:
+    sprintf(logtxt, "unable to serve metrics on %s: %s", opt.metrics, strerror(errno));
+    logx(0, opt, logtxt);
+    if (listener >= 0) close(listener);
+    listener = -1;
+    return -1;
+}
+
+// stop listening, and take a Unix socket's name away with us
+void metricsStop(opts_t opt) {
+    if (listener < 0) return;
+    if (opt.metrics[0] == '/') unlink(opt.metrics);
+}
@@ -0,0 +1,315 @@
+/*
+
+  @mirror - a native action that copies (or hard links) the
+  triggering file into a staging tree without a process per
+  file and without dragging the bytes through user space.
+
+     @mirror destination [copy|link] [fsync=none|file|dir]
+
+  The destination is a template:
+     %f  full path of the triggering object
+     %n  its name within the watched directory
+     %w  the watched file or directory
+     %%  a percent sign
+  A destination ending in / gets the name tacked on.  Missing
+  directories in the destination are created.
+
+  Copies try a reflink (FICLONE) first, which costs nothing on
+  btrfs and XFS, then copy_file_range, then sendfile.  Either
+  way the copy lands in a temporary name in the destination
+  directory and is renamed into place, so nobody downstream
+  ever sees half a file.  fsync=file syncs the copy before the
+  rename, fsync=dir syncs the directory after it as well.
+
+  The daemon is usually root and the names it is handed are
+  whatever somebody dropped in a watched directory, so the
+  work is done with the filesystem identity (uid and primary
+  group) of the trick's userid, as its script would have been.
+  setfsuid() only changes the calling worker's identity, so
+  the other workers carry on as they were.  Only regular files
+  are mirrored, a symlink is never followed to its target, and
+  a link is checked after the fact to be the file that was
+  looked at.
+
+  Don't mirror into a directory watched by the same trick
+  unless you enjoy infinite loops.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include <sys/stat.h>            // fstat, mkdir
+#include <sys/ioctl.h>           // ioctl
+#include <sys/sendfile.h>        // sendfile
+#include <linux/fs.h>            // FICLONE
+#include <pthread.h>             // pthread_self
+#include <sys/fsuid.h>           // setfsuid, this thread only
+
+#define MIRROR_CHUNK (64 * 1024 * 1024)  // per copy_file_range/sendfile call
+
+  typedef enum { FSYNC_NONE, FSYNC_FILE, FSYNC_DIR } fsyncPolicy_t;
+
+  typedef struct {
+      char destination[PATH_MAX];
+      int link;
+      fsyncPolicy_t fsync;
+  } mirrorSpec_t;
+
+// argument text is parsed again for every event, it's a few words
+static int mirrorParse(const char *arg, mirrorSpec_t *spec, char *why, size_t whyLen) {
+    char words[strlen(arg) + 1];
+    char *word, *rest;
+
+    memset(spec, 0, sizeof(*spec));
+    strcpy(words, arg);
+
+    for (word = strtok_r(words, " \t", &rest); word != NULL;
+         word = strtok_r(NULL, " \t", &rest)) {
+        if (strcmp(word, "link") == 0) {
+            spec->link = 1;
+        } else if (strcmp(word, "copy") == 0) {
+            spec->link = 0;
+        } else if (strcmp(word, "fsync=none") == 0) {
+            spec->fsync = FSYNC_NONE;
+        } else if (strcmp(word, "fsync=file") == 0) {
+            spec->fsync = FSYNC_FILE;
+        } else if (strcmp(word, "fsync=dir") == 0) {
+            spec->fsync = FSYNC_DIR;
+        } else if ((spec->destination[0] == '\0') && (strlen(word) < PATH_MAX)) {
+            strcpy(spec->destination, word);
+        } else {
+            snprintf(why, whyLen, "unexpected mirror argument %s", word);
+            return -1;
+        }
+    }
+
+    if (spec->destination[0] != '/') {
+        snprintf(why, whyLen, "mirror needs an absolute destination");
+        return -1;
+    }
+    return 0;
+}
+
+// used by nativeLoad so that typos are caught at config time
+int mirrorCheck(const char *arg, char *why, size_t whyLen) {
+    mirrorSpec_t spec;
+    return mirrorParse(arg, &spec, why, whyLen);
+}
+
+static int mirrorExpand(const char *template, const gidget_event_t *event,
+                        char *dest, size_t destLen) {
+    size_t used = 0;
+    const char *p, *add;
+    char one[2] = { 0, 0 };
+
+    for (p = template; *p != '\0'; p++) {
+        if ((*p == '%') && (p[1] != '\0')) {
+            switch (*++p) {
+              case 'f': add = event->path;    break;
+              case 'n': add = event->name;    break;
+              case 'w': add = event->watched; break;
+              default:  one[0] = *p; add = one; break;
+            }
+        } else {
+            one[0] = *p;
+            add = one;
+        }
+        if (used + strlen(add) >= destLen) return -1;
+        strcpy(dest + used, add);
+        used += strlen(add);
+    }
+
+    if ((used > 0) && (dest[used - 1] == '/')) {
+        if (used + strlen(event->name) >= destLen) return -1;
+        strcpy(dest + used, event->name);
+    }
+    return 0;
+}
+
+// mkdir -p for everything above the destination file
+static int mirrorMakeParents(char *dest) {
+    char *slash;
+    for (slash = strchr(dest + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int made = mkdir(dest, 0777);   // umask trims this down
+        *slash = '/';
+        if ((made < 0) && (errno != EEXIST)) return -1;
+    }
+    return 0;
+}
+
+// move the bytes, cheapest method first.  Returns -1 on failure
+static int mirrorCopy(int from, int to, off_t size) {
+    off_t done = 0;
+    ssize_t moved;
+
+    if (ioctl(to, FICLONE, from) == 0) return 0;
+
+    while (done < size) {
+        moved = copy_file_range(from, NULL, to, NULL,
+                                (size - done > MIRROR_CHUNK) ? MIRROR_CHUNK : size - done, 0);
+        if (moved <= 0) break;
+        done += moved;
+    }
+    if (done >= size) return 0;
+
+// copy_file_range won't cross some filesystems on older kernels
+    off_t offset = done;
+    if (lseek(to, done, SEEK_SET) < 0) return -1;
+    while (offset < size) {
+        moved = sendfile(to, from, &offset,
+                         (size - offset > MIRROR_CHUNK) ? MIRROR_CHUNK : size - offset);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (moved == 0) break;  // file shrank underneath us, take what we got
+    }
+    return 0;
+}
+
+static int mirrorAs(const gidget_event_t *event, char *output, size_t outputSize) {
+
+    mirrorSpec_t spec;
+    char why[256];
+    char dest[PATH_MAX], temp[PATH_MAX + 32];
+    int from = -1, to = -1;
+    struct stat sb, made;
+
+    if (mirrorParse(event->arg, &spec, why, sizeof(why)) < 0) {
+        snprintf(output, outputSize, "%s\n", why);
+        return 1;
+    }
+    if (mirrorExpand(spec.destination, event, dest, sizeof(dest)) < 0) {
+        snprintf(output, outputSize, "mirror destination for %s is too long\n", event->path);
+        return 1;
+    }
+    if (mirrorMakeParents(dest) < 0) {
+        snprintf(output, outputSize, "unable to create directories for %s: %s\n",
+                 dest, strerror(errno));
+        return 1;
+    }
+
+// temp name lives next to the destination so rename() is atomic
+    snprintf(temp, sizeof(temp), "%s.gidget-%d-%lx", dest, getpid(),
+             (unsigned long) pthread_self());
+
+// never follow a symlink, and don't hang opening a fifo
+    from = open(event->path, (spec.link ? O_PATH : O_RDONLY | O_NONBLOCK) |
+                             O_NOFOLLOW | O_CLOEXEC);
+    if (from < 0) {
+        if (errno == ELOOP) return 0;   // a symlink, nothing to mirror
+        snprintf(output, outputSize, "unable to open %s: %s\n",
+                 event->path, strerror(errno));
+        return 1;
+    }
+    if ((fstat(from, &sb) < 0) || !S_ISREG(sb.st_mode)) {
+        close(from);
+        return 0;   // not a regular file, nothing to mirror
+    }
+
+    if (spec.link) {
+        close(from);
+        from = -1;
+        if (link(event->path, temp) < 0) {
+            snprintf(output, outputSize, "unable to link %s to %s: %s\n",
+                     event->path, temp, strerror(errno));
+            return 1;
+        }
+    // the name may have been swapped for something else since we looked
+        if ((lstat(temp, &made) < 0) ||
+            (made.st_dev != sb.st_dev) || (made.st_ino != sb.st_ino)) {
+            snprintf(output, outputSize, "%s changed while being linked, not mirrored\n",
+                     event->path);
+            goto failed;
+        }
+    // rename() between two links to the same file does nothing at all,
+    // so a mirror that is already up to date would keep the temp name
+        if ((lstat(dest, &made) == 0) &&
+            (made.st_dev == sb.st_dev) && (made.st_ino == sb.st_ino)) {
+            unlink(temp);
+            return 0;
+        }
+    } else {
+        to = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sb.st_mode & 07777);
+        if (to < 0) {
+            snprintf(output, outputSize, "unable to create %s: %s\n", temp, strerror(errno));
+            close(from);
+            return 1;
+        }
+        if (mirrorCopy(from, to, sb.st_size) < 0) {
+            snprintf(output, outputSize, "unable to copy %s to %s: %s\n",
+                     event->path, temp, strerror(errno));
+            goto failed;
+        }
+        if ((spec.fsync != FSYNC_NONE) && (fsync(to) < 0)) {
+            snprintf(output, outputSize, "fsync of %s failed: %s\n", temp, strerror(errno));
+            goto failed;
+        }
+        close(to);
+        close(from);
+        to = from = -1;
+    }
+
+    if (rename(temp, dest) < 0) {
+        snprintf(output, outputSize, "unable to rename %s to %s: %s\n",
+                 temp, dest, strerror(errno));
+        goto failed;
+    }
+
+    if (spec.fsync == FSYNC_DIR) {
+        char *slash = strrchr(dest, '/');
+        *slash = '\0';
+        int dir = open((slash == dest) ? "/" : dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ((dir < 0) || (fsync(dir) < 0)) {
+            snprintf(output, outputSize, "fsync of directory %s failed: %s\n",
+                     dest, strerror(errno));
+            if (dir >= 0) close(dir);
+            return 1;
+        }
+        close(dir);
+    }
+
+    return 0;   // success is silent, just like a good script
+
+failed:
+    if (to >= 0) close(to);
+    if (from >= 0) close(from);
+    unlink(temp);
+    return 1;
+}
+
+int mirrorHandler(const gidget_event_t *event, char *output, size_t outputSize) {
+    struct passwd user, *found = NULL;
+    char buffer[4096];
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int result;
+
+// directories and vanished files are not ours to copy
+    if (event->mask & (IN_ISDIR | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM |
+                       IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+        return 0;
+    }
+
+    if ((getpwnam_r(event->userid, &user, buffer, sizeof(buffer), &found) != 0) ||
+        (found == NULL)) {
+        snprintf(output, outputSize, "unable to find user %s, %s not mirrored\n",
+                 event->userid, event->path);
+        return 1;
+    }
+
+// group first, setfsuid() away from root drops the right to change it
+    setfsgid(user.pw_gid);
+    setfsuid(user.pw_uid);
+    if (((uid_t) setfsuid(-1) != user.pw_uid) || ((gid_t) setfsgid(-1) != user.pw_gid)) {
+        setfsuid(uid);
+        setfsgid(gid);
+        snprintf(output, outputSize, "unable to act as user %s, %s not mirrored\n",
+                 event->userid, event->path);
+        return 1;
+    }
+    result = mirrorAs(event, output, outputSize);
+    setfsuid(uid);
+    setfsgid(gid);
+    return result;
+}
@@ -0,0 +1,327 @@
+/*
+
+  Native tricks: handlers that run inside the daemon on a
+  worker thread instead of in a forked shell.  The public
+  side of this lives in gidgetplugin.h
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // content fingerprints
+#include "gidgetpool.h"          // worker threads
+#include <dlfcn.h>               // dlopen & friends
+
+// handlers get this much room for output, same as a pipe holds
+#define NATIVE_OUTPUT_LEN 65536
+
+  typedef struct {
+      trick_t *pony;
+      int32_t trickNo;
+      opts_t opt;
+      int32_t wd;
+      uint32_t mask;
+      uint32_t cookie;
+      int64_t received;     // when the daemon read the event, for the audit log
+      int64_t receivedMono;
+      char name[];          // event name, possibly empty
+  } nativeJob_t;
+
+// Pick apart "@plugin /path/to/thing.so symbol [argument text]" and
+// bind the symbol, or check the arguments of a built in action such
+// as "@mirror".  Called at configuration time so a broken plugin
+// costs us one config line rather than one event at a time.
+// Returns zero on success, logs and returns non-zero otherwise.
+
+int nativeLoad(trick_t *pony, opts_t opt, int lineNo) {
+
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char spec[strlen(pony->script) + 1];
+    char *action, *object, *symbol, *rest;
+
+    strcpy(spec, pony->script);
+    action = strtok_r(spec + 1, " \t", &rest);
+
+// built in actions are handlers that happen to be linked in already
+    if ((action != NULL) && (strcmp(action, "mirror") == 0)) {
+        char why[256];
+        while ((*rest == ' ') || (*rest == '\t')) rest++;
+        if (mirrorCheck(rest, why, sizeof(why)) < 0) {
+            sprintf(logtxt, "ERROR: %s in %s line %d field 3", why, opt.config, lineNo);
+            logx(0, opt, logtxt);
+            return 1;
+        }
+        pony->handler = mirrorHandler;
+        pony->handlerArg = strdup(rest);
+        return (pony->handlerArg == NULL);
+    }
+
+    if ((action != NULL) && (strcmp(action, "checksum") == 0)) {
+        while ((*rest == ' ') || (*rest == '\t')) rest++;
+        pony->ignoreSuffix = checksumSuffix(rest);
+        if (pony->ignoreSuffix == NULL) {
+            sprintf(logtxt, "ERROR: @checksum takes md5 or sha256 in %s line %d field 3",
+                    opt.config, lineNo);
+            logx(0, opt, logtxt);
+            return 1;
+        }
+        pony->handler = checksumHandler;
+        pony->handlerArg = strdup(rest);
+        return (pony->handlerArg == NULL);
+    }
+
+    if ((action == NULL) || (strcmp(action, "plugin") != 0)) {
+        sprintf(logtxt, "ERROR: unknown native action %s in %s line %d field 3",
+                pony->script, opt.config, lineNo);
+        logx(0, opt, logtxt);
+        return 1;
+    }
+
+    object = strtok_r(NULL, " \t", &rest);
+    symbol = strtok_r(NULL, " \t", &rest);
+    if (symbol == NULL) {
+        sprintf(logtxt, "ERROR: %s line %d field 3 should read @plugin object symbol [argument]",
+                opt.config, lineNo);
+        logx(0, opt, logtxt);
+        return 1;
+    }
+    while ((*rest == ' ') || (*rest == '\t')) rest++;
+
+    void *library = dlopen(object, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        sprintf(logtxt, "ERROR: unable to load %s: %s", object, dlerror());
+        logx(0, opt, logtxt);
+        return 1;
+    }
+
+    const uint32_t *abi = dlsym(library, GIDGET_PLUGIN_ABI_SYMBOL);
+    if ((abi != NULL) && (*abi != GIDGET_PLUGIN_ABI)) {
+        sprintf(logtxt, "ERROR: %s was built for plugin ABI %u, this gidget speaks %u",
+                object, *abi, GIDGET_PLUGIN_ABI);
+        logx(0, opt, logtxt);
+        dlclose(library);
+        return 1;
+    }
+
+    pony->handler = (gidget_handler_t *) dlsym(library, symbol);
+    if (pony->handler == NULL) {
+        sprintf(logtxt, "ERROR: symbol %s not found in %s", symbol, object);
+        logx(0, opt, logtxt);
+        dlclose(library);
+        return 1;
+    }
+
+    pony->handlerArg = strdup(rest);
+    if (pony->handlerArg == NULL) {
+        sprintf(logtxt, "Can't allocate memory for plugin argument in line %d", lineNo);
+        logx(0, opt, logtxt);
+        pony->handler = NULL;
+        return 1;
+    }
+
+    if (opt.verbose) {
+        sprintf(logtxt, "Loaded native handler %s from %s", symbol, object);
+        logx(0, opt, logtxt);
+    }
+    return 0;
+}
+
+// a native trick's line in the audit log
+static void nativeAudit(const nativeJob_t *job, const char *path, int64_t picked,
+                        int64_t started, int64_t finished, int status,
+                        int64_t outputBytes, const char *delivery) {
+    audit_t a;
+
+    memset(&a, 0, sizeof(a));
+    a.received = job->received;
+    a.receivedMono = job->receivedMono;
+    a.dispatched = picked;
+    a.spawned = started;
+    a.finished = finished;
+    a.wd = job->wd;
+    a.mask = job->mask;
+    a.path = path;
+    a.trick = job->trickNo;
+    a.script = job->pony->script;
+    a.attempt = 1;
+    a.ran = (started != 0);
+    a.status = status;
+    a.outputBytes = outputBytes;
+    a.delivery = delivery;
+    auditRecord(job->opt, &a);
+}
+
+// A job is done with, and so, if no other job holds it, is a definition
+// that a reload has swapped out or retired.  The read loop frees it,
+// see configReclaim()
+static void nativeDone(nativeJob_t *job) {
+    trick_t *pony = job->pony;
+
+    free(job);
+    __atomic_fetch_sub(&pony->jobs, 1, __ATOMIC_RELEASE);
+}
+
+// everything a native trick does for one event, on a worker thread
+static void nativeRun(void *arg) {
+
+    nativeJob_t *job = arg;
+    trick_t *pony = job->pony;
+    opts_t opt = job->opt;
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[strlen(pony->fileName) + strlen(job->name) + 2];
+    uint64_t pathKey = 0, contentHash = 0;
+    int64_t picked = auditClock(CLOCK_MONOTONIC);
+    const char *delivery = "none";
+
+    if (opt.verbose && !logSampled()) opt.verbose = 0;
+
+    strcpy(path, pony->fileName);
+    if (job->name[0] != '\0') {
+        strcat(path, "/");
+        strcat(path, job->name);
+    }
+
+// same fingerprint rules as script tricks, see main(), but never
+// mapped: a SIGBUS in a worker would take the daemon with it
+    if ((pony->options & TRICK_HASH) &&
+        !(job->mask & (IN_ISDIR | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM |
+                       IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) &&
+        (gigHashFile(path, &contentHash, 0) == 0)) {
+        pathKey = gigHashBytes(path, strlen(path), job->trickNo);
+        if (fingerprintMatches(pathKey, contentHash)) {
+            if (opt.verbose) {
+                sprintf(logtxt, "content of %s unchanged (%016llx), skipping %s",
+                        path, (unsigned long long) contentHash, pony->script);
+                logx(0, opt, logtxt);
+            }
+            nativeAudit(job, path, picked, 0, 0, 0, 0, "skipped");
+            int64_t stamps[STAMPS] = { job->receivedMono, picked, 0, 0, 0 };
+            latencyRecord(job->trickNo, pony->fileName, stamps);
+            flightRecord(FLIGHT_SKIPPED, job->trickNo, job->mask, 0, 0, job->name);
+            nativeDone(job);
+            return;
+        }
+    }
+
+    gidget_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.abi = GIDGET_PLUGIN_ABI;
+    event.size = sizeof(event);
+    event.wd = job->wd;
+    event.mask = job->mask;
+    event.cookie = job->cookie;
+    event.path = path;
+    event.watched = pony->fileName;
+    event.name = job->name;
+    event.arg = pony->handlerArg;
+    event.userid = pony->userid;
+    event.contentHash = contentHash;
+
+    char *output = malloc(NATIVE_OUTPUT_LEN);
+    if (output == NULL) {
+        sprintf(logtxt, "unable to allocate output buffer for %s, event on %s dropped",
+                pony->script, path);
+        logx(0, opt, logtxt);
+        nativeAudit(job, path, picked, 0, 0, 0, 0, "lost");
+        nativeDone(job);
+        return;
+    }
+    output[0] = '\0';
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int status = pony->handler(&event, output, NATIVE_OUTPUT_LEN);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    output[NATIVE_OUTPUT_LEN - 1] = '\0';   // trust, but verify
+
+    metricAdd(METRIC_NATIVE_RUNS, 1);
+    if (status != 0) metricAdd(METRIC_NATIVE_FAILURES, 1);
+
+    long usec = (finished.tv_sec - started.tv_sec) * 1000000L +
+                (finished.tv_nsec - started.tv_nsec) / 1000;
+
+// output goes exactly where script output would go
+    size_t outputLen = strlen(output);
+    if ((outputLen != 0) && (opt.digestCount > 0)) {
+        delivery = (digestAdd(opt, pony, path, job->mask, status, -1, output, outputLen) == 0)
+                   ? "digest" : "lost";
+    } else if (outputLen != 0) {
+        FILE *mailslot;
+        mailSlot_t slot;
+        char preface[strlen(pony->script) + 2];
+        sprintf(preface, "%s:", pony->script);
+        if ((mailslot = mailStream(opt, pony->mail, &slot)) != NULL) {
+            mailHeaders(mailslot, pony, path, job->wd, job->mask, preface);
+            fwrite(output, 1, outputLen, mailslot);
+            delivery = "lost";
+            if (mailFinish(opt, mailslot, &slot) == 0) {
+                if (logRate(RATE_OUTPUT)) {
+                    sprintf(logtxt, "native handler queued %zu bytes of output for %s",
+                            outputLen, pony->mail);
+                    logx(0, opt, logtxt);
+                }
+                delivery = "queued";
+            }
+        } else {
+            delivery = "lost";
+            sprintf(logtxt, "unable to queue output of %s: %s, output lost",
+                    pony->script, strerror(errno));
+            logx(0, opt, logtxt);
+        }
+    }
+    free(output);
+
+    int64_t stamps[STAMPS] = { job->receivedMono, picked, 0,
+                               (int64_t) started.tv_sec * 1000000000 + started.tv_nsec,
+                               (int64_t) finished.tv_sec * 1000000000 + finished.tv_nsec };
+    nativeAudit(job, path, picked, stamps[STAMP_EXEC], stamps[STAMP_EXIT],
+                status, outputLen, delivery);
+    latencyRecord(job->trickNo, pony->fileName, stamps);
+    flightRecord(FLIGHT_EXITED, job->trickNo, job->mask, 0, status, job->name);
+
+    if (status == 0) {
+        if (pathKey != 0) fingerprintRemember(pathKey, contentHash);
+        if (opt.verbose && logRate(RATE_NATIVE)) {
+            sprintf(logtxt, "native handler %s on %s completed in %ld usec",
+                    pony->script, path, usec);
+            logx(0, opt, logtxt);
+        }
+    } else if (logRate(RATE_NATIVE)) {
+        sprintf(logtxt, "native handler fail, %s on %s returned status %d",
+                pony->script, path, status);
+        logx(0, opt, logtxt);
+    }
+
+    nativeDone(job);
+}
+
+// hand an event for a native trick over to the worker pool
+void nativeDispatch(trick_t *pony, int32_t trickNo, event_t *event, opts_t opt,
+                    int64_t received, int64_t receivedMono) {
+
+    char logtxt[MAX_ERR_TEXT_LEN];
+    size_t nameLen = (event->len != 0) ? strlen(event->name) : 0;
+    nativeJob_t *job = malloc(sizeof(nativeJob_t) + nameLen + 1);
+
+    if (job == NULL) {
+        metricAdd(METRIC_DROPPED, 1);
+        sprintf(logtxt, "unable to queue event for %s, event dropped", pony->script);
+        logx(0, opt, logtxt);
+        return;
+    }
+    job->pony = pony;
+    job->trickNo = trickNo;
+    job->opt = opt;
+    job->wd = event->wd;
+    job->mask = event->mask;
+    job->cookie = event->cookie;
+    job->received = received;
+    job->receivedMono = receivedMono;
+    memcpy(job->name, event->name, nameLen);
+    job->name[nameLen] = '\0';
+
+    metricAdd(METRIC_QUEUED, 1);
+    metricMask(1, event->mask);
+    flightRecord(FLIGHT_QUEUED, trickNo, event->mask, 0, 0, job->name);
+    __atomic_fetch_add(&pony->jobs, 1, __ATOMIC_RELAXED);
+    poolSubmit(nativeRun, job);
+}
@@ -0,0 +1,65 @@
+/*
+
+    gidget native handler interface
+
+    For simple reactions (rename a file, checksum it, poke
+    a local socket) forking a shell per event costs far
+    more than the work itself.  A trick whose script field
+    reads
+
+        @plugin /path/to/handler.so symbol [argument text]
+
+    has the shared object loaded once at configuration time
+    and the named symbol called on one of the daemon's worker
+    threads for every event, with no fork and no exec.
+
+    The handler must look like gidget_handler_t below.  It
+    returns an exit status exactly as a script would (zero is
+    success) and may write NUL terminated text into output.
+    Anything written there is logged and mailed exactly like
+    script output.
+
+    Handlers run inside the daemon, as the daemon's user, on
+    several threads at once.  They must be thread safe, must
+    not call exit() and must not block for long.  The userid
+    field of the trick is only used to label the mail.
+
+    This header is the whole ABI.  Fields are only ever added
+    to the end of gidget_event_t; check event->size before
+    touching anything newer than your copy of this file.  A
+    plugin may export gidget_plugin_abi to have the daemon
+    refuse to load it into an incompatible gidget.
+
+*/
+
+// simple inclusion guard
+#ifndef _GIG_PLUGIN
+
+# define _GIG_PLUGIN
+
+# include <stddef.h>
+# include <stdint.h>
+
+# define GIDGET_PLUGIN_ABI 1
+
+  typedef struct gidget_event {
+      uint32_t abi;             // GIDGET_PLUGIN_ABI of the calling daemon
+      uint32_t size;            // sizeof(gidget_event_t) in the daemon
+      int32_t wd;               // inotify watch descriptor
+      uint32_t mask;            // inotify event mask
+      uint32_t cookie;          // inotify rename cookie
+      const char *path;         // full path of the triggering object
+      const char *watched;      // watched file or directory from the config
+      const char *name;         // name within the watched directory, or ""
+      const char *arg;          // argument text from the config, or ""
+      const char *userid;       // userid field from the config
+      uint64_t contentHash;     // fingerprint if the trick has "hash", else 0
+  } gidget_event_t;
+
+  typedef int gidget_handler_t(const gidget_event_t *event,
+                               char *output, size_t outputSize);
+
+// optional, exported by the plugin as: const uint32_t gidget_plugin_abi = GIDGET_PLUGIN_ABI;
+# define GIDGET_PLUGIN_ABI_SYMBOL "gidget_plugin_abi"
+
+#endif
@@ -0,0 +1,615 @@
+/*
+
+  The polling tier.  A trick the kernel has no inotify watch
+  to spare for, or that -W leaves out of the watch budget,
+  is not thrown away but polled.  So is one with the poll
+  option, or on NFS, CIFS, FUSE and the like, where a watch
+  is added without complaint but only ever hears of changes
+  made on this machine.  Its directory is listed
+  with getdents64() and every entry statx()ed, the result
+  compared with the snapshot from the scan before, and the
+  differences turned into the events inotify would have
+  sent, queued for the daemon to read like any others:
+
+    new name            IN_CREATE
+    name gone           IN_DELETE
+    same inode, new     IN_MOVED_FROM and IN_MOVED_TO,
+      name                with a cookie pairing them
+    size or mtime       IN_MODIFY, then IN_CLOSE_WRITE at the
+      changed             first scan that finds it unchanged
+    ctime alone         IN_ATTRIB
+    changed
+    the path itself     IN_DELETE_SELF
+      gone
+
+  A trick on a single file gets the same, without names.
+  Only the bits in the trick's mask are sent.  A directory
+  that changed is scanned again after a quarter of its usual
+  time between changes, a second for a busy one, and one
+  that stays quiet twice as long each time up to a minute,
+  so cold trees cost next to nothing.  Tricks that are due
+  together are listed on several threads at once.
+
+  gidget -B lists every trick in the configuration so many
+  times over and reports how many entries a second that
+  comes to, to size a poller before trusting it with a tree.
+
+  A trick polled because it is on a network filesystem, or
+  has the poll option, is statx()ed the way stat() would be,
+  which makes NFS revalidate what it has cached; a change made
+  on another client could otherwise go unseen for as long as
+  the attribute cache lasts.  A local trick polled only for
+  want of a watch has no such cache, and is asked not to sync.
+
+  Polled events carry a made up watch descriptor, POLL_WD()
+  of the trick number, which watchTrick() understands.
+
+  Deciding which tricks are polled and which watched is done
+  in gidgetconfig.c: polled tricks that turn out busy are
+  given a watch, taking it from the watched trick that has
+  been quiet longest if need be.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // snapshot keys
+#include <dirent.h>              // getdents64
+
+#include <pthread.h>             // listings are taken in parallel
+
+#define POLL_MIN_SECONDS 1
+#define POLL_MAX_SECONDS 60
+#define POLL_DIRENT_BUF (64 * 1024)
+
+// scans are spread over up to this many threads, each taking at least
+// this many tricks.  A scan mostly waits, on a file server as often as
+// not, so this isn't tied to the number of processors
+#define POLL_MAX_THREADS 8
+#define POLL_TRICKS_PER_THREAD 4
+
+// what a scan knows of one name.  Big trees have a lot of them, and
+// times and size are only ever compared, so they are kept folded into
+// stamps, 32 bytes an entry all told
+  typedef struct {
+      uint64_t key;         // hash of the name, entries are sorted by it
+      uint64_t ino;
+      uint32_t stamp;       // size and mtime
+      uint32_t ctime;
+      uint32_t name;        // offset into the snapshot's pool
+      uint16_t isDir;
+      uint16_t unsettled;   // changed at the last scan, IN_CLOSE_WRITE still owed
+  } pollEntry_t;
+
+// one look at a polled path
+  typedef struct {
+      int exists;
+      pollEntry_t self;     // the path itself
+      pollEntry_t *entries; // and what's in it, for a directory
+      int count;
+      char *pool;
+      size_t poolSize;
+  } pollSnap_t;
+
+// a polled trick, its latest snapshot, and the listing just taken
+// that hasn't been compared with it yet
+  typedef struct {
+      int32_t trick;
+      int scanned;          // there is a snapshot to compare with
+      pollSnap_t snap;
+      pollSnap_t fresh;
+      int interval;         // seconds until the next scan
+      int gap;              // seconds between changes, averaged
+      time_t nextScan;
+      time_t changed;       // when a scan last found a difference
+  } polled_t;
+
+  static polled_t *polled = NULL;
+  static int polledCount = 0;
+
+// events waiting for the daemon, whole event_t records back to back
+  static char *pending = NULL;
+  static size_t pendingStart = 0, pendingLen = 0, pendingSize = 0;
+  static uint32_t cookies = 0;
+
+// a share of the scans due, for one thread
+  typedef struct {
+      trick_t **trickHeap;
+      const int *due;
+      int from, to;
+  } pollWork_t;
+
+// queue an event, if the trick asked for it
+static void pollEmit(const trick_t *pony, int32_t trick, uint32_t bit, int isDir,
+                     uint32_t cookie, const char *name) {
+    size_t nameLen = (name != NULL) ? strlen(name) + 1 : 0, need;
+    event_t event;
+    char *grown;
+
+    if (!(pony->actions & bit)) return;
+// names are NUL padded to keep records aligned, as inotify's are
+    nameLen = (nameLen + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    need = sizeof(event_t) + nameLen;
+
+    if (pendingStart > 0) {
+        memmove(pending, pending + pendingStart, pendingLen - pendingStart);
+        pendingLen -= pendingStart;
+        pendingStart = 0;
+    }
+    if (pendingLen + need > pendingSize) {
+        if ((grown = realloc(pending, (pendingLen + need) * 2)) == NULL) return;
+        pending = grown;
+        pendingSize = (pendingLen + need) * 2;
+    }
+    event.wd = POLL_WD(trick);
+    event.mask = bit | (isDir ? IN_ISDIR : 0);
+    event.cookie = cookie;
+    event.len = nameLen;
+    memcpy(pending + pendingLen, &event, sizeof(event_t));
+    memset(pending + pendingLen + sizeof(event_t), 0, nameLen);
+    if (name != NULL) strcpy(pending + pendingLen + sizeof(event_t), name);
+    pendingLen += need;
+}
+
+static int byKey(const void *a, const void *b, void *pool) {
+    const pollEntry_t *x = a, *y = b;
+
+    if (x->key != y->key) return (x->key < y->key) ? -1 : 1;
+    return strcmp((char *) pool + x->name, (char *) pool + y->name);
+}
+
+static void pollEntryFill(pollEntry_t *entry, const struct statx *st) {
+    int64_t stamp[3];
+
+    stamp[0] = st->stx_size;
+    stamp[1] = st->stx_mtime.tv_sec;
+    stamp[2] = st->stx_mtime.tv_nsec;
+    entry->stamp = gigHashBytes(stamp, sizeof(stamp), 0);
+    stamp[1] = st->stx_ctime.tv_sec;
+    stamp[2] = st->stx_ctime.tv_nsec;
+    entry->ctime = gigHashBytes(stamp + 1, 2 * sizeof(int64_t), 0);
+    entry->ino = st->stx_ino;
+    entry->isDir = S_ISDIR(st->stx_mode);
+    entry->unsettled = 0;
+}
+
+// Compare an entry with what it was, queueing events for what changed.
+// Returns 1 if anything did
+static int pollCompare(const trick_t *pony, int32_t trick, pollEntry_t *now,
+                       const pollEntry_t *was, const char *name) {
+    if (now->stamp != was->stamp) {
+        pollEmit(pony, trick, IN_MODIFY, now->isDir, 0, name);
+        now->unsettled = !now->isDir;
+        return 1;
+    }
+    if (was->unsettled) {
+        pollEmit(pony, trick, IN_CLOSE_WRITE, 0, 0, name);
+        return 1;
+    }
+    if (now->ctime != was->ctime) {
+        pollEmit(pony, trick, IN_ATTRIB, now->isDir, 0, name);
+        return 1;
+    }
+    return 0;
+}
+
+// statx() flags for a trick's scans, see the top of the file
+static int pollSync(const trick_t *pony) {
+    return (pony->options & (TRICK_REMOTE | TRICK_POLL)) ? AT_STATX_SYNC_AS_STAT
+                                                          : AT_STATX_DONT_SYNC;
+}
+
+// List a directory into a sorted snapshot.  Each entry is statx()ed
+// by name relative to the directory, so the path is walked once a
+// scan rather than once an entry, with sync from pollSync().  Returns
+// the number of entries, or -1 if it can't be read
+static int pollList(int dirHandle, int sync, pollSnap_t *snap) {
+    char buf[POLL_DIRENT_BUF];
+    struct dirent64 *d;
+    struct statx st;
+    pollEntry_t *list = NULL, *grownList;
+    char *names = NULL, *grownNames;
+    size_t used = 0, room = 0, len;
+    int count = 0, space = 0;
+    ssize_t got, at;
+
+    while ((got = getdents64(dirHandle, buf, sizeof(buf))) > 0) {
+        for (at = 0; at < got; at += d->d_reclen) {
+            d = (struct dirent64 *) (buf + at);
+            if ((d->d_name[0] == '.') &&
+                ((d->d_name[1] == '\0') || ((d->d_name[1] == '.') && (d->d_name[2] == '\0')))) {
+                continue;
+            }
+            if (statx(dirHandle, d->d_name, AT_SYMLINK_NOFOLLOW | sync,
+                      STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st) < 0) {
+                continue;       // gone since it was listed, next scan will say so
+            }
+            len = strlen(d->d_name) + 1;
+            if (count == space) {
+                space = space ? space * 2 : 64;
+                if ((grownList = realloc(list, space * sizeof(pollEntry_t))) == NULL) goto failed;
+                list = grownList;
+            }
+            if (used + len > room) {
+                room = room ? room * 2 + len : 4096 + len;
+                if ((grownNames = realloc(names, room)) == NULL) goto failed;
+                names = grownNames;
+            }
+            memcpy(names + used, d->d_name, len);
+            pollEntryFill(&list[count], &st);
+            list[count].key = gigHashBytes(d->d_name, len - 1, 0);
+            list[count].name = used;
+            used += len;
+            count++;
+        }
+    }
+    if (got < 0) goto failed;
+    if (count > 0) qsort_r(list, count, sizeof(pollEntry_t), byKey, names);
+    snap->entries = list;
+    snap->pool = names;
+    snap->poolSize = used;
+    snap->count = count;
+    return count;
+
+failed:
+    free(list);
+    free(names);
+    return -1;
+}
+
+// entries are the same object when inode and type agree, so a name
+// that went and one that came with the same inode were a rename
+static int inodeOrder(const pollEntry_t *x, const pollEntry_t *y) {
+    if (x->ino != y->ino) return (x->ino < y->ino) ? -1 : 1;
+    return (int) x->isDir - (int) y->isDir;
+}
+
+// orders indexes into an entry list by inodeOrder()
+static int byInode(const void *a, const void *b, void *list) {
+    return inodeOrder((const pollEntry_t *) list + *(const int32_t *) a,
+                      (const pollEntry_t *) list + *(const int32_t *) b);
+}
+
+// Diff a directory's fresh listing against its snapshot.  Returns 1
+// if anything changed
+static int pollDiff(const trick_t *pony, polled_t *p) {
+    const pollEntry_t *was = p->snap.entries;
+    pollEntry_t *now = p->fresh.entries;
+    const char *wasPool = p->snap.pool, *pool = p->fresh.pool;
+    int wasCount = p->snap.count, count = p->fresh.count;
+    int32_t *gone = NULL, *came = NULL;
+    int goneCount = 0, cameCount = 0, i = 0, j = 0, k, order, changed = 0;
+    uint32_t cookie;
+
+    if ((wasCount > 0) && ((gone = malloc(wasCount * sizeof(int32_t))) == NULL)) return 0;
+    if ((count > 0) && ((came = malloc(count * sizeof(int32_t))) == NULL)) {
+        free(gone);
+        return 0;
+    }
+
+// both lists are sorted the same way, so one pass pairs them up
+    while ((i < wasCount) || (j < count)) {
+        if (i == wasCount) order = 1;
+        else if (j == count) order = -1;
+        else {
+            order = (was[i].key < now[j].key) ? -1 : (was[i].key > now[j].key);
+            if (order == 0) order = strcmp(wasPool + was[i].name, pool + now[j].name);
+        }
+        if (order < 0) {
+            gone[goneCount++] = i++;
+        } else if (order > 0) {
+            came[cameCount++] = j++;
+        } else {
+            if (now[j].ino != was[i].ino) {     // replaced by another file
+                gone[goneCount++] = i;
+                came[cameCount++] = j;
+            } else {
+                changed |= pollCompare(pony, p->trick, &now[j], &was[i], pool + now[j].name);
+            }
+            i++;
+            j++;
+        }
+    }
+
+// renames within the directory show up as a pair with the same inode.
+// With both sides sorted by inode one more pass pairs them, rather than
+// looking through everything that came for everything that went
+    if (goneCount > 1) qsort_r(gone, goneCount, sizeof(int32_t), byInode, (void *) was);
+    if (cameCount > 1) qsort_r(came, cameCount, sizeof(int32_t), byInode, now);
+    for (i = 0, k = 0; i < goneCount; i++) {
+        order = 1;
+        while ((k < cameCount) && ((order = inodeOrder(&was[gone[i]], &now[came[k]])) > 0)) k++;
+        if ((k < cameCount) && (order == 0)) {
+            cookie = ++cookies;
+            pollEmit(pony, p->trick, IN_MOVED_FROM, was[gone[i]].isDir, cookie,
+                     wasPool + was[gone[i]].name);
+            pollEmit(pony, p->trick, IN_MOVED_TO, now[came[k]].isDir, cookie,
+                     pool + now[came[k]].name);
+            came[k++] = -1;
+        } else {
+            pollEmit(pony, p->trick, IN_DELETE, was[gone[i]].isDir, 0,
+                     wasPool + was[gone[i]].name);
+        }
+        changed = 1;
+    }
+    for (k = 0; k < cameCount; k++) {
+        if (came[k] < 0) continue;
+        pollEmit(pony, p->trick, IN_CREATE, now[came[k]].isDir, 0, pool + now[came[k]].name);
+        now[came[k]].unsettled = !now[came[k]].isDir;
+        changed = 1;
+    }
+    free(gone);
+    free(came);
+    return changed;
+}
+
+// Take a fresh listing of a polled trick's path.  Touches nothing but
+// p, so any number of these can run at once
+static void pollTake(polled_t *p, const trick_t *pony) {
+    struct statx st;
+    int handle, saved = errno;
+
+    memset(&p->fresh, 0, sizeof(pollSnap_t));
+    if (statx(AT_FDCWD, pony->fileName, pollSync(pony),
+              STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st) < 0) {
+        errno = saved;
+        return;
+    }
+    p->fresh.exists = 1;
+    pollEntryFill(&p->fresh.self, &st);
+    if (p->fresh.self.isDir) {
+        handle = open(pony->fileName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ((handle < 0) || (pollList(handle, pollSync(pony), &p->fresh) < 0)) p->fresh.count = 0;
+        if (handle >= 0) close(handle);
+    }
+    errno = saved;
+}
+
+// Compare the fresh listing with the snapshot, queueing events for
+// what changed, make it the snapshot, and decide when to look again.
+// The first scan only takes the snapshot
+static void pollSettle(polled_t *p, const trick_t *pony, time_t now) {
+    pollSnap_t *was = &p->snap, *is = &p->fresh;
+    int changed = 0;
+
+// a watched directory's own times change with every entry, inotify
+// says nothing about that and neither do we
+    if (!is->exists) {
+        if (p->scanned && was->exists) {
+            pollEmit(pony, p->trick, IN_DELETE_SELF, was->self.isDir, 0, NULL);
+            changed = 1;
+        }
+    } else if (p->scanned && was->exists) {
+        if (is->self.isDir) {
+            changed = pollDiff(pony, p);
+        } else {
+            changed = pollCompare(pony, p->trick, &is->self, &was->self, NULL);
+        }
+    } else if (p->scanned) {
+        changed = 1;    // it's back, but a watch would have been lost with it
+        if (is->self.isDir) {
+            pollDiff(pony, p);
+        } else {
+            pollEmit(pony, p->trick, IN_MODIFY, 0, 0, NULL);
+        }
+    }
+    free(was->entries);
+    free(was->pool);
+    *was = *is;
+    memset(is, 0, sizeof(pollSnap_t));
+
+// after a change the next look comes a quarter of the usual time
+// between changes later, so a busy directory is scanned every
+// second and one written now and then not much more often than it
+// changes.  Each quiet scan doubles the wait
+    if (!p->scanned) changed = 0;
+    p->scanned = 1;
+    if (changed) {
+        if (p->changed > 0) p->gap = (3 * p->gap + (int) (now - p->changed)) / 4;
+        p->changed = now;
+        p->interval = p->gap / 4;
+        if (p->interval < POLL_MIN_SECONDS) p->interval = POLL_MIN_SECONDS;
+        if (p->interval > POLL_MAX_SECONDS) p->interval = POLL_MAX_SECONDS;
+    } else if (p->interval < POLL_MAX_SECONDS) {
+        p->interval *= 2;
+        if (p->interval > POLL_MAX_SECONDS) p->interval = POLL_MAX_SECONDS;
+    }
+    p->nextScan = now + p->interval;
+}
+
+// scan one polled trick there and then
+static void pollScanOne(polled_t *p, const trick_t *pony, time_t now) {
+    pollTake(p, pony);
+    pollSettle(p, pony, now);
+}
+
+static void *pollWorker(void *arg) {
+    pollWork_t *work = arg;
+    int i;
+
+    for (i = work->from; i < work->to; i++) {
+        pollTake(&polled[work->due[i]], work->trickHeap[polled[work->due[i]].trick]);
+    }
+    return NULL;
+}
+
+// threads to list so many tricks on
+static int pollThreads(int count) {
+    int threads = count / POLL_TRICKS_PER_THREAD;
+
+    if (threads > POLL_MAX_THREADS) threads = POLL_MAX_THREADS;
+    if (threads < 1) threads = 1;
+    return threads;
+}
+
+// the slot polling trick t, or -1
+static int pollFind(int32_t trick) {
+    int i;
+
+    for (i = 0; i < polledCount; i++) {
+        if (polled[i].trick == trick) return i;
+    }
+    return -1;
+}
+
+// a new slot for trick t, without a snapshot yet.  Returns it, or
+// NULL if out of memory
+static polled_t *pollSlot(int32_t trick) {
+    polled_t *grown;
+
+    if ((grown = realloc(polled, (polledCount + 1) * sizeof(polled_t))) == NULL) return NULL;
+    polled = grown;
+    memset(&polled[polledCount], 0, sizeof(polled_t));
+    polled[polledCount].trick = trick;
+    polled[polledCount].interval = POLL_MIN_SECONDS;
+    return &polled[polledCount++];
+}
+
+// Start polling trick t, taking its first snapshot now.  Returns 0,
+// or -1 if out of memory
+int pollAdd(const trick_t *pony, int32_t trick) {
+    polled_t *p;
+
+    if (pollFind(trick) >= 0) return 0;
+    if ((p = pollSlot(trick)) == NULL) return -1;
+    pollScanOne(p, pony, time(NULL));
+    return 0;
+}
+
+// Stop polling trick t.  With flush set, whatever changed since its
+// last scan is queued first, for a trick just given a watch; without,
+// any of its events still queued are thrown away too
+void pollRemove(const trick_t *pony, int32_t trick, int flush) {
+    size_t from, to, len;
+    event_t *event;
+    int i;
+
+    if ((i = pollFind(trick)) < 0) return;
+    if (flush) pollScanOne(&polled[i], pony, time(NULL));
+    free(polled[i].snap.entries);
+    free(polled[i].snap.pool);
+    polled[i] = polled[--polledCount];
+    if (flush) return;
+
+    for (from = to = pendingStart; from < pendingLen; from += len) {
+        event = (event_t *) (pending + from);
+        len = sizeof(event_t) + event->len;
+        if (event->wd == POLL_WD(trick)) continue;
+        if (to != from) memmove(pending + to, pending + from, len);
+        to += len;
+    }
+    pendingLen = to;
+}
+
+// Scan every polled trick that is due.  Listings are taken on as many
+// threads as there are enough tricks for; comparing them and queueing
+// events stays on this one, so the queue needs no lock
+void pollScan(trick_t **trickHeap, time_t now) {
+    pollWork_t work[POLL_MAX_THREADS];
+    pthread_t tid[POLL_MAX_THREADS];
+    int *due, count = 0, threads, started, t, i;
+
+    for (i = 0; i < polledCount; i++) {
+        if (polled[i].nextScan <= now) count++;
+    }
+    if (count == 0) return;
+    if ((count == 1) || ((due = malloc(count * sizeof(int))) == NULL)) {
+        for (i = 0; i < polledCount; i++) {
+            if (polled[i].nextScan <= now) pollScanOne(&polled[i], trickHeap[polled[i].trick], now);
+        }
+        return;
+    }
+    for (i = count = 0; i < polledCount; i++) {
+        if (polled[i].nextScan <= now) due[count++] = i;
+    }
+
+    threads = pollThreads(count);
+    for (t = 0; t < threads; t++) {
+        work[t].trickHeap = trickHeap;
+        work[t].due = due;
+        work[t].from = (long long) count * t / threads;
+        work[t].to = (long long) count * (t + 1) / threads;
+    }
+// our own thread takes the first share, and any a thread couldn't be started for
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&tid[started], NULL, pollWorker, &work[started]) != 0) break;
+    }
+    pollWorker(&work[0]);
+    for (t = started; t < threads; t++) pollWorker(&work[t]);
+    for (t = 1; t < started; t++) pthread_join(tid[t], NULL);
+
+    for (i = 0; i < count; i++) pollSettle(&polled[due[i]], trickHeap[polled[due[i]].trick], now);
+    free(due);
+}
+
+// Copy as many whole queued events into buf as fit.  Returns the
+// number of bytes, like a read() of an inotify instance
+int pollEvents(char *buf, int size) {
+    size_t used = 0, len;
+    event_t *event;
+
+    while (pendingStart < pendingLen) {
+        event = (event_t *) (pending + pendingStart);
+        len = sizeof(event_t) + event->len;
+        if (used + len > (size_t) size) break;
+        memcpy(buf + used, event, len);
+        used += len;
+        pendingStart += len;
+    }
+    if (pendingStart == pendingLen) pendingStart = pendingLen = 0;
+    return used;
+}
+
+// milliseconds until the next scan is due, 0 if events are waiting,
+// or -1 if nothing is polled
+int pollTimeout(time_t now) {
+    time_t next = 0;
+    int i;
+
+    if (pendingStart < pendingLen) return 0;
+    for (i = 0; i < polledCount; i++) {
+        if ((i == 0) || (polled[i].nextScan < next)) next = polled[i].nextScan;
+    }
+    if (polledCount == 0) return -1;
+    return (next <= now) ? 0 : (next - now) * 1000;
+}
+
+// Polled tricks whose latest scan found something and that could be
+// watched, at most max of them.  Returns how many
+int pollHot(trick_t **trickHeap, int32_t *tricks, int max, time_t now) {
+    int count = 0, i;
+
+    for (i = 0; (i < polledCount) && (count < max); i++) {
+        if (trickHeap[polled[i].trick]->options & (TRICK_POLL | TRICK_REMOTE | TRICK_RETIRED)) {
+            continue;
+        }
+        if ((polled[i].changed != 0) && (polled[i].interval == POLL_MIN_SECONDS) &&
+            (polled[i].changed + 2 * POLL_MIN_SECONDS >= now)) {
+            tricks[count++] = polled[i].trick;
+        }
+    }
+    return count;
+}
+
+// how many tricks are polled
+int pollCount(void) {
+    return polledCount;
+}
+
+// Scan every one of count tricks at once, due or not, throwing away
+// the events that come of it, for gidget -B.  The first call takes
+// their first snapshots.  Returns the number of paths and entries
+// looked at, or -1 if out of memory
+long pollBench(trick_t **trickHeap, int count, int *threads) {
+    long entries = 0;
+    int i;
+
+    for (i = polledCount; i < count; i++) {
+        if (pollSlot(i) == NULL) return -1;
+    }
+    for (i = 0; i < polledCount; i++) polled[i].nextScan = 0;
+    pollScan(trickHeap, time(NULL));
+    pendingStart = pendingLen = 0;
+    for (i = 0; i < polledCount; i++) entries += polled[i].snap.exists + polled[i].snap.count;
+    *threads = pollThreads(polledCount);
+    return entries;
+}
@@ -0,0 +1,84 @@
+/*
+
+  Worker thread pool for native tricks.
+
+*/
+
+#include "gidget.h"              // stdio and friends
+#include "gidgetpool.h"
+#include <pthread.h>
+
+  typedef struct {
+      poolTask_t *task;
+      void *arg;
+  } poolJob_t;
+
+  static poolJob_t queue[POOL_QUEUE_DEPTH];
+  static unsigned int queueHead = 0, queueTail = 0;  // tail - head = depth
+  static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+  static pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+  static pthread_cond_t queueNotFull = PTHREAD_COND_INITIALIZER;
+  static int workers = 0;
+
+static void *poolWorker(void *unused) {
+    poolJob_t job;
+
+// workers never need to see the daemon's signals, the read loop does
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (queueTail == queueHead) {
+            pthread_cond_wait(&queueNotEmpty, &queueLock);
+        }
+        job = queue[queueHead++ % POOL_QUEUE_DEPTH];
+        pthread_cond_signal(&queueNotFull);
+        pthread_mutex_unlock(&queueLock);
+
+        job.task(job.arg);
+    }
+    return NULL;
+}
+
+static void poolForkPrepare(void) {
+    pthread_mutex_lock(&queueLock);
+}
+
+static void poolForkDone(void) {
+    pthread_mutex_unlock(&queueLock);
+}
+
+// queueLock is held across fork(), see main()
+void poolForkSafe(void) {
+    pthread_atfork(poolForkPrepare, poolForkDone, poolForkDone);
+}
+
+// returns the number of workers running, which is zero on failure
+int poolStart(int threads) {
+    pthread_t tid;
+
+    while (workers < threads) {
+        if (pthread_create(&tid, NULL, poolWorker, NULL) != 0) break;
+        pthread_detach(tid);
+        workers++;
+    }
+    return workers;
+}
+
+void poolSubmit(poolTask_t *task, void *arg) {
+    pthread_mutex_lock(&queueLock);
+    while (queueTail - queueHead >= POOL_QUEUE_DEPTH) {
+        pthread_cond_wait(&queueNotFull, &queueLock);
+    }
+    queue[queueTail % POOL_QUEUE_DEPTH].task = task;
+    queue[queueTail % POOL_QUEUE_DEPTH].arg = arg;
+    queueTail++;
+    pthread_cond_signal(&queueNotEmpty);
+    pthread_mutex_unlock(&queueLock);
+}
+
+int poolRunning(void) {
+    return workers;
+}
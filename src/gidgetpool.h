@@ -0,0 +1,29 @@
+/*
+
+    A small fixed pool of worker threads fed from a bounded
+    queue.  Native tricks run here so that the daemon's read
+    loop never waits on anybody's handler.
+
+    poolSubmit() blocks while the queue is full.  That pushes
+    back on the read loop, which pushes back on the kernel
+    event queue, which at least tells us (IN_Q_OVERFLOW) if
+    things ever get that bad.
+
+*/
+
+// simple inclusion guard
+#ifndef _GIG_POOL
+
+# define _GIG_POOL
+
+# define POOL_THREADS 4        // workers started by poolStart()
+# define POOL_QUEUE_DEPTH 1024 // tasks allowed to wait for a worker
+
+  typedef void poolTask_t(void *arg);
+
+  int poolStart(int threads);
+  void poolSubmit(poolTask_t *task, void *arg);
+  int poolRunning(void);
+  void poolForkSafe(void);
+
+#endif
@@ -0,0 +1,521 @@
+/*
+
+  The mail queue.  See gidgetqueue.h for the spool layout.
+
+  Producers (event children, native handlers, digests) write
+  a message with mailStream() and commit it with mailFinish().
+  The daemon learns about messages queued by event children
+  from their completion reports; anything it never heard of
+  (a child killed between the two) is found by the scan of
+  the queue directory at the next start.
+
+  Couriers are threads, a fixed number of them, so mail
+  concurrency is set by -M and has nothing to do with how
+  many scripts are running.  Each takes a batch of due
+  messages and hands it to the transport: one sendmail
+  process per message, or one pipelined SMTP/LMTP session
+  per courier.  Transient failures go back on the queue with
+  an exponential backoff; messages that fail for good, or
+  too often, are moved to spooldir/failed for a human.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgetmail.h"          // define mailer here
+#include "gidgetqueue.h"
+#include <pthread.h>             // couriers are threads
+#include <dirent.h>              // the start up scan
+#include <sysexits.h>            // EX_TEMPFAIL
+
+#define MAIL_CONNECTIONS 2       // couriers started when -M doesn't say
+#define MAIL_MAX_CONNECTIONS 16
+#define MAIL_PIPELINE 16         // messages a courier takes at once
+#define MAIL_RETRIES 8           // transient failures before giving up
+#define MAIL_BACKOFF 15          // seconds before the first retry
+#define MAIL_MAX_BACKOFF 3600
+#define MAIL_IDLE_SECONDS 60     // hang up after this long with nothing to send
+#define MAIL_STOP_SECONDS 10     // how long shutdown waits on busy couriers
+#define MAIL_STALE_SECONDS 3600  // age at which a tmp file is abandoned
+
+  static mail_t *queueHead = NULL, *queueTail = NULL;
+  static int queued = 0, couriers = 0, stopping = 0, smtp = 0, connections;
+  static pid_t queuePid = 0;     // mailFinish() only enqueues in the daemon
+  static unsigned int queueSeq = 0;
+  static pthread_mutex_t mailLock = PTHREAD_MUTEX_INITIALIZER;
+  static pthread_cond_t mailReady = PTHREAD_COND_INITIALIZER;
+  static pthread_cond_t mailIdle = PTHREAD_COND_INITIALIZER;
+  static opts_t mailOpt;
+
+static void mailForkPrepare(void) {
+    pthread_mutex_lock(&mailLock);
+}
+
+static void mailForkDone(void) {
+    pthread_mutex_unlock(&mailLock);
+}
+
+// mailLock is held across fork(), see main()
+void mailForkSafe(void) {
+    pthread_atfork(mailForkPrepare, mailForkDone, mailForkDone);
+}
+
+// Check a -M transport specification, "sendmail", "smtp:..." or
+// "lmtp:...", each with an optional ",n" connection count.  Remembers
+// it if record is set.  Returns 0 if usable, -1 with the reason in why
+int mailTransportCheck(const char *spec, char *why, size_t whyLen, int record) {
+    char copy[MAX_TRANSPORT_LEN];
+    char *comma;
+    int count = MAIL_CONNECTIONS;
+
+    if (strlen(spec) >= sizeof(copy)) {
+        snprintf(why, whyLen, "transport %s is too long", spec);
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    if ((comma = strrchr(copy, ',')) != NULL) {
+        *comma = '\0';
+        count = atoi(comma + 1);
+        if ((count < 1) || (count > MAIL_MAX_CONNECTIONS)) {
+            snprintf(why, whyLen, "transport connections must be 1 to %d",
+                     MAIL_MAX_CONNECTIONS);
+            return -1;
+        }
+    }
+
+    if ((copy[0] == '\0') || (strcmp(copy, "sendmail") == 0)) {
+        if (record) smtp = 0;
+    } else {
+        if (smtpCheck(copy, why, whyLen, record) < 0) return -1;
+        if (record) smtp = 1;
+    }
+    if (record) connections = count;
+    return 0;
+}
+
+/*
+    Producing.  Messages are written under tmp and renamed into
+    queue, so a half written message is never seen by a courier.
+*/
+
+// Start a message for recipient.  Returns a stream to write the
+// headers and body into, or NULL.  slot remembers where it lives
+FILE *mailStream(opts_t opt, const char *recipient, mailSlot_t *slot) {
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    FILE *mailslot;
+
+    snprintf(slot->name, sizeof(slot->name), "%ld.%d.%u", (long) time(NULL), getpid(),
+             __atomic_fetch_add(&queueSeq, 1, __ATOMIC_RELAXED));
+    sprintf(path, "%s/tmp/%s", opt.spooldir, slot->name);
+
+    if ((slot->handle = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640)) < 0) {
+        return NULL;
+    }
+    if ((mailslot = fdopen(slot->handle, "w")) == NULL) {
+        close(slot->handle);
+        unlink(path);
+        return NULL;
+    }
+    fprintf(mailslot, "%s%s\n", MAIL_ENVELOPE, recipient);
+    return mailslot;
+}
+
+// Commit a message started with mailStream(), closing the stream.
+// In the daemon the couriers are told straight away; an event child
+// passes slot->name back in its report instead.  Returns 0 or -1
+int mailFinish(opts_t opt, FILE *mailslot, mailSlot_t *slot) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char temp[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+
+    sprintf(temp, "%s/tmp/%s", opt.spooldir, slot->name);
+    sprintf(path, "%s/queue/%s", opt.spooldir, slot->name);
+
+    if ((fflush(mailslot) != 0) || (fdatasync(fileno(mailslot)) < 0)) {
+        fclose(mailslot);
+        goto failed;
+    }
+    if ((fclose(mailslot) != 0) || (rename(temp, path) < 0)) goto failed;
+
+    if (getpid() == queuePid) mailEnqueue(slot->name);
+    return 0;
+
+failed:
+    sprintf(logtxt, "unable to queue mail %s: %s", slot->name, strerror(errno));
+    logx(0, opt, logtxt);
+    unlink(temp);
+    return -1;
+}
+
+// withdraw a message the daemon decided not to send after all
+void mailDiscard(opts_t opt, const char *name) {
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+
+    sprintf(path, "%s/queue/%s", opt.spooldir, name);
+    unlink(path);
+}
+
+/*
+    Consuming.  The queue proper is a list of names; files are
+    only opened while a courier is working on them.
+*/
+
+// caller holds mailLock
+static void queueAppend(mail_t *m) {
+    m->next = NULL;
+    if (queueTail != NULL) queueTail->next = m;
+    else queueHead = m;
+    queueTail = m;
+    queued++;
+    metricGauge(GAUGE_MAIL_QUEUED, queued);
+    pthread_cond_signal(&mailReady);
+}
+
+// tell the couriers about a message sitting in spooldir/queue
+void mailEnqueue(const char *name) {
+    mail_t *m = calloc(1, sizeof(mail_t));
+
+    if ((m == NULL) || (strlen(name) >= sizeof(m->name))) {
+        free(m);
+        return;      // it'll be found by the scan at the next start
+    }
+    strcpy(m->name, name);
+    m->message = -1;
+    pthread_mutex_lock(&mailLock);
+    queueAppend(m);
+    pthread_mutex_unlock(&mailLock);
+}
+
+// Take up to max due messages off the queue.  Caller holds mailLock.
+// Sets *wake to the next time something will be due, if anything
+static int queueTake(mail_t **batch, int max, time_t now, time_t *wake) {
+    mail_t **link = &queueHead, *m;
+    int n = 0;
+
+    *wake = 0;
+    queueTail = NULL;
+    while ((m = *link) != NULL) {
+        if ((n < max) && (m->due <= now)) {
+            *link = m->next;
+            batch[n++] = m;
+            queued--;
+            metricGauge(GAUGE_MAIL_QUEUED, queued);
+            continue;
+        }
+        if ((m->due > now) && ((*wake == 0) || (m->due < *wake))) *wake = m->due;
+        queueTail = m;
+        link = &m->next;
+    }
+    return n;
+}
+
+// open a queued message and read its envelope.  Returns 0 or -1
+static int mailLoad(mail_t *m) {
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    char envelope[MAX_ERR_TEXT_LEN];
+    ssize_t got;
+    char *eol;
+
+    sprintf(path, "%s/queue/%s", mailOpt.spooldir, m->name);
+    if ((m->message = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+
+    got = pread(m->message, envelope, sizeof(envelope) - 1, 0);
+    if (got > 0) {
+        envelope[got] = '\0';
+        if ((strncmp(envelope, MAIL_ENVELOPE, strlen(MAIL_ENVELOPE)) == 0) &&
+            ((eol = strchr(envelope, '\n')) != NULL)) {
+            *eol = '\0';
+            m->start = eol + 1 - envelope;
+            free(m->recipient);
+            if ((m->recipient = strdup(envelope + strlen(MAIL_ENVELOPE))) != NULL) return 0;
+        }
+    }
+    close(m->message);
+    m->message = -1;
+    errno = EINVAL;
+    return -1;
+}
+
+// Hand one message to sendmail.  Returns an SMTP style reply code so
+// both transports look the same to the courier.
+//
+// The daemon's SIGCHLD auto reaper would take sendmail's exit status
+// before we could wait for it, so a go-between child puts SIGCHLD back
+// to the default, runs sendmail with the message as its stdin, waits
+// for it, and writes the status back up a pipe.  Both are forked from
+// a threaded process, so neither calls anything but async signal safe
+// functions before the exec
+static int sendmailDeliver(mail_t *m) {
+    struct sigaction dfl;
+    sigset_t none;
+    int status, fds[2];
+    pid_t relay, mailer;
+    ssize_t got;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) return 451;
+    if (lseek(m->message, m->start, SEEK_SET) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 451;
+    }
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigemptyset(&none);
+
+    if ((relay = fork()) == 0) {
+        sigaction(SIGCHLD, &dfl, NULL);
+        status = -1;
+        if ((mailer = fork()) == 0) {
+            sigprocmask(SIG_SETMASK, &none, NULL);  // couriers block everything
+            if (dup2(m->message, 0) < 0) _exit(EX_TEMPFAIL);
+            execl("/bin/sh", "sh", "-c", MAILCOMMAND, (char *) NULL);
+            _exit(EX_TEMPFAIL);
+        }
+        if (mailer > 0) {
+            while ((waitpid(mailer, &status, 0) < 0) && (errno == EINTR));
+        }
+        write(fds[1], &status, sizeof(status));
+        _exit(0);
+    }
+    close(fds[1]);
+    if (relay < 0) {
+        close(fds[0]);
+        return 451;
+    }
+    while (((got = read(fds[0], &status, sizeof(status))) < 0) && (errno == EINTR));
+    close(fds[0]);
+    if (got != sizeof(status)) return 451;      // the go-between died first
+
+    if (status == 0) return 250;
+    if ((status == -1) || !WIFEXITED(status) || (WEXITSTATUS(status) == EX_TEMPFAIL)) {
+        return 451;
+    }
+    return 554;
+}
+
+// move a message out of the way for a human to look at
+static void mailQuarantine(mail_t *m, int code) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    char failed[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+
+    sprintf(path, "%s/queue/%s", mailOpt.spooldir, m->name);
+    sprintf(failed, "%s/failed/%s", mailOpt.spooldir, m->name);
+    rename(path, failed);
+    sprintf(logtxt, "mail %s for %s failed with %d after %d attempts, kept in %s",
+            m->name, m->recipient ? m->recipient : "?", code, m->attempts + 1, failed);
+    logx(0, mailOpt, logtxt);
+}
+
+// a message delivered, counted for the metrics and gone from the queue
+static void mailDone(mail_t *m) {
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    struct stat st;
+
+    metricAdd(METRIC_MAIL_MESSAGES, 1);
+    st.st_size = m->start;
+    if (fstat(m->message, &st) == 0) metricAdd(METRIC_MAIL_BYTES, st.st_size - m->start);
+    flightRecord(FLIGHT_MAILED, -1, 0, 0, st.st_size - m->start, m->recipient);
+    sprintf(path, "%s/queue/%s", mailOpt.spooldir, m->name);
+    unlink(path);
+}
+
+static void *courier(void *unused) {
+    char logtxt[MAX_ERR_TEXT_LEN], why[512];
+    mail_t *batch[MAIL_PIPELINE], *loaded[MAIL_PIPELINE];
+    int result[MAIL_PIPELINE], code[MAIL_PIPELINE];
+    session_t *s = NULL;
+    struct timespec until;
+    time_t now, wake, lastWork = time(NULL);
+    int i, n, ready, down = 0;
+
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, NULL);
+
+    if (smtp && ((s = smtpSession()) == NULL)) goto gone;
+
+    for (;;) {
+        pthread_mutex_lock(&mailLock);
+        for (n = 0; !stopping; ) {
+            now = time(NULL);
+            if ((n = queueTake(batch, MAIL_PIPELINE, now, &wake)) > 0) break;
+
+        // nothing due: hang up if we've been idle a while, then sleep
+            if ((s != NULL) && smtpConnected(s)) {
+                if (now - lastWork >= MAIL_IDLE_SECONDS) {
+                    pthread_mutex_unlock(&mailLock);
+                    smtpClose(s, 1);
+                    pthread_mutex_lock(&mailLock);
+                    continue;
+                }
+                if ((wake == 0) || (lastWork + MAIL_IDLE_SECONDS < wake)) {
+                    wake = lastWork + MAIL_IDLE_SECONDS;
+                }
+            }
+            if (wake == 0) {
+                pthread_cond_wait(&mailReady, &mailLock);
+            } else {
+                until.tv_sec = wake;
+                until.tv_nsec = 0;
+                pthread_cond_timedwait(&mailReady, &mailLock, &until);
+            }
+        }
+        pthread_mutex_unlock(&mailLock);
+        if (n == 0) break;      // stopping, and the queue stays on disk
+
+    // anything that has vanished was dealt with by somebody else
+        for (i = ready = 0; i < n; i++) {
+            if (mailLoad(batch[i]) == 0) {
+                loaded[ready++] = batch[i];
+            } else {
+                if (errno != ENOENT) mailQuarantine(batch[i], 0);
+                free(batch[i]->recipient);
+                free(batch[i]);
+            }
+        }
+
+        if (s != NULL) {
+            if (!smtpConnected(s)) {
+            // say so once when the server goes away, and once when it's back
+                if (smtpOpen(s, why, sizeof(why)) < 0) {
+                    if (!down) {
+                        sprintf(logtxt, "mail transport down, queueing: %s", why);
+                        logx(0, mailOpt, logtxt);
+                    }
+                    down = 1;
+                } else if (down) {
+                    logx(0, mailOpt, "mail transport back up");
+                    down = 0;
+                }
+            }
+            for (i = 0; i < ready; i++) result[i] = -1;
+            if ((ready > 0) && smtpConnected(s)) smtpDeliver(s, loaded, ready, result);
+            for (i = 0; i < ready; i++) {
+                if (result[i] < 0) {
+                    smtpClose(s, 0);  // lost its way mid batch, can't be trusted
+                    break;
+                }
+            }
+        } else {
+            for (i = 0; i < ready; i++) result[i] = sendmailDeliver(loaded[i]);
+        }
+        lastWork = time(NULL);
+
+        for (i = 0; i < ready; i++) {
+            mail_t *m = loaded[i];
+            code[i] = (result[i] < 0) ? 421 : result[i];
+
+            if ((code[i] >= 200) && (code[i] < 300)) {
+                if (mailOpt.verbose) {
+                    sprintf(logtxt, "delivered mail %s for %s via %s", m->name, m->recipient,
+                            (s != NULL) ? smtpEndpoint() : MAIL_TRANSPORT);
+                    logx(0, mailOpt, logtxt);
+                }
+                mailDone(m);
+            } else if ((code[i] < 500) && (m->attempts < MAIL_RETRIES)) {
+                long delay = MAIL_BACKOFF << m->attempts;
+                if (delay > MAIL_MAX_BACKOFF) delay = MAIL_MAX_BACKOFF;
+                m->attempts++;
+                m->due = time(NULL) + delay;
+                metricAdd(METRIC_MAIL_DEFERRED, 1);
+                close(m->message);
+                m->message = -1;
+                pthread_mutex_lock(&mailLock);
+                queueAppend(m);
+                pthread_mutex_unlock(&mailLock);
+                continue;
+            } else if ((s != NULL) && (code[i] < 500) && (sendmailDeliver(m) == 250)) {
+                sprintf(logtxt, "mail %s for %s failed %d times, handed to %s",
+                        m->name, m->recipient, m->attempts + 1, MAIL_TRANSPORT);
+                logx(0, mailOpt, logtxt);
+                mailDone(m);
+            } else {
+                metricAdd(METRIC_MAIL_FAILED, 1);
+                flightRecord(FLIGHT_MAIL_FAILED, -1, 0, 0, m->attempts + 1, m->recipient);
+                mailQuarantine(m, code[i]);
+            }
+            close(m->message);
+            free(m->recipient);
+            free(m);
+        }
+    }
+
+gone:
+    if (s != NULL) {
+        smtpClose(s, 1);
+        free(s);
+    }
+    pthread_mutex_lock(&mailLock);
+    couriers--;
+    pthread_cond_broadcast(&mailIdle);
+    pthread_mutex_unlock(&mailLock);
+    return NULL;
+}
+
+// Pick up whatever an earlier gidget left in the queue, clear out
+// abandoned tmp files and start the couriers.  Returns how many
+int mailStart(opts_t opt) {
+    char logtxt[MAX_ERR_TEXT_LEN], why[512];
+    char path[MAX_SPOOL_NAME_LEN + MAIL_NAME_LEN + 16];
+    struct dirent *entry;
+    struct stat sb;
+    pthread_t tid;
+    DIR *dir;
+    int found = 0;
+
+    if (mailTransportCheck(opt.transport, why, sizeof(why), 1) < 0) return 0;
+    mailOpt = opt;
+    queuePid = getpid();
+
+    sprintf(path, "%s/tmp", opt.spooldir);
+    if ((dir = opendir(path)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            sprintf(path, "%s/tmp/%.*s", opt.spooldir, MAIL_NAME_LEN, entry->d_name);
+            if ((stat(path, &sb) == 0) && (sb.st_mtime + MAIL_STALE_SECONDS < time(NULL))) {
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+
+    sprintf(path, "%s/queue", opt.spooldir);
+    if ((dir = opendir(path)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            mailEnqueue(entry->d_name);
+            found++;
+        }
+        closedir(dir);
+    }
+    if (found > 0) {
+        sprintf(logtxt, "found %d queued messages in %s", found, path);
+        logx(0, opt, logtxt);
+    }
+
+    while (couriers < connections) {
+        if (pthread_create(&tid, NULL, courier, NULL) != 0) break;
+        pthread_detach(tid);
+        pthread_mutex_lock(&mailLock);
+        couriers++;
+        pthread_mutex_unlock(&mailLock);
+    }
+    return couriers;
+}
+
+// Stop the couriers.  Whatever hasn't gone yet stays in the queue
+// directory for next time, so there is no need to wait long
+void mailStop(opts_t opt) {
+    struct timespec until;
+
+    pthread_mutex_lock(&mailLock);
+    stopping = 1;
+    pthread_cond_broadcast(&mailReady);
+    until.tv_sec = time(NULL) + MAIL_STOP_SECONDS;
+    until.tv_nsec = 0;
+    while (couriers > 0) {
+        if (pthread_cond_timedwait(&mailIdle, &mailLock, &until) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&mailLock);
+}
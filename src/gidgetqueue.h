@@ -0,0 +1,51 @@
+/*
+
+    The mail queue and the transports that drain it.
+
+    Every message gidget sends is first written to a file
+    under spooldir/tmp, synced, and renamed into spooldir/queue
+    (the rename is what makes it real).  A small fixed set of
+    courier threads in the daemon delivers from the queue and
+    removes each file once the transport has accepted it, so a
+    slow or dead MTA holds up nothing but the couriers, and
+    queued mail outlives a restart.
+
+    The first line of a queue file is the envelope,
+        gidget-envelope <recipient>
+    and everything after it is the message proper.
+
+    gidgetqueue.c runs the queue and the sendmail transport,
+    gidgetsmtp.c speaks SMTP and LMTP.
+
+*/
+
+// simple inclusion guard
+#ifndef _GIG_QUEUE
+
+# define _GIG_QUEUE
+
+# define MAIL_ENVELOPE "gidget-envelope "
+
+  typedef struct mail_s {
+      struct mail_s *next;
+      char name[MAIL_NAME_LEN];   // file name in spooldir/queue
+      char *recipient;      // from the envelope, once opened
+      int message;          // open only while being delivered
+      off_t start;          // where the message proper begins
+      int attempts;         // transient failures so far
+      time_t due;
+  } mail_t;
+
+// SMTP and LMTP sessions, see gidgetsmtp.c
+
+  typedef struct session_s session_t;
+
+  int smtpCheck(const char *spec, char *why, size_t whyLen, int record);
+  const char *smtpEndpoint(void);
+  session_t *smtpSession(void);
+  int smtpOpen(session_t *s, char *why, size_t whyLen);
+  int smtpConnected(const session_t *s);
+  void smtpClose(session_t *s, int polite);
+  void smtpDeliver(session_t *s, mail_t **batch, int n, int *result);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+
+  Suppression of repeated output.  When something a trick
+  depends on falls over, every event produces the same error
+  text and every one of them used to become a message.  A
+  trick with dedupe=s has the hash of each run's output
+  looked up here: the first of a kind goes out as usual and
+  opens a window of s seconds, and identical output inside
+  the window is dropped and counted.  When the window closes
+  with anything counted the recipient gets a single notice
+  saying how many times it repeated, and a new window opens;
+  a window that closes quietly is forgotten.  An incident
+  that lasts all night then costs one message plus a notice
+  every s seconds.
+
+  Only the daemon's read loop comes here, so no locking.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+
+#define REPEAT_SLOTS 1024        // distinct outputs remembered at once
+#define REPEAT_MAX_WINDOW 86400
+
+  typedef struct {
+      uint64_t hash;        // of the output, 0 marks a free slot
+      int32_t trick;
+      time_t sent;          // when it actually went out
+      time_t opened;        // when the current window opened
+      time_t due;           // and when it closes
+      int repeats;          // dropped in the current window
+      char *last;           // object of the most recent repeat
+  } repeat_t;
+
+  static repeat_t repeats[REPEAT_SLOTS];
+
+// Parse a trick option word.  Returns 1 if it was ours,
+// 0 if it wasn't, or -1 if it was ours but malformed
+int repeatOption(trick_t *pony, const char *word) {
+    char *end;
+    long n;
+
+    if (strncmp(word, "dedupe=", 7) != 0) return 0;
+    n = strtol(word + 7, &end, 10);
+    if ((end == word + 7) || (*end != '\0') || (n < 1) || (n > REPEAT_MAX_WINDOW)) return -1;
+    pony->dedupeWindow = n;
+    return 1;
+}
+
+// tell the recipient how often a window's output repeated
+static void repeatNotice(opts_t opt, trick_t **trickHeap, const repeat_t *r, time_t now) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char text[MAX_ERR_TEXT_LEN];
+    char sentTime[26];
+    struct tm when;
+    const trick_t *pony = trickHeap[r->trick];
+    const char *object = (r->last != NULL) ? r->last : pony->fileName;
+    int textLen;
+
+    strftime(sentTime, sizeof(sentTime), "%a %b %e %T %Y", logTime(r->sent, 1, &when));
+    textLen = snprintf(text, sizeof(text),
+                       "The output of %s repeated %d time%s in the last %ld seconds,\n"
+                       "most recently for %s.  It was last sent in full at %s,\n"
+                       "the repeats were suppressed (dedupe=%d).\n",
+                       pony->script, r->repeats, (r->repeats == 1) ? "" : "s",
+                       (long) (now - r->opened), object, sentTime, pony->dedupeWindow);
+    if (textLen >= (int) sizeof(text)) textLen = sizeof(text) - 1;
+
+    sprintf(logtxt, "output of %s repeated %d times, notifying %s",
+            pony->script, r->repeats, pony->mail);
+    logx(0, opt, logtxt);
+
+    // in digest mode the notice rides along with everything else
+    if (opt.digestCount > 0) {
+        digestAdd(opt, pony, object, 0, 0, -1, text, textLen);
+        return;
+    }
+
+    mailSlot_t slot;
+    FILE *mailslot = mailStream(opt, pony->mail, &slot);
+    if (mailslot == NULL) {
+        sprintf(logtxt, "unable to queue repeat notice for %s: %s", pony->mail, strerror(errno));
+        logx(0, opt, logtxt);
+        return;
+    }
+    char subject[strlen(pony->script) + 64];
+    sprintf(subject, "output of %s repeated %d time%s:", pony->script, r->repeats,
+            (r->repeats == 1) ? "" : "s");
+    mailHeaders(mailslot, pony, object, pony->watchHandle, 0, subject);
+    fwrite(text, 1, textLen, mailslot);
+    mailFinish(opt, mailslot, &slot);
+}
+
+static void repeatFree(repeat_t *r) {
+    free(r->last);
+    memset(r, 0, sizeof(*r));
+}
+
+// Look up one run's output.  Returns 1 if it repeats output already
+// sent inside its trick's window and should be dropped, 0 if it
+// should go out.  object is what the run was for
+int repeatSuppress(opts_t opt, trick_t **trickHeap, int32_t trick, uint64_t hash,
+                   const char *object) {
+    const trick_t *pony = trickHeap[trick];
+    time_t now = time(NULL);
+    repeat_t *r, *slot = NULL, *oldest = NULL;
+    int i;
+
+    if ((pony->dedupeWindow == 0) || (hash == 0)) return 0;
+
+    for (i = 0; i < REPEAT_SLOTS; i++) {
+        r = &repeats[i];
+        if (r->hash == 0) {
+            if (slot == NULL) slot = r;
+            continue;
+        }
+        if ((r->hash == hash) && (r->trick == trick)) {
+            if (r->due <= now) break;     // window closed, the flush is behind
+            r->repeats++;
+            char *copy = strdup(object);
+            if (copy != NULL) {
+                free(r->last);
+                r->last = copy;
+            }
+            return 1;
+        }
+        if ((oldest == NULL) || (r->due < oldest->due)) oldest = r;
+    }
+
+    if (i < REPEAT_SLOTS) {       // closed window, settle it and start again
+        if (r->repeats > 0) repeatNotice(opt, trickHeap, r, now);
+        repeatFree(r);
+        slot = r;
+    } else if (slot == NULL) {    // full, the window closest to closing goes early
+        if (oldest->repeats > 0) repeatNotice(opt, trickHeap, oldest, now);
+        repeatFree(oldest);
+        slot = oldest;
+    }
+    slot->hash = hash;
+    slot->trick = trick;
+    slot->sent = slot->opened = now;
+    slot->due = now + pony->dedupeWindow;
+    return 0;
+}
+
+// milliseconds until a window with repeats closes, -1 if none will
+int repeatTimeout(time_t now) {
+    long wait = -1, due;
+    int i;
+
+    for (i = 0; i < REPEAT_SLOTS; i++) {
+        if ((repeats[i].hash == 0) || (repeats[i].repeats == 0)) continue;
+        due = (repeats[i].due > now) ? (repeats[i].due - now) * 1000 : 0;
+        if ((wait < 0) || (due < wait)) wait = due;
+    }
+    return (int) wait;
+}
+
+// Close windows that are due, or all of them if forced, sending a
+// notice for each that dropped anything.  A window that repeated
+// stays open for another round, one that didn't is forgotten
+void repeatFlush(opts_t opt, trick_t **trickHeap, int force) {
+    time_t now = time(NULL);
+    repeat_t *r;
+    int i;
+
+    for (i = 0; i < REPEAT_SLOTS; i++) {
+        r = &repeats[i];
+        if ((r->hash == 0) || (!force && (r->due > now))) continue;
+        if ((r->repeats == 0) || force) {
+            if (r->repeats > 0) repeatNotice(opt, trickHeap, r, now);
+            repeatFree(r);
+            continue;
+        }
+        repeatNotice(opt, trickHeap, r, now);
+        r->opened = now;
+        r->due = now + trickHeap[r->trick]->dedupeWindow;
+        r->repeats = 0;
+    }
+}
+
+// mark in busy every trick with a window open
+void repeatBusy(char *busy, int32_t trickCount) {
+    int i;
+
+    for (i = 0; i < REPEAT_SLOTS; i++) {
+        if ((repeats[i].hash != 0) && (repeats[i].trick < trickCount)) {
+            busy[repeats[i].trick] = 1;
+        }
+    }
+}
@@ -0,0 +1,395 @@
+/*
+
+  The retry queue.  When a script fails with a retryable
+  status and its trick has a retry policy, the event is
+  parked here and handed back to the read loop once its
+  backoff has expired, just as if inotify had sent it again.
+
+  Pending retries live in a binary min-heap ordered by due
+  time, and are written out to the spool directory so that
+  they survive a daemon restart.  Writes are batched: the
+  queue is marked dirty and saved at most once per second.
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgethash.h"          // keys for coalescing
+
+#define RETRY_FILE_NAME "retry.queue"
+#define RETRY_MAX_DELAY 3600     // never wait more than an hour
+#define RETRY_SAVE_INTERVAL 1    // seconds between saves of a dirty queue
+
+  typedef struct {
+      time_t due;
+      int32_t trick;
+      uint32_t mask;
+      uint32_t cookie;
+      int attempt;          // attempts already made
+      uint64_t key;         // trick and name, for coalescing
+      char *name;
+  } retry_t;
+
+  static retry_t *heap = NULL;
+  static unsigned int heapSize = 0, heapUsed = 0;
+  static int dirty = 0;
+  static time_t lastSave = 0;
+
+static uint64_t retryKey(int32_t trick, const char *name) {
+    return gigHashBytes(name, strlen(name), (uint64_t) trick + 1);
+}
+
+static void heapSwap(unsigned int a, unsigned int b) {
+    retry_t t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+}
+
+static void heapUp(unsigned int i) {
+    while ((i > 0) && (heap[(i - 1) / 2].due > heap[i].due)) {
+        heapSwap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heapDown(unsigned int i) {
+    unsigned int smallest, l, r;
+    for (;;) {
+        l = i * 2 + 1;
+        r = l + 1;
+        smallest = i;
+        if ((l < heapUsed) && (heap[l].due < heap[smallest].due)) smallest = l;
+        if ((r < heapUsed) && (heap[r].due < heap[smallest].due)) smallest = r;
+        if (smallest == i) return;
+        heapSwap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heapDelete(unsigned int i) {
+    free(heap[i].name);
+    heap[i] = heap[--heapUsed];
+    if (i < heapUsed) {
+        heapDown(i);
+        heapUp(i);
+    }
+}
+
+static int heapPush(time_t due, int32_t trick, uint32_t mask, uint32_t cookie,
+                    int attempt, const char *name) {
+    if (heapUsed == heapSize) {
+        unsigned int newSize = heapSize ? heapSize * 2 : 64;
+        retry_t *bigger = realloc(heap, newSize * sizeof(retry_t));
+        if (bigger == NULL) return -1;
+        heap = bigger;
+        heapSize = newSize;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) return -1;
+
+    heap[heapUsed].due = due;
+    heap[heapUsed].trick = trick;
+    heap[heapUsed].mask = mask;
+    heap[heapUsed].cookie = cookie;
+    heap[heapUsed].attempt = attempt;
+    heap[heapUsed].key = retryKey(trick, name);
+    heap[heapUsed].name = copy;
+    heapUp(heapUsed++);
+    dirty = 1;
+    return 0;
+}
+
+// Parse "retry=", "backoff=", "jitter=" and "retrycodes=" trick options.
+// Returns 1 if the word was a retry option, 0 if not ours, -1 if bogus
+int retryOption(trick_t *pony, const char *word) {
+    char *end;
+    long n;
+
+    if (strncmp(word, "retry=", 6) == 0) {
+        n = strtol(word + 6, &end, 10);
+        if ((*end != '\0') || (n < 0) || (n > 1000)) return -1;
+        pony->retryMax = n;
+        return 1;
+    }
+    if (strncmp(word, "backoff=", 8) == 0) {
+        n = strtol(word + 8, &end, 10);
+        if ((*end != '\0') || (n < 1) || (n > RETRY_MAX_DELAY)) return -1;
+        pony->retryBackoff = n;
+        return 1;
+    }
+    if (strncmp(word, "jitter=", 7) == 0) {
+        n = strtol(word + 7, &end, 10);
+        if ((*end != '\0') || (n < 0) || (n > 100)) return -1;
+        pony->retryJitter = n;
+        return 1;
+    }
+    if (strncmp(word, "retrycodes=", 11) == 0) {
+    // slash separated, since commas already separate the options
+        const char *p = word + 11;
+        memset(pony->retryCodes, 0, sizeof(pony->retryCodes));
+        do {
+            n = strtol(p, &end, 10);
+            if ((end == p) || (n < 1) || (n > 255) || ((*end != '/') && (*end != '\0'))) {
+                return -1;
+            }
+            pony->retryCodes[n / 8] |= 1 << (n % 8);
+            p = end + 1;
+        } while (*end == '/');
+        return 1;
+    }
+    return 0;
+}
+
+// is this exit status worth another go?  Without an explicit list,
+// anything but success and the shell's 126/127 "couldn't run it" is
+static int retryable(const trick_t *pony, int status) {
+    unsigned int i;
+
+    if ((status < 1) || (status > 255)) return 0;
+    for (i = 0; i < sizeof(pony->retryCodes); i++) {
+        if (pony->retryCodes[i] != 0) {
+            return (pony->retryCodes[status / 8] & (1 << (status % 8))) != 0;
+        }
+    }
+    return (status < 126);
+}
+
+// Decide whether a failed run gets another attempt, and if so when.
+// Returns the delay in seconds, 0 if the event is not being retried
+// (no policy, status not retryable, or attempts used up), or -1 if
+// it should have been retried but we ran out of memory.
+int retrySchedule(const trick_t *pony, int32_t trick, uint32_t mask, uint32_t cookie,
+                  const char *name, int attempt, int status) {
+    long delay;
+
+    if ((pony->retryMax == 0) || (attempt > pony->retryMax) || !retryable(pony, status)) {
+        return 0;
+    }
+
+    delay = pony->retryBackoff;
+    for (int i = 1; (i < attempt) && (delay < RETRY_MAX_DELAY); i++) delay *= 2;
+    if (delay > RETRY_MAX_DELAY) delay = RETRY_MAX_DELAY;
+
+// jitter spreads a herd of simultaneous failures back out
+    if (pony->retryJitter != 0) {
+        long spread = delay * pony->retryJitter / 100;
+        if (spread > 0) delay += (random() % (2 * spread + 1)) - spread;
+        if (delay < 1) delay = 1;
+    }
+
+    if (heapPush(time(NULL) + delay, trick, mask, cookie, attempt, name) < 0) return -1;
+    return delay;
+}
+
+// a fresh event supersedes any retry pending for the same object.
+// Returns the number of retries dropped
+int retryCoalesce(int32_t trick, const char *name) {
+    unsigned int i = 0;
+    int dropped = 0;
+    uint64_t key;
+
+    if (heapUsed == 0) return 0;
+    key = retryKey(trick, name);
+    while (i < heapUsed) {
+        if ((heap[i].key == key) && (heap[i].trick == trick) &&
+            (strcmp(heap[i].name, name) == 0)) {
+            heapDelete(i);
+            dirty = 1;
+            dropped++;
+        } else {
+            i++;
+        }
+    }
+    return dropped;
+}
+
+// milliseconds until poll() should wake up for us, -1 for never
+int retryTimeout(time_t now) {
+    long wait = -1;
+
+    if (heapUsed != 0) {
+        wait = (heap[0].due > now) ? (heap[0].due - now) * 1000 : 0;
+    }
+    if (dirty) {
+        long save = (lastSave + RETRY_SAVE_INTERVAL > now) ?
+                    (lastSave + RETRY_SAVE_INTERVAL - now) * 1000 : 0;
+        if ((wait < 0) || (save < wait)) wait = save;
+    }
+    return (int) wait;
+}
+
+// Pop the next retry that has come due into buf as an inotify event.
+// buf must have room for an event_t plus NAME_MAX + 1.  Returns the
+// event, or NULL if nothing is due; *trick and *attempt are filled in
+event_t *retryDue(time_t now, char *buf, int32_t *trick, int *attempt) {
+    event_t *event = (event_t *) buf;
+    size_t nameLen;
+
+    if ((heapUsed == 0) || (heap[0].due > now)) return NULL;
+
+    nameLen = strlen(heap[0].name);
+    memset(event, 0, sizeof(event_t));
+    event->wd = heap[0].trick + 1;
+    event->mask = heap[0].mask;
+    event->cookie = heap[0].cookie;
+    event->len = nameLen ? nameLen + 1 : 0;
+    memcpy(event->name, heap[0].name, nameLen + 1);
+    *trick = heap[0].trick;
+    *attempt = heap[0].attempt + 1;
+
+    heapDelete(0);
+    dirty = 1;
+    return event;
+}
+
+int retryPending(void) {
+    return heapUsed;
+}
+
+// mark in busy every trick with a retry pending
+void retryBusy(char *busy, int32_t trickCount) {
+    unsigned int i;
+
+    for (i = 0; i < heapUsed; i++) {
+        if (heap[i].trick < trickCount) busy[heap[i].trick] = 1;
+    }
+}
+
+/*
+    The on-disk queue is plain text, one retry per line:
+        due attempt mask cookie watched-path script name
+    separated by tabs.  Tricks are identified by path and script
+    rather than position so that config edits between restarts
+    don't send retries to the wrong place.  Config fields can't
+    hold tabs (they aren't printable) but file names can hold
+    anything, so names are %XX escaped.
+*/
+
+static void retryEscape(FILE *fh, const char *name) {
+    for (; *name != '\0'; name++) {
+        if ((*name == '%') || (*name == '\t') || (*name == '\n') || (*name == '\r')) {
+            fprintf(fh, "%%%02X", (unsigned char) *name);
+        } else {
+            putc(*name, fh);
+        }
+    }
+}
+
+static void retryUnescape(char *name) {
+    char *in = name, *out = name;
+    unsigned int c;
+
+    while (*in != '\0') {
+        if ((in[0] == '%') && isxdigit(in[1]) && isxdigit(in[2]) &&
+            (sscanf(in + 1, "%2x", &c) == 1)) {
+            *out++ = (char) c;
+            in += 3;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+// Write the queue out if it has changed, no more than once a second
+// unless forced.  Written to a temp file and renamed, so a crash mid
+// save leaves the previous queue intact
+void retrySave(opts_t opt, trick_t **trickHeap, int force) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[MAX_SPOOL_NAME_LEN + 32], temp[MAX_SPOOL_NAME_LEN + 48];
+    time_t now = time(NULL);
+    unsigned int i;
+    FILE *fh;
+
+    if (!dirty) return;
+    if (!force && (now < lastSave + RETRY_SAVE_INTERVAL)) return;
+    lastSave = now;
+
+    sprintf(path, "%s/%s", opt.spooldir, RETRY_FILE_NAME);
+    sprintf(temp, "%s.%d", path, getpid());
+
+    if (heapUsed == 0) {
+        if ((unlink(path) < 0) && (errno != ENOENT)) goto failed;
+        dirty = 0;
+        return;
+    }
+
+    if ((fh = fopen(temp, "w")) == NULL) goto failed;
+    fprintf(fh, "# gidget retry queue, do not edit while gidget is running\n");
+    for (i = 0; i < heapUsed; i++) {
+        fprintf(fh, "%ld\t%d\t%u\t%u\t%s\t%s\t", (long) heap[i].due, heap[i].attempt,
+                heap[i].mask, heap[i].cookie,
+                trickHeap[heap[i].trick]->fileName, trickHeap[heap[i].trick]->script);
+        retryEscape(fh, heap[i].name);
+        putc('\n', fh);
+    }
+    if ((fflush(fh) != 0) || (fsync(fileno(fh)) < 0)) {
+        fclose(fh);
+        unlink(temp);
+        goto failed;
+    }
+    fclose(fh);
+    if (rename(temp, path) < 0) {
+        unlink(temp);
+        goto failed;
+    }
+    dirty = 0;
+    return;
+
+failed:
+    sprintf(logtxt, "unable to save retry queue to %s: %s", path, strerror(errno));
+    logx(0, opt, logtxt);
+}
+
+// reload retries saved by a previous gidget.  Returns how many
+int retryLoad(opts_t opt, trick_t **trickHeap, int trickCount) {
+    char logtxt[MAX_ERR_TEXT_LEN];
+    char path[MAX_SPOOL_NAME_LEN + 32];
+    char line[PATH_MAX * 3 + 64];
+    char *field[7], *save;
+    int loaded = 0, lineNo = 0, f, t;
+    FILE *fh;
+
+    sprintf(path, "%s/%s", opt.spooldir, RETRY_FILE_NAME);
+    if ((fh = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT) {
+            sprintf(logtxt, "unable to read retry queue %s: %s", path, strerror(errno));
+            logx(0, opt, logtxt);
+        }
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        lineNo++;
+        if (line[0] == '#') continue;
+        line[strcspn(line, "\n")] = '\0';
+
+        field[0] = strtok_r(line, "\t", &save);
+        for (f = 1; f < 6; f++) field[f] = strtok_r(NULL, "\t", &save);
+        field[6] = save;    // the name may be empty, strtok would skip it
+        if (field[5] == NULL) {
+            sprintf(logtxt, "ignoring garbled line %d of %s", lineNo, path);
+            logx(0, opt, logtxt);
+            continue;
+        }
+        retryUnescape(field[6]);
+
+        for (t = 0; t < trickCount; t++) {
+            if ((strcmp(trickHeap[t]->fileName, field[4]) == 0) &&
+                (strcmp(trickHeap[t]->script, field[5]) == 0)) break;
+        }
+        if (t == trickCount) {
+            sprintf(logtxt, "dropping saved retry of %s for %s, trick no longer configured",
+                    field[5], field[4]);
+            logx(0, opt, logtxt);
+            continue;
+        }
+
+        if (heapPush(atol(field[0]), t, strtoul(field[2], NULL, 10),
+                     strtoul(field[3], NULL, 10), atoi(field[1]), field[6]) == 0) {
+            loaded++;
+        }
+    }
+    fclose(fh);
+    dirty = 0;      // what's on disk is what we have
+    return loaded;
+}
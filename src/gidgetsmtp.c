@@ -0,0 +1,451 @@
+/*
+
+  The SMTP/LMTP mail transport.  With -M, the couriers keep a
+  session each open to a local MTA, over TCP or a Unix socket,
+  and push queued messages down it:
+
+      -M smtp://127.0.0.1:25       -M lmtp:/run/dovecot/lmtp
+      -M lmtp://localhost:24,3     (three connections)
+
+  When the server offers PIPELINING (LMTP always does) the end
+  of one message and the envelope of the next go out in a
+  single write, so a busy queue costs one round trip per
+  message instead of four.
+
+  The mail field of a trick can name several people, separated
+  by commas and/or whitespace, as sendmail -t took it; each gets
+  a RCPT of their own.  A message counts as delivered when any
+  of them accepted it, and recipients the server turned away
+  are not retried.
+
+  Queue files hold the message with LF line endings; the CRLFs
+  and the dot stuffing are added on the way out.  What to do
+  about failures is the queue's business, see gidgetqueue.c
+
+*/
+
+#include "gidget.h"              // stdio, friends, and tricks
+#include "gidgetqueue.h"
+#include <sys/socket.h>
+#include <sys/un.h>              // AF_UNIX endpoints
+#include <netdb.h>               // getaddrinfo
+
+#define MAIL_IO_TIMEOUT 120      // seconds to wait on a silent server
+#define MAIL_BUF_SIZE 65536
+#define MAIL_LINE_LEN 1024       // longest reply line we keep, RFC 5321 says 512
+#define RECIPIENT_SEPARATORS ", \t\r\n"
+
+  struct session_s {
+      int fd;
+      int pipelining;
+      char in[MAIL_BUF_SIZE];
+      size_t inStart, inEnd;
+      char out[MAIL_BUF_SIZE];
+      size_t outLen;
+  };
+
+// the endpoint, filled in by smtpCheck() when it's serious
+  static struct {
+      int lmtp;
+      int local;            // Unix socket rather than TCP
+      char host[256];
+      char port[16];
+      char path[108];       // sizeof(sun_path)
+  } endpoint;
+
+// Check an smtp: or lmtp: transport, and remember it if record is
+// set.  Returns 0 if usable, -1 with the reason in why if not
+int smtpCheck(const char *spec, char *why, size_t whyLen, int record) {
+    char copy[MAX_TRANSPORT_LEN];
+    char *rest, *colon;
+    int lmtp;
+
+    if (strlen(spec) >= sizeof(copy)) {
+        snprintf(why, whyLen, "transport %s is too long", spec);
+        return -1;
+    }
+    strcpy(copy, spec);
+
+    if (strncmp(copy, "smtp:", 5) == 0) lmtp = 0;
+    else if (strncmp(copy, "lmtp:", 5) == 0) lmtp = 1;
+    else {
+        snprintf(why, whyLen, "transport %s is not sendmail, smtp: or lmtp:", spec);
+        return -1;
+    }
+    rest = copy + 5;
+
+    if (strncmp(rest, "//", 2) == 0) {
+        rest += 2;
+        if ((colon = strrchr(rest, ':')) != NULL) *colon = '\0';
+        if ((*rest == '\0') || (strlen(rest) >= sizeof(endpoint.host)) ||
+            ((colon != NULL) && ((strlen(colon + 1) >= sizeof(endpoint.port)) ||
+                                 (strspn(colon + 1, "0123456789") != strlen(colon + 1))))) {
+            snprintf(why, whyLen, "transport %s has a bad host or port", spec);
+            return -1;
+        }
+        if (record) {
+            endpoint.local = 0;
+            strcpy(endpoint.host, rest);
+            strcpy(endpoint.port, (colon != NULL) ? colon + 1 : (lmtp ? "24" : "25"));
+        }
+    } else {
+        if ((*rest != '/') || (strlen(rest) >= sizeof(endpoint.path))) {
+            snprintf(why, whyLen, "transport %s needs an absolute socket path", spec);
+            return -1;
+        }
+        if (record) {
+            endpoint.local = 1;
+            strcpy(endpoint.path, rest);
+        }
+    }
+
+    if (record) endpoint.lmtp = lmtp;
+    return 0;
+}
+
+const char *smtpEndpoint(void) {
+    return endpoint.local ? endpoint.path : endpoint.host;
+}
+
+session_t *smtpSession(void) {
+    session_t *s = malloc(sizeof(session_t));
+    if (s != NULL) s->fd = -1;
+    return s;
+}
+
+int smtpConnected(const session_t *s) {
+    return (s->fd >= 0);
+}
+
+/*
+    Session plumbing: a buffered writer and a reply reader.
+    Anything that goes wrong on the wire returns -1 and the
+    courier hangs up and starts again.
+*/
+
+static int sessionFlush(session_t *s) {
+    size_t done = 0;
+    ssize_t put;
+
+    while (done < s->outLen) {
+        put = send(s->fd, s->out + done, s->outLen - done, MSG_NOSIGNAL);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += put;
+    }
+    s->outLen = 0;
+    return 0;
+}
+
+static int sessionWrite(session_t *s, const char *data, size_t len) {
+    size_t room;
+
+    while (len > 0) {
+        if (s->outLen == sizeof(s->out) && (sessionFlush(s) < 0)) return -1;
+        room = sizeof(s->out) - s->outLen;
+        if (room > len) room = len;
+        memcpy(s->out + s->outLen, data, room);
+        s->outLen += room;
+        data += room;
+        len -= room;
+    }
+    return 0;
+}
+
+static int sessionPrintf(session_t *s, const char *format, const char *arg) {
+    char line[MAX_ERR_TEXT_LEN];
+    int len = snprintf(line, sizeof(line), format, arg);
+    if ((len < 0) || (len >= (int) sizeof(line))) return -1;
+    return sessionWrite(s, line, len);
+}
+
+// read one line, CRLF stripped, into line.  Returns its length or -1
+static int sessionLine(session_t *s, char *line, size_t lineSize) {
+    size_t len = 0;
+    ssize_t got;
+    char c;
+
+    for (;;) {
+        if (s->inStart == s->inEnd) {
+            got = recv(s->fd, s->in, sizeof(s->in), 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return -1;
+            s->inStart = 0;
+            s->inEnd = got;
+        }
+        c = s->in[s->inStart++];
+        if (c == '\n') break;
+        if ((c != '\r') && (len + 1 < lineSize)) line[len++] = c;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+// Read a whole (possibly multi-line) reply.  Returns the reply code,
+// or -1 if the session died.  If text is given, the last line is kept
+static int sessionReply(session_t *s, int *pipelining, char *text, size_t textSize) {
+    char line[MAIL_LINE_LEN];
+    int len;
+
+    do {
+        if ((len = sessionLine(s, line, sizeof(line))) < 4) {
+            if (len == 3) break;         // bare code, allowed
+            return -1;
+        }
+        if ((pipelining != NULL) && (strncasecmp(line + 4, "PIPELINING", 10) == 0)) {
+            *pipelining = 1;
+        }
+    } while (line[3] == '-');
+
+    if (!isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2])) return -1;
+    if (text != NULL) snprintf(text, textSize, "%s", line);
+    return atoi(line);
+}
+
+// dial the endpoint and say hello.  Returns 0 or -1, with why filled in
+int smtpOpen(session_t *s, char *why, size_t whyLen) {
+    struct timeval timeout = { MAIL_IO_TIMEOUT, 0 };
+    char reply[MAIL_LINE_LEN];
+    int code;
+
+    s->fd = -1;
+    s->pipelining = 0;
+    s->inStart = s->inEnd = s->outLen = 0;
+
+    if (endpoint.local) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, endpoint.path);
+        s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ((s->fd >= 0) && (connect(s->fd, (struct sockaddr *) &address,
+                                     sizeof(address)) < 0)) {
+            close(s->fd);
+            s->fd = -1;
+        }
+    } else {
+        struct addrinfo hints, *found, *a;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if ((code = getaddrinfo(endpoint.host, endpoint.port, &hints, &found)) != 0) {
+            snprintf(why, whyLen, "%s: %s", endpoint.host, gai_strerror(code));
+            return -1;
+        }
+        for (a = found; (a != NULL) && (s->fd < 0); a = a->ai_next) {
+            s->fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if ((s->fd >= 0) && (connect(s->fd, a->ai_addr, a->ai_addrlen) < 0)) {
+                close(s->fd);
+                s->fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    }
+    if (s->fd < 0) {
+        snprintf(why, whyLen, "unable to connect to %s: %s",
+                 endpoint.local ? endpoint.path : endpoint.host, strerror(errno));
+        return -1;
+    }
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char me[256];
+    if (gethostname(me, sizeof(me)) < 0) strcpy(me, "localhost");
+    me[sizeof(me) - 1] = '\0';
+
+    if ((code = sessionReply(s, NULL, reply, sizeof(reply))) != 220) goto refused;
+    if ((sessionPrintf(s, endpoint.lmtp ? "LHLO %s\r\n" : "EHLO %s\r\n", me) < 0) ||
+        (sessionFlush(s) < 0)) goto refused;
+    if ((code = sessionReply(s, &s->pipelining, reply, sizeof(reply))) != 250) goto refused;
+    if (endpoint.lmtp) s->pipelining = 1;     // RFC 2033 says it must
+    return 0;
+
+refused:
+    snprintf(why, whyLen, "%s refused the session: %s",
+             endpoint.local ? endpoint.path : endpoint.host,
+             (code < 0) ? "connection lost" : reply);
+    close(s->fd);
+    s->fd = -1;
+    return -1;
+}
+
+void smtpClose(session_t *s, int polite) {
+    if (s->fd < 0) return;
+    if (polite && (sessionWrite(s, "QUIT\r\n", 6) == 0) && (sessionFlush(s) == 0)) {
+        sessionReply(s, NULL, NULL, 0);
+    }
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Find the next address in a recipient list at or after *list, and
+// leave *list just past it.  Returns its length, 0 when there are no
+// more
+static size_t nextRecipient(const char **list, const char **address) {
+    const char *p = *list + strspn(*list, RECIPIENT_SEPARATORS);
+    size_t len = strcspn(p, RECIPIENT_SEPARATORS);
+
+    *address = p;
+    *list = p + len;
+    return len;
+}
+
+static int countRecipients(const char *list) {
+    const char *address;
+    int n = 0;
+
+    while (nextRecipient(&list, &address) > 0) n++;
+    return n;
+}
+
+// one RCPT, without the reply
+static int sendRecipient(session_t *s, const char *address, size_t len) {
+    if ((sessionWrite(s, "RCPT TO:<", 9) < 0) ||
+        (sessionWrite(s, address, len) < 0)) return -1;
+    return sessionWrite(s, ">\r\n", 3);
+}
+
+static int sendEnvelope(session_t *s, const mail_t *m) {
+    const char *list = m->recipient, *address;
+    size_t len;
+
+    if (sessionWrite(s, "MAIL FROM:<>\r\n", 14) < 0) return -1;
+    while ((len = nextRecipient(&list, &address)) > 0) {
+        if (sendRecipient(s, address, len) < 0) return -1;
+    }
+    return sessionWrite(s, "DATA\r\n", 6);
+}
+
+// The verdict on a message once its body is sent: SMTP gives one
+// reply, LMTP one for every recipient that was accepted.  Any success
+// is a delivery, otherwise the last refusal is what we report
+static int dataReplies(session_t *s, int accepted) {
+    int replies = (endpoint.lmtp && (accepted > 1)) ? accepted : 1;
+    int code, delivered = 0, refused = 0;
+
+    while (replies-- > 0) {
+        if ((code = sessionReply(s, NULL, NULL, 0)) < 0) return -1;
+        if (code < 400) {
+            if (delivered == 0) delivered = code;
+        } else refused = code;
+    }
+    return delivered ? delivered : refused;
+}
+
+// copy a message onto the wire, turning LF into CRLF and doubling any
+// dot that starts a line, then end it with a lone dot
+static int sendBody(session_t *s, const mail_t *m) {
+    char chunk[MAIL_BUF_SIZE];
+    off_t offset;
+    ssize_t got, i, from;
+    int lineStart = 1;
+    char last = '\0';      // the byte before this one, even across chunks
+
+    offset = m->start;
+    while ((got = pread(m->message, chunk, sizeof(chunk), offset)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += got;
+        for (i = from = 0; i < got; i++) {
+            if (lineStart && (chunk[i] == '.')) {
+                if ((sessionWrite(s, chunk + from, i - from) < 0) ||
+                    (sessionWrite(s, ".", 1) < 0)) return -1;
+                from = i;
+            }
+            if ((chunk[i] == '\n') && (last != '\r')) {
+                if ((sessionWrite(s, chunk + from, i - from) < 0) ||
+                    (sessionWrite(s, "\r", 1) < 0)) return -1;
+                from = i;
+            }
+            lineStart = (chunk[i] == '\n');
+            last = chunk[i];
+        }
+        if (sessionWrite(s, chunk + from, got - from) < 0) return -1;
+    }
+    if (!lineStart && (sessionWrite(s, "\r\n", 2) < 0)) return -1;
+    return sessionWrite(s, ".\r\n", 3);
+}
+
+// one command, one reply, for servers that don't pipeline
+static int command(session_t *s, const char *format, const char *arg) {
+    if ((sessionPrintf(s, format, arg) < 0) || (sessionFlush(s) < 0)) return -1;
+    return sessionReply(s, NULL, NULL, 0);
+}
+
+static int deliverOne(session_t *s, const mail_t *m) {
+    const char *list = m->recipient, *address;
+    size_t len;
+    int code, refused = 0, accepted = 0;
+
+    if ((code = command(s, "MAIL FROM:<>\r\n", NULL)) < 0) return -1;
+    if (code >= 400) goto reset;
+    while ((len = nextRecipient(&list, &address)) > 0) {
+        if ((sendRecipient(s, address, len) < 0) || (sessionFlush(s) < 0) ||
+            ((code = sessionReply(s, NULL, NULL, 0)) < 0)) return -1;
+        if (code < 400) accepted++;
+        else refused = code;
+    }
+    if ((accepted == 0) && (refused != 0)) {
+        code = refused;
+        goto reset;
+    }
+    if ((code = command(s, "DATA\r\n", NULL)) < 0) return -1;
+    if (code != 354) goto reset;
+    if ((sendBody(s, m) < 0) || (sessionFlush(s) < 0)) return -1;
+    return dataReplies(s, accepted);
+
+reset:
+    if (command(s, "RSET\r\n", NULL) < 0) return -1;
+    return code;
+}
+
+// Deliver a batch of messages down one session.  result[i] gets the
+// final reply code for each message, or -1 if the session died before
+// we found out.  Pipelined, the body of one message and the envelope
+// of the next share a write, and RFC 2920 is happy with that since
+// DATA is always the last command of a group.  Each envelope owes us
+// a reply for MAIL, one per RCPT, and one for DATA.
+void smtpDeliver(session_t *s, mail_t **batch, int n, int *result) {
+    int i, r, recipients, accepted, code, mailCode, rcptCode, dataCode, rsetPending = 0;
+
+    for (i = 0; i < n; i++) result[i] = -1;
+    if (!s->pipelining) {
+        for (i = 0; i < n; i++) {
+            if ((result[i] = deliverOne(s, batch[i])) < 0) return;
+        }
+        return;
+    }
+
+    if ((sendEnvelope(s, batch[0]) < 0) || (sessionFlush(s) < 0)) return;
+
+    for (i = 0; i < n; i++) {
+        if (rsetPending && (sessionReply(s, NULL, NULL, 0) < 0)) return;
+        rsetPending = 0;
+
+        if ((mailCode = sessionReply(s, NULL, NULL, 0)) < 0) return;
+        recipients = countRecipients(batch[i]->recipient);
+        for (r = accepted = rcptCode = 0; r < recipients; r++) {
+            if ((code = sessionReply(s, NULL, NULL, 0)) < 0) return;
+            if (code < 400) accepted++;
+            else rcptCode = code;
+        }
+        if ((dataCode = sessionReply(s, NULL, NULL, 0)) < 0) return;
+
+        if (dataCode == 354) {
+            if (sendBody(s, batch[i]) < 0) return;
+        } else {
+            result[i] = (mailCode >= 400) ? mailCode :
+                        ((accepted == 0) && (rcptCode != 0)) ? rcptCode : dataCode;
+            if (sessionWrite(s, "RSET\r\n", 6) < 0) return;
+            rsetPending = 1;
+        }
+
+        if ((i + 1 < n) && (sendEnvelope(s, batch[i + 1]) < 0)) return;
+        if (sessionFlush(s) < 0) return;
+        if ((dataCode == 354) && ((result[i] = dataReplies(s, accepted)) < 0)) return;
+    }
+    if (rsetPending) sessionReply(s, NULL, NULL, 0);
+}
@@ -0,0 +1,24 @@
+/*
+    The native handler equivalent of noisy-proc.sh
+
+    build:  make noisy-plugin.so
+    trick:  /tmp:8:@plugin /ta/code/gidget/noisy-plugin.so noisyHandler hello:nobody:charlie@example.com
+*/
+
+#include <stdio.h>
+#include "gidgetplugin.h"
+
+const uint32_t gidget_plugin_abi = GIDGET_PLUGIN_ABI;
+
+int noisyHandler(const gidget_event_t *event, char *output, size_t outputSize) {
+
+// plugins built against a newer gidgetplugin.h must check this
+    if (event->size < sizeof(gidget_event_t)) return 1;
+
+    snprintf(output, outputSize,
+             "Hey, somebody called for the gidget test plugin!\n"
+             "object %s, watch %d, mask %#.8x\n"
+             "my argument was \"%s\"\n",
+             event->path, event->wd, event->mask, event->arg);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+    A stand-in mail server for testing gidget's SMTP transport,
+    see smtp-test.sh.  It speaks just enough ESMTP to take mail
+    on a Unix socket, offers PIPELINING, undoes the CRLFs and
+    the dot stuffing, and keeps each message it is given as
+    outdir/msg.N.  outdir/log gets a line for every command,
+    and a "pipelined" line whenever one read from the client
+    held more than one command, or the end of a message and
+    the command after it.
+
+    Each connection is served by a child of its own, and the
+    reply to msg.1 is held back for a second, so anything
+    queued meanwhile goes out as one batch.  Recipients with
+    "reject" in them are refused.
+
+    build:  make smtp-stub
+    run:    smtp-stub /tmp/smtp.sock outdir
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STUB_BUF_SIZE 65536
+
+  static FILE *logFile, *message;
+  static char *outdir;
+  static int messageNo = 0, inData = 0;
+
+static void reply(int client, const char *text) {
+    if (write(client, text, strlen(text)) < 0) {
+        // the client hung up, the next read will say so
+    }
+}
+
+// one line from the client, without its CRLF.  Returns 1 if it was a
+// command, 0 if it was part of a message
+static int line(int client, char *text) {
+    char path[4096];
+    int fd;
+
+    if (inData) {
+        if (strcmp(text, ".") == 0) {
+            fclose(message);
+            inData = 0;
+            fprintf(logFile, "message %d\n", messageNo);
+            if (messageNo == 1) sleep(1);
+            reply(client, "250 2.0.0 kept\r\n");
+            return 0;
+        }
+        fprintf(message, "%s\n", (text[0] == '.') ? text + 1 : text);
+        return 0;
+    }
+
+    fprintf(logFile, "%s\n", text);
+    if ((strncasecmp(text, "EHLO", 4) == 0) || (strncasecmp(text, "LHLO", 4) == 0)) {
+        reply(client, "250-stub\r\n250-8BITMIME\r\n250 PIPELINING\r\n");
+    } else if ((strncasecmp(text, "RCPT", 4) == 0) && (strstr(text, "reject") != NULL)) {
+        reply(client, "550 5.1.1 no such user\r\n");
+    } else if ((strncasecmp(text, "MAIL", 4) == 0) || (strncasecmp(text, "RCPT", 4) == 0) ||
+               (strncasecmp(text, "RSET", 4) == 0) || (strncasecmp(text, "NOOP", 4) == 0)) {
+        reply(client, "250 2.0.0 ok\r\n");
+    } else if (strncasecmp(text, "DATA", 4) == 0) {
+    // numbered across all the connections, first come first served
+        for (messageNo = 1, fd = -1; (fd < 0) && (messageNo < 100000); messageNo++) {
+            sprintf(path, "%s/msg.%d", outdir, messageNo);
+            fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        }
+        messageNo--;
+        if ((fd < 0) || ((message = fdopen(fd, "w")) == NULL)) {
+            reply(client, "451 4.3.0 can't keep it\r\n");
+        } else {
+            inData = 1;
+            reply(client, "354 go ahead\r\n");
+        }
+    } else if (strncasecmp(text, "QUIT", 4) == 0) {
+        reply(client, "221 2.0.0 bye\r\n");
+    } else {
+        reply(client, "500 5.5.1 what?\r\n");
+    }
+    return 1;
+}
+
+// talk to one client until it goes away
+static void session(int client) {
+    static char buf[STUB_BUF_SIZE + 1];
+    size_t have = 0;
+    ssize_t got;
+    char *start, *end;
+    int commands, ended;
+
+    reply(client, "220 stub ESMTP\r\n");
+    while ((got = read(client, buf + have, STUB_BUF_SIZE - have)) > 0) {
+        have += got;
+        buf[have] = '\0';
+        commands = ended = 0;
+        for (start = buf; (end = strstr(start, "\r\n")) != NULL; start = end + 2) {
+            *end = '\0';
+            if (inData && (strcmp(start, ".") == 0)) ended = 1;
+            if (line(client, start)) {
+                if (ended) fprintf(logFile, "pipelined after a message\n");
+                ended = 0;
+                commands++;
+            }
+        }
+        if (commands > 1) fprintf(logFile, "pipelined %d commands\n", commands);
+        fflush(logFile);
+        have -= start - buf;
+        memmove(buf, start, have);
+        if (have == STUB_BUF_SIZE) break;       // a line longer than any SMTP line
+    }
+    close(client);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un address;
+    char path[4096];
+    int listener, client;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s socket outdir\n", argv[0]);
+        return 2;
+    }
+    outdir = argv[2];
+    snprintf(path, sizeof(path), "%s/log", outdir);
+    if ((logFile = fopen(path, "a")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    setvbuf(logFile, NULL, _IOLBF, 0);     // lines from several children
+    signal(SIGCHLD, SIG_IGN);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    unlink(argv[1]);
+    if (((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+        (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0) ||
+        (listen(listener, 4) < 0)) {
+        perror(argv[1]);
+        return 1;
+    }
+    for (;;) {
+        if ((client = accept(listener, NULL, NULL)) < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return 1;
+        }
+        if (fork() == 0) {
+            close(listener);
+            session(client);
+            _exit(0);
+        }
+        close(client);
+    }
+}
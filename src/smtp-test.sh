@@ -0,0 +1,101 @@
+#! /bin/bash
+#
+# End to end test of the SMTP transport: gidget sends the output of a
+# script whose lines start with dots to smtp-stub, several messages at
+# once so they go out pipelined, and the test checks what arrived.
+# Every message is for three people, one of whom the stub refuses.
+#
+#   make check        or        ./smtp-test.sh [gidget [smtp-stub]]
+#
+
+here=$(cd "$(dirname "$0")" && pwd)
+gidget=${1:-$here/gidget}
+stub=${2:-$here/smtp-stub}
+work=$(mktemp -d /tmp/gidget-smtp.XXXXXX)
+events=5
+failed=0
+
+cleanup() {
+    [ -n "$gidgetPid" ] && kill "$gidgetPid" 2>/dev/null
+    [ -n "$stubPid" ] && kill "$stubPid" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+mkdir "$work/watch" "$work/spool" "$work/out"
+chmod 700 "$work/spool"
+
+# the output a script might well produce, and that SMTP has to carry
+# without mistaking any of it for the end of the message
+cat > "$work/expected" <<'EOF'
+.leading dot
+..two leading dots
+.
+a lone dot above, and a dot at the end.
+EOF
+cat > "$work/script.sh" <<EOF
+#! /bin/sh
+cat "$work/expected"
+EOF
+chmod 755 "$work/script.sh"
+recipients="test@example.com, me@x.org reject"
+echo "$work/watch:8:$work/script.sh:$(id -un):$recipients" > "$work/gidget.conf"
+
+"$stub" "$work/smtp.sock" "$work/out" &
+stubPid=$!
+for i in $(seq 50); do
+    [ -S "$work/smtp.sock" ] && break
+    sleep 0.1
+done
+
+"$gidget" -c "$work/gidget.conf" -q "$work/spool" -M "smtp:$work/smtp.sock,1" \
+    > "$work/gidget.log" 2>&1 &
+gidgetPid=$!
+sleep 1
+
+# one connection, and the stub holds up the first message, so the rest
+# queue behind it and go out as a pipelined batch
+for i in $(seq $events); do
+    touch "$work/watch/file$i"
+    sleep 0.1
+done
+
+for i in $(seq 100); do
+    [ "$(ls "$work/out" | grep -c '^msg\.')" -ge $events ] && break
+    sleep 0.1
+done
+
+count=$(ls "$work/out" | grep -c '^msg\.')
+[ "$count" -eq $events ] || fail "$count of $events messages arrived"
+
+for msg in "$work"/out/msg.*; do
+    [ -e "$msg" ] || continue
+    grep -q "^To: $recipients\$" "$msg" || fail "$(basename "$msg") has no To: header"
+    grep -q $'\r' "$msg" && fail "$(basename "$msg") kept CRs"
+    tail -n "$(wc -l < "$work/expected")" "$msg" | cmp -s - "$work/expected" ||
+        fail "$(basename "$msg") body differs: $(tail -n 4 "$msg" | tr '\n' '|')"
+done
+
+grep -q '^pipelined [0-9]* commands$' "$work/out/log" || fail "envelopes weren't pipelined"
+grep -q '^pipelined after a message$' "$work/out/log" ||
+    fail "no envelope shared a write with the message before it"
+for rcpt in test@example.com me@x.org reject; do
+    [ "$(grep -c "^RCPT TO:<$rcpt>\$" "$work/out/log")" -eq $events ] ||
+        fail "wrong or missing recipient $rcpt"
+done
+
+if [ $failed -ne 0 ]; then
+    echo "--- smtp-stub log"
+    cat "$work/out/log"
+    echo "--- gidget log"
+    cat "$work/gidget.log"
+    exit 1
+fi
+echo "PASS: $count messages, pipelined, dots intact"
+exit 0